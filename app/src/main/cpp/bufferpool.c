@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <android/log.h>
+#include "bufferpool.h"
+
+#define APPNAME "UsbIpServerNativeLibusb"
+#define BUFFER_BLOCK_MAGIC 0x55425546u // "UBUF"
+#define BUFFER_BLOCK_ALIGN 64
+
+// Sits directly in front of the data handed out to Java. Padded to a cache line so
+// the transfer data itself stays 64-byte aligned.
+struct BufferBlock {
+    uint32_t magic;
+    int32_t sizeClass; // -1 for oversized blocks that are never cached
+    uint32_t generation;
+    uint32_t capacity;
+    struct BufferCache *cache;
+    struct BufferBlock *next;
+} __attribute__((aligned(BUFFER_BLOCK_ALIGN)));
+
+#define BUFFER_BLOCK_HEADER_SIZE sizeof(struct BufferBlock)
+
+static int size_to_class(size_t size) {
+    int shift = BUFFER_POOL_MIN_SHIFT;
+    while (shift <= BUFFER_POOL_MAX_SHIFT && ((size_t)1 << shift) < size) shift++;
+    return shift > BUFFER_POOL_MAX_SHIFT ? -1 : shift - BUFFER_POOL_MIN_SHIFT;
+}
+
+static size_t class_to_size(int sizeClass) {
+    return (size_t)1 << (sizeClass + BUFFER_POOL_MIN_SHIFT);
+}
+
+static struct BufferBlock *block_from_data(void *data) {
+    return (struct BufferBlock *)((char *)data - BUFFER_BLOCK_HEADER_SIZE);
+}
+
+static void *block_data(struct BufferBlock *block) {
+    return (char *)block + BUFFER_BLOCK_HEADER_SIZE;
+}
+
+static struct BufferBlock *block_alloc(size_t capacity) {
+    void *mem = NULL;
+    if (posix_memalign(&mem, BUFFER_BLOCK_ALIGN, BUFFER_BLOCK_HEADER_SIZE + capacity) != 0) {
+        return NULL;
+    }
+    return (struct BufferBlock *)mem;
+}
+
+static void block_release(struct BufferBlock *block) {
+    block->magic = 0;
+    free(block);
+}
+
+static void update_peaks(struct BufferCache *cache) {
+    if (cache->bytesInUse > cache->peakInUse) cache->peakInUse = cache->bytesInUse;
+    size_t total = cache->bytesInUse + cache->bytesCached;
+    if (total > cache->peakTotal) cache->peakTotal = total;
+}
+
+// Caller must hold cache->mutex.
+static void release_cached_blocks(struct BufferCache *cache) {
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++) {
+        struct BufferBlock *block = cache->classes[i].freeList;
+        while (block != NULL) {
+            struct BufferBlock *next = block->next;
+            block_release(block);
+            block = next;
+        }
+        cache->classes[i].freeList = NULL;
+        cache->classes[i].freeCount = 0;
+        cache->classes[i].idleCount = 0;
+    }
+    cache->bytesCached = 0;
+}
+
+// The mutex is deliberately never destroyed: Java may hand buffers back after
+// UsbLib.exit() and the cache has to stay lockable for the life of the process.
+void buffer_cache_init(struct BufferCache *cache) {
+    if (cache->initialized) return;
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->initialized = 1;
+}
+
+void buffer_cache_open(struct BufferCache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    cache->active = 1;
+    cache->bytesInUse = 0;
+    cache->bytesCached = 0;
+    cache->peakInUse = 0;
+    cache->peakTotal = 0;
+    cache->allocations = 0;
+    cache->reuses = 0;
+    cache->trimmedBytes = 0;
+    cache->prewarmedBytes = 0;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void buffer_cache_close(struct BufferCache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->active && cache->bytesInUse > 0) {
+        __android_log_print(ANDROID_LOG_WARN, APPNAME, "Buffer cache closed with %zu bytes still in use", cache->bytesInUse);
+    }
+    release_cached_blocks(cache);
+    cache->active = 0;
+    cache->generation++; // Blocks still held by Java are freed directly when returned
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void *buffer_cache_alloc(struct BufferCache *cache, size_t size, size_t *out_capacity) {
+    int sizeClass = size_to_class(size == 0 ? 1 : size);
+    size_t capacity = sizeClass < 0 ? size : class_to_size(sizeClass);
+    struct BufferBlock *block = NULL;
+
+    pthread_mutex_lock(&cache->mutex);
+    if (!cache->active) {
+        pthread_mutex_unlock(&cache->mutex);
+        return NULL;
+    }
+
+    if (sizeClass >= 0 && cache->classes[sizeClass].freeList != NULL) {
+        struct BufferSizeClass *bucket = &cache->classes[sizeClass];
+        block = bucket->freeList;
+        bucket->freeList = block->next;
+        bucket->freeCount--;
+        if (bucket->freeCount < bucket->idleCount) bucket->idleCount = bucket->freeCount;
+        cache->bytesCached -= capacity;
+        cache->reuses++;
+    } else {
+        block = block_alloc(capacity);
+        if (block == NULL) {
+            pthread_mutex_unlock(&cache->mutex);
+            __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Unable to allocate %zu byte transfer buffer", capacity);
+            return NULL;
+        }
+        block->magic = BUFFER_BLOCK_MAGIC;
+        block->sizeClass = sizeClass;
+        block->capacity = (uint32_t)capacity;
+        block->cache = cache;
+        cache->allocations++;
+    }
+    block->generation = cache->generation;
+    block->next = NULL;
+
+    cache->bytesInUse += capacity;
+    update_peaks(cache);
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (out_capacity) *out_capacity = capacity;
+    return block_data(block);
+}
+
+int buffer_cache_free(void *data) {
+    if (data == NULL) return 0;
+
+    struct BufferBlock *block = block_from_data(data);
+    if (block->magic != BUFFER_BLOCK_MAGIC) {
+        __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Attempted to free a buffer not owned by the pool: %p", data);
+        return -1;
+    }
+
+    struct BufferCache *cache = block->cache;
+    pthread_mutex_lock(&cache->mutex);
+    if (!cache->active || block->generation != cache->generation) {
+        // Owning device was closed while Java still held the buffer.
+        pthread_mutex_unlock(&cache->mutex);
+        block_release(block);
+        return 0;
+    }
+
+    cache->bytesInUse -= block->capacity;
+    if (block->sizeClass < 0 || cache->bytesCached + block->capacity > BUFFER_POOL_MAX_CACHED_BYTES) {
+        pthread_mutex_unlock(&cache->mutex);
+        block_release(block);
+        return 0;
+    }
+
+    struct BufferSizeClass *bucket = &cache->classes[block->sizeClass];
+    block->next = bucket->freeList;
+    bucket->freeList = block;
+    bucket->freeCount++;
+    cache->bytesCached += block->capacity;
+    update_peaks(cache);
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+}
+
+int buffer_cache_prewarm(struct BufferCache *cache, size_t size, uint32_t count) {
+    int sizeClass = size_to_class(size == 0 ? 1 : size);
+    if (sizeClass < 0) return 0; // Oversized blocks are never cached
+    size_t capacity = class_to_size(sizeClass);
+    int added = 0;
+
+    pthread_mutex_lock(&cache->mutex);
+    struct BufferSizeClass *bucket = &cache->classes[sizeClass];
+    while (cache->active && bucket->freeCount < count &&
+           cache->bytesCached + capacity <= BUFFER_POOL_MAX_CACHED_BYTES) {
+        struct BufferBlock *block = block_alloc(capacity);
+        if (block == NULL) break;
+        block->magic = BUFFER_BLOCK_MAGIC;
+        block->sizeClass = sizeClass;
+        block->capacity = (uint32_t)capacity;
+        block->cache = cache;
+        block->generation = cache->generation;
+        block->next = bucket->freeList;
+        bucket->freeList = block;
+        bucket->freeCount++;
+        cache->bytesCached += capacity;
+        cache->prewarmedBytes += capacity;
+        added++;
+    }
+    update_peaks(cache);
+    pthread_mutex_unlock(&cache->mutex);
+    return added;
+}
+
+size_t buffer_cache_trim(struct BufferCache *cache) {
+    size_t released = 0;
+
+    pthread_mutex_lock(&cache->mutex);
+    if (!cache->active) {
+        pthread_mutex_unlock(&cache->mutex);
+        return 0;
+    }
+
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++) {
+        struct BufferSizeClass *bucket = &cache->classes[i];
+        uint32_t toRelease = bucket->idleCount;
+        while (toRelease > 0 && bucket->freeList != NULL) {
+            struct BufferBlock *block = bucket->freeList;
+            bucket->freeList = block->next;
+            bucket->freeCount--;
+            released += block->capacity;
+            block_release(block);
+            toRelease--;
+        }
+        bucket->idleCount = bucket->freeCount;
+    }
+    cache->bytesCached -= released;
+    cache->trimmedBytes += released;
+    pthread_mutex_unlock(&cache->mutex);
+
+    return released;
+}
+
+void buffer_cache_stats(struct BufferCache *cache, int64_t out[BUFFER_STAT_COUNT]) {
+    pthread_mutex_lock(&cache->mutex);
+    out[BUFFER_STAT_BYTES_IN_USE] = (int64_t)cache->bytesInUse;
+    out[BUFFER_STAT_BYTES_CACHED] = (int64_t)cache->bytesCached;
+    out[BUFFER_STAT_PEAK_IN_USE] = (int64_t)cache->peakInUse;
+    out[BUFFER_STAT_PEAK_TOTAL] = (int64_t)cache->peakTotal;
+    out[BUFFER_STAT_ALLOCATIONS] = (int64_t)cache->allocations;
+    out[BUFFER_STAT_REUSES] = (int64_t)cache->reuses;
+    out[BUFFER_STAT_TRIMMED_BYTES] = (int64_t)cache->trimmedBytes;
+    out[BUFFER_STAT_PREWARMED_BYTES] = (int64_t)cache->prewarmedBytes;
+    pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,72 @@
+#ifndef USBIP_BUFFERPOOL_H
+#define USBIP_BUFFERPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Power-of-two size classes from 64 B up to 1 MiB. Larger requests bypass the cache.
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_MAX_SHIFT 20
+#define BUFFER_POOL_NUM_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+
+// Upper bound on idle memory a single device may keep cached.
+#define BUFFER_POOL_MAX_CACHED_BYTES (8 * 1024 * 1024)
+// Blocks that stay unused for a whole interval are returned to the system.
+#define BUFFER_POOL_TRIM_INTERVAL_MS 10000
+
+struct BufferBlock;
+
+struct BufferSizeClass {
+    struct BufferBlock *freeList;
+    uint32_t freeCount;
+    uint32_t idleCount; // Lowest freeCount seen since the last trim
+};
+
+struct BufferCache {
+    pthread_mutex_t mutex;
+    int initialized;
+    int active;
+    uint32_t generation;
+    struct BufferSizeClass classes[BUFFER_POOL_NUM_CLASSES];
+
+    size_t bytesInUse;
+    size_t bytesCached;
+    size_t peakInUse;
+    size_t peakTotal;
+    uint64_t allocations;
+    uint64_t reuses;
+    uint64_t trimmedBytes;
+    uint64_t prewarmedBytes;
+};
+
+// Order matches UsbLib.getBufferPoolStats() on the Kotlin side.
+enum BufferCacheStat {
+    BUFFER_STAT_BYTES_IN_USE,
+    BUFFER_STAT_BYTES_CACHED,
+    BUFFER_STAT_PEAK_IN_USE,
+    BUFFER_STAT_PEAK_TOTAL,
+    BUFFER_STAT_ALLOCATIONS,
+    BUFFER_STAT_REUSES,
+    BUFFER_STAT_TRIMMED_BYTES,
+    BUFFER_STAT_PREWARMED_BYTES,
+    BUFFER_STAT_COUNT
+};
+
+void buffer_cache_init(struct BufferCache *cache);
+
+void buffer_cache_open(struct BufferCache *cache);
+void buffer_cache_close(struct BufferCache *cache);
+
+void *buffer_cache_alloc(struct BufferCache *cache, size_t size, size_t *out_capacity);
+int buffer_cache_free(void *data);
+
+// Puts up to count free blocks of size's class in the cache ahead of use, counting the
+// ones already there, within BUFFER_POOL_MAX_CACHED_BYTES. Unused ones are trimmed like
+// any other idle block. Returns how many were added.
+int buffer_cache_prewarm(struct BufferCache *cache, size_t size, uint32_t count);
+
+size_t buffer_cache_trim(struct BufferCache *cache);
+void buffer_cache_stats(struct BufferCache *cache, int64_t out[BUFFER_STAT_COUNT]);
+
+#endif // USBIP_BUFFERPOOL_H
@@ -0,0 +1,35 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <android/log.h>
+
+// USBIP_HOST_LOG_LEVEL takes the numeric android_LogPriority, e.g. 4 for INFO.
+// Defaults to WARN so benchmarks are not dominated by logging.
+static int min_priority(void) {
+    static int level = -1;
+    if (level < 0) {
+        const char *env = getenv("USBIP_HOST_LOG_LEVEL");
+        level = env != NULL ? atoi(env) : ANDROID_LOG_WARN;
+    }
+    return level;
+}
+
+static const char PRIORITY_CHARS[] = "??VDIWEFS";
+
+int __android_log_write(int prio, const char *tag, const char *text) {
+    if (prio < min_priority()) return 0;
+    char c = prio >= 0 && prio <= ANDROID_LOG_SILENT ? PRIORITY_CHARS[prio] : '?';
+    return fprintf(stderr, "%c/%s: %s\n", c, tag, text);
+}
+
+int __android_log_print(int prio, const char *tag, const char *fmt, ...) {
+    if (prio < min_priority()) return 0;
+
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return __android_log_write(prio, tag, buf);
+}
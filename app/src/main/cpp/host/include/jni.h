@@ -0,0 +1,107 @@
+/*
+ * Minimal stand-in for <jni.h> used by the host build.
+ *
+ * Only declares the parts of the JNI C API that usbipfunctions.c touches. The table
+ * layout does not match a real JVM, which is fine because the only implementation
+ * is the fake environment in jnihost.c.
+ */
+#ifndef USBIP_HOST_JNI_H
+#define USBIP_HOST_JNI_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+typedef uint8_t jboolean;
+typedef int8_t jbyte;
+typedef uint16_t jchar;
+typedef int16_t jshort;
+typedef int32_t jint;
+typedef int64_t jlong;
+typedef float jfloat;
+typedef double jdouble;
+typedef jint jsize;
+
+typedef void *jobject;
+typedef jobject jclass;
+typedef jobject jstring;
+typedef jobject jarray;
+typedef jarray jintArray;
+typedef jarray jlongArray;
+typedef jarray jbyteArray;
+typedef jarray jobjectArray;
+typedef jobject jthrowable;
+
+typedef struct _jmethodID *jmethodID;
+typedef struct _jfieldID *jfieldID;
+
+#define JNI_FALSE 0
+#define JNI_TRUE 1
+
+#define JNI_OK 0
+#define JNI_ERR (-1)
+#define JNI_EDETACHED (-2)
+#define JNI_EVERSION (-3)
+
+#define JNI_COMMIT 1
+#define JNI_ABORT 2
+
+#define JNI_VERSION_1_6 0x00010006
+
+#define JNIEXPORT __attribute__((visibility("default")))
+#define JNICALL
+
+struct JNINativeInterface;
+struct JNIInvokeInterface;
+
+typedef const struct JNINativeInterface *JNIEnv;
+typedef const struct JNIInvokeInterface *JavaVM;
+
+struct JNINativeInterface {
+    jclass (*GetObjectClass)(JNIEnv *, jobject);
+    jclass (*FindClass)(JNIEnv *, const char *);
+    jmethodID (*GetMethodID)(JNIEnv *, jclass, const char *, const char *);
+    jmethodID (*GetStaticMethodID)(JNIEnv *, jclass, const char *, const char *);
+    void (*CallVoidMethod)(JNIEnv *, jobject, jmethodID, ...);
+
+    jobject (*NewGlobalRef)(JNIEnv *, jobject);
+    void (*DeleteGlobalRef)(JNIEnv *, jobject);
+    void (*DeleteLocalRef)(JNIEnv *, jobject);
+    jint (*GetJavaVM)(JNIEnv *, JavaVM **);
+
+    jobject (*NewDirectByteBuffer)(JNIEnv *, void *, jlong);
+    void *(*GetDirectBufferAddress)(JNIEnv *, jobject);
+    jlong (*GetDirectBufferCapacity)(JNIEnv *, jobject);
+
+    jsize (*GetArrayLength)(JNIEnv *, jarray);
+    jintArray (*NewIntArray)(JNIEnv *, jsize);
+    void (*GetIntArrayRegion)(JNIEnv *, jintArray, jsize, jsize, jint *);
+    void (*SetIntArrayRegion)(JNIEnv *, jintArray, jsize, jsize, const jint *);
+    jlongArray (*NewLongArray)(JNIEnv *, jsize);
+    void (*SetLongArrayRegion)(JNIEnv *, jlongArray, jsize, jsize, const jlong *);
+    jbyteArray (*NewByteArray)(JNIEnv *, jsize);
+    void (*GetByteArrayRegion)(JNIEnv *, jbyteArray, jsize, jsize, jbyte *);
+    void (*SetByteArrayRegion)(JNIEnv *, jbyteArray, jsize, jsize, const jbyte *);
+    void *(*GetPrimitiveArrayCritical)(JNIEnv *, jarray, jboolean *);
+    void (*ReleasePrimitiveArrayCritical)(JNIEnv *, jarray, void *, jint);
+
+    jstring (*NewStringUTF)(JNIEnv *, const char *);
+    const char *(*GetStringUTFChars)(JNIEnv *, jstring, jboolean *);
+    void (*ReleaseStringUTFChars)(JNIEnv *, jstring, const char *);
+
+    jboolean (*ExceptionCheck)(JNIEnv *);
+    void (*ExceptionClear)(JNIEnv *);
+};
+
+typedef struct {
+    jint version;
+    char *name;
+    jobject group;
+} JavaVMAttachArgs;
+
+struct JNIInvokeInterface {
+    jint (*AttachCurrentThread)(JavaVM *, JNIEnv **, void *);
+    jint (*DetachCurrentThread)(JavaVM *);
+    jint (*GetEnv)(JavaVM *, void **, jint);
+};
+
+#endif // USBIP_HOST_JNI_H
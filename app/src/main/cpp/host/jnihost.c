@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jnihost.h"
+
+enum HostObjectKind {
+    HOST_OBJECT_USBLIB = 1,
+    HOST_OBJECT_CLASS,
+    HOST_OBJECT_DIRECT_BUFFER,
+    HOST_OBJECT_INT_ARRAY,
+    HOST_OBJECT_LONG_ARRAY,
+    HOST_OBJECT_BYTE_ARRAY,
+    HOST_OBJECT_STRING
+};
+
+struct HostObject {
+    enum HostObjectKind kind;
+    jsize length;   // Elements for arrays, bytes for strings
+    jlong capacity; // Direct buffers only
+    void *address;  // Direct buffers point at caller memory, everything else at data
+    unsigned char data[];
+};
+
+static struct HostObject g_usblib = { .kind = HOST_OBJECT_USBLIB };
+static struct HostObject g_usblibClass = { .kind = HOST_OBJECT_CLASS };
+static struct _jmethodID { int unused; } g_onTransferCompleted, g_onDeviceDisconnected;
+
+static JniHostCompletionFn g_completionFn;
+static void *g_completionUser;
+static JniHostDisconnectFn g_disconnectFn;
+static void *g_disconnectUser;
+
+static struct HostObject *new_object(enum HostObjectKind kind, jsize length, size_t bytes) {
+    struct HostObject *obj = calloc(1, sizeof(*obj) + bytes);
+    if (obj == NULL) return NULL;
+    obj->kind = kind;
+    obj->length = length;
+    obj->address = obj->data;
+    return obj;
+}
+
+static size_t element_size(const struct HostObject *obj) {
+    switch (obj->kind) {
+        case HOST_OBJECT_INT_ARRAY: return sizeof(jint);
+        case HOST_OBJECT_LONG_ARRAY: return sizeof(jlong);
+        default: return 1;
+    }
+}
+
+static jclass host_GetObjectClass(JNIEnv *env, jobject obj) {
+    return &g_usblibClass;
+}
+
+static jclass host_FindClass(JNIEnv *env, const char *name) {
+    return &g_usblibClass;
+}
+
+static jmethodID host_GetMethodID(JNIEnv *env, jclass clazz, const char *name, const char *sig) {
+    if (strcmp(name, "onTransferCompleted") == 0 && strcmp(sig, "(IIII[I[I)V") == 0) {
+        return &g_onTransferCompleted;
+    }
+    if (strcmp(name, "onDeviceDisconnected") == 0 && strcmp(sig, "(I)V") == 0) {
+        return &g_onDeviceDisconnected;
+    }
+    return NULL;
+}
+
+static jmethodID host_GetStaticMethodID(JNIEnv *env, jclass clazz, const char *name, const char *sig) {
+    return NULL;
+}
+
+static void host_CallVoidMethod(JNIEnv *env, jobject obj, jmethodID method, ...) {
+    va_list args;
+    va_start(args, method);
+    if (method == &g_onDeviceDisconnected) {
+        jint fd = va_arg(args, jint);
+        va_end(args);
+        if (g_disconnectFn != NULL) g_disconnectFn(g_disconnectUser, fd);
+        return;
+    }
+    if (method != &g_onTransferCompleted || g_completionFn == NULL) {
+        va_end(args);
+        return;
+    }
+
+    jint seqNum = va_arg(args, jint);
+    jint status = va_arg(args, jint);
+    jint actualLength = va_arg(args, jint);
+    jint type = va_arg(args, jint);
+    struct HostObject *lengths = va_arg(args, struct HostObject *);
+    struct HostObject *statuses = va_arg(args, struct HostObject *);
+    va_end(args);
+
+    g_completionFn(g_completionUser, seqNum, status, actualLength, type,
+                   lengths ? (const jint *)lengths->data : NULL,
+                   statuses ? (const jint *)statuses->data : NULL,
+                   lengths ? lengths->length : 0);
+}
+
+static jobject host_NewGlobalRef(JNIEnv *env, jobject obj) {
+    return obj;
+}
+
+static void host_DeleteRef(JNIEnv *env, jobject obj) {
+    jni_host_delete(obj);
+}
+
+static jint host_GetJavaVM(JNIEnv *env, JavaVM **vm);
+
+static jobject host_NewDirectByteBuffer(JNIEnv *env, void *address, jlong capacity) {
+    return jni_host_new_direct_buffer(address, capacity);
+}
+
+static void *host_GetDirectBufferAddress(JNIEnv *env, jobject buf) {
+    struct HostObject *obj = buf;
+    return obj != NULL && obj->kind == HOST_OBJECT_DIRECT_BUFFER ? obj->address : NULL;
+}
+
+static jlong host_GetDirectBufferCapacity(JNIEnv *env, jobject buf) {
+    struct HostObject *obj = buf;
+    return obj != NULL && obj->kind == HOST_OBJECT_DIRECT_BUFFER ? obj->capacity : -1;
+}
+
+static jsize host_GetArrayLength(JNIEnv *env, jarray array) {
+    return ((struct HostObject *)array)->length;
+}
+
+static jintArray host_NewIntArray(JNIEnv *env, jsize length) {
+    return new_object(HOST_OBJECT_INT_ARRAY, length, (size_t)length * sizeof(jint));
+}
+
+static jlongArray host_NewLongArray(JNIEnv *env, jsize length) {
+    return new_object(HOST_OBJECT_LONG_ARRAY, length, (size_t)length * sizeof(jlong));
+}
+
+static jbyteArray host_NewByteArray(JNIEnv *env, jsize length) {
+    return new_object(HOST_OBJECT_BYTE_ARRAY, length, (size_t)length);
+}
+
+static void get_region(jarray array, jsize start, jsize len, void *out) {
+    struct HostObject *obj = array;
+    size_t size = element_size(obj);
+    memcpy(out, obj->data + (size_t)start * size, (size_t)len * size);
+}
+
+static void set_region(jarray array, jsize start, jsize len, const void *in) {
+    struct HostObject *obj = array;
+    size_t size = element_size(obj);
+    memcpy(obj->data + (size_t)start * size, in, (size_t)len * size);
+}
+
+static void host_GetIntArrayRegion(JNIEnv *env, jintArray a, jsize start, jsize len, jint *buf) {
+    get_region(a, start, len, buf);
+}
+
+static void host_SetIntArrayRegion(JNIEnv *env, jintArray a, jsize start, jsize len, const jint *buf) {
+    set_region(a, start, len, buf);
+}
+
+static void host_SetLongArrayRegion(JNIEnv *env, jlongArray a, jsize start, jsize len, const jlong *buf) {
+    set_region(a, start, len, buf);
+}
+
+static void host_GetByteArrayRegion(JNIEnv *env, jbyteArray a, jsize start, jsize len, jbyte *buf) {
+    get_region(a, start, len, buf);
+}
+
+static void host_SetByteArrayRegion(JNIEnv *env, jbyteArray a, jsize start, jsize len, const jbyte *buf) {
+    set_region(a, start, len, buf);
+}
+
+static void *host_GetPrimitiveArrayCritical(JNIEnv *env, jarray array, jboolean *isCopy) {
+    if (isCopy) *isCopy = JNI_FALSE;
+    return ((struct HostObject *)array)->data;
+}
+
+static void host_ReleasePrimitiveArrayCritical(JNIEnv *env, jarray array, void *carray, jint mode) {
+}
+
+static jstring host_NewStringUTF(JNIEnv *env, const char *utf) {
+    return jni_host_new_string(utf);
+}
+
+static const char *host_GetStringUTFChars(JNIEnv *env, jstring str, jboolean *isCopy) {
+    if (isCopy) *isCopy = JNI_FALSE;
+    return jni_host_string_chars(str);
+}
+
+static void host_ReleaseStringUTFChars(JNIEnv *env, jstring str, const char *chars) {
+}
+
+static jboolean host_ExceptionCheck(JNIEnv *env) {
+    return JNI_FALSE;
+}
+
+static void host_ExceptionClear(JNIEnv *env) {
+}
+
+static const struct JNINativeInterface g_nativeInterface = {
+        .GetObjectClass = host_GetObjectClass,
+        .FindClass = host_FindClass,
+        .GetMethodID = host_GetMethodID,
+        .GetStaticMethodID = host_GetStaticMethodID,
+        .CallVoidMethod = host_CallVoidMethod,
+        .NewGlobalRef = host_NewGlobalRef,
+        .DeleteGlobalRef = host_DeleteRef,
+        .DeleteLocalRef = host_DeleteRef,
+        .GetJavaVM = host_GetJavaVM,
+        .NewDirectByteBuffer = host_NewDirectByteBuffer,
+        .GetDirectBufferAddress = host_GetDirectBufferAddress,
+        .GetDirectBufferCapacity = host_GetDirectBufferCapacity,
+        .GetArrayLength = host_GetArrayLength,
+        .NewIntArray = host_NewIntArray,
+        .GetIntArrayRegion = host_GetIntArrayRegion,
+        .SetIntArrayRegion = host_SetIntArrayRegion,
+        .NewLongArray = host_NewLongArray,
+        .SetLongArrayRegion = host_SetLongArrayRegion,
+        .NewByteArray = host_NewByteArray,
+        .GetByteArrayRegion = host_GetByteArrayRegion,
+        .SetByteArrayRegion = host_SetByteArrayRegion,
+        .GetPrimitiveArrayCritical = host_GetPrimitiveArrayCritical,
+        .ReleasePrimitiveArrayCritical = host_ReleasePrimitiveArrayCritical,
+        .NewStringUTF = host_NewStringUTF,
+        .GetStringUTFChars = host_GetStringUTFChars,
+        .ReleaseStringUTFChars = host_ReleaseStringUTFChars,
+        .ExceptionCheck = host_ExceptionCheck,
+        .ExceptionClear = host_ExceptionClear,
+};
+static JNIEnv g_env = &g_nativeInterface;
+
+// Every thread shares the one environment; the fake has no per-thread state.
+static jint host_AttachCurrentThread(JavaVM *vm, JNIEnv **env, void *args) {
+    *env = &g_env;
+    return JNI_OK;
+}
+
+static jint host_DetachCurrentThread(JavaVM *vm) {
+    return JNI_OK;
+}
+
+static jint host_GetEnv(JavaVM *vm, void **env, jint version) {
+    *env = &g_env;
+    return JNI_OK;
+}
+
+static const struct JNIInvokeInterface g_invokeInterface = {
+        .AttachCurrentThread = host_AttachCurrentThread,
+        .DetachCurrentThread = host_DetachCurrentThread,
+        .GetEnv = host_GetEnv,
+};
+static JavaVM g_vm = &g_invokeInterface;
+
+static jint host_GetJavaVM(JNIEnv *env, JavaVM **vm) {
+    *vm = &g_vm;
+    return JNI_OK;
+}
+
+JNIEnv *jni_host_env(void) {
+    return &g_env;
+}
+
+jobject jni_host_usblib(void) {
+    return &g_usblib;
+}
+
+void jni_host_set_disconnect_handler(JniHostDisconnectFn fn, void *user) {
+    g_disconnectUser = user;
+    g_disconnectFn = fn;
+}
+
+void jni_host_set_completion_handler(JniHostCompletionFn fn, void *user) {
+    g_completionUser = user;
+    g_completionFn = fn;
+}
+
+jobject jni_host_new_direct_buffer(void *address, jlong capacity) {
+    struct HostObject *obj = new_object(HOST_OBJECT_DIRECT_BUFFER, 0, 0);
+    if (obj == NULL) return NULL;
+    obj->address = address;
+    obj->capacity = capacity;
+    return obj;
+}
+
+jintArray jni_host_new_int_array(const jint *values, jsize length) {
+    struct HostObject *obj = new_object(HOST_OBJECT_INT_ARRAY, length, (size_t)length * sizeof(jint));
+    if (obj != NULL && values != NULL) memcpy(obj->data, values, (size_t)length * sizeof(jint));
+    return obj;
+}
+
+jstring jni_host_new_string(const char *utf) {
+    size_t len = strlen(utf);
+    struct HostObject *obj = new_object(HOST_OBJECT_STRING, (jsize)len, len + 1);
+    if (obj != NULL) memcpy(obj->data, utf, len + 1);
+    return obj;
+}
+
+const char *jni_host_string_chars(jstring str) {
+    struct HostObject *obj = str;
+    return obj != NULL && obj->kind == HOST_OBJECT_STRING ? (const char *)obj->data : NULL;
+}
+
+const jlong *jni_host_long_elements(jlongArray array, jsize *length) {
+    struct HostObject *obj = array;
+    if (obj == NULL || obj->kind != HOST_OBJECT_LONG_ARRAY) return NULL;
+    if (length) *length = obj->length;
+    return (const jlong *)obj->data;
+}
+
+void jni_host_delete(jobject ref) {
+    struct HostObject *obj = ref;
+    if (obj == NULL || obj == &g_usblib || obj == &g_usblibClass) return;
+    free(obj);
+}
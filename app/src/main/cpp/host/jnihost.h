@@ -0,0 +1,31 @@
+#ifndef USBIP_HOST_JNIHOST_H
+#define USBIP_HOST_JNIHOST_H
+
+#include <jni.h>
+
+// A fake JNI environment that lets host tools call the Java_..._UsbLib_* entry points
+// of usbipfunctions.c directly. UsbLib.onTransferCompleted() and onDeviceDisconnected()
+// are routed to C callbacks.
+
+typedef void (*JniHostCompletionFn)(void *user, jint seqNum, jint status, jint actualLength, jint type,
+                                    const jint *isoActualLengths, const jint *isoStatuses, jsize numIsoPackets);
+
+typedef void (*JniHostDisconnectFn)(void *user, jint fd);
+
+JNIEnv *jni_host_env(void);
+// Stands in for the UsbLib instance passed as `thiz`.
+jobject jni_host_usblib(void);
+
+void jni_host_set_completion_handler(JniHostCompletionFn fn, void *user);
+void jni_host_set_disconnect_handler(JniHostDisconnectFn fn, void *user);
+
+// Objects returned by these, and by the JNI functions that create objects, are freed
+// with jni_host_delete().
+jobject jni_host_new_direct_buffer(void *address, jlong capacity);
+jintArray jni_host_new_int_array(const jint *values, jsize length);
+jstring jni_host_new_string(const char *utf);
+const char *jni_host_string_chars(jstring str);
+const jlong *jni_host_long_elements(jlongArray array, jsize *length);
+void jni_host_delete(jobject obj);
+
+#endif // USBIP_HOST_JNIHOST_H
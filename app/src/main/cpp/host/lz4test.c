@@ -0,0 +1,282 @@
+/*
+ * Tests for lz4block.c, registered with ctest. The decoder reads tunnel payloads
+ * straight off the socket, so besides round trips this feeds it truncated and random
+ * blocks and checks it rejects them without writing past dstCapacity.
+ *
+ *   lz4test
+ *
+ * Prints each failure and exits non-zero if there was one.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4block.h"
+
+#define MAX_SIZE (64 * 1024)
+// Bytes after dstCapacity that must come out of every decode untouched
+#define GUARD_SIZE 64
+#define GUARD_BYTE 0xA5
+
+static int g_failures;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            g_failures++; \
+        } \
+    } while (0)
+
+static uint64_t g_rng = 0x9E3779B97F4A7C15ull;
+
+static uint32_t next_random(void) {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return (uint32_t)(g_rng >> 32);
+}
+
+static void fill_random(uint8_t *p, int len) {
+    for (int i = 0; i < len; i++) p[i] = (uint8_t)next_random();
+}
+
+// Short words from a small alphabet with runs mixed in, like descriptors and file
+// system metadata: plenty of matches at all kinds of offsets and lengths.
+static void fill_compressible(uint8_t *p, int len) {
+    static const char *const words[] = { "usb", "ip", "bulk", "urb", "\0\0\0\0", "endpoint " };
+    int i = 0;
+    while (i < len) {
+        uint32_t r = next_random();
+        if ((r & 7) == 0) {
+            int run = (int)(r >> 8) % 600;
+            for (int k = 0; k < run && i < len; k++) p[i++] = (uint8_t)(r >> 24);
+        } else {
+            const char *w = words[(r >> 8) % 6];
+            size_t n = (r >> 8) % 6 == 4 ? 4 : strlen(w);
+            for (size_t k = 0; k < n && i < len; k++) p[i++] = (uint8_t)w[k];
+        }
+    }
+}
+
+// Decodes into a buffer of dstCapacity followed by a guard, checking the guard after
+static int decode_guarded(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity) {
+    memset(dst + dstCapacity, GUARD_BYTE, GUARD_SIZE);
+    int r = lz4_decompress_block(src, srcLen, dst, dstCapacity);
+    for (int i = 0; i < GUARD_SIZE; i++) {
+        if (dst[dstCapacity + i] != GUARD_BYTE) {
+            CHECK(0, "wrote %d bytes past dstCapacity %d", i + 1, dstCapacity);
+            break;
+        }
+    }
+    CHECK(r <= dstCapacity, "returned %d for dstCapacity %d", r, dstCapacity);
+    return r;
+}
+
+static uint8_t g_src[MAX_SIZE];
+static uint8_t g_block[LZ4_BLOCK_BOUND(MAX_SIZE)];
+static uint8_t g_dst[MAX_SIZE + GUARD_SIZE];
+
+static void round_trip(int size, const char *kind) {
+    int n = lz4_compress_block(g_src, size, g_block, LZ4_BLOCK_BOUND(size));
+    CHECK(n > 0 && n <= LZ4_BLOCK_BOUND(size), "%s %d bytes compressed to %d", kind, size, n);
+    if (n <= 0) return;
+
+    int r = decode_guarded(g_block, n, g_dst, size);
+    CHECK(r == size, "%s %d bytes came back as %d", kind, size, r);
+    CHECK(r != size || memcmp(g_src, g_dst, (size_t)size) == 0, "%s %d bytes came back different", kind, size);
+
+    // One byte short of room must be refused, not cut short
+    if (size > 0) {
+        r = decode_guarded(g_block, n, g_dst, size - 1);
+        CHECK(r == -1, "%s %d bytes into %d returned %d", kind, size, size - 1, r);
+    }
+
+    // A block cut short either fails or, cut right after a sequence's literals, is a
+    // shorter well-formed block itself; it never yields the whole input
+    int step = n > 512 ? n / 97 : 1;
+    for (int len = 0; len < n; len += step) {
+        r = decode_guarded(g_block, len, g_dst, size);
+        CHECK(r == -1 || r < size, "%s %d bytes cut to %d of %d returned %d", kind, size, len, n, r);
+    }
+}
+
+static void test_round_trips(void) {
+    // Around the format's edges: the 12 byte match limit, the 15 and 15 + 255 length
+    // extensions, then sizes up to the limit
+    static const int sizes[] = {
+        0, 1, 4, 5, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 31, 64,
+        254, 255, 256, 269, 270, 271, 284, 285, 286, 524, 525, 526, 1000,
+        4096, 16384, 65535, MAX_SIZE
+    };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        fill_random(g_src, sizes[i]);
+        round_trip(sizes[i], "random");
+        fill_compressible(g_src, sizes[i]);
+        round_trip(sizes[i], "compressible");
+        memset(g_src, 0, (size_t)sizes[i]);
+        round_trip(sizes[i], "zeros");
+    }
+    for (int i = 0; i < 200; i++) {
+        int size = (int)(next_random() % (MAX_SIZE + 1));
+        if (i & 1) fill_random(g_src, size); else fill_compressible(g_src, size);
+        round_trip(size, i & 1 ? "random" : "compressible");
+    }
+
+    // Compressible data has to actually shrink
+    fill_compressible(g_src, MAX_SIZE);
+    int n = lz4_compress_block(g_src, MAX_SIZE, g_block, LZ4_BLOCK_BOUND(MAX_SIZE));
+    CHECK(n > 0 && n < MAX_SIZE / 2, "compressible 64 KiB compressed to %d", n);
+    // And a capacity below the input is how callers ask for a win only
+    fill_random(g_src, 4096);
+    CHECK(lz4_compress_block(g_src, 4096, g_block, 4095) == 0, "random data claimed to shrink");
+}
+
+// Extra length bytes after a nibble of 15, written independently of lz4block.c
+static uint8_t *put_length(uint8_t *op, int len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// One sequence; matchLen 0 makes it the last, literals only
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *literals, int litLen, int offset, int matchLen) {
+    uint8_t *token = op++;
+    int m = matchLen > 0 ? matchLen - 4 : 0;
+    *token = (uint8_t)((litLen >= 15 ? 15 : litLen) << 4 | (matchLen > 0 ? (m >= 15 ? 15 : m) : 0));
+    if (litLen >= 15) op = put_length(op, litLen - 15);
+    memcpy(op, literals, (size_t)litLen);
+    op += litLen;
+    if (matchLen > 0) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if (m >= 15) op = put_length(op, m - 15);
+    }
+    return op;
+}
+
+static void expect_block(const uint8_t *block, int n, const uint8_t *want, int wantLen, const char *what) {
+    int r = decode_guarded(block, n, g_dst, wantLen);
+    CHECK(r == wantLen, "%s: returned %d, want %d", what, r, wantLen);
+    CHECK(r != wantLen || memcmp(g_dst, want, (size_t)wantLen) == 0, "%s: wrong output", what);
+}
+
+static void test_overlapping_matches(void) {
+    uint8_t block[64];
+    uint8_t want[1024];
+    static const uint8_t tail[5] = { 'x', 'y', 'z', '!', '\n' };
+
+    // Offset 1 repeats one byte, the run-length case
+    uint8_t *op = put_sequence(block, (const uint8_t *)"a", 1, 1, 300);
+    op = put_sequence(op, tail, 5, 0, 0);
+    memset(want, 'a', 301);
+    memcpy(want + 301, tail, 5);
+    expect_block(block, (int)(op - block), want, 306, "offset 1, 300 byte match");
+
+    // Offset 3, shorter than the match, repeats a 3 byte pattern
+    op = put_sequence(block, (const uint8_t *)"abc", 3, 3, 10);
+    op = put_sequence(op, tail, 5, 0, 0);
+    for (int i = 0; i < 13; i++) want[i] = (uint8_t)("abc"[i % 3]);
+    memcpy(want + 13, tail, 5);
+    expect_block(block, (int)(op - block), want, 18, "offset 3, 10 byte match");
+
+    // Offset equal to the match length, the first non-overlapping case
+    op = put_sequence(block, (const uint8_t *)"abcd", 4, 4, 4);
+    op = put_sequence(op, tail, 5, 0, 0);
+    memcpy(want, "abcdabcd", 8);
+    memcpy(want + 8, tail, 5);
+    expect_block(block, (int)(op - block), want, 13, "offset 4, 4 byte match");
+}
+
+static void test_length_extensions(void) {
+    static uint8_t literals[600];
+    static uint8_t block[1024];
+    static uint8_t want[2048];
+    static const uint8_t tail[5] = { 1, 2, 3, 4, 5 };
+    fill_random(literals, sizeof(literals));
+
+    // Literal lengths across the nibble of 15 and the extra byte of 255
+    static const int litLens[] = { 14, 15, 16, 269, 270, 271, 524, 525, 526 };
+    for (size_t i = 0; i < sizeof(litLens) / sizeof(litLens[0]); i++) {
+        int len = litLens[i];
+        uint8_t *op = put_sequence(block, literals, len, 0, 0);
+        char what[64];
+        snprintf(what, sizeof(what), "%d literals", len);
+        expect_block(block, (int)(op - block), literals, len, what);
+    }
+
+    // Match lengths likewise, the nibble counting from 4
+    static const int matchLens[] = { 18, 19, 20, 273, 274, 275, 528, 529, 530 };
+    for (size_t i = 0; i < sizeof(matchLens) / sizeof(matchLens[0]); i++) {
+        int len = matchLens[i];
+        uint8_t *op = put_sequence(block, literals, 8, 8, len);
+        op = put_sequence(op, tail, 5, 0, 0);
+        memcpy(want, literals, 8);
+        for (int k = 0; k < len; k++) want[8 + k] = literals[k % 8];
+        memcpy(want + 8 + len, tail, 5);
+        char what[64];
+        snprintf(what, sizeof(what), "%d byte match", len);
+        expect_block(block, (int)(op - block), want, 8 + len + 5, what);
+    }
+}
+
+static void test_malformed(void) {
+    uint8_t block[64];
+    static const uint8_t tail[5] = { 1, 2, 3, 4, 5 };
+
+    CHECK(lz4_decompress_block(block, 0, g_dst, 16) == -1, "empty block accepted");
+    block[0] = 0x10;
+    CHECK(lz4_decompress_block(block, 2, g_dst, -1) == -1, "negative capacity accepted");
+
+    // Cut inside the literals, the offset and the extra length bytes
+    uint8_t *op = put_sequence(block, tail, 5, 5, 300);
+    int n = (int)(put_sequence(op, tail, 5, 0, 0) - block);
+    static const int cuts[] = { 1, 3, 5, 7, 8, 9, 10 };
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+        CHECK(decode_guarded(block, cuts[i], g_dst, 512) == -1, "cut to %d of %d accepted", cuts[i], n);
+    }
+
+    // A match must be followed by a last sequence
+    n = (int)(put_sequence(block, tail, 5, 5, 8) - block);
+    CHECK(decode_guarded(block, n, g_dst, 512) == -1, "block ending in a match accepted");
+
+    // Offsets of 0 and before the start of the output
+    op = put_sequence(block, tail, 5, 0, 8);
+    n = (int)(put_sequence(op, tail, 5, 0, 0) - block);
+    CHECK(decode_guarded(block, n, g_dst, 512) == -1, "offset 0 accepted");
+    op = put_sequence(block, tail, 5, 6, 8);
+    n = (int)(put_sequence(op, tail, 5, 0, 0) - block);
+    CHECK(decode_guarded(block, n, g_dst, 512) == -1, "offset past the start accepted");
+
+    // A literal length running past the end of the block
+    op = put_sequence(block, tail, 5, 0, 0);
+    block[0] = 0xF0;
+    block[1] = 200;
+    CHECK(decode_guarded(block, 6, g_dst, 512) == -1, "literals past the end accepted");
+
+    // Random blocks, into small and large capacities: whatever they decode to, nothing
+    // lands past dstCapacity
+    static uint8_t garbage[4096];
+    for (int i = 0; i < 20000; i++) {
+        int len = 1 + (int)(next_random() % sizeof(garbage));
+        int cap = (int)(next_random() % (i & 1 ? 64 : MAX_SIZE));
+        fill_random(garbage, len);
+        decode_guarded(garbage, len, g_dst, cap);
+    }
+}
+
+int main(void) {
+    test_round_trips();
+    test_overlapping_matches();
+    test_length_extensions();
+    test_malformed();
+
+    if (g_failures > 0) {
+        fprintf(stderr, "%d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("lz4block: all checks passed\n");
+    return 0;
+}
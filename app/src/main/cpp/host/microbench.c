@@ -0,0 +1,355 @@
+/*
+ * Microbenchmarks for the primitives on the native transfer path. The file includes
+ * usbipfunctions.c directly so its static helpers can be timed in isolation; it runs
+ * on the simulated backend, so no device is involved.
+ *
+ *   microbench [--benchmark_filter=substring] [--benchmark_format=console|json]
+ *              [--benchmark_min_time=seconds]
+ *
+ * Flags and the JSON layout follow Google Benchmark, so its compare.py can diff two
+ * runs. Each benchmark is calibrated to run for at least min_time.
+ */
+#include "../usbipfunctions.c"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jnihost.h"
+#include "simdevice.h"
+
+#define BENCH_MAX_DEVICES MAX_ATTACHED_DEVICES
+#define BENCH_MAX_IN_FLIGHT 256
+
+typedef void (*BenchFn)(void *arg, uint64_t iterations);
+
+struct BenchOptions {
+    const char *filter;
+    int json;
+    double minTime;
+    int first;
+};
+
+static struct BenchOptions g_options = { .filter = "", .minTime = 0.1, .first = 1 };
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Keeps the compiler from discarding results that are otherwise unused.
+static void do_not_optimize(const void *p) {
+    __asm__ volatile("" : : "g"(p) : "memory");
+}
+
+static void bench_run(const char *name, BenchFn fn, void *arg) {
+    if (strstr(name, g_options.filter) == NULL) return;
+
+    // Grow the batch until it is long enough to time, then size it for minTime
+    uint64_t iterations = 1;
+    uint64_t real, cpu;
+    for (;;) {
+        uint64_t real0 = clock_ns(CLOCK_MONOTONIC), cpu0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        fn(arg, iterations);
+        real = clock_ns(CLOCK_MONOTONIC) - real0;
+        cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+
+        double seconds = (double)real / 1e9;
+        if (seconds >= g_options.minTime || iterations >= 1000000000ull) break;
+        uint64_t next = seconds < g_options.minTime / 100 ? iterations * 10 :
+                        (uint64_t)((double)iterations * g_options.minTime * 1.4 / seconds);
+        iterations = next > iterations ? next : iterations + 1;
+    }
+
+    double real_per = (double)real / (double)iterations;
+    double cpu_per = (double)cpu / (double)iterations;
+    if (g_options.json) {
+        printf("%s\n    {\"name\": \"%s\", \"run_name\": \"%s\", \"run_type\": \"iteration\", "
+               "\"iterations\": %llu, \"real_time\": %.3f, \"cpu_time\": %.3f, \"time_unit\": \"ns\"}",
+               g_options.first ? "" : ",", name, name, (unsigned long long)iterations, real_per, cpu_per);
+    } else {
+        printf("%-52s %12.1f ns %12.1f ns %12llu\n", name, real_per, cpu_per, (unsigned long long)iterations);
+    }
+    g_options.first = 0;
+    fflush(stdout);
+}
+
+/* --- Slot table: store_transfer / reset_transfer / find_device_by_fd --- */
+
+struct SlotBench {
+    int fds[BENCH_MAX_DEVICES];
+    int devices;
+    int inFlight;
+};
+
+// Occupies inFlight - 1 slots on the last device so the measured store has to scan
+// past them, as it does under load.
+static void slot_bench_fill(struct SlotBench *b) {
+    int fd = b->fds[b->devices - 1];
+    for (int i = 0; i < b->inFlight - 1; i++) {
+        store_transfer(fd, 1000000 + i, (struct libusb_transfer *)&b->fds, NULL, NULL);
+    }
+}
+
+static void slot_bench_clear(struct SlotBench *b) {
+    struct AttachedDeviceHandle *dev = find_device_by_fd(b->fds[b->devices - 1]);
+    for (int j = 0; j < MAX_ASYNC_TRANSFERS_PER_DEVICE; j++) {
+        if (dev->activeTransfers[j].seqNum >= 1000000) {
+            reset_transfer((int)(dev - g_attachedDevices), j, dev->activeTransfers[j].seqNum);
+        }
+    }
+}
+
+static void bm_store_reset(void *arg, uint64_t iterations) {
+    struct SlotBench *b = arg;
+    int fd = b->fds[b->devices - 1];
+    int dev_pos, xfer_pos;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        store_transfer(fd, (int)(i & 0xffff), (struct libusb_transfer *)b, &dev_pos, &xfer_pos);
+        reset_transfer(dev_pos, xfer_pos, (int)(i & 0xffff));
+    }
+}
+
+static void bm_find_device(void *arg, uint64_t iterations) {
+    struct SlotBench *b = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        do_not_optimize(find_device_by_fd(b->fds[b->devices - 1]));
+    }
+}
+
+/* --- libusb_alloc_transfer / libusb_free_transfer --- */
+
+static void bm_alloc_free(void *arg, uint64_t iterations) {
+    int packets = *(int *)arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        struct libusb_transfer *t = libusb_alloc_transfer(packets);
+        do_not_optimize(t);
+        libusb_free_transfer(t);
+    }
+}
+
+/* --- add_to_flying_list via submit + cancel + reap --- */
+
+struct FlyingBench {
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    int fd;
+    int inFlight;
+    unsigned char buffer[64];
+    struct libusb_transfer *background[BENCH_MAX_IN_FLIGHT];
+};
+
+static void LIBUSB_CALL flying_cb(struct libusb_transfer *transfer) {
+    *(int *)transfer->user_data = 1;
+}
+
+static int flying_bench_open(struct FlyingBench *b) {
+    struct SimDeviceConfig config;
+    char err[128];
+    // Transfers on 0x81 never finish on their own, so they stay on the flying list
+    if (sim_device_config_parse(&config, "endpoint addr=0x81 type=bulk latency_us=600000000\n", err, sizeof(err)) != 0) {
+        return -1;
+    }
+    b->fd = sim_device_create(&config);
+    if (b->fd < 0 || libusb_init_context(&b->ctx, NULL, 0) != 0) return -1;
+    return libusb_wrap_sys_device(b->ctx, (intptr_t)b->fd, &b->handle);
+}
+
+static void flying_bench_close(struct FlyingBench *b) {
+    libusb_close(b->handle);
+    libusb_exit(b->ctx);
+    sim_device_destroy(b->fd);
+}
+
+static void reap(libusb_context *ctx, int *done) {
+    struct timeval zero = { 0, 0 };
+    while (!*done) libusb_handle_events_timeout_completed(ctx, &zero, done);
+}
+
+// Every transfer carries a timeout, so each submit walks the flying list to find its
+// place; the measured one has the latest deadline and walks all of it.
+static void flying_bench_fill(struct FlyingBench *b) {
+    for (int i = 0; i < b->inFlight - 1; i++) {
+        struct libusb_transfer *t = libusb_alloc_transfer(0);
+        libusb_fill_bulk_transfer(t, b->handle, 0x81, b->buffer, sizeof(b->buffer), flying_cb, NULL, 60000);
+        t->user_data = calloc(1, sizeof(int));
+        libusb_submit_transfer(t);
+        b->background[i] = t;
+    }
+}
+
+static void flying_bench_drain(struct FlyingBench *b) {
+    for (int i = 0; i < b->inFlight - 1; i++) {
+        libusb_cancel_transfer(b->background[i]);
+        reap(b->ctx, b->background[i]->user_data);
+        free(b->background[i]->user_data);
+        libusb_free_transfer(b->background[i]);
+    }
+}
+
+static void bm_submit_cancel(void *arg, uint64_t iterations) {
+    struct FlyingBench *b = arg;
+    struct libusb_transfer *t = libusb_alloc_transfer(0);
+    int done;
+
+    libusb_fill_bulk_transfer(t, b->handle, 0x81, b->buffer, sizeof(b->buffer), flying_cb, &done, 60000);
+    for (uint64_t i = 0; i < iterations; i++) {
+        done = 0;
+        libusb_submit_transfer(t);
+        libusb_cancel_transfer(t);
+        reap(b->ctx, &done);
+    }
+    libusb_free_transfer(t);
+}
+
+/* --- ISO result marshalling as done in generic_transfer_cb --- */
+
+static void bm_iso_marshal(void *arg, uint64_t iterations) {
+    struct libusb_transfer *t = arg;
+    JNIEnv *env = jni_host_env();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        jintArray lengths, statuses;
+        int total = marshal_iso_results(env, t, &lengths, &statuses);
+        do_not_optimize(&total);
+        (*env)->DeleteLocalRef(env, lengths);
+        (*env)->DeleteLocalRef(env, statuses);
+    }
+}
+
+/* --- errno mapping --- */
+
+static void bm_libusb_to_errno(void *arg, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        int r = libusb_to_errno(-(int)(i % 14)); // LIBUSB_SUCCESS .. LIBUSB_ERROR_NOT_SUPPORTED
+        do_not_optimize(&r);
+    }
+}
+
+static void bm_status_to_errno(void *arg, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        int r = libusb_status_to_errno((int)(i % 7));
+        do_not_optimize(&r);
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--benchmark_filter=substring] [--benchmark_format=console|json] "
+                    "[--benchmark_min_time=seconds]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--benchmark_filter=", 19) == 0) {
+            g_options.filter = argv[i] + 19;
+        } else if (strcmp(argv[i], "--benchmark_format=json") == 0) {
+            g_options.json = 1;
+        } else if (strcmp(argv[i], "--benchmark_format=console") == 0) {
+            g_options.json = 0;
+        } else if (strncmp(argv[i], "--benchmark_min_time=", 21) == 0) {
+            g_options.minTime = atof(argv[i] + 21);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    JNIEnv *env = jni_host_env();
+    jobject thiz = jni_host_usblib();
+    if (Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_init(env, thiz) != 0) return 1;
+
+    struct SlotBench slots = { 0 };
+    struct SimDeviceConfig config;
+    sim_device_config_defaults(&config);
+    for (int i = 0; i < BENCH_MAX_DEVICES; i++) {
+        slots.fds[i] = sim_device_create(&config);
+        if (slots.fds[i] < 0 ||
+            Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_openDeviceHandle(env, thiz, slots.fds[i]) != 0) {
+            fprintf(stderr, "could not open simulated device %d\n", i);
+            return 1;
+        }
+    }
+
+    if (g_options.json) {
+        char host[64] = "";
+        gethostname(host, sizeof(host) - 1);
+        time_t now = time(NULL);
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+        printf("{\n  \"context\": {\"date\": \"%s\", \"host_name\": \"%s\", \"executable\": \"%s\", "
+               "\"num_cpus\": %ld, \"library_build_type\": \"%s\"},\n  \"benchmarks\": [",
+               date, host, argv[0], sysconf(_SC_NPROCESSORS_ONLN),
+#ifdef NDEBUG
+               "release"
+#else
+               "debug"
+#endif
+               );
+    } else {
+        printf("%-52s %15s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+    }
+
+    // Slots only go up to the per-device limit; the scan is over devices and slots
+    static const int SLOT_DEVICES[] = { 1, 4, 16 };
+    static const int SLOT_IN_FLIGHT[] = { 1, 8, MAX_ASYNC_TRANSFERS_PER_DEVICE };
+    char name[128];
+    for (size_t d = 0; d < sizeof(SLOT_DEVICES) / sizeof(SLOT_DEVICES[0]); d++) {
+        slots.devices = SLOT_DEVICES[d];
+        for (size_t n = 0; n < sizeof(SLOT_IN_FLIGHT) / sizeof(SLOT_IN_FLIGHT[0]); n++) {
+            slots.inFlight = SLOT_IN_FLIGHT[n];
+            slot_bench_fill(&slots);
+            snprintf(name, sizeof(name), "BM_StoreResetTransfer/devices:%d/in_flight:%d", slots.devices, slots.inFlight);
+            bench_run(name, bm_store_reset, &slots);
+            slot_bench_clear(&slots);
+        }
+        snprintf(name, sizeof(name), "BM_FindDeviceByFd/devices:%d", slots.devices);
+        bench_run(name, bm_find_device, &slots);
+    }
+
+    static int ISO_PACKETS[] = { 0, 8, 32, 128 };
+    for (size_t i = 0; i < sizeof(ISO_PACKETS) / sizeof(ISO_PACKETS[0]); i++) {
+        snprintf(name, sizeof(name), "BM_AllocFreeTransfer/iso_packets:%d", ISO_PACKETS[i]);
+        bench_run(name, bm_alloc_free, &ISO_PACKETS[i]);
+    }
+
+    static const int FLYING_IN_FLIGHT[] = { 1, 16, 64, BENCH_MAX_IN_FLIGHT };
+    for (size_t i = 0; i < sizeof(FLYING_IN_FLIGHT) / sizeof(FLYING_IN_FLIGHT[0]); i++) {
+        struct FlyingBench flying = { .inFlight = FLYING_IN_FLIGHT[i] };
+        snprintf(name, sizeof(name), "BM_SubmitCancelReap/in_flight:%d", flying.inFlight);
+        if (strstr(name, g_options.filter) == NULL) continue;
+        if (flying_bench_open(&flying) != 0) {
+            fprintf(stderr, "could not open simulated device for %s\n", name);
+            return 1;
+        }
+        flying_bench_fill(&flying);
+        bench_run(name, bm_submit_cancel, &flying);
+        flying_bench_drain(&flying);
+        flying_bench_close(&flying);
+    }
+
+    for (size_t i = 1; i < sizeof(ISO_PACKETS) / sizeof(ISO_PACKETS[0]); i++) {
+        struct libusb_transfer *t = libusb_alloc_transfer(ISO_PACKETS[i]);
+        t->num_iso_packets = ISO_PACKETS[i];
+        for (int p = 0; p < t->num_iso_packets; p++) {
+            t->iso_packet_desc[p].actual_length = 1024;
+            t->iso_packet_desc[p].status = p % 50 == 49 ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED;
+        }
+        snprintf(name, sizeof(name), "BM_IsoMarshal/packets:%d", ISO_PACKETS[i]);
+        bench_run(name, bm_iso_marshal, t);
+        libusb_free_transfer(t);
+    }
+
+    bench_run("BM_LibusbToErrno", bm_libusb_to_errno, NULL);
+    bench_run("BM_StatusToErrno", bm_status_to_errno, NULL);
+
+    if (g_options.json) printf("\n  ]\n}\n");
+
+    for (int i = 0; i < BENCH_MAX_DEVICES; i++) {
+        Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_closeDeviceHandle(env, thiz, slots.fds[i]);
+        sim_device_destroy(slots.fds[i]);
+    }
+    Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_exit(env, thiz);
+    return 0;
+}
@@ -0,0 +1,846 @@
+/*
+ * libusb OS backend driving simulated devices, used in place of os/linux_usbfs.c by
+ * the host build.
+ *
+ * Each simulated device owns an eventfd that plays the part of the usbfs fd: it is
+ * registered as a libusb event source when wrapped and becomes readable whenever a
+ * transfer on that device has completed. A single scheduler thread completes transfers
+ * once their simulated latency and bandwidth have elapsed; transfers that would take
+ * no time complete straight from submit so the engine can run flat out.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusbi.h"
+#include "simdevice.h"
+#include "../usbipprobes.h"
+
+#define SIM_MAX_DEVICES 64
+
+enum SimTransferState {
+    SIM_TRANSFER_IDLE,
+    SIM_TRANSFER_SCHEDULED, // Waiting in the scheduler queue
+    SIM_TRANSFER_DONE,      // On the device's completed list
+};
+
+struct SimTransferPriv {
+    struct usbi_transfer *itransfer;
+    struct SimDevice *device;
+    struct SimTransferPriv *next;
+    uint64_t dueNs;
+    enum SimTransferState state;
+    int cancelled;
+    enum libusb_transfer_status status;
+    int scripted;
+    struct SimResponse response;
+};
+
+struct SimEndpointState {
+    const struct SimEndpointConfig *config;
+    uint64_t busyUntilNs;
+    uint64_t transfers;
+    uint64_t isoPackets;
+};
+
+struct SimDevice {
+    int fd;
+    int connected;
+    struct SimDeviceConfig config;
+    struct SimEndpointConfig control;
+    struct SimEndpointState endpoints[SIM_MAX_ENDPOINTS];
+    unsigned char configDescriptor[9 + 9 + 7 * SIM_MAX_ENDPOINTS];
+    uint16_t configDescriptorLength;
+
+    struct SimTransferPriv *completedHead;
+    struct SimTransferPriv *completedTail;
+    uint64_t stats[SIM_STAT_COUNT];
+
+    SimResponderFn responder;
+    void *responderUser;
+};
+
+struct SimHandlePriv {
+    struct SimDevice *device;
+};
+
+struct SimDevicePriv {
+    struct SimDevice *device;
+};
+
+// One lock covers the device table, the scheduler queue and every completed list.
+// The simulation is about exercising the engine above it, not about scaling itself.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int condInitialized;
+    struct SimDevice *devices[SIM_MAX_DEVICES];
+    struct SimTransferPriv *scheduled; // Sorted by dueNs
+    pthread_t thread;
+    int contexts;
+    int running;
+} g_sim = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int endpoint_index(uint8_t address) {
+    return (address & 0x0f) | ((address & LIBUSB_ENDPOINT_IN) ? 0x10 : 0);
+}
+
+static struct SimDevice *find_device(int fd) {
+    for (int i = 0; i < SIM_MAX_DEVICES; i++) {
+        if (g_sim.devices[i] != NULL && g_sim.devices[i]->fd == fd) return g_sim.devices[i];
+    }
+    return NULL;
+}
+
+static void signal_device(int fd) {
+    uint64_t one = 1;
+    ssize_t r = write(fd, &one, sizeof(one));
+    (void)r; // EAGAIN only means the counter is already non-zero
+}
+
+static void build_config_descriptor(struct SimDevice *dev) {
+    unsigned char *p = dev->configDescriptor;
+    int total = 9 + 9 + 7 * dev->config.numEndpoints;
+
+    const unsigned char config[9] = {
+            9, LIBUSB_DT_CONFIG, (unsigned char)(total & 0xff), (unsigned char)(total >> 8),
+            1, 1, 0, 0x80, 50
+    };
+    const unsigned char interface[9] = {
+            9, LIBUSB_DT_INTERFACE, 0, 0, (unsigned char)dev->config.numEndpoints,
+            dev->config.interfaceClass, dev->config.interfaceSubClass, dev->config.interfaceProtocol, 0
+    };
+    memcpy(p, config, sizeof(config));
+    memcpy(p + 9, interface, sizeof(interface));
+    p += 18;
+
+    for (int i = 0; i < dev->config.numEndpoints; i++) {
+        const struct SimEndpointConfig *ep = &dev->config.endpoints[i];
+        p[0] = 7;
+        p[1] = LIBUSB_DT_ENDPOINT;
+        p[2] = ep->address;
+        p[3] = ep->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? 1 :
+               ep->type == LIBUSB_TRANSFER_TYPE_BULK ? 2 : 3;
+        p[4] = (unsigned char)(ep->maxPacketSize & 0xff);
+        p[5] = (unsigned char)(ep->maxPacketSize >> 8);
+        p[6] = ep->interval;
+        p += 7;
+    }
+    dev->configDescriptorLength = (uint16_t)total;
+}
+
+static void fill_device_descriptor(const struct SimDevice *dev, struct libusb_device_descriptor *desc) {
+    desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+    desc->bDescriptorType = LIBUSB_DT_DEVICE;
+    desc->bcdUSB = dev->config.bcdUSB;
+    desc->bDeviceClass = dev->config.deviceClass;
+    desc->bDeviceSubClass = dev->config.deviceSubClass;
+    desc->bDeviceProtocol = dev->config.deviceProtocol;
+    desc->bMaxPacketSize0 = dev->config.speed >= LIBUSB_SPEED_SUPER ? 9 : 64;
+    desc->idVendor = dev->config.vendorId;
+    desc->idProduct = dev->config.productId;
+    desc->bcdDevice = dev->config.bcdDevice;
+    desc->iManufacturer = 1;
+    desc->iProduct = 2;
+    desc->iSerialNumber = 3;
+    desc->bNumConfigurations = 1;
+}
+
+int sim_device_create(const struct SimDeviceConfig *config) {
+    if (config->numEndpoints < 0 || config->numEndpoints > SIM_MAX_ENDPOINTS) return -EINVAL;
+
+    struct SimDevice *dev = calloc(1, sizeof(*dev));
+    if (dev == NULL) return -ENOMEM;
+
+    dev->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dev->fd < 0) {
+        int err = errno;
+        free(dev);
+        return -err;
+    }
+    dev->connected = 1;
+    dev->config = *config;
+    dev->control.type = LIBUSB_TRANSFER_TYPE_CONTROL;
+    dev->control.maxPacketSize = 64;
+    dev->control.latencyUs = config->controlLatencyUs;
+    dev->endpoints[0].config = &dev->control;
+    dev->endpoints[0x10].config = &dev->control;
+    for (int i = 0; i < config->numEndpoints; i++) {
+        dev->endpoints[endpoint_index(config->endpoints[i].address)].config = &dev->config.endpoints[i];
+    }
+    build_config_descriptor(dev);
+
+    pthread_mutex_lock(&g_sim.lock);
+    for (int i = 0; i < SIM_MAX_DEVICES; i++) {
+        if (g_sim.devices[i] == NULL) {
+            g_sim.devices[i] = dev;
+            pthread_mutex_unlock(&g_sim.lock);
+            return dev->fd;
+        }
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+
+    close(dev->fd);
+    free(dev);
+    return -EMFILE;
+}
+
+// Only safe once the device has been closed in libusb.
+void sim_device_destroy(int fd) {
+    struct SimDevice *dev = NULL;
+
+    pthread_mutex_lock(&g_sim.lock);
+    for (int i = 0; i < SIM_MAX_DEVICES; i++) {
+        if (g_sim.devices[i] != NULL && g_sim.devices[i]->fd == fd) {
+            dev = g_sim.devices[i];
+            g_sim.devices[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+
+    if (dev != NULL) {
+        close(dev->fd);
+        free(dev);
+    }
+}
+
+int sim_device_stats(int fd, uint64_t out[SIM_STAT_COUNT]) {
+    pthread_mutex_lock(&g_sim.lock);
+    struct SimDevice *dev = find_device(fd);
+    if (dev != NULL) memcpy(out, dev->stats, sizeof(dev->stats));
+    pthread_mutex_unlock(&g_sim.lock);
+    return dev != NULL ? 0 : -ENODEV;
+}
+
+// Caller holds g_sim.lock.
+int sim_device_set_responder(int fd, SimResponderFn fn, void *user) {
+    pthread_mutex_lock(&g_sim.lock);
+    struct SimDevice *dev = find_device(fd);
+    if (dev != NULL) {
+        dev->responder = fn;
+        dev->responderUser = user;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return dev != NULL ? 0 : -ENODEV;
+}
+
+static void push_completed(struct SimDevice *dev, struct SimTransferPriv *tpriv) {
+    tpriv->state = SIM_TRANSFER_DONE;
+    tpriv->next = NULL;
+    if (dev->completedTail != NULL) dev->completedTail->next = tpriv;
+    else dev->completedHead = tpriv;
+    dev->completedTail = tpriv;
+}
+
+static void remove_scheduled(struct SimTransferPriv *tpriv) {
+    struct SimTransferPriv **link = &g_sim.scheduled;
+    while (*link != NULL && *link != tpriv) link = &(*link)->next;
+    if (*link == tpriv) *link = tpriv->next;
+    tpriv->next = NULL;
+}
+
+static void remove_completed(struct SimDevice *dev, struct SimTransferPriv *tpriv) {
+    struct SimTransferPriv *prev = NULL;
+    for (struct SimTransferPriv *cur = dev->completedHead; cur != NULL; prev = cur, cur = cur->next) {
+        if (cur != tpriv) continue;
+        if (prev != NULL) prev->next = cur->next;
+        else dev->completedHead = cur->next;
+        if (dev->completedTail == cur) dev->completedTail = prev;
+        break;
+    }
+    tpriv->next = NULL;
+}
+
+int sim_device_disconnect(int fd) {
+    pthread_mutex_lock(&g_sim.lock);
+    struct SimDevice *dev = find_device(fd);
+    if (dev == NULL) {
+        pthread_mutex_unlock(&g_sim.lock);
+        return -ENODEV;
+    }
+    dev->connected = 0;
+
+    struct SimTransferPriv **link = &g_sim.scheduled;
+    while (*link != NULL) {
+        struct SimTransferPriv *tpriv = *link;
+        if (tpriv->device != dev) {
+            link = &tpriv->next;
+            continue;
+        }
+        *link = tpriv->next;
+        tpriv->status = LIBUSB_TRANSFER_NO_DEVICE;
+        push_completed(dev, tpriv);
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+
+    signal_device(fd);
+    return 0;
+}
+
+static size_t copy_string_descriptor(unsigned char *out, size_t max, uint8_t index) {
+    static const char *const STRINGS[] = { NULL, "USB/IP Simulator", "Simulated Device", "SIM0001" };
+    unsigned char desc[2 + 2 * 32];
+    size_t len;
+
+    if (index == 0) {
+        desc[2] = 0x09; // en-US
+        desc[3] = 0x04;
+        len = 4;
+    } else {
+        const char *s = index < sizeof(STRINGS) / sizeof(STRINGS[0]) ? STRINGS[index] : "Simulated";
+        len = 2;
+        for (; *s && len + 2 <= sizeof(desc); s++) {
+            desc[len++] = (unsigned char)*s;
+            desc[len++] = 0;
+        }
+    }
+    desc[0] = (unsigned char)len;
+    desc[1] = LIBUSB_DT_STRING;
+    len = len < max ? len : max;
+    memcpy(out, desc, len);
+    return len;
+}
+
+static size_t copy_bos_descriptor(const struct SimDevice *dev, unsigned char *out, size_t max) {
+    unsigned char desc[5 + 7 + 10];
+    size_t len = 5;
+
+    desc[len++] = 7; // USB 2.0 extension
+    desc[len++] = LIBUSB_DT_DEVICE_CAPABILITY;
+    desc[len++] = LIBUSB_BT_USB_2_0_EXTENSION;
+    desc[len++] = 0x02; // LPM
+    desc[len++] = 0;
+    desc[len++] = 0;
+    desc[len++] = 0;
+    if (dev->config.speed >= LIBUSB_SPEED_SUPER) {
+        const unsigned char ss[10] = { 10, LIBUSB_DT_DEVICE_CAPABILITY, LIBUSB_BT_SS_USB_DEVICE_CAPABILITY,
+                                       0, 0x0e, 0, 1, 10, 0xff, 0x07 };
+        memcpy(desc + len, ss, sizeof(ss));
+        len += sizeof(ss);
+    }
+    desc[0] = 5;
+    desc[1] = LIBUSB_DT_BOS;
+    desc[2] = (unsigned char)len;
+    desc[3] = 0;
+    desc[4] = dev->config.speed >= LIBUSB_SPEED_SUPER ? 2 : 1;
+
+    len = len < max ? len : max;
+    memcpy(out, desc, len);
+    return len;
+}
+
+// Answers standard requests from the simulated descriptors. Everything else succeeds,
+// with zeroed data for IN requests.
+static int run_control(struct SimDevice *dev, struct libusb_transfer *transfer, int *actual) {
+    const struct libusb_control_setup *setup = (const struct libusb_control_setup *)transfer->buffer;
+    unsigned char *data = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+    uint16_t wValue = libusb_le16_to_cpu(setup->wValue);
+    uint16_t wLength = libusb_le16_to_cpu(setup->wLength);
+    size_t max = wLength;
+    int is_in = (setup->bmRequestType & LIBUSB_ENDPOINT_IN) != 0;
+
+    if (transfer->length < LIBUSB_CONTROL_SETUP_SIZE + (int)wLength) return LIBUSB_TRANSFER_ERROR;
+    *actual = 0;
+
+    if ((setup->bmRequestType & (0x03 << 5)) == LIBUSB_REQUEST_TYPE_STANDARD && is_in) {
+        switch (setup->bRequest) {
+            case LIBUSB_REQUEST_GET_DESCRIPTOR:
+                switch (wValue >> 8) {
+                    case LIBUSB_DT_DEVICE: {
+                        struct libusb_device_descriptor desc;
+                        unsigned char raw[LIBUSB_DT_DEVICE_SIZE];
+                        fill_device_descriptor(dev, &desc);
+                        raw[0] = desc.bLength;
+                        raw[1] = desc.bDescriptorType;
+                        raw[2] = desc.bcdUSB & 0xff;
+                        raw[3] = desc.bcdUSB >> 8;
+                        raw[4] = desc.bDeviceClass;
+                        raw[5] = desc.bDeviceSubClass;
+                        raw[6] = desc.bDeviceProtocol;
+                        raw[7] = desc.bMaxPacketSize0;
+                        raw[8] = desc.idVendor & 0xff;
+                        raw[9] = desc.idVendor >> 8;
+                        raw[10] = desc.idProduct & 0xff;
+                        raw[11] = desc.idProduct >> 8;
+                        raw[12] = desc.bcdDevice & 0xff;
+                        raw[13] = desc.bcdDevice >> 8;
+                        raw[14] = desc.iManufacturer;
+                        raw[15] = desc.iProduct;
+                        raw[16] = desc.iSerialNumber;
+                        raw[17] = desc.bNumConfigurations;
+                        *actual = (int)(max < sizeof(raw) ? max : sizeof(raw));
+                        memcpy(data, raw, (size_t)*actual);
+                        return LIBUSB_TRANSFER_COMPLETED;
+                    }
+                    case LIBUSB_DT_CONFIG:
+                        *actual = (int)(max < dev->configDescriptorLength ? max : dev->configDescriptorLength);
+                        memcpy(data, dev->configDescriptor, (size_t)*actual);
+                        return LIBUSB_TRANSFER_COMPLETED;
+                    case LIBUSB_DT_STRING:
+                        *actual = (int)copy_string_descriptor(data, max, wValue & 0xff);
+                        return LIBUSB_TRANSFER_COMPLETED;
+                    case LIBUSB_DT_BOS:
+                        if (dev->config.bcdUSB < 0x0201) return LIBUSB_TRANSFER_STALL;
+                        *actual = (int)copy_bos_descriptor(dev, data, max);
+                        return LIBUSB_TRANSFER_COMPLETED;
+                    default:
+                        return LIBUSB_TRANSFER_STALL;
+                }
+            case LIBUSB_REQUEST_GET_CONFIGURATION:
+                if (max >= 1) {
+                    data[0] = 1;
+                    *actual = 1;
+                }
+                return LIBUSB_TRANSFER_COMPLETED;
+            default:
+                break;
+        }
+    }
+
+    if (is_in) memset(data, 0, max);
+    *actual = (int)max;
+    return LIBUSB_TRANSFER_COMPLETED;
+}
+
+static void run_scripted(struct SimDevice *dev, struct SimTransferPriv *tpriv) {
+    struct usbi_transfer *itransfer = tpriv->itransfer;
+    struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+    int is_in = (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+    int max = transfer->length;
+    int actual = tpriv->response.actualLength;
+
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        is_in = (transfer->buffer[0] & LIBUSB_ENDPOINT_IN) != 0;
+        max -= LIBUSB_CONTROL_SETUP_SIZE;
+    }
+    if (actual < 0) actual = 0;
+    if (actual > max) actual = max;
+    tpriv->status = tpriv->response.status;
+
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        int left = actual;
+        for (int i = 0; i < transfer->num_iso_packets; i++) {
+            struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
+            pkt->actual_length = left < (int)pkt->length ? (unsigned int)left : pkt->length;
+            pkt->status = LIBUSB_TRANSFER_COMPLETED;
+            left -= (int)pkt->actual_length;
+        }
+    }
+    dev->stats[is_in ? SIM_STAT_BYTES_IN : SIM_STAT_BYTES_OUT] += (uint64_t)actual;
+    itransfer->transferred = transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? 0 : actual;
+}
+
+// Produces the result of a transfer. Caller holds g_sim.lock.
+static void run_transfer(struct SimDevice *dev, struct SimTransferPriv *tpriv) {
+    struct usbi_transfer *itransfer = tpriv->itransfer;
+    struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+    struct SimEndpointState *ep = &dev->endpoints[endpoint_index(transfer->endpoint)];
+    const struct SimEndpointConfig *cfg = ep->config;
+    int is_in = (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+    int actual = transfer->length;
+
+    ep->transfers++;
+    tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+
+    if (!dev->connected) {
+        tpriv->status = LIBUSB_TRANSFER_NO_DEVICE;
+        itransfer->transferred = 0;
+        return;
+    }
+    if (tpriv->scripted) {
+        run_scripted(dev, tpriv);
+        return;
+    }
+    if (cfg->stallEvery && ep->transfers % cfg->stallEvery == 0) {
+        tpriv->status = LIBUSB_TRANSFER_STALL;
+        itransfer->transferred = 0;
+        return;
+    }
+
+    switch (transfer->type) {
+        case LIBUSB_TRANSFER_TYPE_CONTROL:
+            tpriv->status = (enum libusb_transfer_status)run_control(dev, transfer, &actual);
+            is_in = (transfer->buffer[0] & LIBUSB_ENDPOINT_IN) != 0;
+            break;
+        case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+            actual = 0;
+            for (int i = 0; i < transfer->num_iso_packets; i++) {
+                struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
+                ep->isoPackets++;
+                if (cfg->errorEvery && ep->isoPackets % cfg->errorEvery == 0) {
+                    pkt->status = LIBUSB_TRANSFER_ERROR;
+                    pkt->actual_length = 0;
+                } else {
+                    pkt->status = LIBUSB_TRANSFER_COMPLETED;
+                    pkt->actual_length = pkt->length;
+                    actual += (int)pkt->length;
+                }
+            }
+            break;
+        default:
+            if (is_in && cfg->shortEvery && ep->transfers % cfg->shortEvery == 0) {
+                actual = transfer->length / 2;
+            }
+            break;
+    }
+
+    if (is_in && dev->config.fillPattern && transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL) {
+        memset(transfer->buffer, (int)(ep->transfers & 0xff), (size_t)transfer->length);
+    }
+    dev->stats[is_in ? SIM_STAT_BYTES_IN : SIM_STAT_BYTES_OUT] += (uint64_t)actual;
+    // Like usbfs, ISO transfers only report per-packet lengths
+    itransfer->transferred = transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? 0 : actual;
+}
+
+// How long the device spends on a transfer. Transfers on one endpoint are serialised.
+static uint64_t schedule_due(struct SimDevice *dev, struct libusb_transfer *transfer, uint64_t now) {
+    struct SimEndpointState *ep = &dev->endpoints[endpoint_index(transfer->endpoint)];
+    const struct SimEndpointConfig *cfg = ep->config;
+    uint64_t busy = 0;
+
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && cfg->isoIntervalUs) {
+        busy = (uint64_t)transfer->num_iso_packets * cfg->isoIntervalUs * 1000ull;
+    } else if (cfg->bandwidthBps) {
+        busy = (uint64_t)transfer->length * 1000000000ull / cfg->bandwidthBps;
+    }
+
+    if (busy == 0 && cfg->latencyUs == 0) return 0;
+
+    uint64_t start = ep->busyUntilNs > now ? ep->busyUntilNs : now;
+    ep->busyUntilNs = start + busy;
+    return ep->busyUntilNs + (uint64_t)cfg->latencyUs * 1000ull;
+}
+
+static void *scheduler_thread_func(void *arg) {
+    pthread_mutex_lock(&g_sim.lock);
+    while (g_sim.running) {
+        struct SimTransferPriv *head = g_sim.scheduled;
+        if (head == NULL) {
+            pthread_cond_wait(&g_sim.wake, &g_sim.lock);
+            continue;
+        }
+
+        uint64_t now = now_ns();
+        if (head->dueNs > now) {
+            struct timespec deadline = {
+                    .tv_sec = (time_t)(head->dueNs / 1000000000ull),
+                    .tv_nsec = (long)(head->dueNs % 1000000000ull)
+            };
+            pthread_cond_timedwait(&g_sim.wake, &g_sim.lock, &deadline);
+            continue;
+        }
+
+        g_sim.scheduled = head->next;
+        run_transfer(head->device, head);
+        push_completed(head->device, head);
+        int fd = head->device->fd;
+        pthread_mutex_unlock(&g_sim.lock);
+        signal_device(fd);
+        pthread_mutex_lock(&g_sim.lock);
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return NULL;
+}
+
+static int op_init(struct libusb_context *ctx) {
+    int r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (!g_sim.condInitialized) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&g_sim.wake, &attr);
+        pthread_condattr_destroy(&attr);
+        g_sim.condInitialized = 1;
+    }
+    if (g_sim.contexts++ == 0) {
+        g_sim.running = 1;
+        if (pthread_create(&g_sim.thread, NULL, scheduler_thread_func, NULL) != 0) {
+            g_sim.running = 0;
+            g_sim.contexts--;
+            r = LIBUSB_ERROR_OTHER;
+        }
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return r;
+}
+
+static void op_exit(struct libusb_context *ctx) {
+    pthread_mutex_lock(&g_sim.lock);
+    int stop = --g_sim.contexts == 0;
+    if (stop) {
+        g_sim.running = 0;
+        pthread_cond_signal(&g_sim.wake);
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+
+    if (stop) pthread_join(g_sim.thread, NULL);
+}
+
+static int op_set_option(struct libusb_context *ctx, enum libusb_option option, va_list args) {
+    return option == LIBUSB_OPTION_NO_DEVICE_DISCOVERY ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static int op_get_device_list(struct libusb_context *ctx, struct discovered_devs **discdevs) {
+    return LIBUSB_SUCCESS; // Simulated devices are only reachable through their fd
+}
+
+static int op_wrap_sys_device(struct libusb_context *ctx, struct libusb_device_handle *handle, intptr_t sys_dev) {
+    struct SimHandlePriv *hpriv = usbi_get_device_handle_priv(handle);
+    int fd = (int)sys_dev;
+
+    pthread_mutex_lock(&g_sim.lock);
+    struct SimDevice *sim = find_device(fd);
+    pthread_mutex_unlock(&g_sim.lock);
+    if (sim == NULL) return LIBUSB_ERROR_NO_DEVICE;
+
+    struct libusb_device *dev = usbi_alloc_device(ctx, 0);
+    if (dev == NULL) return LIBUSB_ERROR_NO_MEM;
+
+    ((struct SimDevicePriv *)usbi_get_device_priv(dev))->device = sim;
+    dev->bus_number = sim->config.busNumber;
+    dev->device_address = sim->config.deviceAddress;
+    dev->speed = sim->config.speed;
+    fill_device_descriptor(sim, &dev->device_descriptor);
+
+    int r = usbi_sanitize_device(dev);
+    if (r == 0) r = usbi_add_event_source(ctx, fd, POLLIN);
+    if (r < 0) {
+        libusb_unref_device(dev);
+        return r;
+    }
+
+    usbi_atomic_store(&dev->attached, 1);
+    handle->dev = dev;
+    hpriv->device = sim;
+    return LIBUSB_SUCCESS;
+}
+
+static int op_open(struct libusb_device_handle *handle) {
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static void op_close(struct libusb_device_handle *handle) {
+    struct SimHandlePriv *hpriv = usbi_get_device_handle_priv(handle);
+    if (hpriv->device != NULL) usbi_remove_event_source(HANDLE_CTX(handle), hpriv->device->fd);
+}
+
+static int op_get_active_config_descriptor(struct libusb_device *device, void *buffer, size_t len) {
+    struct SimDevice *sim = ((struct SimDevicePriv *)usbi_get_device_priv(device))->device;
+    size_t n = len < sim->configDescriptorLength ? len : sim->configDescriptorLength;
+    memcpy(buffer, sim->configDescriptor, n);
+    return (int)n;
+}
+
+static int op_get_config_descriptor(struct libusb_device *device, uint8_t config_index, void *buffer, size_t len) {
+    if (config_index != 0) return LIBUSB_ERROR_NOT_FOUND;
+    return op_get_active_config_descriptor(device, buffer, len);
+}
+
+static int op_get_configuration(struct libusb_device_handle *handle, uint8_t *config) {
+    *config = 1;
+    return LIBUSB_SUCCESS;
+}
+
+static int op_set_configuration(struct libusb_device_handle *handle, int config) {
+    return LIBUSB_SUCCESS;
+}
+
+static int op_claim_interface(struct libusb_device_handle *handle, uint8_t iface) {
+    return LIBUSB_SUCCESS;
+}
+
+static int op_release_interface(struct libusb_device_handle *handle, uint8_t iface) {
+    return LIBUSB_SUCCESS;
+}
+
+static int op_set_interface_altsetting(struct libusb_device_handle *handle, uint8_t iface, uint8_t altsetting) {
+    return LIBUSB_SUCCESS;
+}
+
+static int op_clear_halt(struct libusb_device_handle *handle, unsigned char endpoint) {
+    return LIBUSB_SUCCESS;
+}
+
+static int op_submit_transfer(struct usbi_transfer *itransfer) {
+    struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+    struct SimHandlePriv *hpriv = usbi_get_device_handle_priv(transfer->dev_handle);
+    struct SimTransferPriv *tpriv = usbi_get_transfer_priv(itransfer);
+    struct SimDevice *dev = hpriv->device;
+
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM) return LIBUSB_ERROR_NOT_SUPPORTED;
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL && transfer->length < LIBUSB_CONTROL_SETUP_SIZE) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (!dev->connected) {
+        pthread_mutex_unlock(&g_sim.lock);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (dev->endpoints[endpoint_index(transfer->endpoint)].config == NULL) {
+        pthread_mutex_unlock(&g_sim.lock);
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    memset(tpriv, 0, sizeof(*tpriv));
+    tpriv->itransfer = itransfer;
+    tpriv->device = dev;
+    dev->stats[SIM_STAT_SUBMITTED]++;
+
+    uint64_t due;
+    if (dev->responder != NULL && dev->responder(dev->responderUser, transfer, &tpriv->response)) {
+        tpriv->scripted = 1;
+        due = tpriv->response.delayUs ? now_ns() + (uint64_t)tpriv->response.delayUs * 1000ull : 0;
+    } else {
+        due = schedule_due(dev, transfer, now_ns());
+    }
+    if (due == 0) {
+        run_transfer(dev, tpriv);
+        push_completed(dev, tpriv);
+        pthread_mutex_unlock(&g_sim.lock);
+        signal_device(dev->fd);
+        return LIBUSB_SUCCESS;
+    }
+
+    tpriv->dueNs = due;
+    tpriv->state = SIM_TRANSFER_SCHEDULED;
+    struct SimTransferPriv **link = &g_sim.scheduled;
+    while (*link != NULL && (*link)->dueNs <= due) link = &(*link)->next;
+    tpriv->next = *link;
+    *link = tpriv;
+    if (g_sim.scheduled == tpriv) pthread_cond_signal(&g_sim.wake);
+    pthread_mutex_unlock(&g_sim.lock);
+    return LIBUSB_SUCCESS;
+}
+
+static int op_cancel_transfer(struct usbi_transfer *itransfer) {
+    struct SimTransferPriv *tpriv = usbi_get_transfer_priv(itransfer);
+    int r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (tpriv->state == SIM_TRANSFER_SCHEDULED) {
+        remove_scheduled(tpriv);
+        tpriv->cancelled = 1;
+        push_completed(tpriv->device, tpriv);
+    } else {
+        r = LIBUSB_ERROR_NOT_FOUND; // Already done, the completion is on its way
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+
+    if (r == LIBUSB_SUCCESS) signal_device(tpriv->device->fd);
+    return r;
+}
+
+static void op_clear_transfer_priv(struct usbi_transfer *itransfer) {
+    struct SimTransferPriv *tpriv = usbi_get_transfer_priv(itransfer);
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (tpriv->state == SIM_TRANSFER_SCHEDULED) remove_scheduled(tpriv);
+    else if (tpriv->state == SIM_TRANSFER_DONE) remove_completed(tpriv->device, tpriv);
+    tpriv->state = SIM_TRANSFER_IDLE;
+    pthread_mutex_unlock(&g_sim.lock);
+}
+
+// The kernel's status for a URB that ended this way, for the urb_reap probe
+static int urb_status(enum libusb_transfer_status status) {
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return 0;
+        case LIBUSB_TRANSFER_STALL: return -EPIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE: return -ENODEV;
+        case LIBUSB_TRANSFER_OVERFLOW: return -EOVERFLOW;
+        case LIBUSB_TRANSFER_TIMED_OUT: return -ETIMEDOUT;
+        case LIBUSB_TRANSFER_CANCELLED: return -ENOENT;
+        default: return -EPROTO;
+    }
+}
+
+static int op_handle_events(struct libusb_context *ctx, void *event_data, unsigned int count, unsigned int num_ready) {
+    struct pollfd *fds = event_data;
+
+    for (unsigned int n = 0; n < count && num_ready > 0; n++) {
+        if (!fds[n].revents) continue;
+        num_ready--;
+
+        uint64_t value;
+        ssize_t r = read(fds[n].fd, &value, sizeof(value));
+        (void)r;
+
+        pthread_mutex_lock(&g_sim.lock);
+        struct SimDevice *dev = find_device(fds[n].fd);
+        struct SimTransferPriv *done = NULL;
+        if (dev != NULL) {
+            done = dev->completedHead;
+            dev->completedHead = NULL;
+            dev->completedTail = NULL;
+        }
+        pthread_mutex_unlock(&g_sim.lock);
+
+        while (done != NULL) {
+            struct SimTransferPriv *tpriv = done;
+            struct usbi_transfer *itransfer = tpriv->itransfer;
+            done = tpriv->next;
+
+            usbi_mutex_lock(&itransfer->lock);
+            pthread_mutex_lock(&g_sim.lock);
+            int cancelled = tpriv->cancelled;
+            enum libusb_transfer_status status = tpriv->status;
+            struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+            // Where linux_usbfs.c reaps, so the same probes work against the simulator
+            USBIP_PROBE(urb_reap, (intptr_t)transfer->user_data, dev->fd, transfer->endpoint,
+                        itransfer->transferred, cancelled ? -ENOENT : urb_status(status));
+            tpriv->state = SIM_TRANSFER_IDLE;
+            tpriv->next = NULL;
+            dev->stats[cancelled ? SIM_STAT_CANCELLED : SIM_STAT_COMPLETED]++;
+            pthread_mutex_unlock(&g_sim.lock);
+            usbi_mutex_unlock(&itransfer->lock);
+
+            if (cancelled) {
+                usbi_handle_transfer_cancellation(itransfer);
+            } else {
+                usbi_handle_transfer_completion(itransfer, status);
+            }
+        }
+    }
+    return LIBUSB_SUCCESS;
+}
+
+const struct usbi_os_backend usbi_backend = {
+        .name = "Simulated USB",
+        .caps = 0,
+        .init = op_init,
+        .exit = op_exit,
+        .set_option = op_set_option,
+        .get_device_list = op_get_device_list,
+        .wrap_sys_device = op_wrap_sys_device,
+        .open = op_open,
+        .close = op_close,
+        .get_active_config_descriptor = op_get_active_config_descriptor,
+        .get_config_descriptor = op_get_config_descriptor,
+        .get_configuration = op_get_configuration,
+        .set_configuration = op_set_configuration,
+        .claim_interface = op_claim_interface,
+        .release_interface = op_release_interface,
+        .set_interface_altsetting = op_set_interface_altsetting,
+        .clear_halt = op_clear_halt,
+        .submit_transfer = op_submit_transfer,
+        .cancel_transfer = op_cancel_transfer,
+        .clear_transfer_priv = op_clear_transfer_priv,
+        .handle_events = op_handle_events,
+        .device_priv_size = sizeof(struct SimDevicePriv),
+        .device_handle_priv_size = sizeof(struct SimHandlePriv),
+        .transfer_priv_size = sizeof(struct SimTransferPriv),
+};
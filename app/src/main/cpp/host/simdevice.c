@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simdevice.h"
+
+void sim_device_config_defaults(struct SimDeviceConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->vendorId = 0x1d6b;
+    config->productId = 0x0104;
+    config->bcdUSB = 0x0200;
+    config->bcdDevice = 0x0100;
+    config->interfaceClass = 0xff;
+    config->busNumber = 1;
+    config->deviceAddress = 2;
+    config->speed = LIBUSB_SPEED_HIGH;
+}
+
+static int parse_speed(const char *value, enum libusb_speed *out) {
+    static const struct { const char *name; enum libusb_speed speed; } SPEEDS[] = {
+            { "low", LIBUSB_SPEED_LOW },
+            { "full", LIBUSB_SPEED_FULL },
+            { "high", LIBUSB_SPEED_HIGH },
+            { "super", LIBUSB_SPEED_SUPER },
+            { "super_plus", LIBUSB_SPEED_SUPER_PLUS },
+    };
+    for (size_t i = 0; i < sizeof(SPEEDS) / sizeof(SPEEDS[0]); i++) {
+        if (strcmp(value, SPEEDS[i].name) == 0) {
+            *out = SPEEDS[i].speed;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int parse_type(const char *value, uint8_t *out) {
+    if (strcmp(value, "bulk") == 0) *out = LIBUSB_TRANSFER_TYPE_BULK;
+    else if (strcmp(value, "interrupt") == 0) *out = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+    else if (strcmp(value, "iso") == 0) *out = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+    else return -1;
+    return 0;
+}
+
+static int parse_number(const char *value, uint64_t max, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 0);
+    if (errno != 0 || end == value || *end != '\0' || n > max) return -1;
+    *out = n;
+    return 0;
+}
+
+static int parse_device_key(struct SimDeviceConfig *config, const char *key, const char *value) {
+    uint64_t n;
+
+    if (strcmp(key, "speed") == 0) return parse_speed(value, &config->speed);
+    if (parse_number(value, UINT32_MAX, &n) != 0) return -1;
+
+    if (strcmp(key, "vid") == 0 && n <= 0xffff) config->vendorId = (uint16_t)n;
+    else if (strcmp(key, "pid") == 0 && n <= 0xffff) config->productId = (uint16_t)n;
+    else if (strcmp(key, "bcd_usb") == 0 && n <= 0xffff) config->bcdUSB = (uint16_t)n;
+    else if (strcmp(key, "bcd_device") == 0 && n <= 0xffff) config->bcdDevice = (uint16_t)n;
+    else if (strcmp(key, "class") == 0 && n <= 0xff) config->deviceClass = (uint8_t)n;
+    else if (strcmp(key, "subclass") == 0 && n <= 0xff) config->deviceSubClass = (uint8_t)n;
+    else if (strcmp(key, "protocol") == 0 && n <= 0xff) config->deviceProtocol = (uint8_t)n;
+    else if (strcmp(key, "interface_class") == 0 && n <= 0xff) config->interfaceClass = (uint8_t)n;
+    else if (strcmp(key, "interface_subclass") == 0 && n <= 0xff) config->interfaceSubClass = (uint8_t)n;
+    else if (strcmp(key, "interface_protocol") == 0 && n <= 0xff) config->interfaceProtocol = (uint8_t)n;
+    else if (strcmp(key, "bus") == 0 && n <= 0xff) config->busNumber = (uint8_t)n;
+    else if (strcmp(key, "address") == 0 && n >= 1 && n <= 127) config->deviceAddress = (uint8_t)n;
+    else if (strcmp(key, "control_latency_us") == 0) config->controlLatencyUs = (uint32_t)n;
+    else if (strcmp(key, "fill_pattern") == 0) config->fillPattern = n != 0;
+    else return -1;
+    return 0;
+}
+
+static int parse_endpoint_key(struct SimEndpointConfig *ep, const char *key, const char *value) {
+    uint64_t n;
+
+    if (strcmp(key, "type") == 0) return parse_type(value, &ep->type);
+    if (parse_number(value, UINT64_MAX, &n) != 0) return -1;
+
+    if (strcmp(key, "addr") == 0 && n <= 0xff && (n & 0x70) == 0 && (n & 0x0f) != 0) ep->address = (uint8_t)n;
+    else if (strcmp(key, "max_packet") == 0 && n >= 1 && n <= 0xffff) ep->maxPacketSize = (uint16_t)n;
+    else if (strcmp(key, "interval") == 0 && n <= 0xff) ep->interval = (uint8_t)n;
+    else if (strcmp(key, "latency_us") == 0 && n <= UINT32_MAX) ep->latencyUs = (uint32_t)n;
+    else if (strcmp(key, "bandwidth") == 0) ep->bandwidthBps = n;
+    else if (strcmp(key, "interval_us") == 0 && n <= UINT32_MAX) ep->isoIntervalUs = (uint32_t)n;
+    else if (strcmp(key, "short_every") == 0 && n <= UINT32_MAX) ep->shortEvery = (uint32_t)n;
+    else if (strcmp(key, "stall_every") == 0 && n <= UINT32_MAX) ep->stallEvery = (uint32_t)n;
+    else if (strcmp(key, "error_every") == 0 && n <= UINT32_MAX) ep->errorEvery = (uint32_t)n;
+    else return -1;
+    return 0;
+}
+
+int sim_device_config_parse(struct SimDeviceConfig *config, const char *text, char *err, size_t err_size) {
+    int line_no = 0;
+
+    sim_device_config_defaults(config);
+
+    while (*text) {
+        char line[512];
+        const char *eol = strchr(text, '\n');
+        size_t len = eol ? (size_t)(eol - text) : strlen(text);
+        line_no++;
+        if (len >= sizeof(line)) {
+            snprintf(err, err_size, "line %d: too long", line_no);
+            return -1;
+        }
+        memcpy(line, text, len);
+        line[len] = '\0';
+        text += eol ? len + 1 : len;
+
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *save;
+        char *word = strtok_r(line, " \t\r", &save);
+        if (word == NULL) continue;
+
+        struct SimEndpointConfig *ep = NULL;
+        if (strcmp(word, "endpoint") == 0) {
+            if (config->numEndpoints == SIM_MAX_ENDPOINTS) {
+                snprintf(err, err_size, "line %d: too many endpoints", line_no);
+                return -1;
+            }
+            ep = &config->endpoints[config->numEndpoints++];
+            ep->type = LIBUSB_TRANSFER_TYPE_BULK;
+            ep->maxPacketSize = 512;
+        } else if (strcmp(word, "device") != 0) {
+            snprintf(err, err_size, "line %d: expected 'device' or 'endpoint', got '%s'", line_no, word);
+            return -1;
+        }
+
+        while ((word = strtok_r(NULL, " \t\r", &save)) != NULL) {
+            char *eq = strchr(word, '=');
+            if (eq == NULL) {
+                snprintf(err, err_size, "line %d: expected key=value, got '%s'", line_no, word);
+                return -1;
+            }
+            *eq = '\0';
+            int r = ep ? parse_endpoint_key(ep, word, eq + 1) : parse_device_key(config, word, eq + 1);
+            if (r != 0) {
+                snprintf(err, err_size, "line %d: bad %s '%s'", line_no, word, eq + 1);
+                return -1;
+            }
+        }
+
+        if (ep != NULL && ep->address == 0) {
+            snprintf(err, err_size, "line %d: endpoint needs addr=", line_no);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < config->numEndpoints; i++) {
+        for (int j = 0; j < i; j++) {
+            if (config->endpoints[i].address == config->endpoints[j].address) {
+                snprintf(err, err_size, "endpoint 0x%02x declared twice", config->endpoints[i].address);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int sim_device_config_load(struct SimDeviceConfig *config, const char *path, char *err, size_t err_size) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        snprintf(err, err_size, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char text[16384];
+    size_t len = fread(text, 1, sizeof(text) - 1, f);
+    int too_long = !feof(f);
+    fclose(f);
+    if (too_long) {
+        snprintf(err, err_size, "%s: too large", path);
+        return -1;
+    }
+    text[len] = '\0';
+
+    return sim_device_config_parse(config, text, err, err_size);
+}
@@ -0,0 +1,90 @@
+#ifndef USBIP_HOST_SIMDEVICE_H
+#define USBIP_HOST_SIMDEVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libusb.h"
+
+// Simulated USB devices for the host build. simbackend.c replaces the Linux usbfs
+// backend of the vendored libusb, so usbipfunctions.c runs unmodified against devices
+// described here: sim_device_create() hands out an fd that stands in for the usbfs fd
+// Android gives us, ready for UsbLib.openDeviceHandle().
+
+#define SIM_MAX_ENDPOINTS 32
+
+struct SimEndpointConfig {
+    uint8_t address;        // Including the direction bit
+    uint8_t type;           // LIBUSB_TRANSFER_TYPE_*
+    uint16_t maxPacketSize;
+    uint8_t interval;       // bInterval, interrupt and ISO only
+    uint32_t latencyUs;     // Added to every transfer on this endpoint
+    uint64_t bandwidthBps;  // Transfers are serialised at this rate, 0 for unlimited
+    uint32_t isoIntervalUs; // Time per ISO packet, overrides bandwidth for ISO
+    uint32_t shortEvery;    // Every Nth IN transfer comes back half full
+    uint32_t stallEvery;    // Every Nth transfer stalls
+    uint32_t errorEvery;    // Every Nth ISO packet fails
+};
+
+struct SimDeviceConfig {
+    uint16_t vendorId;
+    uint16_t productId;
+    uint16_t bcdUSB;
+    uint16_t bcdDevice;
+    uint8_t deviceClass;
+    uint8_t deviceSubClass;
+    uint8_t deviceProtocol;
+    uint8_t interfaceClass;
+    uint8_t interfaceSubClass;
+    uint8_t interfaceProtocol;
+    uint8_t busNumber;
+    uint8_t deviceAddress;
+    enum libusb_speed speed;
+    uint32_t controlLatencyUs;
+    int fillPattern; // Write a per-transfer byte pattern into IN data
+    int numEndpoints;
+    struct SimEndpointConfig endpoints[SIM_MAX_ENDPOINTS];
+};
+
+// Order matches the stats array of sim_device_stats().
+enum SimDeviceStat {
+    SIM_STAT_SUBMITTED,
+    SIM_STAT_COMPLETED,
+    SIM_STAT_CANCELLED,
+    SIM_STAT_BYTES_IN,
+    SIM_STAT_BYTES_OUT,
+    SIM_STAT_COUNT
+};
+
+void sim_device_config_defaults(struct SimDeviceConfig *config);
+
+// Line based: a "device key=value ..." line and one "endpoint key=value ..." line per
+// endpoint, '#' starts a comment. See host/devices/ for examples. Returns 0, or -1
+// with a message in err.
+int sim_device_config_parse(struct SimDeviceConfig *config, const char *text, char *err, size_t err_size);
+int sim_device_config_load(struct SimDeviceConfig *config, const char *path, char *err, size_t err_size);
+
+// Returns the device fd, or a negative errno.
+int sim_device_create(const struct SimDeviceConfig *config);
+void sim_device_destroy(int fd);
+
+// Fails everything in flight with LIBUSB_TRANSFER_NO_DEVICE, as does every later submit.
+int sim_device_disconnect(int fd);
+
+int sim_device_stats(int fd, uint64_t out[SIM_STAT_COUNT]);
+
+// Scripted result of one transfer, overriding what the endpoint config would produce.
+struct SimResponse {
+    uint32_t delayUs;                   // From submit to completion
+    enum libusb_transfer_status status;
+    int actualLength;                   // Spread over the packets for ISO
+};
+
+// Asked about every transfer at submit, with the simulator lock held, so it must not
+// call back into libusb. Returns 1 after filling in out, 0 to leave the transfer to
+// the endpoint config.
+typedef int (*SimResponderFn)(void *user, const struct libusb_transfer *transfer, struct SimResponse *out);
+
+int sim_device_set_responder(int fd, SimResponderFn fn, void *user);
+
+#endif // USBIP_HOST_SIMDEVICE_H
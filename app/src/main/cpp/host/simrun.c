@@ -0,0 +1,200 @@
+/*
+ * Drives the native engine against a simulated device and reports throughput, e.g.
+ *
+ *   simrun devices/bulk_loopback.sim -e 0x81 -s 16384 -q 8 -t 5
+ *
+ * Transfers go through the same UsbLib entry points the Kotlin server calls and are
+ * resubmitted from the completion callback, keeping the queue depth constant. -b turns
+ * on the event thread's busy-poll mode with the given spin time in microseconds.
+ */
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jnihost.h"
+#include "simdevice.h"
+#include "usblib.h"
+
+#define MAX_QUEUE_DEPTH 32
+
+struct RunState {
+    int fd;
+    int endpoint;
+    uint8_t type;
+    int isoPackets;
+    int transferSize;
+    jobject buffers[MAX_QUEUE_DEPTH];
+    jintArray isoLengths;
+    uint64_t deadlineNs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int inFlight;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t bytes;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int submit(struct RunState *run, int slot) {
+    JNIEnv *env = jni_host_env();
+    jobject thiz = jni_host_usblib();
+    jlong rx = (jlong)now_ns();
+
+    switch (run->type) {
+        case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+            return USBLIB_FN(doIsochronousTransferAsync)(env, thiz, run->fd, run->endpoint, run->buffers[slot],
+                                                        run->transferSize, run->isoLengths, slot, 0, rx);
+        case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+            return USBLIB_FN(doInterruptTransferAsync)(env, thiz, run->fd, run->endpoint, run->buffers[slot],
+                                                      run->transferSize, 0, slot, 0, rx);
+        default:
+            return USBLIB_FN(doBulkTransferAsync)(env, thiz, run->fd, run->endpoint, run->buffers[slot],
+                                                 run->transferSize, 0, slot, 0, rx);
+    }
+}
+
+static void on_completed(void *user, jint seqNum, jint status, jint actualLength, jint type,
+                         const jint *isoActualLengths, const jint *isoStatuses, jsize numIsoPackets) {
+    struct RunState *run = user;
+
+    pthread_mutex_lock(&run->lock);
+    if (status == 0) run->completed++;
+    else run->failed++;
+    run->bytes += (uint64_t)actualLength;
+    pthread_mutex_unlock(&run->lock);
+
+    if (now_ns() < run->deadlineNs && submit(run, seqNum) == 0) return;
+
+    pthread_mutex_lock(&run->lock);
+    if (--run->inFlight == 0) pthread_cond_signal(&run->idle);
+    pthread_mutex_unlock(&run->lock);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s DEVICE.sim [-e endpoint] [-s transfer_size] [-q queue_depth] [-t seconds] [-b spin_us]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    struct RunState run = { .endpoint = -1, .transferSize = 16384 };
+    int depth = 4;
+    double seconds = 3;
+    int spinUs = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:s:q:t:b:h")) != -1) {
+        switch (opt) {
+            case 'e': run.endpoint = (int)strtol(optarg, NULL, 0); break;
+            case 's': run.transferSize = atoi(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 't': seconds = atof(optarg); break;
+            case 'b': spinUs = atoi(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc - 1 || depth < 1 || depth > MAX_QUEUE_DEPTH || run.transferSize < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct SimDeviceConfig config;
+    char err[256];
+    if (sim_device_config_load(&config, argv[optind], err, sizeof(err)) != 0) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+
+    const struct SimEndpointConfig *ep = NULL;
+    for (int i = 0; i < config.numEndpoints && ep == NULL; i++) {
+        if (run.endpoint < 0 || config.endpoints[i].address == run.endpoint) ep = &config.endpoints[i];
+    }
+    if (ep == NULL) {
+        fprintf(stderr, "device has no endpoint 0x%02x\n", run.endpoint);
+        return 1;
+    }
+    run.endpoint = ep->address;
+    run.type = ep->type;
+
+    JNIEnv *env = jni_host_env();
+    jobject thiz = jni_host_usblib();
+    jni_host_set_completion_handler(on_completed, &run);
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.idle, NULL);
+
+    if (USBLIB_FN(init)(env, thiz) != 0) return 1;
+    if (spinUs > 0) USBLIB_FN(setBusyPoll)(env, thiz, spinUs, 50);
+    run.fd = sim_device_create(&config);
+    if (run.fd < 0 || USBLIB_FN(openDeviceHandle)(env, thiz, run.fd) != 0) {
+        fprintf(stderr, "could not open simulated device\n");
+        return 1;
+    }
+
+    if (run.type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        run.isoPackets = run.transferSize / ep->maxPacketSize;
+        if (run.isoPackets < 1) run.isoPackets = 1;
+        jint *lengths = malloc(sizeof(jint) * (size_t)run.isoPackets);
+        for (int i = 0; i < run.isoPackets; i++) lengths[i] = ep->maxPacketSize;
+        run.isoLengths = jni_host_new_int_array(lengths, run.isoPackets);
+        run.transferSize = run.isoPackets * ep->maxPacketSize;
+        free(lengths);
+    }
+    for (int i = 0; i < depth; i++) {
+        run.buffers[i] = USBLIB_FN(allocBuffer)(env, thiz, run.fd, run.transferSize);
+    }
+
+    uint64_t start = now_ns();
+    run.deadlineNs = start + (uint64_t)(seconds * 1e9);
+    for (int i = 0; i < depth; i++) {
+        pthread_mutex_lock(&run.lock);
+        run.inFlight++;
+        pthread_mutex_unlock(&run.lock);
+        if (submit(&run, i) != 0) {
+            pthread_mutex_lock(&run.lock);
+            run.inFlight--;
+            pthread_mutex_unlock(&run.lock);
+            fprintf(stderr, "submit on 0x%02x failed\n", run.endpoint);
+        }
+    }
+
+    pthread_mutex_lock(&run.lock);
+    while (run.inFlight > 0) pthread_cond_wait(&run.idle, &run.lock);
+    pthread_mutex_unlock(&run.lock);
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    printf("endpoint 0x%02x, %d byte transfers, queue depth %d\n", run.endpoint, run.transferSize, depth);
+    printf("%llu completed, %llu failed in %.2f s: %.0f URB/s, %.1f MB/s\n",
+           (unsigned long long)run.completed, (unsigned long long)run.failed, elapsed,
+           (double)run.completed / elapsed, (double)run.bytes / elapsed / 1e6);
+
+    if (spinUs > 0) {
+        jlongArray stats = USBLIB_FN(getBusyPollStats)(env, thiz);
+        const jlong *values = jni_host_long_elements(stats, NULL);
+        printf("busy poll: %lld spins, %lld caught, %.1f ms spinning\n",
+               (long long)values[0], (long long)values[1], (double)values[2] / 1e6);
+        jni_host_delete(stats);
+    }
+
+    jstring report = USBLIB_FN(getMetricsReport)(env, thiz, run.fd);
+    if (report != NULL) {
+        printf("%s\n", jni_host_string_chars(report));
+        jni_host_delete(report);
+    }
+
+    for (int i = 0; i < depth; i++) {
+        USBLIB_FN(releaseBuffer)(env, thiz, run.buffers[i]);
+        jni_host_delete(run.buffers[i]);
+    }
+    if (run.isoLengths != NULL) jni_host_delete(run.isoLengths);
+    USBLIB_FN(closeDeviceHandle)(env, thiz, run.fd);
+    USBLIB_FN(exit)(env, thiz);
+    sim_device_destroy(run.fd);
+    return run.failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,647 @@
+/*
+ * USB/IP client load generator. Imports a device from a running server and keeps a
+ * fixed number of URBs in flight against it, then reports throughput and per-URB
+ * round trip latency. For example, against a phone forwarded with `adb forward
+ * tcp:3240 tcp:3240`:
+ *
+ *   usbipload -P bulk -e 0x81 -q 16 -t 10
+ *   usbipload -P unlink -b 1-2 -c $(adb shell pidof com.techphenom.usbipserver)
+ *
+ * -U connects to the server's abstract AF_UNIX socket (UsbIpServerConfig.localSocketName)
+ * instead of TCP, e.g. from `adb shell` or a container sharing the network namespace.
+ *
+ * -c reads the server's CPU time from /proc/<pid>/stat before and after the run, so it
+ * only works when the server runs on this host or the pid belongs to a local instance.
+ *
+ * Profiles only pick defaults; every one of them can be overridden on the command line:
+ *   bulk   - bulk streaming, 16 KiB URBs at queue depth 8
+ *   hid    - interrupt polling, one 8 byte URB at a time
+ *   uvc    - isochronous IN, 32 x 1024 byte packets per URB, 4 URBs queued
+ *   audio  - isochronous IN, 8 x 192 byte packets per URB, 2 URBs queued
+ *   unlink - bulk IN with every submit chased by an unlink of the oldest URB in flight
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USBIP_VERSION 0x0111
+#define OP_REQ_DEVLIST 0x8005
+#define OP_REP_DEVLIST 0x0005
+#define OP_REQ_IMPORT 0x8003
+#define OP_REP_IMPORT 0x0003
+
+#define USBIP_CMD_SUBMIT 1
+#define USBIP_CMD_UNLINK 2
+#define USBIP_RET_SUBMIT 3
+#define USBIP_RET_UNLINK 4
+#define USBIP_DIR_OUT 0
+#define USBIP_DIR_IN 1
+#define USBIP_HEADER_SIZE 48
+#define USBIP_ISO_DESCRIPTOR_SIZE 16
+#define USBIP_ECONNRESET (-104)
+
+#define DEV_PATH_SIZE 256
+#define BUS_ID_SIZE 32
+#define DEVICE_WIRE_SIZE (DEV_PATH_SIZE + BUS_ID_SIZE + 24)
+
+#define MAX_QUEUE_DEPTH 256
+#define MAX_ISO_PACKETS 1024
+
+enum Profile { PROFILE_BULK, PROFILE_HID, PROFILE_UVC, PROFILE_AUDIO, PROFILE_UNLINK };
+
+struct LoadConfig {
+    const char *host;
+    const char *port;
+    const char *localName; // Abstract AF_UNIX name, NULL for TCP
+    char busId[BUS_ID_SIZE];
+    enum Profile profile;
+    int endpoint;
+    int transferSize;
+    int depth;
+    int isoPackets;
+    int isoPacketSize;
+    double seconds;
+    int serverPid;
+    int json;
+};
+
+struct InFlight {
+    uint32_t seqNum; // 0 while the slot is free
+    uint64_t sentNs;
+    uint32_t unlinkSeqNum; // Of the CMD_UNLINK aimed at this URB, 0 if none
+};
+
+struct LoadStats {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t unlinked;    // RET_UNLINK that cancelled the URB
+    uint64_t unlinkLate;  // RET_UNLINK after the URB had already completed
+    uint64_t bytes;
+    uint64_t *latencies;  // ns, one per completed URB
+    size_t latencyCount;
+    size_t latencyCapacity;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void put_be16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int skip_bytes(int fd, size_t len) {
+    unsigned char scratch[16384];
+    while (len > 0) {
+        size_t chunk = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (read_all(fd, scratch, chunk) != 0) return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int connect_local(const char *name) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t len = strlen(name);
+    if (len + 1 > sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket name too long: %s\n", name);
+        return -1;
+    }
+    memcpy(addr.sun_path + 1, name, len); // Leading NUL selects the abstract namespace
+
+    socklen_t addrLen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, addrLen) != 0) {
+        fprintf(stderr, "connect to @%s: %s\n", name, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_server(const struct LoadConfig *config) {
+    if (config->localName != NULL) return connect_local(config->localName);
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int r = getaddrinfo(config->host, config->port, &hints, &res);
+    if (r != 0) {
+        fprintf(stderr, "%s: %s\n", config->host, gai_strerror(r));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        fprintf(stderr, "connect to %s:%s: %s\n", config->host, config->port, strerror(errno));
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_op_request(int fd, uint16_t code) {
+    unsigned char header[8];
+    put_be16(header, USBIP_VERSION);
+    put_be16(header + 2, code);
+    put_be32(header + 4, 0);
+    return write_all(fd, header, sizeof(header));
+}
+
+static int read_op_reply(int fd, uint16_t expected, uint32_t *status) {
+    unsigned char header[8];
+    if (read_all(fd, header, sizeof(header)) != 0) return -1;
+    if (get_be16(header + 2) != expected) {
+        fprintf(stderr, "unexpected reply code 0x%04x\n", get_be16(header + 2));
+        return -1;
+    }
+    *status = get_be32(header + 4);
+    return 0;
+}
+
+static void print_device(const unsigned char *dev) {
+    char busId[BUS_ID_SIZE + 1] = { 0 };
+    memcpy(busId, dev + DEV_PATH_SIZE, BUS_ID_SIZE);
+    const unsigned char *p = dev + DEV_PATH_SIZE + BUS_ID_SIZE;
+    printf("  %-10s %04x:%04x speed=%u class=%02x interfaces=%u\n", busId,
+           get_be16(p + 12), get_be16(p + 14), get_be32(p + 8), p[18], p[23]);
+}
+
+// Lists the exported devices and, if no bus id was given, picks the first one.
+static int devlist(struct LoadConfig *config) {
+    int fd = connect_server(config);
+    if (fd < 0) return -1;
+
+    uint32_t status, count;
+    unsigned char buf[4];
+    if (send_op_request(fd, OP_REQ_DEVLIST) != 0 || read_op_reply(fd, OP_REP_DEVLIST, &status) != 0 ||
+        read_all(fd, buf, 4) != 0) {
+        fprintf(stderr, "OP_REQ_DEVLIST failed\n");
+        close(fd);
+        return -1;
+    }
+    count = get_be32(buf);
+
+    if (!config->json) printf("%u exported device(s)\n", count);
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned char dev[DEVICE_WIRE_SIZE];
+        if (read_all(fd, dev, sizeof(dev)) != 0 || skip_bytes(fd, 4u * dev[DEVICE_WIRE_SIZE - 1]) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (!config->json) print_device(dev);
+        if (config->busId[0] == '\0') memcpy(config->busId, dev + DEV_PATH_SIZE, BUS_ID_SIZE - 1);
+    }
+    close(fd);
+
+    if (config->busId[0] == '\0') {
+        fprintf(stderr, "server exports no devices\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int import(const struct LoadConfig *config) {
+    int fd = connect_server(config);
+    if (fd < 0) return -1;
+
+    unsigned char busId[BUS_ID_SIZE] = { 0 };
+    memcpy(busId, config->busId, strnlen(config->busId, BUS_ID_SIZE - 1));
+
+    uint32_t status;
+    if (send_op_request(fd, OP_REQ_IMPORT) != 0 || write_all(fd, busId, sizeof(busId)) != 0 ||
+        read_op_reply(fd, OP_REP_IMPORT, &status) != 0) {
+        fprintf(stderr, "OP_REQ_IMPORT failed\n");
+        close(fd);
+        return -1;
+    }
+    if (status != 0) {
+        fprintf(stderr, "server refused to import %s (status %u)\n", config->busId, status);
+        close(fd);
+        return -1;
+    }
+
+    unsigned char dev[DEVICE_WIRE_SIZE];
+    if (read_all(fd, dev, sizeof(dev)) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (!config->json) {
+        printf("imported\n");
+        print_device(dev);
+    }
+    return fd;
+}
+
+static int is_iso(const struct LoadConfig *config) {
+    return config->profile == PROFILE_UVC || config->profile == PROFILE_AUDIO;
+}
+
+static int send_submit(int fd, const struct LoadConfig *config, uint32_t seqNum, const unsigned char *outData) {
+    unsigned char header[USBIP_HEADER_SIZE] = { 0 };
+    int in = (config->endpoint & 0x80) != 0;
+    int packets = is_iso(config) ? config->isoPackets : 0;
+
+    put_be32(header, USBIP_CMD_SUBMIT);
+    put_be32(header + 4, seqNum);
+    put_be32(header + 8, 0x00010002); // devid, the server ignores it
+    put_be32(header + 12, in ? USBIP_DIR_IN : USBIP_DIR_OUT);
+    put_be32(header + 16, (uint32_t)(config->endpoint & 0x0f));
+    put_be32(header + 20, 0);
+    put_be32(header + 24, (uint32_t)config->transferSize);
+    put_be32(header + 28, 0);
+    put_be32(header + 32, packets ? (uint32_t)packets : 0xffffffffu);
+    put_be32(header + 36, 1);
+    if (write_all(fd, header, sizeof(header)) != 0) return -1;
+    if (!in && write_all(fd, outData, (size_t)config->transferSize) != 0) return -1;
+
+    if (packets) {
+        unsigned char desc[MAX_ISO_PACKETS * USBIP_ISO_DESCRIPTOR_SIZE];
+        for (int i = 0; i < packets; i++) {
+            unsigned char *d = desc + i * USBIP_ISO_DESCRIPTOR_SIZE;
+            put_be32(d, (uint32_t)(i * config->isoPacketSize));
+            put_be32(d + 4, (uint32_t)config->isoPacketSize);
+            put_be32(d + 8, 0);
+            put_be32(d + 12, 0);
+        }
+        if (write_all(fd, desc, (size_t)packets * USBIP_ISO_DESCRIPTOR_SIZE) != 0) return -1;
+    }
+    return 0;
+}
+
+static int send_unlink(int fd, uint32_t seqNum, uint32_t victim) {
+    unsigned char header[USBIP_HEADER_SIZE] = { 0 };
+    put_be32(header, USBIP_CMD_UNLINK);
+    put_be32(header + 4, seqNum);
+    put_be32(header + 20, victim);
+    return write_all(fd, header, sizeof(header));
+}
+
+static struct InFlight *find_in_flight(struct InFlight *slots, int depth, uint32_t seqNum) {
+    for (int i = 0; i < depth; i++) {
+        if (slots[i].seqNum == seqNum) return &slots[i];
+    }
+    return NULL;
+}
+
+static void record_latency(struct LoadStats *stats, uint64_t ns) {
+    if (stats->latencyCount == stats->latencyCapacity) {
+        size_t capacity = stats->latencyCapacity ? stats->latencyCapacity * 2 : 65536;
+        uint64_t *grown = realloc(stats->latencies, capacity * sizeof(uint64_t));
+        if (grown == NULL) return;
+        stats->latencies = grown;
+        stats->latencyCapacity = capacity;
+    }
+    stats->latencies[stats->latencyCount++] = ns;
+}
+
+// Reads one RET_SUBMIT or RET_UNLINK. Returns the freed in-flight slot, NULL when the
+// reply did not free one, or (void *)-1 on a broken connection.
+#define READ_FAILED ((struct InFlight *)-1)
+
+static struct InFlight *read_reply(int fd, const struct LoadConfig *config, struct InFlight *slots,
+                                   struct LoadStats *stats) {
+    unsigned char header[USBIP_HEADER_SIZE];
+    if (read_all(fd, header, sizeof(header)) != 0) return READ_FAILED;
+    uint64_t now = now_ns();
+
+    uint32_t command = get_be32(header);
+    uint32_t seqNum = get_be32(header + 4);
+    int32_t status = (int32_t)get_be32(header + 20);
+
+    if (command == USBIP_RET_UNLINK) {
+        // RET_UNLINK carries the unlink's own seqnum, not the URB's
+        struct InFlight *victim = NULL;
+        for (int i = 0; i < config->depth && victim == NULL; i++) {
+            if (slots[i].seqNum != 0 && slots[i].unlinkSeqNum == seqNum) victim = &slots[i];
+        }
+        if (status == USBIP_ECONNRESET && victim != NULL) {
+            stats->unlinked++;
+            return victim;
+        }
+        stats->unlinkLate++; // The RET_SUBMIT is, or was already, on its way
+        return NULL;
+    }
+    if (command != USBIP_RET_SUBMIT) {
+        fprintf(stderr, "unexpected command %u from server\n", command);
+        return READ_FAILED;
+    }
+
+    int32_t actual = (int32_t)get_be32(header + 24);
+    int32_t packets = (int32_t)get_be32(header + 32);
+    size_t payload = (config->endpoint & 0x80) && actual > 0 ? (size_t)actual : 0;
+    if (packets > 0) payload += (size_t)packets * USBIP_ISO_DESCRIPTOR_SIZE;
+    if (skip_bytes(fd, payload) != 0) return READ_FAILED;
+
+    struct InFlight *slot = find_in_flight(slots, config->depth, seqNum);
+    if (slot == NULL) {
+        fprintf(stderr, "RET_SUBMIT for unknown seqnum %u\n", seqNum);
+        return READ_FAILED;
+    }
+    if (status == 0) {
+        stats->completed++;
+        stats->bytes += (uint64_t)(actual > 0 ? actual : 0);
+        record_latency(stats, now - slot->sentNs);
+    } else {
+        stats->failed++;
+    }
+    return slot;
+}
+
+static int run(int fd, const struct LoadConfig *config, struct LoadStats *stats) {
+    struct InFlight slots[MAX_QUEUE_DEPTH] = { 0 };
+    unsigned char *outData = calloc(1, (size_t)config->transferSize);
+    uint32_t nextSeq = 1;
+    int inFlight = 0;
+    uint64_t deadline = now_ns() + (uint64_t)(config->seconds * 1e9);
+    int r = 0;
+
+    if (outData == NULL) return -1;
+
+    for (;;) {
+        int sending = now_ns() < deadline;
+
+        // Top the queue up
+        for (int i = 0; sending && i < config->depth; i++) {
+            if (slots[i].seqNum != 0) continue;
+            uint32_t seq = nextSeq++;
+            slots[i] = (struct InFlight){ .seqNum = seq, .sentNs = now_ns() };
+            if (send_submit(fd, config, seq, outData) != 0) {
+                r = -1;
+                goto out;
+            }
+            stats->submitted++;
+            inFlight++;
+
+            if (config->profile == PROFILE_UNLINK) {
+                struct InFlight *oldest = NULL;
+                for (int j = 0; j < config->depth; j++) {
+                    if (slots[j].seqNum == 0 || slots[j].unlinkSeqNum != 0) continue;
+                    if (oldest == NULL || slots[j].sentNs < oldest->sentNs) oldest = &slots[j];
+                }
+                if (oldest != NULL) {
+                    oldest->unlinkSeqNum = nextSeq++;
+                    if (send_unlink(fd, oldest->unlinkSeqNum, oldest->seqNum) != 0) {
+                        r = -1;
+                        goto out;
+                    }
+                }
+            }
+        }
+        if (inFlight == 0) break;
+
+        struct InFlight *freed = read_reply(fd, config, slots, stats);
+        if (freed == READ_FAILED) {
+            fprintf(stderr, "connection lost with %d URB(s) in flight\n", inFlight);
+            r = -1;
+            break;
+        }
+        if (freed != NULL) {
+            freed->seqNum = 0;
+            freed->unlinkSeqNum = 0;
+            inFlight--;
+        }
+    }
+out:
+    free(outData);
+    return r;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct LoadStats *stats, double p) {
+    if (stats->latencyCount == 0) return 0;
+    size_t index = (size_t)(p / 100.0 * (double)(stats->latencyCount - 1) + 0.5);
+    return (double)stats->latencies[index] / 1000.0;
+}
+
+// utime + stime of a process in ns, or -1.
+static int64_t process_cpu_ns(int pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // The command name may contain spaces, fields resume after its closing paren
+    char *p = strrchr(buf, ')');
+    unsigned long long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (int64_t)((utime + stime) * (1000000000ull / (unsigned long long)sysconf(_SC_CLK_TCK)));
+}
+
+static int64_t self_cpu_ns(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ll +
+           ((int64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ll;
+}
+
+static const char *const PROFILE_NAMES[] = { "bulk", "hid", "uvc", "audio", "unlink" };
+
+static void apply_profile(struct LoadConfig *config) {
+    switch (config->profile) {
+        case PROFILE_HID:
+            if (config->transferSize < 0) config->transferSize = 8;
+            if (config->depth < 0) config->depth = 1;
+            break;
+        case PROFILE_UVC:
+            if (config->isoPackets < 0) config->isoPackets = 32;
+            if (config->isoPacketSize < 0) config->isoPacketSize = 1024;
+            if (config->depth < 0) config->depth = 4;
+            break;
+        case PROFILE_AUDIO:
+            if (config->isoPackets < 0) config->isoPackets = 8;
+            if (config->isoPacketSize < 0) config->isoPacketSize = 192;
+            if (config->depth < 0) config->depth = 2;
+            break;
+        case PROFILE_UNLINK:
+            if (config->depth < 0) config->depth = 16;
+            break;
+        default:
+            break;
+    }
+    if (config->endpoint < 0) config->endpoint = 0x81;
+    if (config->depth < 0) config->depth = 8;
+    if (is_iso(config)) config->transferSize = config->isoPackets * config->isoPacketSize;
+    if (config->transferSize < 0) config->transferSize = 16384;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-H host] [-p port] [-U local_socket] [-b busid] [-P bulk|hid|uvc|audio|unlink] [-e endpoint]\n"
+            "          [-s transfer_size] [-q queue_depth] [-n iso_packets] [-i iso_packet_size]\n"
+            "          [-t seconds] [-c server_pid] [-j]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    struct LoadConfig config = {
+            .host = "127.0.0.1", .port = "3240", .profile = PROFILE_BULK, .endpoint = -1,
+            .transferSize = -1, .depth = -1, .isoPackets = -1, .isoPacketSize = -1, .seconds = 5,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:U:b:P:e:s:q:n:i:t:c:jh")) != -1) {
+        switch (opt) {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = optarg; break;
+            case 'U': config.localName = optarg; break;
+            case 'b': snprintf(config.busId, sizeof(config.busId), "%s", optarg); break;
+            case 'P': {
+                int found = 0;
+                for (int i = 0; i < (int)(sizeof(PROFILE_NAMES) / sizeof(PROFILE_NAMES[0])); i++) {
+                    if (strcmp(optarg, PROFILE_NAMES[i]) == 0) {
+                        config.profile = (enum Profile)i;
+                        found = 1;
+                    }
+                }
+                if (!found) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            }
+            case 'e': config.endpoint = (int)strtol(optarg, NULL, 0); break;
+            case 's': config.transferSize = atoi(optarg); break;
+            case 'q': config.depth = atoi(optarg); break;
+            case 'n': config.isoPackets = atoi(optarg); break;
+            case 'i': config.isoPacketSize = atoi(optarg); break;
+            case 't': config.seconds = atof(optarg); break;
+            case 'c': config.serverPid = atoi(optarg); break;
+            case 'j': config.json = 1; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    apply_profile(&config);
+    if (optind != argc || config.depth < 1 || config.depth > MAX_QUEUE_DEPTH || config.transferSize < 1 ||
+        (is_iso(&config) && (config.isoPackets < 1 || config.isoPackets > MAX_ISO_PACKETS ||
+                             config.isoPacketSize < 1 || !(config.endpoint & 0x80)))) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (config.profile == PROFILE_UNLINK && config.depth < 2) config.depth = 2;
+
+    if (devlist(&config) != 0) return 1;
+    int fd = import(&config);
+    if (fd < 0) return 1;
+
+    struct LoadStats stats = { 0 };
+    int64_t serverCpuBefore = config.serverPid ? process_cpu_ns(config.serverPid) : -1;
+    int64_t selfCpuBefore = self_cpu_ns();
+    uint64_t start = now_ns();
+
+    int r = run(fd, &config, &stats);
+
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    int64_t serverCpuAfter = config.serverPid ? process_cpu_ns(config.serverPid) : -1;
+    int64_t selfCpu = self_cpu_ns() - selfCpuBefore;
+    close(fd);
+
+    qsort(stats.latencies, stats.latencyCount, sizeof(uint64_t), compare_u64);
+    uint64_t urbs = stats.completed + stats.failed + stats.unlinked;
+    double serverCpuPerUrb = serverCpuBefore >= 0 && serverCpuAfter >= 0 && urbs > 0 ?
+                             (double)(serverCpuAfter - serverCpuBefore) / (double)urbs / 1000.0 : -1;
+
+    if (config.json) {
+        printf("{\"profile\":\"%s\",\"endpoint\":%d,\"transfer_size\":%d,\"queue_depth\":%d,"
+               "\"seconds\":%.3f,\"submitted\":%llu,\"completed\":%llu,\"failed\":%llu,"
+               "\"unlinked\":%llu,\"unlink_late\":%llu,\"bytes\":%llu,\"urbs_per_sec\":%.1f,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+               "\"server_cpu_us_per_urb\":%.2f,\"client_cpu_us_per_urb\":%.2f}\n",
+               PROFILE_NAMES[config.profile], config.endpoint, config.transferSize, config.depth, elapsed,
+               (unsigned long long)stats.submitted, (unsigned long long)stats.completed,
+               (unsigned long long)stats.failed, (unsigned long long)stats.unlinked,
+               (unsigned long long)stats.unlinkLate, (unsigned long long)stats.bytes,
+               (double)urbs / elapsed, percentile_us(&stats, 50), percentile_us(&stats, 99),
+               percentile_us(&stats, 99.9), percentile_us(&stats, 100), serverCpuPerUrb,
+               urbs ? (double)selfCpu / (double)urbs / 1000.0 : 0);
+    } else {
+        printf("%s on 0x%02x, %d byte URBs, queue depth %d, %.2f s\n", PROFILE_NAMES[config.profile],
+               config.endpoint, config.transferSize, config.depth, elapsed);
+        printf("  urbs: %llu submitted, %llu ok, %llu failed, %llu unlinked, %llu unlinked too late\n",
+               (unsigned long long)stats.submitted, (unsigned long long)stats.completed,
+               (unsigned long long)stats.failed, (unsigned long long)stats.unlinked,
+               (unsigned long long)stats.unlinkLate);
+        printf("  throughput: %.0f URB/s, %.2f MB/s\n", (double)urbs / elapsed, (double)stats.bytes / elapsed / 1e6);
+        printf("  latency: p50=%.0fus p99=%.0fus p999=%.0fus max=%.0fus\n", percentile_us(&stats, 50),
+               percentile_us(&stats, 99), percentile_us(&stats, 99.9), percentile_us(&stats, 100));
+        if (serverCpuPerUrb >= 0) printf("  server cpu: %.2f us/URB\n", serverCpuPerUrb);
+        printf("  client cpu: %.2f us/URB\n", urbs ? (double)selfCpu / (double)urbs / 1000.0 : 0);
+    }
+
+    free(stats.latencies);
+    return r == 0 ? 0 : 1;
+}
@@ -0,0 +1,503 @@
+/*
+ * Replays a session recorded by the server (UsbIpServerConfig.sessionRecordDir) through
+ * the native engine against a simulated device that answers every transfer with its
+ * recorded status, length and device time, e.g.
+ *
+ *   usbipreplay session-1-2-1700000000000.uipr -j > new.json
+ *   usbipreplay session-1-2-1700000000000.uipr -b old.json
+ *
+ * By default commands are issued as fast as causality allows: a SUBMIT waits until as
+ * many transfers have completed as had completed before it in the recording, which
+ * keeps request/response protocols like BOT in step. -r also holds every command back
+ * to its recorded arrival time. -d scales the recorded device time, 0 for none.
+ *
+ * Session file, all little-endian:
+ *   header, 32 bytes: "UIPRSESS", u16 version, u16 vid, u16 pid, u8 speed (Android
+ *                     UsbIpDeviceConstants), u8 0, u64 start (ms since epoch), 8 bytes 0
+ *   records, 40 bytes: u8 kind, u8 transfer type, u8 endpoint, u8 direction, u32 seq,
+ *                      u64 ns since start, i32 a, b, c, d, u8 setup[8]
+ *     SUBMIT   a = length, b = USB/IP flags, c = ISO packets, d = interval, setup
+ *     UNLINK   a = seq to unlink
+ *     COMPLETE a = status (negative errno), b = actual length, c = failed ISO packets
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jnihost.h"
+#include "simdevice.h"
+#include "usblib.h"
+
+#define SESSION_MAGIC "UIPRSESS"
+#define SESSION_HEADER_SIZE 32
+#define SESSION_RECORD_SIZE 40
+
+#define KIND_SUBMIT 1
+#define KIND_UNLINK 2
+#define KIND_COMPLETE 3
+
+// Matches MAX_ASYNC_TRANSFERS_PER_DEVICE, more would only bounce off with -EBUSY
+#define MAX_IN_FLIGHT 32
+
+struct Record {
+    uint8_t kind;
+    uint8_t type;
+    uint8_t endpoint;
+    uint8_t direction;
+    int32_t seqNum;
+    uint64_t tNs;
+    int32_t a, b, c, d;
+    uint8_t setup[8];
+};
+
+// One per recorded SUBMIT
+struct Urb {
+    const struct Record *submit;
+    const struct Record *complete; // NULL if the session ended first
+    uint64_t completesBefore;      // COMPLETE records ahead of the submit
+    uint64_t issuedNs;
+    jobject buffer;
+};
+
+struct Replay {
+    struct Record *records;
+    size_t numRecords;
+    struct Urb *urbs;
+    size_t numUrbs;
+    int32_t *seqIndex; // Open addressing, seqNum -> urbs index + 1
+    size_t seqIndexSize;
+    double deviceScale;
+    int fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int inFlight;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t mismatched; // Status differs from the recording
+    uint64_t bytes;
+    uint64_t *latencies;
+    size_t numLatencies;
+};
+
+struct Summary {
+    double urbPerSec;
+    double mbPerSec;
+    double p50Us;
+    double p99Us;
+    double p999Us;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadlineNs) {
+    struct timespec ts = { (time_t)(deadlineNs / 1000000000ull), (long)(deadlineNs % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+static uint32_t rd16(const uint8_t *p) { return (uint32_t)p[0] | (uint32_t)p[1] << 8; }
+static uint32_t rd32(const uint8_t *p) { return rd16(p) | rd16(p + 2) << 16; }
+static uint64_t rd64(const uint8_t *p) { return (uint64_t)rd32(p) | (uint64_t)rd32(p + 4) << 32; }
+
+static size_t seq_slot(const struct Replay *replay, int32_t seqNum) {
+    return ((uint32_t)seqNum * 2654435761u) & (replay->seqIndexSize - 1);
+}
+
+static struct Urb *find_urb(const struct Replay *replay, int32_t seqNum) {
+    for (size_t i = seq_slot(replay, seqNum); replay->seqIndex[i] != 0; i = (i + 1) & (replay->seqIndexSize - 1)) {
+        struct Urb *urb = &replay->urbs[replay->seqIndex[i] - 1];
+        if (urb->submit->seqNum == seqNum) return urb;
+    }
+    return NULL;
+}
+
+static int load_session(struct Replay *replay, const char *path, struct SimDeviceConfig *config) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    uint8_t header[SESSION_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, SESSION_MAGIC, 8) != 0 ||
+        rd16(header + 8) != 1) {
+        fprintf(stderr, "%s: not a version 1 session recording\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    sim_device_config_defaults(config);
+    config->vendorId = (uint16_t)rd16(header + 10);
+    config->productId = (uint16_t)rd16(header + 12);
+    switch (header[14]) {
+        case 1: config->speed = LIBUSB_SPEED_LOW; break;
+        case 2: config->speed = LIBUSB_SPEED_FULL; break;
+        case 5: config->speed = LIBUSB_SPEED_SUPER; break;
+        default: config->speed = LIBUSB_SPEED_HIGH; break;
+    }
+
+    size_t capacity = 4096;
+    replay->records = malloc(capacity * sizeof(struct Record));
+    uint8_t raw[SESSION_RECORD_SIZE];
+    while (fread(raw, 1, sizeof(raw), f) == sizeof(raw)) {
+        if (replay->numRecords == capacity) {
+            capacity *= 2;
+            replay->records = realloc(replay->records, capacity * sizeof(struct Record));
+        }
+        struct Record *r = &replay->records[replay->numRecords++];
+        r->kind = raw[0];
+        r->type = raw[1];
+        r->endpoint = raw[2];
+        r->direction = raw[3];
+        r->seqNum = (int32_t)rd32(raw + 4);
+        r->tNs = rd64(raw + 8);
+        r->a = (int32_t)rd32(raw + 16);
+        r->b = (int32_t)rd32(raw + 20);
+        r->c = (int32_t)rd32(raw + 24);
+        r->d = (int32_t)rd32(raw + 28);
+        memcpy(r->setup, raw + 32, sizeof(r->setup));
+    }
+    fclose(f);
+
+    size_t submits = 0;
+    for (size_t i = 0; i < replay->numRecords; i++) {
+        if (replay->records[i].kind == KIND_SUBMIT) submits++;
+    }
+    replay->urbs = calloc(submits ? submits : 1, sizeof(struct Urb));
+    replay->seqIndexSize = 64;
+    while (replay->seqIndexSize < submits * 2) replay->seqIndexSize *= 2;
+    replay->seqIndex = calloc(replay->seqIndexSize, sizeof(int32_t));
+    replay->latencies = malloc((submits ? submits : 1) * sizeof(uint64_t));
+
+    uint64_t completes = 0;
+    for (size_t i = 0; i < replay->numRecords; i++) {
+        const struct Record *r = &replay->records[i];
+        if (r->kind == KIND_SUBMIT) {
+            struct Urb *urb = &replay->urbs[replay->numUrbs++];
+            urb->submit = r;
+            urb->completesBefore = completes;
+            size_t slot = seq_slot(replay, r->seqNum);
+            while (replay->seqIndex[slot] != 0) slot = (slot + 1) & (replay->seqIndexSize - 1);
+            replay->seqIndex[slot] = (int32_t)replay->numUrbs;
+        } else if (r->kind == KIND_COMPLETE) {
+            struct Urb *urb = find_urb(replay, r->seqNum);
+            if (urb != NULL && urb->complete == NULL) {
+                urb->complete = r;
+                completes++;
+            }
+        }
+    }
+
+    // Endpoints the session used, sized so no recorded transfer is refused
+    for (size_t i = 0; i < replay->numUrbs; i++) {
+        const struct Record *r = replay->urbs[i].submit;
+        if (r->endpoint == 0 || r->type == LIBUSB_TRANSFER_TYPE_CONTROL) continue;
+        struct SimEndpointConfig *ep = NULL;
+        for (int j = 0; j < config->numEndpoints && ep == NULL; j++) {
+            if (config->endpoints[j].address == r->endpoint) ep = &config->endpoints[j];
+        }
+        if (ep == NULL) {
+            if (config->numEndpoints == SIM_MAX_ENDPOINTS) continue;
+            ep = &config->endpoints[config->numEndpoints++];
+            memset(ep, 0, sizeof(*ep));
+            ep->address = r->endpoint;
+            ep->type = r->type;
+            ep->interval = (uint8_t)(r->d > 0 && r->d < 256 ? r->d : 1);
+            ep->maxPacketSize = r->type == LIBUSB_TRANSFER_TYPE_INTERRUPT ? 64
+                                : config->speed >= LIBUSB_SPEED_SUPER ? 1024
+                                : config->speed == LIBUSB_SPEED_HIGH ? 512 : 64;
+        }
+        if (r->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && r->c > 0) {
+            int packet = (r->a + r->c - 1) / r->c;
+            if (packet > ep->maxPacketSize) ep->maxPacketSize = (uint16_t)(packet < 3072 ? packet : 3072);
+        }
+    }
+    return 0;
+}
+
+static enum libusb_transfer_status status_from_errno(int status) {
+    switch (status) {
+        case 0: return LIBUSB_TRANSFER_COMPLETED;
+        case -ETIMEDOUT: return LIBUSB_TRANSFER_TIMED_OUT;
+        case -EPIPE: return LIBUSB_TRANSFER_STALL;
+        case -ENODEV: return LIBUSB_TRANSFER_NO_DEVICE;
+        case -EOVERFLOW: return LIBUSB_TRANSFER_OVERFLOW;
+        // Unlinked in the recording, the replayed UNLINK decides the outcome again
+        case -ENOENT:
+        case -ECONNRESET: return LIBUSB_TRANSFER_COMPLETED;
+        default: return LIBUSB_TRANSFER_ERROR;
+    }
+}
+
+static int respond(void *user, const struct libusb_transfer *transfer, struct SimResponse *out) {
+    struct Replay *replay = user;
+    const struct Urb *urb = find_urb(replay, (int32_t)(intptr_t)transfer->user_data);
+    if (urb == NULL || urb->complete == NULL) return 0;
+
+    uint64_t deviceNs = urb->complete->tNs > urb->submit->tNs ? urb->complete->tNs - urb->submit->tNs : 0;
+    out->delayUs = (uint32_t)((double)deviceNs * replay->deviceScale / 1000.0);
+    out->status = status_from_errno(urb->complete->a);
+    out->actualLength = urb->complete->b;
+    return 1;
+}
+
+static void on_completed(void *user, jint seqNum, jint status, jint actualLength, jint type,
+                         const jint *isoActualLengths, const jint *isoStatuses, jsize numIsoPackets) {
+    struct Replay *replay = user;
+    struct Urb *urb = find_urb(replay, seqNum);
+    uint64_t now = now_ns();
+
+    if (urb != NULL && urb->buffer != NULL) {
+        USBLIB_FN(releaseBuffer)(jni_host_env(), jni_host_usblib(), urb->buffer);
+        jni_host_delete(urb->buffer);
+        urb->buffer = NULL;
+    }
+
+    pthread_mutex_lock(&replay->lock);
+    if (status == 0) replay->completed++;
+    else replay->failed++;
+    // Whether an UNLINK beats the completion is down to timing, so those don't count
+    if (urb != NULL && urb->complete != NULL && urb->complete->a != -ENOENT && urb->complete->a != -ECONNRESET &&
+        (status == 0) != (urb->complete->a == 0)) {
+        replay->mismatched++;
+    }
+    replay->bytes += (uint64_t)actualLength;
+    if (urb != NULL) replay->latencies[replay->numLatencies++] = now - urb->issuedNs;
+    replay->inFlight--;
+    pthread_cond_broadcast(&replay->changed);
+    pthread_mutex_unlock(&replay->lock);
+}
+
+static int issue_submit(struct Replay *replay, struct Urb *urb) {
+    JNIEnv *env = jni_host_env();
+    jobject thiz = jni_host_usblib();
+    const struct Record *r = urb->submit;
+    int length = r->a > 0 ? r->a : 0;
+    int is_control = r->endpoint == 0 || r->type == LIBUSB_TRANSFER_TYPE_CONTROL;
+    int size = is_control ? length + 8 : length;
+
+    urb->buffer = USBLIB_FN(allocBuffer)(env, thiz, replay->fd, size > 0 ? size : 1);
+    if (urb->buffer == NULL) return -ENOMEM;
+    if (is_control) memcpy((*env)->GetDirectBufferAddress(env, urb->buffer), r->setup, sizeof(r->setup));
+
+    urb->issuedNs = now_ns();
+    jlong rx = (jlong)urb->issuedNs;
+    int ret;
+    if (is_control) {
+        ret = USBLIB_FN(doControlTransferAsync)(env, thiz, replay->fd, urb->buffer, 300, r->seqNum, r->b, rx);
+    } else if (r->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        int packets = r->c > 0 ? r->c : 1;
+        jint *lengths = malloc(sizeof(jint) * (size_t)packets);
+        for (int i = 0; i < packets; i++) lengths[i] = length / packets;
+        lengths[packets - 1] += length % packets;
+        jintArray isoLengths = jni_host_new_int_array(lengths, packets);
+        free(lengths);
+        ret = USBLIB_FN(doIsochronousTransferAsync)(env, thiz, replay->fd, r->endpoint, urb->buffer, length, isoLengths,
+                                                    r->seqNum, r->b, rx);
+        jni_host_delete(isoLengths);
+    } else if (r->type == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+        ret = USBLIB_FN(doInterruptTransferAsync)(env, thiz, replay->fd, r->endpoint, urb->buffer, length, 1000,
+                                                  r->seqNum, r->b, rx);
+    } else {
+        ret = USBLIB_FN(doBulkTransferAsync)(env, thiz, replay->fd, r->endpoint, urb->buffer, length, 300,
+                                             r->seqNum, r->b, rx);
+    }
+
+    if (ret < 0) {
+        USBLIB_FN(releaseBuffer)(env, thiz, urb->buffer);
+        jni_host_delete(urb->buffer);
+        urb->buffer = NULL;
+    }
+    return ret;
+}
+
+static int run(struct Replay *replay, int realTime) {
+    uint64_t start = now_ns();
+    struct Urb *next = replay->urbs;
+
+    for (size_t i = 0; i < replay->numRecords; i++) {
+        const struct Record *r = &replay->records[i];
+        if (r->kind == KIND_COMPLETE) continue;
+        if (realTime) sleep_until(start + r->tNs);
+
+        if (r->kind == KIND_UNLINK) {
+            USBLIB_FN(cancelTransfer)(jni_host_env(), jni_host_usblib(), r->a, replay->fd);
+            continue;
+        }
+        if (r->kind != KIND_SUBMIT) continue;
+
+        struct Urb *urb = next++;
+        pthread_mutex_lock(&replay->lock);
+        while (replay->completed + replay->failed < urb->completesBefore || replay->inFlight >= MAX_IN_FLIGHT) {
+            pthread_cond_wait(&replay->changed, &replay->lock);
+        }
+        replay->inFlight++;
+        pthread_mutex_unlock(&replay->lock);
+
+        int ret = issue_submit(replay, urb);
+        if (ret < 0) {
+            fprintf(stderr, "seq %d: submit failed with %d\n", r->seqNum, ret);
+            pthread_mutex_lock(&replay->lock);
+            replay->inFlight--;
+            replay->failed++;
+            pthread_mutex_unlock(&replay->lock);
+        }
+    }
+
+    pthread_mutex_lock(&replay->lock);
+    while (replay->inFlight > 0) pthread_cond_wait(&replay->changed, &replay->lock);
+    pthread_mutex_unlock(&replay->lock);
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return (double)sorted[i] / 1000.0;
+}
+
+// Reads a number following "key": in a JSON file written by -j. Returns 0 if absent.
+static double json_number(const char *json, const char *key) {
+    char needle[64];
+    snprintf(needle, sizeof(needle), "\"%s\":", key);
+    const char *p = strstr(json, needle);
+    return p != NULL ? strtod(p + strlen(needle), NULL) : 0;
+}
+
+static int load_baseline(const char *path, struct Summary *out) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char json[4096];
+    size_t n = fread(json, 1, sizeof(json) - 1, f);
+    fclose(f);
+    json[n] = '\0';
+    out->urbPerSec = json_number(json, "urb_per_sec");
+    out->mbPerSec = json_number(json, "mb_per_sec");
+    out->p50Us = json_number(json, "p50_us");
+    out->p99Us = json_number(json, "p99_us");
+    out->p999Us = json_number(json, "p999_us");
+    return 0;
+}
+
+static void print_delta(FILE *out, const char *name, double base, double now, const char *unit,
+                        int higherIsBetter) {
+    double pct = base != 0 ? (now - base) / base * 100.0 : 0;
+    int worse = higherIsBetter ? pct < 0 : pct > 0;
+    fprintf(out, "  %-12s %12.1f -> %12.1f %-5s %+7.1f%%%s\n", name, base, now, unit, pct,
+           worse && (pct > 5 || pct < -5) ? "  REGRESSED" : "");
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s SESSION.uipr [-r] [-d device_time_scale] [-j] [-b baseline.json]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    struct Replay replay = { .deviceScale = 1.0 };
+    const char *baselinePath = NULL;
+    int realTime = 0, json = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rd:jb:h")) != -1) {
+        switch (opt) {
+            case 'r': realTime = 1; break;
+            case 'd': replay.deviceScale = atof(optarg); break;
+            case 'j': json = 1; break;
+            case 'b': baselinePath = optarg; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc - 1 || replay.deviceScale < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct SimDeviceConfig config;
+    if (load_session(&replay, argv[optind], &config) != 0) return 1;
+    if (replay.numUrbs == 0) {
+        fprintf(stderr, "%s: no transfers recorded\n", argv[optind]);
+        return 1;
+    }
+    struct Summary baseline = {0};
+    if (baselinePath != NULL && load_baseline(baselinePath, &baseline) != 0) return 1;
+
+    JNIEnv *env = jni_host_env();
+    jobject thiz = jni_host_usblib();
+    pthread_mutex_init(&replay.lock, NULL);
+    pthread_cond_init(&replay.changed, NULL);
+    jni_host_set_completion_handler(on_completed, &replay);
+
+    if (USBLIB_FN(init)(env, thiz) != 0) return 1;
+    replay.fd = sim_device_create(&config);
+    if (replay.fd < 0 || USBLIB_FN(openDeviceHandle)(env, thiz, replay.fd) != 0) {
+        fprintf(stderr, "could not open simulated device\n");
+        return 1;
+    }
+    sim_device_set_responder(replay.fd, respond, &replay);
+
+    uint64_t start = now_ns();
+    run(&replay, realTime);
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    qsort(replay.latencies, replay.numLatencies, sizeof(uint64_t), compare_u64);
+    struct Summary summary = {
+        .urbPerSec = (double)(replay.completed + replay.failed) / elapsed,
+        .mbPerSec = (double)replay.bytes / elapsed / 1e6,
+        .p50Us = percentile_us(replay.latencies, replay.numLatencies, 0.50),
+        .p99Us = percentile_us(replay.latencies, replay.numLatencies, 0.99),
+        .p999Us = percentile_us(replay.latencies, replay.numLatencies, 0.999),
+    };
+    uint64_t recordedNs = replay.records[replay.numRecords - 1].tNs;
+
+    if (json) {
+        printf("{\"session\":\"%s\",\"mode\":\"%s\",\"device_time_scale\":%.3f,\"urbs\":%zu,"
+               "\"completed\":%llu,\"failed\":%llu,\"mismatched\":%llu,\"recorded_s\":%.3f,\"elapsed_s\":%.3f,"
+               "\"urb_per_sec\":%.1f,\"mb_per_sec\":%.3f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+               argv[optind], realTime ? "realtime" : "asap", replay.deviceScale, replay.numUrbs,
+               (unsigned long long)replay.completed, (unsigned long long)replay.failed,
+               (unsigned long long)replay.mismatched, (double)recordedNs / 1e9, elapsed,
+               summary.urbPerSec, summary.mbPerSec, summary.p50Us, summary.p99Us, summary.p999Us);
+    } else {
+        printf("%zu URBs recorded over %.2f s on %04x:%04x, replayed %s in %.2f s\n", replay.numUrbs,
+               (double)recordedNs / 1e9, config.vendorId, config.productId, realTime ? "in real time" : "asap",
+               elapsed);
+        printf("%llu completed, %llu failed (%llu differ from the recording)\n",
+               (unsigned long long)replay.completed, (unsigned long long)replay.failed,
+               (unsigned long long)replay.mismatched);
+        printf("%.0f URB/s, %.1f MB/s, latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us\n", summary.urbPerSec,
+               summary.mbPerSec, summary.p50Us, summary.p99Us, summary.p999Us);
+    }
+    if (baselinePath != NULL) {
+        // Keep stdout a single JSON document with -j
+        FILE *out = json ? stderr : stdout;
+        fprintf(out, "against %s:\n", baselinePath);
+        print_delta(out, "URB/s", baseline.urbPerSec, summary.urbPerSec, "", 1);
+        print_delta(out, "MB/s", baseline.mbPerSec, summary.mbPerSec, "", 1);
+        print_delta(out, "p50", baseline.p50Us, summary.p50Us, "us", 0);
+        print_delta(out, "p99", baseline.p99Us, summary.p99Us, "us", 0);
+        print_delta(out, "p99.9", baseline.p999Us, summary.p999Us, "us", 0);
+    }
+
+    USBLIB_FN(closeDeviceHandle)(env, thiz, replay.fd);
+    USBLIB_FN(exit)(env, thiz);
+    sim_device_destroy(replay.fd);
+    free(replay.latencies);
+    free(replay.seqIndex);
+    free(replay.urbs);
+    free(replay.records);
+    return replay.mismatched == 0 ? 0 : 1;
+}
@@ -0,0 +1,528 @@
+/*
+ * Client side of the compressed tunnel. Listens for a stock USB/IP client (usbip
+ * attach, vhci-hcd) and relays it to the server, importing with OP_REQ_IMPORT_TUNNEL
+ * instead of OP_REQ_IMPORT. Transfer payloads then cross the slow link framed as
+ * TunnelCodec.kt describes: OUT data is compressed here, IN data by the server, and
+ * either side sends a payload as is when it doesn't shrink.
+ *
+ *   usbiptunnel -H 192.168.1.20 &
+ *   usbip attach -r 127.0.0.1 -b 1-2
+ *
+ * Other requests (device list, diagnostics) are relayed unchanged. A server without
+ * tunnel support closes the connection on the import, which fails the attach.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lz4block.h"
+
+#define USBIP_VERSION 0x0111
+#define OP_REQ_IMPORT 0x8003
+#define OP_REP_IMPORT 0x0003
+#define OP_REQ_IMPORT_TUNNEL 0x8072
+#define OP_REP_IMPORT_TUNNEL 0x0072
+#define OP_HEADER_SIZE 8
+
+#define USBIP_CMD_SUBMIT 1
+#define USBIP_CMD_UNLINK 2
+#define USBIP_RET_SUBMIT 3
+#define USBIP_RET_UNLINK 4
+#define USBIP_DIR_OUT 0
+#define USBIP_HEADER_SIZE 48
+#define USBIP_ISO_DESCRIPTOR_SIZE 16
+
+#define DEV_PATH_SIZE 256
+#define BUS_ID_SIZE 32
+#define DEVICE_WIRE_SIZE (DEV_PATH_SIZE + BUS_ID_SIZE + 24)
+
+#define TUNNEL_PREFIX_SIZE 8
+// Larger lengths mean a desynchronised stream, not a real URB
+#define MAX_PAYLOAD (64 * 1024 * 1024)
+#define MAX_ISO_PACKETS 1024
+
+// Same rules as TunnelCodec.kt
+#define MIN_SAVING_DIVISOR 16
+#define POOR_STREAK_LIMIT 4
+#define BACKOFF_PAYLOADS 64
+#define ENDPOINT_SLOTS 32
+
+struct TunnelConfig {
+    const char *listenAddr;
+    const char *listenPort;
+    const char *host;
+    const char *port;
+    const char *localName; // Abstract AF_UNIX name of the server, NULL for TCP
+    int minCompressBytes;
+};
+
+struct Direction {
+    uint64_t payloads;
+    uint64_t compressed;
+    uint64_t rawBytes;
+    uint64_t wireBytes;
+};
+
+struct Session {
+    const struct TunnelConfig *config;
+    int client;
+    int server;
+    char busId[BUS_ID_SIZE + 1];
+    struct Direction up;   // Client to server, OUT data
+    struct Direction down; // Server to client, IN data
+    int poorStreak[ENDPOINT_SLOTS];
+    int skipRemaining[ENDPOINT_SLOTS];
+};
+
+static void put_be16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)count };
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int ensure_capacity(unsigned char **buf, size_t *capacity, size_t needed) {
+    if (*capacity >= needed) return 0;
+    unsigned char *grown = realloc(*buf, needed);
+    if (grown == NULL) return -1;
+    *buf = grown;
+    *capacity = needed;
+    return 0;
+}
+
+static int connect_local(const char *name) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t len = strlen(name);
+    if (len + 1 > sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket name too long: %s\n", name);
+        return -1;
+    }
+    memcpy(addr.sun_path + 1, name, len); // Leading NUL selects the abstract namespace
+
+    socklen_t addrLen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, addrLen) != 0) {
+        fprintf(stderr, "connect to @%s: %s\n", name, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_server(const struct TunnelConfig *config) {
+    if (config->localName != NULL) return connect_local(config->localName);
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int r = getaddrinfo(config->host, config->port, &hints, &res);
+    if (r != 0) {
+        fprintf(stderr, "%s: %s\n", config->host, gai_strerror(r));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        fprintf(stderr, "connect to %s:%s: %s\n", config->host, config->port, strerror(errno));
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int listen_on(const struct TunnelConfig *config) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res;
+    int r = getaddrinfo(config->listenAddr, config->listenPort, &hints, &res);
+    if (r != 0) {
+        fprintf(stderr, "%s: %s\n", config->listenAddr, gai_strerror(r));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 8) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) fprintf(stderr, "listen on %s:%s: %s\n", config->listenAddr, config->listenPort, strerror(errno));
+    return fd;
+}
+
+// Copies bytes both ways until either side closes, for requests we don't translate
+static void relay_plain(struct Session *s) {
+    unsigned char buf[16384];
+    struct pollfd fds[2] = { { .fd = s->client, .events = POLLIN }, { .fd = s->server, .events = POLLIN } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            ssize_t n = recv(fds[i].fd, buf, sizeof(buf), 0);
+            if (n <= 0 || write_all(fds[1 - i].fd, buf, (size_t)n) != 0) return;
+        }
+    }
+}
+
+// Returns the size of the block left in out, or 0 to send the payload as is
+static int compress_payload(struct Session *s, int slot, const unsigned char *data, int len,
+                            unsigned char *out) {
+    if (len < s->config->minCompressBytes) return 0;
+    if (s->skipRemaining[slot] > 0) {
+        s->skipRemaining[slot]--;
+        return 0;
+    }
+    int size = lz4_compress_block(data, len, out, len - len / MIN_SAVING_DIVISOR);
+    if (size > 0) {
+        s->poorStreak[slot] = 0;
+    } else if (++s->poorStreak[slot] >= POOR_STREAK_LIMIT) {
+        s->poorStreak[slot] = 0;
+        s->skipRemaining[slot] = BACKOFF_PAYLOADS;
+    }
+    return size;
+}
+
+static int read_iso_descriptors(int fd, uint32_t packets, unsigned char *iso, size_t *isoLen) {
+    *isoLen = 0;
+    if (packets == 0 || packets == 0xffffffffu) return 0; // No packets, or not isochronous
+    if (packets > MAX_ISO_PACKETS) return -1;
+    *isoLen = (size_t)packets * USBIP_ISO_DESCRIPTOR_SIZE;
+    return read_all(fd, iso, *isoLen);
+}
+
+// Client to server: frames (and maybe compresses) the payload of every CMD_SUBMIT
+static void *relay_up(void *arg) {
+    struct Session *s = arg;
+    unsigned char header[USBIP_HEADER_SIZE];
+    unsigned char prefix[TUNNEL_PREFIX_SIZE];
+    unsigned char *iso = malloc(MAX_ISO_PACKETS * USBIP_ISO_DESCRIPTOR_SIZE);
+    unsigned char *data = NULL, *block = NULL;
+    size_t dataCapacity = 0, blockCapacity = 0;
+
+    while (iso != NULL && read_all(s->client, header, sizeof(header)) == 0) {
+        uint32_t command = get_be32(header);
+        if (command == USBIP_CMD_UNLINK) {
+            if (write_all(s->server, header, sizeof(header)) != 0) break;
+            continue;
+        }
+        if (command != USBIP_CMD_SUBMIT) {
+            fprintf(stderr, "%s: unexpected command %u from client\n", s->busId, command);
+            break;
+        }
+
+        uint32_t direction = get_be32(header + 12);
+        uint32_t ep = get_be32(header + 16);
+        uint32_t length = direction == USBIP_DIR_OUT ? get_be32(header + 24) : 0;
+        if (length > MAX_PAYLOAD) break;
+        if (ensure_capacity(&data, &dataCapacity, length) != 0 ||
+            ensure_capacity(&block, &blockCapacity, length) != 0 ||
+            read_all(s->client, data, length) != 0) {
+            break;
+        }
+        size_t isoLen;
+        if (read_iso_descriptors(s->client, get_be32(header + 32), iso, &isoLen) != 0) break;
+
+        int slot = (int)((ep & 0x0f) | (direction ? 0x10 : 0));
+        int size = compress_payload(s, slot, data, (int)length, block);
+        uint32_t encoded = size > 0 ? (uint32_t)size : length;
+        put_be32(prefix, length);
+        put_be32(prefix + 4, encoded);
+
+        struct iovec iov[4] = {
+                { header, sizeof(header) },
+                { prefix, sizeof(prefix) },
+                { size > 0 ? block : data, encoded },
+                { iso, isoLen },
+        };
+        if (writev_all(s->server, iov, 4) != 0) break;
+
+        if (length > 0) s->up.payloads++;
+        if (size > 0) s->up.compressed++;
+        s->up.rawBytes += length;
+        s->up.wireBytes += TUNNEL_PREFIX_SIZE + encoded;
+    }
+
+    shutdown(s->server, SHUT_RDWR);
+    shutdown(s->client, SHUT_RDWR);
+    free(iso);
+    free(data);
+    free(block);
+    return NULL;
+}
+
+// Server to client: unwraps the payload of every RET_SUBMIT
+static void relay_down(struct Session *s) {
+    unsigned char header[USBIP_HEADER_SIZE];
+    unsigned char prefix[TUNNEL_PREFIX_SIZE];
+    unsigned char *iso = malloc(MAX_ISO_PACKETS * USBIP_ISO_DESCRIPTOR_SIZE);
+    unsigned char *data = NULL, *block = NULL;
+    size_t dataCapacity = 0, blockCapacity = 0;
+
+    while (iso != NULL && read_all(s->server, header, sizeof(header)) == 0) {
+        uint32_t command = get_be32(header);
+        if (command == USBIP_RET_UNLINK) {
+            if (write_all(s->client, header, sizeof(header)) != 0) break;
+            continue;
+        }
+        if (command != USBIP_RET_SUBMIT) {
+            fprintf(stderr, "%s: unexpected command %u from server\n", s->busId, command);
+            break;
+        }
+
+        if (read_all(s->server, prefix, sizeof(prefix)) != 0) break;
+        uint32_t length = get_be32(prefix);
+        uint32_t encoded = get_be32(prefix + 4);
+        if (length > MAX_PAYLOAD || encoded > length) {
+            fprintf(stderr, "%s: bad payload framing %u/%u\n", s->busId, encoded, length);
+            break;
+        }
+        if (ensure_capacity(&data, &dataCapacity, length) != 0 ||
+            ensure_capacity(&block, &blockCapacity, encoded) != 0) {
+            break;
+        }
+        if (encoded == length) {
+            if (read_all(s->server, data, length) != 0) break;
+        } else {
+            if (read_all(s->server, block, encoded) != 0) break;
+            if (lz4_decompress_block(block, (int)encoded, data, (int)length) != (int)length) {
+                fprintf(stderr, "%s: corrupt payload\n", s->busId);
+                break;
+            }
+            s->down.compressed++;
+        }
+        size_t isoLen;
+        if (read_iso_descriptors(s->server, get_be32(header + 32), iso, &isoLen) != 0) break;
+
+        struct iovec iov[3] = {
+                { header, sizeof(header) },
+                { data, length },
+                { iso, isoLen },
+        };
+        if (writev_all(s->client, iov, 3) != 0) break;
+
+        if (length > 0) s->down.payloads++;
+        s->down.rawBytes += length;
+        s->down.wireBytes += TUNNEL_PREFIX_SIZE + encoded;
+    }
+
+    shutdown(s->server, SHUT_RDWR);
+    shutdown(s->client, SHUT_RDWR);
+    free(iso);
+    free(data);
+    free(block);
+}
+
+static void print_direction(const char *name, const struct Direction *d) {
+    fprintf(stderr, "  %s: %llu payloads (%llu compressed), %llu bytes as %llu on the wire (%.2fx)\n", name,
+            (unsigned long long)d->payloads, (unsigned long long)d->compressed,
+            (unsigned long long)d->rawBytes, (unsigned long long)d->wireBytes,
+            d->wireBytes ? (double)d->rawBytes / (double)d->wireBytes : 1.0);
+}
+
+// Swaps the client's import for a tunnel import; returns 0 once the device is attached
+static int import(struct Session *s, const unsigned char *request) {
+    unsigned char busId[BUS_ID_SIZE];
+    if (read_all(s->client, busId, sizeof(busId)) != 0) return -1;
+    memcpy(s->busId, busId, BUS_ID_SIZE);
+    s->busId[BUS_ID_SIZE] = '\0';
+
+    unsigned char header[OP_HEADER_SIZE];
+    memcpy(header, request, OP_HEADER_SIZE);
+    put_be16(header + 2, OP_REQ_IMPORT_TUNNEL);
+    struct iovec iov[2] = { { header, sizeof(header) }, { busId, sizeof(busId) } };
+    if (writev_all(s->server, iov, 2) != 0) return -1;
+
+    unsigned char reply[OP_HEADER_SIZE + DEVICE_WIRE_SIZE];
+    if (read_all(s->server, reply, OP_HEADER_SIZE) != 0) {
+        fprintf(stderr, "%s: server closed the import, no tunnel support?\n", s->busId);
+        put_be16(reply, USBIP_VERSION);
+        put_be32(reply + 4, 1);
+    } else if (get_be16(reply + 2) != OP_REP_IMPORT_TUNNEL) {
+        fprintf(stderr, "%s: unexpected reply code 0x%04x\n", s->busId, get_be16(reply + 2));
+        put_be32(reply + 4, 1);
+    }
+    put_be16(reply + 2, OP_REP_IMPORT);
+
+    uint32_t status = get_be32(reply + 4);
+    if (status == 0 && read_all(s->server, reply + OP_HEADER_SIZE, DEVICE_WIRE_SIZE) != 0) return -1;
+    if (write_all(s->client, reply, status == 0 ? sizeof(reply) : OP_HEADER_SIZE) != 0) return -1;
+    return status == 0 ? 0 : -1;
+}
+
+static void *serve(void *arg) {
+    struct Session *s = arg;
+    unsigned char request[OP_HEADER_SIZE];
+
+    s->server = connect_server(s->config);
+    if (s->server >= 0 && read_all(s->client, request, sizeof(request)) == 0) {
+        if (get_be16(request + 2) != OP_REQ_IMPORT) {
+            if (write_all(s->server, request, sizeof(request)) == 0) relay_plain(s);
+        } else if (import(s, request) == 0) {
+            fprintf(stderr, "%s: attached\n", s->busId);
+            pthread_t up;
+            if (pthread_create(&up, NULL, relay_up, s) == 0) {
+                relay_down(s);
+                pthread_join(up, NULL);
+            }
+            fprintf(stderr, "%s: detached\n", s->busId);
+            print_direction("out", &s->up);
+            print_direction("in", &s->down);
+        }
+    }
+
+    if (s->server >= 0) close(s->server);
+    close(s->client);
+    free(s);
+    return NULL;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-H host] [-p port] [-U local_socket] [-L listen_addr] [-l listen_port]\n"
+            "          [-m min_compress_bytes]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    struct TunnelConfig config = {
+            .listenAddr = "127.0.0.1", .listenPort = "3240", .host = "127.0.0.1", .port = "3240",
+            .minCompressBytes = 512,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:U:L:l:m:h")) != -1) {
+        switch (opt) {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = optarg; break;
+            case 'U': config.localName = optarg; break;
+            case 'L': config.listenAddr = optarg; break;
+            case 'l': config.listenPort = optarg; break;
+            case 'm': config.minCompressBytes = atoi(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc || config.minCompressBytes < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int listener = listen_on(&config);
+    if (listener < 0) return 1;
+    fprintf(stderr, "tunnelling %s:%s to %s%s%s\n", config.listenAddr, config.listenPort,
+            config.localName ? "@" : config.host, config.localName ? config.localName : ":",
+            config.localName ? "" : config.port);
+
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            return 1;
+        }
+        int one = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct Session *s = calloc(1, sizeof(*s));
+        pthread_t thread;
+        if (s == NULL) {
+            close(client);
+            continue;
+        }
+        s->config = &config;
+        s->client = client;
+        s->server = -1;
+        if (pthread_create(&thread, NULL, serve, s) != 0) {
+            close(client);
+            free(s);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
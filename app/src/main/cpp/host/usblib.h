@@ -0,0 +1,49 @@
+#ifndef USBIP_HOST_USBLIB_H
+#define USBIP_HOST_USBLIB_H
+
+#include <jni.h>
+
+// The UsbLib entry points of usbipfunctions.c, for host tools that drive the engine
+// through jnihost.h instead of a JVM. Keep in step with UsbLib.kt.
+
+#define USBLIB_FN(name) Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_##name
+
+jint USBLIB_FN(init)(JNIEnv *env, jobject thiz);
+jint USBLIB_FN(exit)(JNIEnv *env, jobject thiz);
+jint USBLIB_FN(openDeviceHandle)(JNIEnv *env, jobject thiz, jint fd);
+jint USBLIB_FN(closeDeviceHandle)(JNIEnv *env, jobject thiz, jint fd);
+jint USBLIB_FN(doControlTransfer)(JNIEnv *env, jobject thiz, jint fd, jbyte request_type, jbyte request,
+                                  jshort value, jshort index, jobject buffer, jint length, jint timeout);
+jint USBLIB_FN(doControlTransferAsync)(JNIEnv *env, jobject thiz, jint fd, jobject buffer, jint timeout,
+                                       jint seqNum, jint usbipFlags, jlong rxTimestampNs);
+jint USBLIB_FN(doBulkTransferAsync)(JNIEnv *env, jobject thiz, jint fd, jint endpoint, jobject buffer,
+                                    jint length, jint timeout, jint seqNum, jint usbipFlags, jlong rxTimestampNs);
+jint USBLIB_FN(doInterruptTransferAsync)(JNIEnv *env, jobject thiz, jint fd, jint endpoint, jobject buffer,
+                                         jint length, jint timeout, jint seqNum, jint usbipFlags, jlong rxTimestampNs);
+jint USBLIB_FN(doIsochronousTransferAsync)(JNIEnv *env, jobject thiz, jint fd, jint endpoint, jobject buffer,
+                                           jint length, jintArray iso_packet_lengths, jint seqNum, jint usbipFlags,
+                                           jlong rxTimestampNs);
+jint USBLIB_FN(cancelTransfer)(JNIEnv *env, jobject thiz, jint seq_num, jint fd);
+jobject USBLIB_FN(allocBuffer)(JNIEnv *env, jobject thiz, jint fd, jint size);
+jint USBLIB_FN(releaseBuffer)(JNIEnv *env, jobject thiz, jobject buffer);
+jint USBLIB_FN(prewarmBuffers)(JNIEnv *env, jobject thiz, jint fd, jint size, jint count);
+jint USBLIB_FN(prewarmTransfers)(JNIEnv *env, jobject thiz, jint fd, jint isoPackets, jint count);
+jlongArray USBLIB_FN(getBufferPoolStats)(JNIEnv *env, jobject thiz, jint fd);
+jlongArray USBLIB_FN(getUsbfsBudgetStats)(JNIEnv *env, jobject thiz);
+jint USBLIB_FN(startCapture)(JNIEnv *env, jobject thiz, jstring path, jint snapLen);
+void USBLIB_FN(stopCapture)(JNIEnv *env, jobject thiz);
+jlongArray USBLIB_FN(getCaptureStats)(JNIEnv *env, jobject thiz);
+void USBLIB_FN(recordLatency)(JNIEnv *env, jobject thiz, jint fd, jint endpoint, jint stage, jlong nanos);
+jstring USBLIB_FN(getMetricsReport)(JNIEnv *env, jobject thiz, jint fd);
+jint USBLIB_FN(getDeviceSpeed)(JNIEnv *env, jobject thiz, jint fd);
+jint USBLIB_FN(setEventThreadProfile)(JNIEnv *env, jobject thiz, jint nice, jint fifoPriority, jlong cpuMask);
+jint USBLIB_FN(getEventThreadProfileResult)(JNIEnv *env, jobject thiz);
+jint USBLIB_FN(applyThreadProfile)(JNIEnv *env, jobject thiz, jint nice, jint fifoPriority, jlong cpuMask);
+void USBLIB_FN(setBusyPoll)(JNIEnv *env, jobject thiz, jint spinUs, jint idleMs);
+jlongArray USBLIB_FN(getBusyPollStats)(JNIEnv *env, jobject thiz);
+jint USBLIB_FN(setSocketBusyPoll)(JNIEnv *env, jobject thiz, jint fd, jint usec);
+jint USBLIB_FN(compressBlock)(JNIEnv *env, jobject thiz, jobject src, jint srcOffset, jint srcLength,
+                             jbyteArray dst);
+jint USBLIB_FN(decompressBlock)(JNIEnv *env, jobject thiz, jbyteArray src, jint srcLength, jbyteArray dst);
+
+#endif // USBIP_HOST_USBLIB_H
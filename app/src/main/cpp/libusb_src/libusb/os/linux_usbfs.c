@@ -24,6 +24,7 @@
 
 #include "libusbi.h"
 #include "linux_usbfs.h"
+#include "../../../usbipprobes.h"
 
 #include <alloca.h>
 #include <ctype.h>
@@ -2693,6 +2694,9 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
 	usbi_dbg(HANDLE_CTX(handle), "urb type=%u status=%d transferred=%d", urb->type, urb->status, urb->actual_length);
+	/* user_data carries the USB/IP seqNum, see usbipfunctions.c */
+	USBIP_PROBE(urb_reap, (intptr_t)transfer->user_data, hpriv->fd, transfer->endpoint,
+		    urb->actual_length, urb->status);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
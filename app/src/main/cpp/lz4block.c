@@ -0,0 +1,174 @@
+#include <string.h>
+
+#include "lz4block.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_LOG 12
+#define LZ4_MAX_OFFSET 65535
+// The format wants the last 5 bytes as literals and no match starting in the last 12
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+// Misses before the search starts skipping ahead, so incompressible data is cheap
+#define LZ4_SKIP_TRIGGER 6
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Extra length bytes after a nibble of 15
+static inline uint8_t *put_length(uint8_t *op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+int lz4_compress_block(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity) {
+    // Positions of the last occurrence of each 4-byte hash; stale or colliding entries
+    // are harmless, every candidate is compared before use.
+    uint32_t table[1 << LZ4_HASH_LOG];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *const iend = src + srcLen;
+    const uint8_t *const mflimit = iend - LZ4_MF_LIMIT;
+    const uint8_t *const matchlimit = iend - LZ4_LAST_LITERALS;
+    uint8_t *op = dst;
+    uint8_t *const oend = dst + dstCapacity;
+
+    if (srcLen < 0 || dstCapacity <= 0) return 0;
+
+    if (srcLen > LZ4_MF_LIMIT) {
+        memset(table, 0, sizeof(table));
+        unsigned int searches = 1u << LZ4_SKIP_TRIGGER;
+        ip++;
+        while (ip < mflimit) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash4(sequence);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != sequence) {
+                ip += searches++ >> LZ4_SKIP_TRIGGER;
+                continue;
+            }
+            searches = 1u << LZ4_SKIP_TRIGGER;
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *end = ip + LZ4_MIN_MATCH;
+            const uint8_t *refEnd = ref + LZ4_MIN_MATCH;
+            while (end < matchlimit && *end == *refEnd) {
+                end++;
+                refEnd++;
+            }
+
+            int literals = (int)(ip - anchor);
+            int matchLen = (int)(end - ip) - LZ4_MIN_MATCH;
+            if (oend - op < 1 + literals + literals / 255 + 1 + 2 + matchLen / 255 + 1) return 0;
+
+            uint8_t *token = op++;
+            if (literals >= 15) {
+                *token = 15 << 4;
+                op = put_length(op, literals - 15);
+            } else {
+                *token = (uint8_t)(literals << 4);
+            }
+            memcpy(op, anchor, (size_t)literals);
+            op += literals;
+
+            uint32_t offset = (uint32_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+
+            if (matchLen >= 15) {
+                *token |= 15;
+                op = put_length(op, matchLen - 15);
+            } else {
+                *token |= (uint8_t)matchLen;
+            }
+
+            ip = end;
+            anchor = ip;
+            // Index a position inside the match too, helps runs of short repeats
+            if (ip < mflimit) table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    int literals = (int)(iend - anchor);
+    if (oend - op < 1 + literals + literals / 255 + 1) return 0;
+    if (literals >= 15) {
+        *op++ = 15 << 4;
+        op = put_length(op, literals - 15);
+    } else {
+        *op++ = (uint8_t)(literals << 4);
+    }
+    memcpy(op, anchor, (size_t)literals);
+    op += literals;
+    return (int)(op - dst);
+}
+
+// Adds the extra length bytes to len; returns -1 when the input ends first
+static inline int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress_block(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity) {
+    const uint8_t *ip = src;
+    const uint8_t *const iend = src + srcLen;
+    uint8_t *op = dst;
+    uint8_t *const oend = dst + dstCapacity;
+
+    if (srcLen <= 0 || dstCapacity < 0) return -1;
+
+    for (;;) {
+        unsigned int token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && get_length(&ip, iend, &literals) < 0) return -1;
+        if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        // The last sequence is literals only
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && get_length(&ip, iend, &matchLen) < 0) return -1;
+        matchLen += LZ4_MIN_MATCH;
+        if (matchLen > (size_t)(oend - op)) return -1;
+
+        const uint8_t *match = op - offset;
+        if (offset >= matchLen) {
+            memcpy(op, match, matchLen);
+            op += matchLen;
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            while (matchLen--) *op++ = *match++;
+        }
+
+        if (ip >= iend) return -1;
+    }
+    return (int)(op - dst);
+}
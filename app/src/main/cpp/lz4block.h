@@ -0,0 +1,20 @@
+#ifndef USBIP_LZ4BLOCK_H
+#define USBIP_LZ4BLOCK_H
+
+#include <stdint.h>
+
+// LZ4 block format (no frame, no checksum) for the compressed tunnel framing: a fast
+// greedy single-pass compressor and a bounds-checked decompressor. Output is readable
+// by any LZ4 block decoder, e.g. LZ4_decompress_safe().
+
+// Worst case compressed size of len bytes of incompressible input.
+#define LZ4_BLOCK_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Returns the compressed size, or 0 if it would not fit in dstCapacity. Callers that
+// only want a win pass a capacity below srcLen.
+int lz4_compress_block(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity);
+
+// Returns the decompressed size, or -1 if src is malformed or would overrun dst.
+int lz4_decompress_block(const uint8_t *src, int srcLen, uint8_t *dst, int dstCapacity);
+
+#endif // USBIP_LZ4BLOCK_H
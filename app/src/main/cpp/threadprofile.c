@@ -0,0 +1,53 @@
+#define _GNU_SOURCE // cpu_set_t
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <android/log.h>
+#include "threadprofile.h"
+
+#define APPNAME "UsbIpServerNativeLibusb"
+
+int thread_profile_apply(const struct ThreadProfile *profile, pid_t tid) {
+    int failed = 0;
+    int fifo = 0;
+
+    if (profile->fifoPriority > 0) {
+        struct sched_param param = { .sched_priority = profile->fifoPriority };
+        if (sched_setscheduler(tid, SCHED_FIFO, &param) == 0) {
+            fifo = 1;
+        } else {
+            __android_log_print(ANDROID_LOG_WARN, APPNAME, "SCHED_FIFO %d refused for thread %d: %s",
+                                profile->fifoPriority, (int)tid, strerror(errno));
+            failed |= THREAD_PROFILE_FIFO_REFUSED;
+        }
+    }
+
+    // A nice value means nothing to a SCHED_FIFO thread
+    if (!fifo && profile->nice != 0 && setpriority(PRIO_PROCESS, (id_t)tid, profile->nice) != 0) {
+        __android_log_print(ANDROID_LOG_WARN, APPNAME, "Nice %d refused for thread %d: %s",
+                            profile->nice, (int)tid, strerror(errno));
+        failed |= THREAD_PROFILE_NICE_REFUSED;
+    }
+
+    if (profile->cpuMask != 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++) {
+            if (profile->cpuMask & ((uint64_t)1 << cpu)) CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(tid, sizeof(set), &set) != 0) {
+            __android_log_print(ANDROID_LOG_WARN, APPNAME, "CPU mask 0x%llx refused for thread %d: %s",
+                                (unsigned long long)profile->cpuMask, (int)tid, strerror(errno));
+            failed |= THREAD_PROFILE_AFFINITY_REFUSED;
+        }
+    }
+    return failed;
+}
+
+pid_t thread_profile_current_tid(void) {
+    return (pid_t)syscall(SYS_gettid);
+}
@@ -0,0 +1,24 @@
+#ifndef USBIP_THREADPROFILE_H
+#define USBIP_THREADPROFILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Scheduling for threads that sit on the completion path. SCHED_FIFO is refused to
+// ordinary apps on most devices, so a nice value is applied instead when it is.
+struct ThreadProfile {
+    int nice;         // -20..19, applied when fifoPriority is 0 or SCHED_FIFO is refused
+    int fifoPriority; // 1..99 asks for SCHED_FIFO, 0 leaves the policy alone
+    uint64_t cpuMask; // Bit n allows CPU n, 0 leaves the affinity alone
+};
+
+// Bits of the thread_profile_apply() result, matching UsbLib.kt
+#define THREAD_PROFILE_FIFO_REFUSED 0x1
+#define THREAD_PROFILE_NICE_REFUSED 0x2
+#define THREAD_PROFILE_AFFINITY_REFUSED 0x4
+
+// Applies what it can of profile to thread tid and returns the parts that failed.
+int thread_profile_apply(const struct ThreadProfile *profile, pid_t tid);
+pid_t thread_profile_current_tid(void);
+
+#endif // USBIP_THREADPROFILE_H
@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <android/log.h>
+#include "usbcapture.h"
+
+#define APPNAME "UsbIpServerNativeLibusb"
+
+// Binary usbmon record header, as read from /dev/usbmonN with MON_IOCX_MFETCH.
+// Host byte order, 64 bytes.
+struct UsbmonPacket {
+    uint64_t id;
+    uint8_t type;
+    uint8_t xferType;
+    uint8_t epnum;
+    uint8_t devnum;
+    uint16_t busnum;
+    char flagSetup;
+    char flagData;
+    int64_t tsSec;
+    int32_t tsUsec;
+    int32_t status;
+    uint32_t length;
+    uint32_t lenCap;
+    union {
+        uint8_t setup[8];
+        struct {
+            int32_t errorCount;
+            int32_t numDesc;
+        } iso;
+    } s;
+    int32_t interval;
+    int32_t startFrame;
+    uint32_t xferFlags;
+    uint32_t ndesc;
+};
+_Static_assert(sizeof(struct UsbmonPacket) == 64, "usbmon header must be 64 bytes");
+
+struct UsbmonIsoDesc {
+    int32_t status;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t pad;
+};
+
+#define USBMON_XFER_ISO 0
+#define USBMON_XFER_INTR 1
+#define USBMON_XFER_CONTROL 2
+#define USBMON_XFER_BULK 3
+
+// Bounded MPMC queue after Dmitry Vyukov: each cell's sequence number says whether it
+// is free for the producer at that position or holds data for the consumer.
+struct CaptureCell {
+    _Atomic size_t sequence;
+    uint32_t length;     // Bytes in data
+    uint32_t origLength; // What the record would be without truncation
+    unsigned char data[USB_CAPTURE_CELL_BYTES];
+};
+
+struct UsbCapture {
+    pthread_mutex_t control; // Serialises start/stop
+    _Atomic int enabled;
+    _Atomic int writers; // Producers currently between their enabled check and publish
+    _Atomic int running;
+    struct CaptureCell *cells;
+    _Atomic size_t enqueuePos;
+    size_t dequeuePos; // Writer thread only
+    uint32_t snaplen;
+    FILE *file;
+    pthread_t thread;
+
+    _Atomic uint64_t captured;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t bytesWritten;
+};
+
+static struct UsbCapture g_capture = { .control = PTHREAD_MUTEX_INITIALIZER };
+
+static int transfer_status_to_errno(enum libusb_transfer_status status) {
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED: return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT: return -ETIMEDOUT;
+        case LIBUSB_TRANSFER_CANCELLED: return -ENOENT;
+        case LIBUSB_TRANSFER_STALL: return -EPIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE: return -ENODEV;
+        case LIBUSB_TRANSFER_OVERFLOW: return -EOVERFLOW;
+        default: return -EPROTO;
+    }
+}
+
+static uint8_t usbmon_xfer_type(uint8_t libusb_type) {
+    switch (libusb_type) {
+        case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS: return USBMON_XFER_ISO;
+        case LIBUSB_TRANSFER_TYPE_INTERRUPT: return USBMON_XFER_INTR;
+        case LIBUSB_TRANSFER_TYPE_CONTROL: return USBMON_XFER_CONTROL;
+        default: return USBMON_XFER_BULK;
+    }
+}
+
+static struct CaptureCell *ring_claim(size_t *out_pos) {
+    const size_t mask = USB_CAPTURE_RING_CELLS - 1;
+    size_t pos = atomic_load_explicit(&g_capture.enqueuePos, memory_order_relaxed);
+    for (;;) {
+        struct CaptureCell *cell = &g_capture.cells[pos & mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&g_capture.enqueuePos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *out_pos = pos;
+                return cell;
+            }
+        } else if (diff < 0) {
+            return NULL; // Full, the writer thread is behind
+        } else {
+            pos = atomic_load_explicit(&g_capture.enqueuePos, memory_order_relaxed);
+        }
+    }
+}
+
+static void ring_publish(struct CaptureCell *cell, size_t pos) {
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+}
+
+static struct CaptureCell *ring_peek(void) {
+    struct CaptureCell *cell = &g_capture.cells[g_capture.dequeuePos & (USB_CAPTURE_RING_CELLS - 1)];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    return seq == g_capture.dequeuePos + 1 ? cell : NULL;
+}
+
+static void ring_release(struct CaptureCell *cell) {
+    atomic_store_explicit(&cell->sequence, g_capture.dequeuePos + USB_CAPTURE_RING_CELLS, memory_order_release);
+    g_capture.dequeuePos++;
+}
+
+static void capture_event(const struct libusb_transfer *transfer, uint64_t id, char type, int status) {
+    if (!atomic_load_explicit(&g_capture.enabled, memory_order_relaxed)) return;
+
+    // Pairs with the store/load in usb_capture_stop() so the ring can't be freed under us
+    atomic_fetch_add(&g_capture.writers, 1);
+    if (!atomic_load(&g_capture.enabled)) {
+        atomic_fetch_sub(&g_capture.writers, 1);
+        return;
+    }
+
+    size_t pos;
+    struct CaptureCell *cell = ring_claim(&pos);
+    if (cell == NULL) {
+        atomic_fetch_add_explicit(&g_capture.dropped, 1, memory_order_relaxed);
+        atomic_fetch_sub(&g_capture.writers, 1);
+        return;
+    }
+
+    struct UsbmonPacket *hdr = (struct UsbmonPacket *)cell->data;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(hdr, 0, sizeof(*hdr));
+
+    libusb_device *dev = transfer->dev_handle ? libusb_get_device(transfer->dev_handle) : NULL;
+    int is_in = (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+    int is_control = transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL;
+    int is_iso = transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+
+    hdr->id = id;
+    hdr->type = (uint8_t)type;
+    hdr->xferType = usbmon_xfer_type(transfer->type);
+    hdr->devnum = dev ? libusb_get_device_address(dev) : 0;
+    hdr->busnum = dev ? libusb_get_bus_number(dev) : 0;
+    hdr->tsSec = ts.tv_sec;
+    hdr->tsUsec = (int32_t)(ts.tv_nsec / 1000);
+    hdr->status = status;
+
+    const unsigned char *payload = transfer->buffer;
+    int requested = transfer->length;
+    if (is_control && transfer->length >= (int)LIBUSB_CONTROL_SETUP_SIZE) {
+        memcpy(hdr->s.setup, transfer->buffer, LIBUSB_CONTROL_SETUP_SIZE);
+        payload += LIBUSB_CONTROL_SETUP_SIZE;
+        requested -= LIBUSB_CONTROL_SETUP_SIZE;
+        is_in = (transfer->buffer[0] & LIBUSB_ENDPOINT_IN) != 0;
+    }
+    hdr->epnum = (uint8_t)(transfer->endpoint | (is_in ? LIBUSB_ENDPOINT_IN : 0));
+    hdr->flagSetup = (is_control && type == 'S') ? 0 : '-';
+
+    // Data goes out with the submission and comes back with the completion
+    int data_len = 0;
+    if (type == 'S' && !is_in) {
+        data_len = requested;
+    } else if (type == 'C' && is_in) {
+        data_len = is_iso ? requested : transfer->actual_length;
+    }
+    hdr->length = (uint32_t)(type == 'C' && !is_iso ? transfer->actual_length : requested);
+
+    size_t used = sizeof(*hdr);
+    size_t orig = used + (data_len > 0 ? (size_t)data_len : 0);
+    if (is_iso) {
+        size_t room = (USB_CAPTURE_CELL_BYTES - used) / sizeof(struct UsbmonIsoDesc);
+        int ndesc = transfer->num_iso_packets < (int)room ? transfer->num_iso_packets : (int)room;
+        struct UsbmonIsoDesc *desc = (struct UsbmonIsoDesc *)(cell->data + used);
+        uint32_t offset = 0;
+        int errors = 0;
+        for (int i = 0; i < transfer->num_iso_packets; i++) {
+            const struct libusb_iso_packet_descriptor *p = &transfer->iso_packet_desc[i];
+            int pkt_status = type == 'C' ? transfer_status_to_errno(p->status) : -EXDEV;
+            if (type == 'C' && pkt_status != 0) errors++;
+            if (i < ndesc) {
+                desc[i].status = pkt_status;
+                desc[i].offset = offset;
+                desc[i].length = type == 'C' ? p->actual_length : p->length;
+                desc[i].pad = 0;
+            }
+            offset += p->length;
+        }
+        hdr->s.iso.errorCount = errors;
+        hdr->s.iso.numDesc = transfer->num_iso_packets;
+        hdr->ndesc = (uint32_t)ndesc;
+        used += (size_t)ndesc * sizeof(struct UsbmonIsoDesc);
+        orig += (size_t)transfer->num_iso_packets * sizeof(struct UsbmonIsoDesc);
+    }
+
+    if (data_len > 0) {
+        size_t cap = data_len < (int)g_capture.snaplen ? (size_t)data_len : g_capture.snaplen;
+        if (cap > USB_CAPTURE_CELL_BYTES - used) cap = USB_CAPTURE_CELL_BYTES - used;
+        memcpy(cell->data + used, payload, cap);
+        used += cap;
+        hdr->lenCap = (uint32_t)cap;
+        hdr->flagData = 0;
+    } else {
+        hdr->flagData = is_in ? '<' : '>';
+    }
+
+    cell->length = (uint32_t)used;
+    cell->origLength = (uint32_t)orig;
+    ring_publish(cell, pos);
+    atomic_fetch_add_explicit(&g_capture.captured, 1, memory_order_relaxed);
+    atomic_fetch_sub(&g_capture.writers, 1);
+}
+
+void usb_capture_submit(const struct libusb_transfer *transfer, uint64_t id) {
+    capture_event(transfer, id, 'S', -EINPROGRESS);
+}
+
+void usb_capture_complete(const struct libusb_transfer *transfer, uint64_t id) {
+    capture_event(transfer, id, 'C', transfer_status_to_errno(transfer->status));
+}
+
+void usb_capture_error(const struct libusb_transfer *transfer, uint64_t id, int status) {
+    capture_event(transfer, id, 'E', status);
+}
+
+struct PcapRecordHeader {
+    uint32_t tsSec;
+    uint32_t tsUsec;
+    uint32_t inclLen;
+    uint32_t origLen;
+};
+
+static int write_cell(struct CaptureCell *cell) {
+    const struct UsbmonPacket *hdr = (const struct UsbmonPacket *)cell->data;
+    struct PcapRecordHeader rec = {
+            .tsSec = (uint32_t)hdr->tsSec,
+            .tsUsec = (uint32_t)hdr->tsUsec,
+            .inclLen = cell->length,
+            .origLen = cell->origLength
+    };
+    if (fwrite(&rec, sizeof(rec), 1, g_capture.file) != 1) return -1;
+    if (fwrite(cell->data, cell->length, 1, g_capture.file) != 1) return -1;
+    atomic_fetch_add_explicit(&g_capture.bytesWritten, sizeof(rec) + cell->length, memory_order_relaxed);
+    return 0;
+}
+
+static void *capture_thread_func(void *arg) {
+    const struct timespec idle = { 0, USB_CAPTURE_FLUSH_INTERVAL_MS * 1000000L };
+    int failed = 0;
+
+    for (;;) {
+        struct CaptureCell *cell = ring_peek();
+        if (cell != NULL) {
+            if (!failed && write_cell(cell) < 0) {
+                __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Capture write failed: %s", strerror(errno));
+                failed = 1; // Keep draining so producers don't see a full ring forever
+            }
+            ring_release(cell);
+            continue;
+        }
+        if (!atomic_load(&g_capture.running)) break;
+        fflush(g_capture.file);
+        nanosleep(&idle, NULL);
+    }
+    fflush(g_capture.file);
+    return NULL;
+}
+
+struct PcapFileHeader {
+    uint32_t magic;
+    uint16_t versionMajor;
+    uint16_t versionMinor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+int usb_capture_start(const char *path, uint32_t snaplen) {
+    int result = 0;
+
+    pthread_mutex_lock(&g_capture.control);
+    if (atomic_load(&g_capture.running)) {
+        pthread_mutex_unlock(&g_capture.control);
+        return -EALREADY;
+    }
+
+    struct CaptureCell *cells = calloc(USB_CAPTURE_RING_CELLS, sizeof(struct CaptureCell));
+    FILE *file = cells ? fopen(path, "wb") : NULL;
+    if (file == NULL) {
+        result = cells ? -errno : -ENOMEM;
+        __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Unable to start capture to %s: %s", path, strerror(-result));
+        free(cells);
+        pthread_mutex_unlock(&g_capture.control);
+        return result;
+    }
+
+    struct PcapFileHeader fh = {
+            .magic = 0xa1b2c3d4,
+            .versionMajor = 2,
+            .versionMinor = 4,
+            .snaplen = USB_CAPTURE_CELL_BYTES,
+            .linktype = USB_CAPTURE_LINKTYPE
+    };
+    fwrite(&fh, sizeof(fh), 1, file);
+
+    for (size_t i = 0; i < USB_CAPTURE_RING_CELLS; i++) {
+        atomic_init(&cells[i].sequence, i);
+    }
+    g_capture.cells = cells;
+    g_capture.file = file;
+    g_capture.snaplen = snaplen == 0 ? USB_CAPTURE_DEFAULT_SNAPLEN : snaplen;
+    g_capture.dequeuePos = 0;
+    atomic_store(&g_capture.enqueuePos, 0);
+    atomic_store(&g_capture.captured, 0);
+    atomic_store(&g_capture.dropped, 0);
+    atomic_store(&g_capture.bytesWritten, sizeof(fh));
+    atomic_store(&g_capture.running, 1);
+
+    if (pthread_create(&g_capture.thread, NULL, capture_thread_func, NULL) != 0) {
+        atomic_store(&g_capture.running, 0);
+        fclose(file);
+        free(cells);
+        g_capture.cells = NULL;
+        g_capture.file = NULL;
+        pthread_mutex_unlock(&g_capture.control);
+        return -EAGAIN;
+    }
+    atomic_store(&g_capture.enabled, 1);
+    pthread_mutex_unlock(&g_capture.control);
+
+    __android_log_print(ANDROID_LOG_INFO, APPNAME, "Capturing URBs to %s (snaplen %u)", path, g_capture.snaplen);
+    return result;
+}
+
+void usb_capture_stop(void) {
+    pthread_mutex_lock(&g_capture.control);
+    if (!atomic_load(&g_capture.running)) {
+        pthread_mutex_unlock(&g_capture.control);
+        return;
+    }
+
+    atomic_store(&g_capture.enabled, 0);
+    while (atomic_load(&g_capture.writers) > 0) {
+        sched_yield();
+    }
+    atomic_store(&g_capture.running, 0);
+    pthread_join(g_capture.thread, NULL);
+
+    fclose(g_capture.file);
+    free(g_capture.cells);
+    g_capture.file = NULL;
+    g_capture.cells = NULL;
+    pthread_mutex_unlock(&g_capture.control);
+
+    __android_log_print(ANDROID_LOG_INFO, APPNAME, "Capture stopped: %llu events, %llu dropped",
+                        (unsigned long long)atomic_load(&g_capture.captured),
+                        (unsigned long long)atomic_load(&g_capture.dropped));
+}
+
+void usb_capture_stats(int64_t out[USB_CAPTURE_STAT_COUNT]) {
+    out[USB_CAPTURE_STAT_ACTIVE] = atomic_load(&g_capture.enabled);
+    out[USB_CAPTURE_STAT_CAPTURED] = (int64_t)atomic_load(&g_capture.captured);
+    out[USB_CAPTURE_STAT_DROPPED] = (int64_t)atomic_load(&g_capture.dropped);
+    out[USB_CAPTURE_STAT_BYTES_WRITTEN] = (int64_t)atomic_load(&g_capture.bytesWritten);
+}
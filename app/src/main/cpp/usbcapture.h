@@ -0,0 +1,41 @@
+#ifndef USBIP_USBCAPTURE_H
+#define USBIP_USBCAPTURE_H
+
+#include <stdint.h>
+
+#include "libusb_src/libusb/libusb.h"
+
+// Optional capture of the URBs we put on the bus, written as a pcap file with the
+// usbmon link type (DLT_USB_LINUX_MMAPPED) so Wireshark can open it directly.
+//
+// The transfer path only copies the event into a preallocated lock-free ring; a
+// background thread does all the file I/O. While capture is off the hooks cost one
+// atomic load.
+#define USB_CAPTURE_LINKTYPE 220 // LINKTYPE_USB_LINUX_MMAPPED
+#define USB_CAPTURE_RING_CELLS 1024 // Power of two
+#define USB_CAPTURE_CELL_BYTES 2048 // usbmon header + ISO descriptors + payload
+#define USB_CAPTURE_DEFAULT_SNAPLEN 256
+#define USB_CAPTURE_FLUSH_INTERVAL_MS 5
+
+// Order matches UsbLib.getCaptureStats() on the Kotlin side.
+enum UsbCaptureStat {
+    USB_CAPTURE_STAT_ACTIVE,
+    USB_CAPTURE_STAT_CAPTURED,
+    USB_CAPTURE_STAT_DROPPED,
+    USB_CAPTURE_STAT_BYTES_WRITTEN,
+    USB_CAPTURE_STAT_COUNT
+};
+
+// snaplen caps the payload bytes kept per event; 0 picks the default.
+int usb_capture_start(const char *path, uint32_t snaplen);
+void usb_capture_stop(void);
+
+// 'S' when a transfer is handed to libusb, 'C' when it completes, 'E' when the
+// submission itself failed.
+void usb_capture_submit(const struct libusb_transfer *transfer, uint64_t id);
+void usb_capture_complete(const struct libusb_transfer *transfer, uint64_t id);
+void usb_capture_error(const struct libusb_transfer *transfer, uint64_t id, int status);
+
+void usb_capture_stats(int64_t out[USB_CAPTURE_STAT_COUNT]);
+
+#endif // USBIP_USBCAPTURE_H
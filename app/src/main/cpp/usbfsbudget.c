@@ -0,0 +1,161 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <android/log.h>
+#include "usbfsbudget.h"
+
+#define APPNAME "UsbIpServerNativeLibusb"
+#define USBFS_MEMORY_MB_PATH "/sys/module/usbcore/parameters/usbfs_memory_mb"
+
+struct UsbfsBudget {
+    pthread_mutex_t mutex;
+    size_t limit;           // Effective budget, shrinks when the kernel says no
+    size_t configuredLimit; // What usbfs_memory_mb says (or the kernel default)
+    size_t inFlight;
+    size_t peakInFlight;
+    size_t devInFlight[USBFS_BUDGET_MAX_DEVICES];
+    int devWaiting[USBFS_BUDGET_MAX_DEVICES];
+    unsigned int completionsSinceShrink;
+    uint64_t deferred;
+    uint64_t noMemEvents;
+};
+
+static struct UsbfsBudget g_budget = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t read_configured_limit(void) {
+    size_t limit = (size_t)USBFS_BUDGET_DEFAULT_MB * 1024 * 1024;
+    FILE *f = fopen(USBFS_MEMORY_MB_PATH, "r");
+    if (f == NULL) return limit; // Not readable from an app sandbox on most devices
+
+    unsigned long mb = 0;
+    if (fscanf(f, "%lu", &mb) == 1) {
+        limit = mb == 0 ? SIZE_MAX : (size_t)mb * 1024 * 1024; // 0 disables the kernel limit
+    }
+    fclose(f);
+    return limit;
+}
+
+void usbfs_budget_init(void) {
+    pthread_mutex_lock(&g_budget.mutex);
+    g_budget.configuredLimit = read_configured_limit();
+    g_budget.limit = g_budget.configuredLimit;
+    g_budget.inFlight = 0;
+    g_budget.peakInFlight = 0;
+    memset(g_budget.devInFlight, 0, sizeof(g_budget.devInFlight));
+    memset(g_budget.devWaiting, 0, sizeof(g_budget.devWaiting));
+    g_budget.completionsSinceShrink = 0;
+    g_budget.deferred = 0;
+    g_budget.noMemEvents = 0;
+    pthread_mutex_unlock(&g_budget.mutex);
+
+    __android_log_print(ANDROID_LOG_INFO, APPNAME, "usbfs budget: %zu bytes", g_budget.configuredLimit);
+}
+
+// A device may always go up to its fair share. Beyond that it may only borrow budget
+// nobody else is waiting for. A refused device is marked waiting under the same lock, so
+// a completion that returns budget right after the refusal still sees it and drains.
+int usbfs_budget_try_reserve(int dev, size_t bytes) {
+    int admitted = 0;
+
+    pthread_mutex_lock(&g_budget.mutex);
+    if (g_budget.inFlight == 0) {
+        admitted = 1; // Never hold back the only transfer, even an oversized one
+    } else if (g_budget.inFlight + bytes <= g_budget.limit) {
+        int activeDevices = 0;
+        int othersWaiting = 0;
+        for (int i = 0; i < USBFS_BUDGET_MAX_DEVICES; i++) {
+            if (i == dev || g_budget.devInFlight[i] > 0 || g_budget.devWaiting[i]) activeDevices++;
+            if (i != dev && g_budget.devWaiting[i]) othersWaiting = 1;
+        }
+        size_t fairShare = g_budget.limit / (size_t)activeDevices;
+        admitted = !othersWaiting || g_budget.devInFlight[dev] + bytes <= fairShare;
+    }
+
+    if (admitted) {
+        g_budget.inFlight += bytes;
+        g_budget.devInFlight[dev] += bytes;
+        if (g_budget.inFlight > g_budget.peakInFlight) g_budget.peakInFlight = g_budget.inFlight;
+    } else {
+        g_budget.deferred++;
+        g_budget.devWaiting[dev] = 1;
+    }
+    pthread_mutex_unlock(&g_budget.mutex);
+    return admitted;
+}
+
+void usbfs_budget_release(int dev, size_t bytes) {
+    pthread_mutex_lock(&g_budget.mutex);
+    g_budget.inFlight = g_budget.inFlight >= bytes ? g_budget.inFlight - bytes : 0;
+    g_budget.devInFlight[dev] = g_budget.devInFlight[dev] >= bytes ? g_budget.devInFlight[dev] - bytes : 0;
+
+    if (g_budget.limit < g_budget.configuredLimit &&
+            ++g_budget.completionsSinceShrink >= USBFS_BUDGET_RECOVERY_COMPLETIONS) {
+        size_t step = g_budget.configuredLimit / 16;
+        g_budget.limit = g_budget.configuredLimit - g_budget.limit > step ? g_budget.limit + step : g_budget.configuredLimit;
+        g_budget.completionsSinceShrink = 0;
+    }
+    pthread_mutex_unlock(&g_budget.mutex);
+}
+
+// Returns 1 if the caller should hold the transfer and retry once something completes,
+// marking dev waiting as a refused reservation does, 0 if nothing of ours is in flight
+// and waiting would never end.
+int usbfs_budget_on_no_mem(int dev) {
+    int retry;
+    size_t limit;
+
+    pthread_mutex_lock(&g_budget.mutex);
+    g_budget.noMemEvents++;
+    retry = g_budget.inFlight > 0;
+    if (retry) {
+        // The kernel also counts other users and per-URB overhead, so what we had in
+        // flight when it refused is the best estimate of what we can actually use.
+        g_budget.limit = g_budget.inFlight > USBFS_BUDGET_MIN_BYTES ? g_budget.inFlight : USBFS_BUDGET_MIN_BYTES;
+        g_budget.completionsSinceShrink = 0;
+        g_budget.devWaiting[dev] = 1;
+    }
+    limit = g_budget.limit;
+    pthread_mutex_unlock(&g_budget.mutex);
+
+    if (retry) {
+        __android_log_print(ANDROID_LOG_WARN, APPNAME, "usbfs out of memory, budget lowered to %zu bytes", limit);
+    }
+    return retry;
+}
+
+void usbfs_budget_set_waiting(int dev, int waiting) {
+    pthread_mutex_lock(&g_budget.mutex);
+    g_budget.devWaiting[dev] = waiting;
+    pthread_mutex_unlock(&g_budget.mutex);
+}
+
+int usbfs_budget_has_waiters(void) {
+    int waiting = 0;
+    pthread_mutex_lock(&g_budget.mutex);
+    for (int i = 0; i < USBFS_BUDGET_MAX_DEVICES && !waiting; i++) {
+        waiting = g_budget.devWaiting[i];
+    }
+    pthread_mutex_unlock(&g_budget.mutex);
+    return waiting;
+}
+
+void usbfs_budget_reset_device(int dev) {
+    pthread_mutex_lock(&g_budget.mutex);
+    size_t devBytes = g_budget.devInFlight[dev];
+    g_budget.inFlight = g_budget.inFlight >= devBytes ? g_budget.inFlight - devBytes : 0;
+    g_budget.devInFlight[dev] = 0;
+    g_budget.devWaiting[dev] = 0;
+    pthread_mutex_unlock(&g_budget.mutex);
+}
+
+void usbfs_budget_stats(int64_t out[USBFS_STAT_COUNT]) {
+    pthread_mutex_lock(&g_budget.mutex);
+    out[USBFS_STAT_LIMIT_BYTES] = g_budget.limit == SIZE_MAX ? -1 : (int64_t)g_budget.limit;
+    out[USBFS_STAT_CONFIGURED_BYTES] = g_budget.configuredLimit == SIZE_MAX ? -1 : (int64_t)g_budget.configuredLimit;
+    out[USBFS_STAT_IN_FLIGHT_BYTES] = (int64_t)g_budget.inFlight;
+    out[USBFS_STAT_PEAK_IN_FLIGHT_BYTES] = (int64_t)g_budget.peakInFlight;
+    out[USBFS_STAT_DEFERRED] = (int64_t)g_budget.deferred;
+    out[USBFS_STAT_NO_MEM_EVENTS] = (int64_t)g_budget.noMemEvents;
+    pthread_mutex_unlock(&g_budget.mutex);
+}
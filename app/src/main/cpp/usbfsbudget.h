@@ -0,0 +1,39 @@
+#ifndef USBIP_USBFSBUDGET_H
+#define USBIP_USBFSBUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// usbfs caps the memory of all submitted URBs system-wide (usbcore.usbfs_memory_mb).
+// This tracks what we have in flight against that cap so excess submissions can wait
+// for completions instead of failing with LIBUSB_ERROR_NO_MEM.
+#define USBFS_BUDGET_MAX_DEVICES 16
+#define USBFS_BUDGET_DEFAULT_MB 16
+#define USBFS_BUDGET_MIN_BYTES (1024 * 1024)
+// Completions without an ENOMEM before a shrunk budget grows back by 1/16th.
+#define USBFS_BUDGET_RECOVERY_COMPLETIONS 64
+
+// Order matches UsbLib.getUsbfsBudgetStats() on the Kotlin side.
+enum UsbfsBudgetStat {
+    USBFS_STAT_LIMIT_BYTES,
+    USBFS_STAT_CONFIGURED_BYTES,
+    USBFS_STAT_IN_FLIGHT_BYTES,
+    USBFS_STAT_PEAK_IN_FLIGHT_BYTES,
+    USBFS_STAT_DEFERRED,
+    USBFS_STAT_NO_MEM_EVENTS,
+    USBFS_STAT_COUNT
+};
+
+void usbfs_budget_init(void);
+
+int usbfs_budget_try_reserve(int dev, size_t bytes);
+void usbfs_budget_release(int dev, size_t bytes);
+int usbfs_budget_on_no_mem(int dev);
+
+void usbfs_budget_set_waiting(int dev, int waiting);
+int usbfs_budget_has_waiters(void);
+void usbfs_budget_reset_device(int dev);
+
+void usbfs_budget_stats(int64_t out[USBFS_STAT_COUNT]);
+
+#endif // USBIP_USBFSBUDGET_H
@@ -1,24 +1,58 @@
 #include <stdlib.h>
 #include <jni.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <time.h>
 
 #include <errno.h>
 #include <android/log.h>
 #include "libusb_src/libusb/libusb.h"
+#include "bufferpool.h"
+#include "usbfsbudget.h"
+#include "usbipmetrics.h"
+#include "usbcapture.h"
+#include "usbipprobes.h"
+#include "lz4block.h"
+#include "threadprofile.h"
 
 #define APPNAME "UsbIpServerNativeLibusb"
 #define MAX_ASYNC_TRANSFERS_PER_DEVICE 32
 #define MAX_ATTACHED_DEVICES 16
+// How long closing a device waits for its cancelled transfers to be reaped
+#define CLOSE_DRAIN_TIMEOUT_MS 500
+#define EXIT_DRAIN_TIMEOUT_MS 5000
+
+_Static_assert(MAX_ATTACHED_DEVICES <= USBFS_BUDGET_MAX_DEVICES, "usbfs budget tracks too few devices");
+_Static_assert(MAX_ATTACHED_DEVICES <= METRICS_MAX_DEVICES, "metrics track too few devices");
 
 struct ActiveTransfer {
     int seqNum;
     struct libusb_transfer* transfer;
+    int admitted; // Counted against the usbfs budget
+    int deferred; // Waiting in deferredQueue for budget
+    uint64_t rxNs; // When the request came off the socket
+    uint64_t submitNs; // When it was handed to libusb, 0 while deferred
 };
 struct AttachedDeviceHandle {
     int fd;
     libusb_device_handle* handle;
     pthread_mutex_t transferMutex;
+    // Signalled when inFlight, the number of occupied activeTransfers slots, drops to 0
+    pthread_cond_t drained;
+    int inFlight;
+    // Set once libusb reports the device gone; submissions are refused from then on
+    atomic_int dead;
     struct ActiveTransfer activeTransfers[MAX_ASYNC_TRANSFERS_PER_DEVICE];
+    // Slot indexes of deferred transfers in submission order, guarded by transferMutex
+    int deferredQueue[MAX_ASYNC_TRANSFERS_PER_DEVICE];
+    int deferredHead;
+    int deferredCount;
+    // Finished transfers kept for the next submits, each still allocated for the
+    // num_iso_packets it was last filled with. Guarded by transferMutex.
+    struct libusb_transfer* spareTransfers[MAX_ASYNC_TRANSFERS_PER_DEVICE];
+    int spareCount;
+    struct BufferCache buffers;
 };
 
 static libusb_context *g_ctx = NULL;
@@ -26,12 +60,60 @@ static pthread_mutex_t g_attachedDevicesMutex;
 static pthread_t g_eventThread;
 static jobject g_usbLibInstance = NULL;
 jmethodID g_onTransferCompletedMethodID = NULL;
+static jmethodID g_onDeviceDisconnectedMethodID = NULL;
 JavaVM* g_jvm = NULL;
 
 static volatile int g_keepEventThreadRunning = 0;
+// Scheduling profile of the event thread. Set from Kotlin before or after the thread
+// starts; a thread that starts later applies it itself.
+static pthread_mutex_t g_eventProfileMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ThreadProfile g_eventProfile;
+static int g_eventProfileSet = 0;
+static pid_t g_eventThreadTid = 0;
+static int g_eventProfileResult = -1; // -1 until applied
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+// Busy-poll mode: while a transfer was submitted or completed within idleMs, the event
+// thread polls with zero timeouts for up to spinUs before it blocks again. Off when
+// spinUs is 0.
+enum BusyPollStat {
+    BUSY_POLL_STAT_SPINS,     // Rounds of polling
+    BUSY_POLL_STAT_CAUGHT,    // Rounds that handled a completion before giving up
+    BUSY_POLL_STAT_SPIN_NS,   // Time spent polling
+    BUSY_POLL_STAT_COUNT
+};
+static struct {
+    atomic_uint spinUs;
+    atomic_uint idleMs;
+    atomic_uint_least64_t lastActivityNs;
+    atomic_uint_least64_t completions;
+    atomic_uint_least64_t stats[BUSY_POLL_STAT_COUNT];
+} g_busyPoll;
 static int open_devs = 0;
 static struct AttachedDeviceHandle g_attachedDevices[MAX_ATTACHED_DEVICES];
 
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct AttachedDeviceHandle* find_device_by_fd(int fd) {
+    struct AttachedDeviceHandle* dev = NULL;
+    pthread_mutex_lock(&g_attachedDevicesMutex);
+    for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
+        if (g_attachedDevices[i].fd == fd) {
+            dev = &g_attachedDevices[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_attachedDevicesMutex);
+    return dev;
+}
+
 static int libusb_to_errno(int libusb_err) {
     switch (libusb_err) {
         case LIBUSB_SUCCESS: return 0;
@@ -80,6 +162,12 @@ static const char * LIBUSB_CALL libusb_status_name(int libusb_status) {
     }
 }
 
+void LIBUSB_CALL generic_transfer_cb(struct libusb_transfer *transfer);
+static void flush_deferred_transfers(struct AttachedDeviceHandle* dev, enum libusb_transfer_status status);
+static void mark_device_dead(int dev_pos, libusb_device_handle* handle);
+static int wait_for_drain(struct AttachedDeviceHandle* dev, int timeout_ms);
+static void detach_device_slot(struct AttachedDeviceHandle* dev);
+
 JNIEXPORT jint JNICALL
 Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_init(JNIEnv *env, jobject thiz) {
     if (g_ctx != NULL) {
@@ -97,6 +185,15 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_init(JNIEnv *env, job
             return -1;
         }
     }
+    if (g_onDeviceDisconnectedMethodID == NULL) {
+        jclass clazz = (*env)->GetObjectClass(env, thiz);
+        g_onDeviceDisconnectedMethodID = (*env)->GetMethodID(env, clazz, "onDeviceDisconnected", "(I)V");
+
+        if (g_onDeviceDisconnectedMethodID == NULL) {
+            __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Fatal: Could not find onDeviceDisconnected method!");
+            return -1;
+        }
+    }
 
     libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
     int r = libusb_init_context(&g_ctx, NULL, 0);
@@ -107,16 +204,29 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_init(JNIEnv *env, job
     }
 
     pthread_mutex_init(&g_attachedDevicesMutex, NULL);
+    pthread_condattr_t drainedAttr;
+    pthread_condattr_init(&drainedAttr);
+    pthread_condattr_setclock(&drainedAttr, CLOCK_MONOTONIC);
     for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
         g_attachedDevices[i].fd = -1;
         g_attachedDevices[i].handle = NULL;
         pthread_mutex_init(&g_attachedDevices[i].transferMutex, NULL);
+        pthread_cond_init(&g_attachedDevices[i].drained, &drainedAttr);
+        g_attachedDevices[i].inFlight = 0;
+        buffer_cache_init(&g_attachedDevices[i].buffers);
 
         for(int j=0; j<MAX_ASYNC_TRANSFERS_PER_DEVICE; j++){
             g_attachedDevices[i].activeTransfers[j].seqNum = -1;
             g_attachedDevices[i].activeTransfers[j].transfer = NULL;
+            g_attachedDevices[i].activeTransfers[j].admitted = 0;
+            g_attachedDevices[i].activeTransfers[j].deferred = 0;
         }
+        g_attachedDevices[i].deferredHead = 0;
+        g_attachedDevices[i].deferredCount = 0;
+        g_attachedDevices[i].spareCount = 0;
     }
+    pthread_condattr_destroy(&drainedAttr);
+    usbfs_budget_init();
 
     if (g_usbLibInstance == NULL) {
         g_usbLibInstance = (*env)->NewGlobalRef(env, thiz);
@@ -126,10 +236,16 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_init(JNIEnv *env, job
     return 0;
 }
 
-JNIEXPORT void JNICALL
+// Returns how many transfers were still not reaped when it gave up waiting; libusb may
+// write into their buffers until the device is closed, so those must not be freed.
+JNIEXPORT jint JNICALL
 Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_exit(JNIEnv *env, jobject thiz) {
     __android_log_print(ANDROID_LOG_INFO, APPNAME, "Exit requested. Cancelling all active transfers...");
 
+    for(int i=0; i<MAX_ATTACHED_DEVICES; i++) {
+        flush_deferred_transfers(&g_attachedDevices[i], LIBUSB_TRANSFER_CANCELLED);
+    }
+
     pthread_mutex_lock(&g_attachedDevicesMutex);
     for(int i=0; i<MAX_ATTACHED_DEVICES; i++) {
         if (g_attachedDevices[i].fd != -1) {
@@ -144,33 +260,18 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_exit(JNIEnv *env, job
     }
     pthread_mutex_unlock(&g_attachedDevicesMutex);
 
-    int timeout_ms = 5000;
-    while (timeout_ms > 0) {
-        int active_count = 0;
-
-        pthread_mutex_lock(&g_attachedDevicesMutex);
-        for(int i=0; i<MAX_ATTACHED_DEVICES; i++) {
-            if (g_attachedDevices[i].fd != -1) {
-                pthread_mutex_lock(&g_attachedDevices[i].transferMutex);
-                for(int j=0; j<MAX_ASYNC_TRANSFERS_PER_DEVICE; j++) {
-                    if (g_attachedDevices[i].activeTransfers[j].transfer != NULL) active_count++;
-                }
-                pthread_mutex_unlock(&g_attachedDevices[i].transferMutex);
-            }
-        }
-        pthread_mutex_unlock(&g_attachedDevicesMutex);
-
-        if (active_count == 0) {
-            __android_log_print(ANDROID_LOG_INFO, APPNAME, "All active transfers reaped.");
-            break;
-        }
-
-        struct timeval tv = {0, 10000}; // Wait for up to 10ms for an event.
-        libusb_handle_events_timeout(g_ctx, &tv);
-        timeout_ms -= 10;
+    int64_t deadline = monotonic_ms() + EXIT_DRAIN_TIMEOUT_MS;
+    int remaining = 0;
+    for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
+        int64_t left = deadline - monotonic_ms();
+        pthread_mutex_lock(&g_attachedDevices[i].transferMutex);
+        remaining += wait_for_drain(&g_attachedDevices[i], left > 0 ? (int)left : 0);
+        pthread_mutex_unlock(&g_attachedDevices[i].transferMutex);
     }
-    if (timeout_ms <= 0) {
-        __android_log_print(ANDROID_LOG_WARN, APPNAME, "Exit timeout! Some transfers may not have been reaped.");
+    if (remaining == 0) {
+        __android_log_print(ANDROID_LOG_INFO, APPNAME, "All active transfers reaped.");
+    } else {
+        __android_log_print(ANDROID_LOG_WARN, APPNAME, "Exit timeout! %d transfers were not reaped.", remaining);
     }
 
     if (g_keepEventThreadRunning) {
@@ -184,16 +285,18 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_exit(JNIEnv *env, job
         pthread_join(g_eventThread, NULL);
         __android_log_print(ANDROID_LOG_INFO, APPNAME, "Background event thread stopped.");
     }
+    usb_capture_stop(); // No more completions can arrive, flush what was captured
 
     pthread_mutex_lock(&g_attachedDevicesMutex);
     for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
         if (g_attachedDevices[i].handle != NULL) {
             __android_log_print(ANDROID_LOG_WARN, APPNAME, "Force closing orphan device handle for fd %d", g_attachedDevices[i].fd);
             libusb_close(g_attachedDevices[i].handle);
-            g_attachedDevices[i].handle = NULL;
         }
-        g_attachedDevices[i].fd = -1;
+        detach_device_slot(&g_attachedDevices[i]);
+        buffer_cache_close(&g_attachedDevices[i].buffers);
         pthread_mutex_destroy(&g_attachedDevices[i].transferMutex);
+        pthread_cond_destroy(&g_attachedDevices[i].drained);
     }
     open_devs = 0;
     pthread_mutex_unlock(&g_attachedDevicesMutex);
@@ -210,6 +313,39 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_exit(JNIEnv *env, job
     }
 
     pthread_mutex_destroy(&g_attachedDevicesMutex);
+    return remaining;
+}
+
+static inline void busy_poll_note_activity(uint64_t now_ns) {
+    if (atomic_load_explicit(&g_busyPoll.spinUs, memory_order_relaxed) != 0) {
+        atomic_store_explicit(&g_busyPoll.lastActivityNs, now_ns, memory_order_relaxed);
+    }
+}
+
+// Returns 1 when the spin handled events (or failed, with the result in *r), 0 when the
+// caller should block as usual.
+static int busy_poll_spin(int *r) {
+    unsigned int spinUs = atomic_load_explicit(&g_busyPoll.spinUs, memory_order_relaxed);
+    if (spinUs == 0) return 0;
+    uint64_t start = metrics_now_ns();
+    uint64_t idleNs = (uint64_t)atomic_load_explicit(&g_busyPoll.idleMs, memory_order_relaxed) * 1000000;
+    if (start - atomic_load_explicit(&g_busyPoll.lastActivityNs, memory_order_relaxed) > idleNs) return 0;
+
+    uint64_t seen = atomic_load(&g_busyPoll.completions);
+    uint64_t now = start;
+    int caught = 0;
+    atomic_fetch_add_explicit(&g_busyPoll.stats[BUSY_POLL_STAT_SPINS], 1, memory_order_relaxed);
+    do {
+        struct timeval zero = {0, 0};
+        *r = libusb_handle_events_timeout(g_ctx, &zero);
+        now = metrics_now_ns();
+        if (*r < 0) break;
+        caught = atomic_load(&g_busyPoll.completions) != seen;
+    } while (!caught && now - start < (uint64_t)spinUs * 1000 && g_keepEventThreadRunning);
+
+    if (caught) atomic_fetch_add_explicit(&g_busyPoll.stats[BUSY_POLL_STAT_CAUGHT], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_busyPoll.stats[BUSY_POLL_STAT_SPIN_NS], now - start, memory_order_relaxed);
+    return caught || *r < 0;
 }
 
 void *event_thread_func(void *arg) {
@@ -226,15 +362,41 @@ void *event_thread_func(void *arg) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Failed to attach event thread to JVM");
     }
 
+    pthread_mutex_lock(&g_eventProfileMutex);
+    g_eventThreadTid = thread_profile_current_tid();
+    if (g_eventProfileSet) g_eventProfileResult = thread_profile_apply(&g_eventProfile, g_eventThreadTid);
+    pthread_mutex_unlock(&g_eventProfileMutex);
+
+    int64_t lastTrim = monotonic_ms();
     while (g_keepEventThreadRunning) {
-        struct timeval tv = {1, 0};
-        int r = libusb_handle_events_timeout(g_ctx, &tv);
+        int r = 0;
+        if (!busy_poll_spin(&r)) {
+            struct timeval tv = {1, 0};
+            r = libusb_handle_events_timeout(g_ctx, &tv);
+        }
         if (r < 0) {
             __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Event thread: libusb_handle_events failed: %s", libusb_error_name(r));
-            if (r == LIBUSB_ERROR_NO_DEVICE) break;
+            // The thread outlives any one device, so a vanished device is no reason to stop
+            struct timespec backoff = {0, 10000000};
+            nanosleep(&backoff, NULL);
+        }
+
+        int64_t now = monotonic_ms();
+        if (now - lastTrim >= BUFFER_POOL_TRIM_INTERVAL_MS) {
+            lastTrim = now;
+            for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
+                size_t released = buffer_cache_trim(&g_attachedDevices[i].buffers);
+                if (released > 0) {
+                    __android_log_print(ANDROID_LOG_INFO, APPNAME, "Trimmed %zu idle buffer bytes from device slot %d", released, i);
+                }
+            }
         }
     }
 
+    pthread_mutex_lock(&g_eventProfileMutex);
+    g_eventThreadTid = 0;
+    pthread_mutex_unlock(&g_eventProfileMutex);
+
     if (attach_result == JNI_OK) {
         (*g_jvm)->DetachCurrentThread(g_jvm);
     }
@@ -251,6 +413,7 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_openDeviceHandle(JNIE
     int r = libusb_wrap_sys_device(g_ctx, (intptr_t)fd, &dev_handle);
     if (r < 0 || dev_handle == NULL) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Failed to wrap device for fd %d: %s", fd, libusb_error_name(r));
+        USBIP_PROBE(device_open, -1, fd, 0, 0, libusb_to_errno(r));
         return libusb_to_errno(r);
     }
 
@@ -260,6 +423,9 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_openDeviceHandle(JNIE
         if (g_attachedDevices[i].fd == -1) {
             g_attachedDevices[i].fd = fd;
             g_attachedDevices[i].handle = dev_handle;
+            atomic_store(&g_attachedDevices[i].dead, 0);
+            buffer_cache_open(&g_attachedDevices[i].buffers);
+            metrics_reset_device(i);
             slot = i;
             break;
         }
@@ -269,11 +435,14 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_openDeviceHandle(JNIE
         pthread_mutex_unlock(&g_attachedDevicesMutex);
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "No free slots to store device handle for fd %d", fd);
         libusb_close(dev_handle);
+        USBIP_PROBE(device_open, -1, fd, 0, 0, -EBUSY);
         return -EBUSY;
     }
 
     open_devs++;
-    if (open_devs == 1) {
+    // Started by the first open and kept until exit, so device churn doesn't pay for a
+    // thread start and join each time
+    if (!g_keepEventThreadRunning) {
         g_keepEventThreadRunning = 1;
         pthread_create(&g_eventThread, NULL, event_thread_func, NULL);
     }
@@ -281,15 +450,17 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_openDeviceHandle(JNIE
     pthread_mutex_unlock(&g_attachedDevicesMutex);
 
     __android_log_print(ANDROID_LOG_INFO, APPNAME, "Successfully opened and stored handle for fd %d", fd);
+    USBIP_PROBE(device_open, -1, fd, 0, 0, 0);
     return 0;
 }
 
+// Returns how many of the device's transfers were not reaped within the drain timeout,
+// see exit.
 JNIEXPORT jint JNICALL
 Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_closeDeviceHandle(JNIEnv *env,
                                                                              jobject thiz,
                                                                              jint fd) {
     struct AttachedDeviceHandle* targetDev = NULL;
-    int stop_thread = 0;
 
     if (g_ctx == NULL) {
         __android_log_print(ANDROID_LOG_WARN, APPNAME, "Ignored closeDeviceHandle for fd %d: Libusb context already destroyed", fd);
@@ -307,39 +478,27 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_closeDeviceHandle(JNI
 
     if (targetDev == NULL) return 0; // Already closed
 
+    flush_deferred_transfers(targetDev, LIBUSB_TRANSFER_CANCELLED);
+
     pthread_mutex_lock(&targetDev->transferMutex);
-    int active_count = 0;
+    int active_count = targetDev->inFlight;
     for (int i = 0; i < MAX_ASYNC_TRANSFERS_PER_DEVICE; i++) {
         if (targetDev->activeTransfers[i].transfer != NULL) {
             libusb_cancel_transfer(targetDev->activeTransfers[i].transfer);
-            active_count++;
         }
     }
+    int remaining = wait_for_drain(targetDev, CLOSE_DRAIN_TIMEOUT_MS);
     pthread_mutex_unlock(&targetDev->transferMutex);
-
-    if (active_count > 0) {
-        int retries = 50; // 500ms
-        while (retries > 0) {
-            int remaining = 0;
-            pthread_mutex_lock(&targetDev->transferMutex);
-            for (int i = 0; i < MAX_ASYNC_TRANSFERS_PER_DEVICE; i++) {
-                if (targetDev->activeTransfers[i].transfer != NULL) remaining++;
-            }
-            pthread_mutex_unlock(&targetDev->transferMutex);
-
-            if (remaining == 0) break;
-
-            struct timeval tv = {0, 10000};
-            libusb_handle_events_timeout(g_ctx, &tv);
-            retries--;
-        }
+    if (remaining > 0) {
+        __android_log_print(ANDROID_LOG_WARN, APPNAME, "Closing fd %d with %d transfers not reaped", fd, remaining);
     }
 
     pthread_mutex_lock(&g_attachedDevicesMutex);
     libusb_device_handle* handle = targetDev->handle;
 
-    targetDev->fd = -1;
-    targetDev->handle = NULL;
+    detach_device_slot(targetDev);
+    buffer_cache_close(&targetDev->buffers);
+    usbfs_budget_reset_device((int)(targetDev - g_attachedDevices));
 
     if (handle) {
         libusb_close(handle);
@@ -347,24 +506,139 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_closeDeviceHandle(JNI
     }
 
     open_devs--;
-    if (open_devs == 0) {
-        stop_thread = 1;
-        g_keepEventThreadRunning = 0;
+    pthread_mutex_unlock(&g_attachedDevicesMutex);
+
+    USBIP_PROBE(device_close, -1, fd, 0, active_count, 0);
+    return remaining;
+}
+
+// Copies the per-packet results of an ISO transfer into Java arrays for
+// onTransferCompleted. Returns the sum of the packets' actual lengths.
+static int marshal_iso_results(JNIEnv* env, const struct libusb_transfer *transfer,
+                               jintArray* out_lengths, jintArray* out_statuses) {
+    int num_packets = transfer->num_iso_packets;
+    int total = 0;
+
+    *out_lengths = (*env)->NewIntArray(env, num_packets);
+    *out_statuses = (*env)->NewIntArray(env, num_packets);
+    if (*out_lengths == NULL || *out_statuses == NULL) return 0;
+
+    jint *temp_lengths = (jint *) malloc(num_packets * sizeof(jint));
+    jint *temp_statuses = (jint *) malloc(num_packets * sizeof(jint));
+
+    if (temp_lengths != NULL && temp_statuses != NULL) {
+        for (int i = 0; i < num_packets; i++) {
+            temp_lengths[i] = (jint) transfer->iso_packet_desc[i].actual_length;
+            total += temp_lengths[i];
+
+            int packet_status = transfer->iso_packet_desc[i].status;
+            temp_statuses[i] = (jint) libusb_status_to_errno(packet_status);
+        }
+
+        (*env)->SetIntArrayRegion(env, *out_lengths, 0, num_packets, temp_lengths);
+        (*env)->SetIntArrayRegion(env, *out_statuses, 0, num_packets, temp_statuses);
     }
+    free(temp_lengths);
+    free(temp_statuses);
+    return total;
+}
 
-    pthread_mutex_unlock(&g_attachedDevicesMutex);
+static void drain_deferred_transfers(void);
+
+// A transfer for num_packets ISO packets, 0 for the other types, from the device's spares
+// when one was allocated for that many. The fill functions and the flags set after them
+// cover everything a submit reads, so a spare needs no resetting.
+static struct libusb_transfer* take_transfer(struct AttachedDeviceHandle* dev, int num_packets) {
+    pthread_mutex_lock(&dev->transferMutex);
+    for (int i = dev->spareCount - 1; i >= 0; i--) {
+        struct libusb_transfer* transfer = dev->spareTransfers[i];
+        if (transfer->num_iso_packets != num_packets) continue;
+        dev->spareTransfers[i] = dev->spareTransfers[--dev->spareCount];
+        pthread_mutex_unlock(&dev->transferMutex);
+        return transfer;
+    }
+    pthread_mutex_unlock(&dev->transferMutex);
+    return libusb_alloc_transfer(num_packets);
+}
 
-    if (stop_thread) {
-        if (g_ctx != NULL) libusb_interrupt_event_handler(g_ctx);
-        pthread_join(g_eventThread, NULL);
+// Keeps a finished transfer for the next submit on its device, unless the device has
+// been closed meanwhile or already has all the spares it can use. Only takes the
+// device's transferMutex: closing holds g_attachedDevicesMutex while libusb_close waits
+// for the event thread, which may be in here.
+static void recycle_transfer(int dev_pos, libusb_device_handle* handle, struct libusb_transfer* transfer) {
+    int kept = 0;
+    if (dev_pos >= 0) {
+        struct AttachedDeviceHandle* dev = &g_attachedDevices[dev_pos];
+        pthread_mutex_lock(&dev->transferMutex);
+        if (dev->handle == handle && dev->spareCount < MAX_ASYNC_TRANSFERS_PER_DEVICE) {
+            dev->spareTransfers[dev->spareCount++] = transfer;
+            kept = 1;
+        }
+        pthread_mutex_unlock(&dev->transferMutex);
     }
+    if (!kept) libusb_free_transfer(transfer);
+}
 
-    return 0;
+// Takes the device out of the table, under transferMutex as well so recycle_transfer
+// sees it gone, and frees its spares. Caller holds g_attachedDevicesMutex.
+static void detach_device_slot(struct AttachedDeviceHandle* dev) {
+    pthread_mutex_lock(&dev->transferMutex);
+    dev->fd = -1;
+    dev->handle = NULL;
+    for (int i = 0; i < dev->spareCount; i++) {
+        libusb_free_transfer(dev->spareTransfers[i]);
+    }
+    dev->spareCount = 0;
+    pthread_mutex_unlock(&dev->transferMutex);
+}
+
+static void release_slot(struct AttachedDeviceHandle* dev, int xfer_pos) {
+    dev->activeTransfers[xfer_pos].seqNum = -1;
+    dev->activeTransfers[xfer_pos].transfer = NULL;
+    dev->activeTransfers[xfer_pos].admitted = 0;
+    dev->activeTransfers[xfer_pos].deferred = 0;
+    if (--dev->inFlight == 0) pthread_cond_broadcast(&dev->drained);
+}
+
+// Waits up to timeout_ms for every transfer of dev to be reaped and returns how many
+// are left. Completions arrive on the event thread, so this only has to sleep; if
+// there is no event thread to do it, or this is it, events are handled here instead.
+// Caller holds dev->transferMutex.
+static int wait_for_drain(struct AttachedDeviceHandle* dev, int timeout_ms) {
+    int64_t deadline_ms = monotonic_ms() + timeout_ms;
+    struct timespec deadline;
+    deadline.tv_sec = (time_t)(deadline_ms / 1000);
+    deadline.tv_nsec = (long)(deadline_ms % 1000) * 1000000;
+    int reaped_elsewhere = g_keepEventThreadRunning && !pthread_equal(pthread_self(), g_eventThread);
+
+    while (dev->inFlight > 0) {
+        if (reaped_elsewhere) {
+            if (pthread_cond_timedwait(&dev->drained, &dev->transferMutex, &deadline) == ETIMEDOUT) break;
+            continue;
+        }
+        if (monotonic_ms() >= deadline_ms) break;
+        pthread_mutex_unlock(&dev->transferMutex);
+        struct timeval tv = {0, 10000};
+        libusb_handle_events_timeout(g_ctx, &tv);
+        pthread_mutex_lock(&dev->transferMutex);
+    }
+    return dev->inFlight;
 }
 
 void LIBUSB_CALL generic_transfer_cb(struct libusb_transfer *transfer) {
+    uint64_t entry_ns = metrics_now_ns();
+    atomic_fetch_add(&g_busyPoll.completions, 1);
+    busy_poll_note_activity(entry_ns);
     int seqNum = (int)(intptr_t)transfer->user_data;
+    USBIP_PROBE(callback_entry, seqNum, -1, transfer->endpoint, transfer->actual_length,
+                libusb_status_to_errno(transfer->status));
+    usb_capture_complete(transfer, (uint32_t)seqNum);
     int totalActualLength = transfer->actual_length;
+    int released_budget = 0;
+    int device_gone = 0;
+    int dev_pos = -1;
+    int fd = -1;
+    uint64_t submit_ns = 0;
     libusb_device_handle *handle = transfer->dev_handle;
     if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
         transfer->status != LIBUSB_TRANSFER_CANCELLED &&
@@ -376,12 +650,19 @@ void LIBUSB_CALL generic_transfer_cb(struct libusb_transfer *transfer) {
     pthread_mutex_lock(&g_attachedDevicesMutex);
     for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
         if (g_attachedDevices[i].handle == handle) {
+            fd = g_attachedDevices[i].fd;
 
             pthread_mutex_lock(&g_attachedDevices[i].transferMutex);
             for (int j = 0; j < MAX_ASYNC_TRANSFERS_PER_DEVICE; j++) {
                 if (g_attachedDevices[i].activeTransfers[j].seqNum == seqNum) {
-                    g_attachedDevices[i].activeTransfers[j].seqNum = -1;
-                    g_attachedDevices[i].activeTransfers[j].transfer = NULL;
+                    dev_pos = i;
+                    device_gone = transfer->status == LIBUSB_TRANSFER_NO_DEVICE;
+                    submit_ns = g_attachedDevices[i].activeTransfers[j].submitNs;
+                    if (g_attachedDevices[i].activeTransfers[j].admitted) {
+                        usbfs_budget_release(i, (size_t)transfer->length);
+                        released_budget = 1;
+                    }
+                    release_slot(&g_attachedDevices[i], j);
                     break;
                 }
             }
@@ -391,6 +672,13 @@ void LIBUSB_CALL generic_transfer_cb(struct libusb_transfer *transfer) {
     }
     pthread_mutex_unlock(&g_attachedDevicesMutex);
 
+    if (released_budget && usbfs_budget_has_waiters()) {
+        drain_deferred_transfers();
+    }
+    if (submit_ns != 0) {
+        metrics_record_latency(dev_pos, transfer->endpoint, METRICS_STAGE_DEVICE, entry_ns - submit_ns);
+    }
+
     JNIEnv* env;
     int needs_detach = 0;
 
@@ -413,29 +701,7 @@ void LIBUSB_CALL generic_transfer_cb(struct libusb_transfer *transfer) {
     jintArray iso_actual_lengths = NULL;
     jintArray iso_packet_statuses = NULL;
     if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-        int num_packets = transfer->num_iso_packets;
-        iso_actual_lengths = (*env)->NewIntArray(env, num_packets);
-        iso_packet_statuses = (*env)->NewIntArray(env, num_packets);
-
-        if (iso_actual_lengths != NULL) {
-            jint *temp_lengths = (jint *) malloc(num_packets * sizeof(jint));
-            jint *temp_statuses = (jint *) malloc(num_packets * sizeof(jint));
-
-            if (temp_lengths != NULL && temp_statuses != NULL) {
-                for (int i = 0; i < num_packets; i++) {
-                    temp_lengths[i] = (jint) transfer->iso_packet_desc[i].actual_length;
-                    totalActualLength += temp_lengths[i];
-
-                    int packet_status = transfer->iso_packet_desc[i].status;
-                    temp_statuses[i] = (jint) libusb_status_to_errno(packet_status);
-                }
-
-                (*env)->SetIntArrayRegion(env, iso_actual_lengths, 0, num_packets, temp_lengths);
-                (*env)->SetIntArrayRegion(env, iso_packet_statuses, 0, num_packets, temp_statuses);
-                free(temp_lengths);
-                free(temp_statuses);
-            }
-        }
+        totalActualLength += marshal_iso_results(env, transfer, &iso_actual_lengths, &iso_packet_statuses);
     }
 
     (*env)->CallVoidMethod(env, g_usbLibInstance, g_onTransferCompletedMethodID,
@@ -446,13 +712,19 @@ void LIBUSB_CALL generic_transfer_cb(struct libusb_transfer *transfer) {
                            iso_actual_lengths,
                            iso_packet_statuses);
 
+    metrics_record_completion(dev_pos, transfer->endpoint, transfer->status, totalActualLength);
+    metrics_record_latency(dev_pos, transfer->endpoint, METRICS_STAGE_CALLBACK, metrics_now_ns() - entry_ns);
+
     if (iso_actual_lengths != NULL) {
         (*env)->DeleteLocalRef(env, iso_actual_lengths);
     }
     if (iso_packet_statuses != NULL) {
         (*env)->DeleteLocalRef(env, iso_packet_statuses);
     }
-    libusb_free_transfer(transfer);
+    USBIP_PROBE(callback_return, seqNum, fd, transfer->endpoint, totalActualLength,
+                libusb_status_to_errno(transfer->status));
+    if (device_gone) mark_device_dead(dev_pos, handle);
+    recycle_transfer(dev_pos, handle, transfer);
     if (needs_detach) {
         (*g_jvm)->DetachCurrentThread(g_jvm);
     }
@@ -475,6 +747,11 @@ int store_transfer(int fd, int seqNum, struct libusb_transfer* transfer,
                     if (out_xfer_pos) *out_xfer_pos = j;
                     g_attachedDevices[i].activeTransfers[j].seqNum = seqNum;
                     g_attachedDevices[i].activeTransfers[j].transfer = transfer;
+                    g_attachedDevices[i].activeTransfers[j].admitted = 0;
+                    g_attachedDevices[i].activeTransfers[j].deferred = 0;
+                    g_attachedDevices[i].activeTransfers[j].rxNs = 0;
+                    g_attachedDevices[i].activeTransfers[j].submitNs = 0;
+                    g_attachedDevices[i].inFlight++;
                     result = 0;
                     break;
                 }
@@ -496,14 +773,242 @@ int reset_transfer(int dev_pos, int xfer_pos, int expected_seqNum) {
 
     pthread_mutex_lock(&g_attachedDevices[dev_pos].transferMutex);
     if (g_attachedDevices[dev_pos].activeTransfers[xfer_pos].seqNum == expected_seqNum) {
-        g_attachedDevices[dev_pos].activeTransfers[xfer_pos].seqNum = -1;
-        g_attachedDevices[dev_pos].activeTransfers[xfer_pos].transfer = NULL;
+        release_slot(&g_attachedDevices[dev_pos], xfer_pos);
     }
     pthread_mutex_unlock(&g_attachedDevices[dev_pos].transferMutex);
 
     return 0;
 }
 
+// Caller must hold dev->transferMutex for all deferred queue helpers.
+static void deferred_push_back(struct AttachedDeviceHandle* dev, int xfer_pos) {
+    int tail = (dev->deferredHead + dev->deferredCount) % MAX_ASYNC_TRANSFERS_PER_DEVICE;
+    dev->deferredQueue[tail] = xfer_pos;
+    dev->deferredCount++;
+    dev->activeTransfers[xfer_pos].deferred = 1;
+}
+
+static void deferred_push_front(struct AttachedDeviceHandle* dev, int xfer_pos) {
+    dev->deferredHead = (dev->deferredHead + MAX_ASYNC_TRANSFERS_PER_DEVICE - 1) % MAX_ASYNC_TRANSFERS_PER_DEVICE;
+    dev->deferredQueue[dev->deferredHead] = xfer_pos;
+    dev->deferredCount++;
+    dev->activeTransfers[xfer_pos].deferred = 1;
+}
+
+static int deferred_pop_front(struct AttachedDeviceHandle* dev) {
+    if (dev->deferredCount == 0) return -1;
+    int xfer_pos = dev->deferredQueue[dev->deferredHead];
+    dev->deferredHead = (dev->deferredHead + 1) % MAX_ASYNC_TRANSFERS_PER_DEVICE;
+    dev->deferredCount--;
+    dev->activeTransfers[xfer_pos].deferred = 0;
+    return xfer_pos;
+}
+
+static int deferred_remove(struct AttachedDeviceHandle* dev, int xfer_pos) {
+    for (int i = 0; i < dev->deferredCount; i++) {
+        int idx = (dev->deferredHead + i) % MAX_ASYNC_TRANSFERS_PER_DEVICE;
+        if (dev->deferredQueue[idx] != xfer_pos) continue;
+
+        for (int j = i; j < dev->deferredCount - 1; j++) {
+            int cur = (dev->deferredHead + j) % MAX_ASYNC_TRANSFERS_PER_DEVICE;
+            int next = (dev->deferredHead + j + 1) % MAX_ASYNC_TRANSFERS_PER_DEVICE;
+            dev->deferredQueue[cur] = dev->deferredQueue[next];
+        }
+        dev->deferredCount--;
+        dev->activeTransfers[xfer_pos].deferred = 0;
+        return 0;
+    }
+    return -1;
+}
+
+// Submits right away when the usbfs budget allows, otherwise parks the transfer until
+// completions free up room. Transfers of one device always go out in submission order.
+static int submit_or_defer(int dev_pos, int xfer_pos, struct libusb_transfer* transfer, uint64_t rx_ns) {
+    struct AttachedDeviceHandle* dev = &g_attachedDevices[dev_pos];
+    size_t cost = (size_t)transfer->length;
+
+    pthread_mutex_lock(&dev->transferMutex);
+    dev->activeTransfers[xfer_pos].rxNs = rx_ns;
+    if (dev->deferredCount == 0 && usbfs_budget_try_reserve(dev_pos, cost)) {
+        uint64_t submit_ns = metrics_now_ns();
+        dev->activeTransfers[xfer_pos].admitted = 1;
+        dev->activeTransfers[xfer_pos].submitNs = submit_ns;
+        pthread_mutex_unlock(&dev->transferMutex);
+
+        // Captured up front, the transfer may already be completed and freed once submitted
+        usb_capture_submit(transfer, (uint32_t)(intptr_t)transfer->user_data);
+        int r = libusb_submit_transfer(transfer);
+        if (r == LIBUSB_SUCCESS) {
+            if (rx_ns != 0) metrics_record_latency(dev_pos, transfer->endpoint, METRICS_STAGE_SUBMIT, submit_ns - rx_ns);
+            busy_poll_note_activity(submit_ns);
+            return 0;
+        }
+
+        usb_capture_error(transfer, (uint32_t)(intptr_t)transfer->user_data, libusb_to_errno(r));
+
+        pthread_mutex_lock(&dev->transferMutex);
+        dev->activeTransfers[xfer_pos].admitted = 0;
+        dev->activeTransfers[xfer_pos].submitNs = 0;
+        usbfs_budget_release(dev_pos, cost);
+        if (r != LIBUSB_ERROR_NO_MEM || !usbfs_budget_on_no_mem(dev_pos)) {
+            pthread_mutex_unlock(&dev->transferMutex);
+            if (r == LIBUSB_ERROR_NO_DEVICE) mark_device_dead(dev_pos, transfer->dev_handle);
+            return r;
+        }
+    }
+
+    // The budget marked the device waiting when it refused, completions drain it from here
+    deferred_push_back(dev, xfer_pos);
+    pthread_mutex_unlock(&dev->transferMutex);
+    return 0;
+}
+
+// Runs on the event thread after a completion returned budget. Devices take turns one
+// transfer at a time so a device with a deep queue cannot starve the others.
+static void drain_deferred_transfers(void) {
+    static __thread int draining = 0;
+    struct libusb_transfer* failed[MAX_ATTACHED_DEVICES * MAX_ASYNC_TRANSFERS_PER_DEVICE];
+    int failed_errors[MAX_ATTACHED_DEVICES * MAX_ASYNC_TRANSFERS_PER_DEVICE];
+    int failed_count = 0;
+    int progress = 1;
+
+    if (draining) return;
+    draining = 1;
+
+    while (progress) {
+        progress = 0;
+        for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
+            struct AttachedDeviceHandle* dev = &g_attachedDevices[i];
+
+            pthread_mutex_lock(&dev->transferMutex);
+            if (dev->deferredCount == 0) {
+                pthread_mutex_unlock(&dev->transferMutex);
+                continue;
+            }
+
+            int xfer_pos = dev->deferredQueue[dev->deferredHead];
+            struct libusb_transfer* transfer = dev->activeTransfers[xfer_pos].transfer;
+            size_t cost = (size_t)transfer->length;
+            if (!usbfs_budget_try_reserve(i, cost)) {
+                pthread_mutex_unlock(&dev->transferMutex);
+                continue;
+            }
+            deferred_pop_front(dev);
+            uint64_t rx_ns = dev->activeTransfers[xfer_pos].rxNs;
+            uint64_t submit_ns = metrics_now_ns();
+            dev->activeTransfers[xfer_pos].admitted = 1;
+            dev->activeTransfers[xfer_pos].submitNs = submit_ns;
+            pthread_mutex_unlock(&dev->transferMutex);
+
+            usb_capture_submit(transfer, (uint32_t)(intptr_t)transfer->user_data);
+            int r = libusb_submit_transfer(transfer);
+            if (r != LIBUSB_SUCCESS) {
+                usb_capture_error(transfer, (uint32_t)(intptr_t)transfer->user_data, libusb_to_errno(r));
+            }
+
+            pthread_mutex_lock(&dev->transferMutex);
+            if (r == LIBUSB_SUCCESS) {
+                progress = 1;
+                if (rx_ns != 0) metrics_record_latency(i, transfer->endpoint, METRICS_STAGE_SUBMIT, submit_ns - rx_ns);
+            } else {
+                dev->activeTransfers[xfer_pos].admitted = 0;
+                dev->activeTransfers[xfer_pos].submitNs = 0;
+                usbfs_budget_release(i, cost);
+                if (r == LIBUSB_ERROR_NO_MEM && usbfs_budget_on_no_mem(i)) {
+                    deferred_push_front(dev, xfer_pos);
+                } else {
+                    failed[failed_count] = transfer;
+                    failed_errors[failed_count] = r;
+                    failed_count++;
+                }
+            }
+            usbfs_budget_set_waiting(i, dev->deferredCount > 0);
+            pthread_mutex_unlock(&dev->transferMutex);
+        }
+    }
+
+    for (int i = 0; i < failed_count; i++) {
+        __android_log_print(ANDROID_LOG_ERROR, APPNAME, "Deferred submit failed: %s", libusb_error_name(failed_errors[i]));
+        failed[i]->status = failed_errors[i] == LIBUSB_ERROR_NO_DEVICE ? LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+        failed[i]->actual_length = 0;
+        generic_transfer_cb(failed[i]);
+    }
+    draining = 0;
+}
+
+// Completes every deferred transfer of a device with status so Java gets its buffers back.
+// Empties the deferred queue into flushed and returns how many it held. Caller holds
+// dev->transferMutex.
+static int take_deferred_transfers(struct AttachedDeviceHandle* dev, struct libusb_transfer** flushed) {
+    int count = 0;
+    int xfer_pos;
+    while ((xfer_pos = deferred_pop_front(dev)) != -1) {
+        flushed[count++] = dev->activeTransfers[xfer_pos].transfer;
+    }
+    usbfs_budget_set_waiting((int)(dev - g_attachedDevices), 0);
+    return count;
+}
+
+static void fail_transfers(struct libusb_transfer** flushed, int count, enum libusb_transfer_status status) {
+    for (int i = 0; i < count; i++) {
+        flushed[i]->status = status;
+        flushed[i]->actual_length = 0;
+        generic_transfer_cb(flushed[i]);
+    }
+}
+
+static void flush_deferred_transfers(struct AttachedDeviceHandle* dev, enum libusb_transfer_status status) {
+    struct libusb_transfer* flushed[MAX_ASYNC_TRANSFERS_PER_DEVICE];
+
+    pthread_mutex_lock(&dev->transferMutex);
+    int count = take_deferred_transfers(dev, flushed);
+    pthread_mutex_unlock(&dev->transferMutex);
+
+    fail_transfers(flushed, count, status);
+}
+
+static void notify_device_disconnected(int fd) {
+    JNIEnv* env;
+    int needs_detach = 0;
+    int r = (*g_jvm)->GetEnv(g_jvm, (void**)&env, JNI_VERSION_1_6);
+    if (r == JNI_EDETACHED) {
+        if ((*g_jvm)->AttachCurrentThread(g_jvm, &env, NULL) != JNI_OK) return;
+        needs_detach = 1;
+    } else if (r != JNI_OK) {
+        return;
+    }
+    (*env)->CallVoidMethod(env, g_usbLibInstance, g_onDeviceDisconnectedMethodID, fd);
+    if (needs_detach) (*g_jvm)->DetachCurrentThread(g_jvm);
+}
+
+// Called when libusb reports the device behind handle gone, from a completion or a
+// failed submit, with no locks held. The first call fails everything still waiting for
+// usbfs budget with ENODEV, cancels what is in flight so it doesn't linger until close,
+// and tells Java once. The entry points refuse new submissions from then on. Nothing
+// happens if the slot has been closed since, and perhaps given to another device.
+static void mark_device_dead(int dev_pos, libusb_device_handle* handle) {
+    struct AttachedDeviceHandle* dev = &g_attachedDevices[dev_pos];
+    struct libusb_transfer* flushed[MAX_ASYNC_TRANSFERS_PER_DEVICE];
+
+    pthread_mutex_lock(&dev->transferMutex);
+    if (dev->handle != handle || atomic_exchange(&dev->dead, 1)) {
+        pthread_mutex_unlock(&dev->transferMutex);
+        return;
+    }
+    int fd = dev->fd;
+    int count = take_deferred_transfers(dev, flushed);
+    for (int i = 0; i < MAX_ASYNC_TRANSFERS_PER_DEVICE; i++) {
+        if (dev->activeTransfers[i].transfer != NULL && dev->activeTransfers[i].submitNs != 0) {
+            libusb_cancel_transfer(dev->activeTransfers[i].transfer);
+        }
+    }
+    pthread_mutex_unlock(&dev->transferMutex);
+
+    __android_log_print(ANDROID_LOG_WARN, APPNAME, "Device on fd %d is gone, failing its transfers", fd);
+    fail_transfers(flushed, count, LIBUSB_TRANSFER_NO_DEVICE);
+    notify_device_disconnected(fd);
+}
+
 static uint8_t map_urb_flags_to_libusb(int usbip_flags) {
     uint8_t libusb_flags = 0;
 
@@ -529,6 +1034,7 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doControlTransfer(JNI
                                                                            jint length,
                                                                            jint timeout) {
     libusb_device_handle *dev_handle = NULL;
+    int dead = 0;
     int r;
     jint result_status = -EIO;
     unsigned char *native_buffer = NULL;
@@ -543,10 +1049,12 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doControlTransfer(JNI
     for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
         if (g_attachedDevices[i].fd == fd) {
             dev_handle = g_attachedDevices[i].handle;
+            dead = atomic_load(&g_attachedDevices[i].dead);
             break;
         }
     }
     pthread_mutex_unlock(&g_attachedDevicesMutex);
+    if (dead) return -ENODEV; // Unplugged, libusb would only fail it more slowly
     if (dev_handle == NULL) { // If running before device attached
         r = libusb_wrap_sys_device(g_ctx, (intptr_t)fd, &dev_handle);
         needs_cleanup = 1;
@@ -603,8 +1111,11 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doControlTransferAsyn
                                                                                   jobject buffer,
                                                                                   jint timeout,
                                                                                   jint seqNum,
-                                                                                  jint usbipFlags) {
+                                                                                  jint usbipFlags,
+                                                                                  jlong rxTimestampNs) {
     libusb_device_handle *dev_handle = NULL;
+    struct AttachedDeviceHandle *dev = NULL;
+    int dead = 0;
     struct libusb_transfer *transfer = NULL;
     unsigned char *native_buffer = NULL;
     int dev_idx, xfer_idx, r, store_xfer_r;
@@ -614,11 +1125,14 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doControlTransferAsyn
     pthread_mutex_lock(&g_attachedDevicesMutex);
     for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
         if (g_attachedDevices[i].fd == fd) {
-            dev_handle = g_attachedDevices[i].handle;
+            dev = &g_attachedDevices[i];
+            dev_handle = dev->handle;
+            dead = atomic_load(&g_attachedDevices[i].dead);
             break;
         }
     }
     pthread_mutex_unlock(&g_attachedDevicesMutex);
+    if (dead) return -ENODEV; // Unplugged, libusb would only fail it more slowly
 
     if (dev_handle == NULL) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncCtrl: No stored handle found for fd %d", fd);
@@ -631,7 +1145,7 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doControlTransferAsyn
         return -EFAULT;
     }
 
-    transfer = libusb_alloc_transfer(0);
+    transfer = take_transfer(dev, 0);
     if (!transfer) return -ENOMEM;
 
     libusb_fill_control_transfer(
@@ -647,12 +1161,16 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doControlTransferAsyn
     store_xfer_r = store_transfer(fd, seqNum, transfer, &dev_idx, &xfer_idx);
     if (store_xfer_r == -1) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncCtrl: No free slots!");
+        USBIP_PROBE(urb_submit_fail, seqNum, fd, transfer->endpoint, transfer->length, -EBUSY);
         libusb_free_transfer(transfer);
         return -EBUSY;
     }
 
-    r = libusb_submit_transfer(transfer);
+    USBIP_PROBE(urb_submit, seqNum, fd, transfer->endpoint, transfer->length, 0);
+    r = submit_or_defer(dev_idx, xfer_idx, transfer, (uint64_t)rxTimestampNs);
     if (r < 0) {
+        USBIP_PROBE(urb_submit_fail, seqNum, fd, transfer->endpoint, transfer->length, libusb_to_errno(r));
+        metrics_record_submit_failure(dev_idx, transfer->endpoint);
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncCtrl: libusb_submit_transfer failed: %s", libusb_error_name(r));
         reset_transfer(dev_idx, xfer_idx, seqNum);
         libusb_free_transfer(transfer);
@@ -667,10 +1185,14 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doBulkTransferAsync(J
                                                                                jint fd,
                                                                                jint endpoint,
                                                                                jobject buffer,
+                                                                               jint length,
                                                                                jint timeout,
                                                                                jint seqNum,
-                                                                               jint usbipFlags) {
+                                                                               jint usbipFlags,
+                                                                               jlong rxTimestampNs) {
     libusb_device_handle *dev_handle = NULL;
+    struct AttachedDeviceHandle *dev = NULL;
+    int dead = 0;
     struct libusb_transfer *transfer = NULL;
     unsigned char *native_buffer = NULL;
     int dev_idx, xfer_idx, r, store_xfer_r;
@@ -680,11 +1202,14 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doBulkTransferAsync(J
     pthread_mutex_lock(&g_attachedDevicesMutex);
     for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
         if (g_attachedDevices[i].fd == fd) {
-            dev_handle = g_attachedDevices[i].handle;
+            dev = &g_attachedDevices[i];
+            dev_handle = dev->handle;
+            dead = atomic_load(&g_attachedDevices[i].dead);
             break;
         }
     }
     pthread_mutex_unlock(&g_attachedDevicesMutex);
+    if (dead) return -ENODEV; // Unplugged, libusb would only fail it more slowly
 
     if (dev_handle == NULL) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncBulk: No stored handle found for fd %d!", fd);
@@ -697,17 +1222,18 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doBulkTransferAsync(J
         return -EFAULT;
     }
 
-    transfer = libusb_alloc_transfer(0);
-    if (!transfer) return -ENOMEM;
+    // The pooled buffer is usually larger than the transfer
+    if (length < 0 || length > (*env)->GetDirectBufferCapacity(env, buffer)) return -EINVAL;
 
-    jlong capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+    transfer = take_transfer(dev, 0);
+    if (!transfer) return -ENOMEM;
 
     libusb_fill_bulk_transfer(
             transfer,
             dev_handle,
             (unsigned char)endpoint,
             native_buffer,
-            (int)capacity,
+            length,
             generic_transfer_cb,
             (void*)(intptr_t)seqNum,
             (unsigned int)timeout
@@ -717,12 +1243,16 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doBulkTransferAsync(J
     store_xfer_r = store_transfer(fd, seqNum, transfer, &dev_idx, &xfer_idx);
     if (store_xfer_r == -1) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncCtrl: No free slots!");
+        USBIP_PROBE(urb_submit_fail, seqNum, fd, transfer->endpoint, transfer->length, -EBUSY);
         libusb_free_transfer(transfer);
         return -EBUSY;
     }
 
-    r = libusb_submit_transfer(transfer);
+    USBIP_PROBE(urb_submit, seqNum, fd, transfer->endpoint, transfer->length, 0);
+    r = submit_or_defer(dev_idx, xfer_idx, transfer, (uint64_t)rxTimestampNs);
     if (r < 0) {
+        USBIP_PROBE(urb_submit_fail, seqNum, fd, transfer->endpoint, transfer->length, libusb_to_errno(r));
+        metrics_record_submit_failure(dev_idx, transfer->endpoint);
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncBulk: libusb_submit_transfer failed: %s", libusb_error_name(r));
         reset_transfer(dev_idx, xfer_idx, seqNum);
         libusb_free_transfer(transfer);
@@ -738,10 +1268,14 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doInterruptTransferAs
                                                                                     jint fd,
                                                                                     jint endpoint,
                                                                                     jobject buffer,
+                                                                                    jint length,
                                                                                     jint timeout,
                                                                                     jint seqNum,
-                                                                                    jint usbipFlags) {
+                                                                                    jint usbipFlags,
+                                                                                    jlong rxTimestampNs) {
     libusb_device_handle *dev_handle = NULL;
+    struct AttachedDeviceHandle *dev = NULL;
+    int dead = 0;
     struct libusb_transfer *transfer = NULL;
     unsigned char *native_buffer = NULL;
     int dev_idx, xfer_idx, r, store_xfer_r;
@@ -751,11 +1285,14 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doInterruptTransferAs
     pthread_mutex_lock(&g_attachedDevicesMutex);
     for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
         if (g_attachedDevices[i].fd == fd) {
-            dev_handle = g_attachedDevices[i].handle;
+            dev = &g_attachedDevices[i];
+            dev_handle = dev->handle;
+            dead = atomic_load(&g_attachedDevices[i].dead);
             break;
         }
     }
     pthread_mutex_unlock(&g_attachedDevicesMutex);
+    if (dead) return -ENODEV; // Unplugged, libusb would only fail it more slowly
     if (dev_handle == NULL) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncIntr: No stored handle found for fd %d!", fd);
         return -ENODEV;
@@ -767,17 +1304,17 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doInterruptTransferAs
         return -EFAULT;
     }
 
-    transfer = libusb_alloc_transfer(0);
-    if (!transfer) return -ENOMEM;
+    if (length < 0 || length > (*env)->GetDirectBufferCapacity(env, buffer)) return -EINVAL;
 
-    jlong capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+    transfer = take_transfer(dev, 0);
+    if (!transfer) return -ENOMEM;
 
     libusb_fill_interrupt_transfer(
             transfer,
             dev_handle,
             (unsigned char)endpoint,
             native_buffer,
-            (int)capacity,
+            length,
             generic_transfer_cb,
             (void*)(intptr_t)seqNum,
             (unsigned int)timeout
@@ -787,12 +1324,16 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doInterruptTransferAs
     store_xfer_r = store_transfer(fd, seqNum, transfer, &dev_idx, &xfer_idx);
     if (store_xfer_r == -1) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncCtrl: No free slots!");
+        USBIP_PROBE(urb_submit_fail, seqNum, fd, transfer->endpoint, transfer->length, -EBUSY);
         libusb_free_transfer(transfer);
         return -EBUSY;
     }
 
-    r = libusb_submit_transfer(transfer);
+    USBIP_PROBE(urb_submit, seqNum, fd, transfer->endpoint, transfer->length, 0);
+    r = submit_or_defer(dev_idx, xfer_idx, transfer, (uint64_t)rxTimestampNs);
     if (r < 0) {
+        USBIP_PROBE(urb_submit_fail, seqNum, fd, transfer->endpoint, transfer->length, libusb_to_errno(r));
+        metrics_record_submit_failure(dev_idx, transfer->endpoint);
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncIntr: libusb_submit_transfer failed: %s", libusb_error_name(r));
         reset_transfer(dev_idx, xfer_idx, seqNum);
         libusb_free_transfer(transfer);
@@ -807,10 +1348,14 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doIsochronousTransfer
                                                                                       jint fd,
                                                                                       jint endpoint,
                                                                                       jobject buffer,
+                                                                                      jint length,
                                                                                       jintArray iso_packet_lengths,
                                                                                       jint seqNum,
-                                                                                      jint usbipFlags) {
+                                                                                      jint usbipFlags,
+                                                                                      jlong rxTimestampNs) {
     libusb_device_handle *dev_handle = NULL;
+    struct AttachedDeviceHandle *dev = NULL;
+    int dead = 0;
     struct libusb_transfer *transfer = NULL;
     unsigned char *native_buffer = NULL;
     jint *native_packet_lengths = NULL;
@@ -819,11 +1364,14 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doIsochronousTransfer
     pthread_mutex_lock(&g_attachedDevicesMutex);
     for (int i = 0; i < MAX_ATTACHED_DEVICES; i++) {
         if (g_attachedDevices[i].fd == fd) {
-            dev_handle = g_attachedDevices[i].handle;
+            dev = &g_attachedDevices[i];
+            dev_handle = dev->handle;
+            dead = atomic_load(&g_attachedDevices[i].dead);
             break;
         }
     }
     pthread_mutex_unlock(&g_attachedDevicesMutex);
+    if (dead) return -ENODEV; // Unplugged, libusb would only fail it more slowly
 
     if (dev_handle == NULL) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncIntr: No stored handle found for fd %d!", fd);
@@ -835,10 +1383,10 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doIsochronousTransfer
         return -EFAULT;
     }
 
+    if (length < 0 || length > (*env)->GetDirectBufferCapacity(env, buffer)) return -EINVAL;
     jsize num_packets = (*env)->GetArrayLength(env, iso_packet_lengths);
-    jlong total_length = (*env)->GetDirectBufferCapacity(env, buffer);
 
-    transfer = libusb_alloc_transfer(num_packets);
+    transfer = take_transfer(dev, num_packets);
     if (!transfer) return -ENOMEM;
 
     native_packet_lengths = (jint*)(*env)->GetPrimitiveArrayCritical(env, iso_packet_lengths, NULL);
@@ -851,7 +1399,7 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doIsochronousTransfer
                              dev_handle,
                              (unsigned char)endpoint,
                              native_buffer,
-                             (int)total_length,
+                             length,
                              num_packets,
                              generic_transfer_cb,
                              (void*)(intptr_t)seqNum,
@@ -865,12 +1413,16 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_doIsochronousTransfer
     store_xfer_r = store_transfer(fd, seqNum, transfer, &dev_idx, &xfer_idx);
     if (store_xfer_r == -1) {
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncCtrl: No free slots!");
+        USBIP_PROBE(urb_submit_fail, seqNum, fd, transfer->endpoint, transfer->length, -EBUSY);
         libusb_free_transfer(transfer);
         return -EBUSY;
     }
 
-    r = libusb_submit_transfer(transfer);
+    USBIP_PROBE(urb_submit, seqNum, fd, transfer->endpoint, transfer->length, 0);
+    r = submit_or_defer(dev_idx, xfer_idx, transfer, (uint64_t)rxTimestampNs);
     if (r < 0) {
+        USBIP_PROBE(urb_submit_fail, seqNum, fd, transfer->endpoint, transfer->length, libusb_to_errno(r));
+        metrics_record_submit_failure(dev_idx, transfer->endpoint);
         __android_log_print(ANDROID_LOG_ERROR, APPNAME, "AsyncIso: libusb_submit_transfer failed: %s", libusb_error_name(r));
         reset_transfer(dev_idx, xfer_idx, seqNum);
         libusb_free_transfer(transfer);
@@ -885,6 +1437,7 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_cancelTransfer(JNIEnv
                                                                           jint seq_num,
                                                                           jint fd) {
     struct libusb_transfer *transfer_to_cancel = NULL;
+    int was_deferred = 0;
     int r = -1;
 
     pthread_mutex_lock(&g_attachedDevicesMutex);
@@ -894,6 +1447,11 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_cancelTransfer(JNIEnv
             for (int j = 0; j < MAX_ASYNC_TRANSFERS_PER_DEVICE; j++) {
                 if (g_attachedDevices[i].activeTransfers[j].seqNum == seq_num) {
                     transfer_to_cancel = g_attachedDevices[i].activeTransfers[j].transfer;
+                    metrics_record_unlink(i, transfer_to_cancel->endpoint);
+                    if (g_attachedDevices[i].activeTransfers[j].deferred) {
+                        was_deferred = deferred_remove(&g_attachedDevices[i], j) == 0;
+                        usbfs_budget_set_waiting(i, g_attachedDevices[i].deferredCount > 0);
+                    }
                     break;
                 }
             }
@@ -903,8 +1461,18 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_cancelTransfer(JNIEnv
     }
     pthread_mutex_unlock(&g_attachedDevicesMutex);
 
+    if (was_deferred) { // Never reached libusb, complete it here
+        USBIP_PROBE(urb_cancel, seq_num, fd, transfer_to_cancel->endpoint, 0, 0);
+        transfer_to_cancel->status = LIBUSB_TRANSFER_CANCELLED;
+        transfer_to_cancel->actual_length = 0;
+        generic_transfer_cb(transfer_to_cancel);
+        return 0;
+    }
+
     if (transfer_to_cancel != NULL) {
+        unsigned char endpoint = transfer_to_cancel->endpoint; // Gone once the cancellation completes
         r = libusb_cancel_transfer(transfer_to_cancel);
+        USBIP_PROBE(urb_cancel, seq_num, fd, endpoint, 0, libusb_to_errno(r));
         if (r < 0) {
             if (r == LIBUSB_ERROR_NOT_FOUND) return 0;
 
@@ -917,5 +1485,307 @@ Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_cancelTransfer(JNIEnv
         return 0;
     }
 
+    USBIP_PROBE(urb_cancel, seq_num, fd, -1, 0, -ENOENT);
     return -ENOENT;
-}
\ No newline at end of file
+}
+JNIEXPORT jobject JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_allocBuffer(JNIEnv *env, jobject thiz,
+                                                                       jint fd, jint size) {
+    if (size < 0) return NULL;
+
+    struct AttachedDeviceHandle* dev = find_device_by_fd(fd);
+    if (dev == NULL) {
+        __android_log_print(ANDROID_LOG_ERROR, APPNAME, "allocBuffer: No stored handle found for fd %d", fd);
+        return NULL;
+    }
+
+    size_t capacity = 0;
+    void* data = buffer_cache_alloc(&dev->buffers, (size_t)size, &capacity);
+    if (data == NULL) return NULL;
+
+    jobject buffer = (*env)->NewDirectByteBuffer(env, data, (jlong)capacity);
+    if (buffer == NULL) buffer_cache_free(data);
+    return buffer;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_releaseBuffer(JNIEnv *env, jobject thiz,
+                                                                         jobject buffer) {
+    void* data = (*env)->GetDirectBufferAddress(env, buffer);
+    if (data == NULL) return -EFAULT;
+    return buffer_cache_free(data) == 0 ? 0 : -EINVAL;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_prewarmBuffers(JNIEnv *env, jobject thiz,
+                                                                          jint fd, jint size, jint count) {
+    if (size < 0 || count < 0) return -EINVAL;
+    struct AttachedDeviceHandle* dev = find_device_by_fd(fd);
+    if (dev == NULL) return -ENOENT;
+    return buffer_cache_prewarm(&dev->buffers, (size_t)size, (uint32_t)count);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_prewarmTransfers(JNIEnv *env, jobject thiz,
+                                                                            jint fd, jint isoPackets, jint count) {
+    if (isoPackets < 0 || count < 0) return -EINVAL;
+    struct AttachedDeviceHandle* dev = find_device_by_fd(fd);
+    if (dev == NULL) return -ENOENT;
+
+    int added = 0;
+    pthread_mutex_lock(&dev->transferMutex);
+    while (added < count && dev->spareCount < MAX_ASYNC_TRANSFERS_PER_DEVICE) {
+        struct libusb_transfer* transfer = libusb_alloc_transfer(isoPackets);
+        if (transfer == NULL) break;
+        transfer->num_iso_packets = isoPackets; // What take_transfer matches spares on
+        dev->spareTransfers[dev->spareCount++] = transfer;
+        added++;
+    }
+    pthread_mutex_unlock(&dev->transferMutex);
+    return added;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_getBufferPoolStats(JNIEnv *env, jobject thiz,
+                                                                              jint fd) {
+    struct AttachedDeviceHandle* dev = find_device_by_fd(fd);
+    if (dev == NULL) return NULL;
+
+    int64_t stats[BUFFER_STAT_COUNT];
+    buffer_cache_stats(&dev->buffers, stats);
+
+    jlongArray result = (*env)->NewLongArray(env, BUFFER_STAT_COUNT);
+    if (result != NULL) {
+        (*env)->SetLongArrayRegion(env, result, 0, BUFFER_STAT_COUNT, (const jlong*)stats);
+    }
+    return result;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_getUsbfsBudgetStats(JNIEnv *env, jobject thiz) {
+    int64_t stats[USBFS_STAT_COUNT];
+    usbfs_budget_stats(stats);
+
+    jlongArray result = (*env)->NewLongArray(env, USBFS_STAT_COUNT);
+    if (result != NULL) {
+        (*env)->SetLongArrayRegion(env, result, 0, USBFS_STAT_COUNT, (const jlong*)stats);
+    }
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_startCapture(JNIEnv *env, jobject thiz,
+                                                                        jstring path, jint snapLen) {
+    const char* file_path = (*env)->GetStringUTFChars(env, path, NULL);
+    if (file_path == NULL) return -ENOMEM;
+
+    int r = usb_capture_start(file_path, snapLen > 0 ? (uint32_t)snapLen : 0);
+    (*env)->ReleaseStringUTFChars(env, path, file_path);
+    return r;
+}
+
+JNIEXPORT void JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_stopCapture(JNIEnv *env, jobject thiz) {
+    usb_capture_stop();
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_getCaptureStats(JNIEnv *env, jobject thiz) {
+    int64_t stats[USB_CAPTURE_STAT_COUNT];
+    usb_capture_stats(stats);
+
+    jlongArray result = (*env)->NewLongArray(env, USB_CAPTURE_STAT_COUNT);
+    if (result != NULL) {
+        (*env)->SetLongArrayRegion(env, result, 0, USB_CAPTURE_STAT_COUNT, (const jlong*)stats);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_recordLatency(JNIEnv *env, jobject thiz,
+                                                                         jint fd, jint endpoint,
+                                                                         jint stage, jlong nanos) {
+    if (stage < 0 || stage >= METRICS_STAGE_COUNT || nanos < 0) return;
+    struct AttachedDeviceHandle* dev = find_device_by_fd(fd);
+    if (dev == NULL) return;
+    metrics_record_latency((int)(dev - g_attachedDevices), endpoint, (enum MetricsStage)stage, (uint64_t)nanos);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_getMetricsReport(JNIEnv *env, jobject thiz,
+                                                                            jint fd) {
+    struct AttachedDeviceHandle* dev = find_device_by_fd(fd);
+    if (dev == NULL) return NULL;
+
+    int dev_pos = (int)(dev - g_attachedDevices);
+    size_t needed = metrics_format_device(dev_pos, NULL, 0) + 1;
+    char* report = malloc(needed);
+    if (report == NULL) return NULL;
+
+    metrics_format_device(dev_pos, report, needed);
+    jstring result = (*env)->NewStringUTF(env, report);
+    free(report);
+    return result;
+}
+
+// USB/IP reports speed as the kernel's enum usb_device_speed. SuperSpeedPlus is reported
+// as SuperSpeed: the usbip tools only attach USB_SPEED_SUPER to vhci-hcd's USB 3 root hub
+// and would put anything else, 6 included, on the USB 2 one.
+static int usbip_speed_code(enum libusb_speed speed) {
+    switch (speed) {
+        case LIBUSB_SPEED_LOW: return 1;
+        case LIBUSB_SPEED_FULL: return 2;
+        case LIBUSB_SPEED_HIGH: return 3;
+        case LIBUSB_SPEED_SUPER:
+        case LIBUSB_SPEED_SUPER_PLUS:
+        case LIBUSB_SPEED_SUPER_PLUS_X2: return 5;
+        default: return 0;
+    }
+}
+
+// For kernels without USBDEVFS_GET_SPEED. A USB 3 device on a USB 2 link enumerates with
+// bcdUSB 2.x, so bcdUSB 3.x together with a SuperSpeed or SuperSpeedPlus capability in
+// the BOS means the link is running at SuperSpeed.
+static enum libusb_speed speed_from_bos(libusb_device_handle* handle) {
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(libusb_get_device(handle), &desc) != LIBUSB_SUCCESS ||
+        desc.bcdUSB < 0x0300) {
+        return LIBUSB_SPEED_UNKNOWN;
+    }
+
+    struct libusb_bos_descriptor* bos = NULL;
+    if (libusb_get_bos_descriptor(handle, &bos) != LIBUSB_SUCCESS) return LIBUSB_SPEED_UNKNOWN;
+
+    enum libusb_speed speed = LIBUSB_SPEED_UNKNOWN;
+    for (int i = 0; i < bos->bNumDeviceCaps; i++) {
+        struct libusb_bos_dev_capability_descriptor* cap = bos->dev_capability[i];
+        if (cap->bDevCapabilityType == LIBUSB_BT_SUPERSPEED_PLUS_CAPABILITY &&
+            cap->bLength >= LIBUSB_BT_SSPLUS_USB_DEVICE_CAPABILITY_SIZE) {
+            speed = LIBUSB_SPEED_SUPER_PLUS;
+        } else if (cap->bDevCapabilityType == LIBUSB_BT_SS_USB_DEVICE_CAPABILITY && speed == LIBUSB_SPEED_UNKNOWN) {
+            struct libusb_ss_usb_device_capability_descriptor* ss = NULL;
+            if (libusb_get_ss_usb_device_capability_descriptor(g_ctx, cap, &ss) == LIBUSB_SUCCESS) {
+                speed = LIBUSB_SPEED_SUPER;
+                libusb_free_ss_usb_device_capability_descriptor(ss);
+            }
+        }
+    }
+    libusb_free_bos_descriptor(bos);
+    return speed;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_getDeviceSpeed(JNIEnv *env, jobject thiz,
+                                                                          jint fd) {
+    struct AttachedDeviceHandle* dev = find_device_by_fd(fd);
+    if (dev == NULL) return -ENOENT;
+
+    // Filled in from USBDEVFS_GET_SPEED when the handle was wrapped
+    enum libusb_speed speed = (enum libusb_speed)libusb_get_device_speed(libusb_get_device(dev->handle));
+    if (speed == LIBUSB_SPEED_UNKNOWN) speed = speed_from_bos(dev->handle);
+    return usbip_speed_code(speed);
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_setEventThreadProfile(JNIEnv *env, jobject thiz,
+                                                                                 jint nice, jint fifoPriority,
+                                                                                 jlong cpuMask) {
+    pthread_mutex_lock(&g_eventProfileMutex);
+    g_eventProfile.nice = nice;
+    g_eventProfile.fifoPriority = fifoPriority;
+    g_eventProfile.cpuMask = (uint64_t)cpuMask;
+    g_eventProfileSet = 1;
+    g_eventProfileResult = -1;
+    if (g_eventThreadTid != 0) g_eventProfileResult = thread_profile_apply(&g_eventProfile, g_eventThreadTid);
+    int result = g_eventProfileResult;
+    pthread_mutex_unlock(&g_eventProfileMutex);
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_getEventThreadProfileResult(JNIEnv *env, jobject thiz) {
+    pthread_mutex_lock(&g_eventProfileMutex);
+    int result = g_eventProfileResult;
+    pthread_mutex_unlock(&g_eventProfileMutex);
+    return result;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_applyThreadProfile(JNIEnv *env, jobject thiz,
+                                                                              jint nice, jint fifoPriority,
+                                                                              jlong cpuMask) {
+    struct ThreadProfile profile = { .nice = nice, .fifoPriority = fifoPriority, .cpuMask = (uint64_t)cpuMask };
+    return thread_profile_apply(&profile, thread_profile_current_tid());
+}
+
+JNIEXPORT void JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_setBusyPoll(JNIEnv *env, jobject thiz,
+                                                                       jint spinUs, jint idleMs) {
+    atomic_store(&g_busyPoll.idleMs, idleMs > 0 ? (unsigned int)idleMs : 0);
+    atomic_store(&g_busyPoll.lastActivityNs, metrics_now_ns());
+    atomic_store(&g_busyPoll.spinUs, spinUs > 0 ? (unsigned int)spinUs : 0);
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_getBusyPollStats(JNIEnv *env, jobject thiz) {
+    jlong stats[BUSY_POLL_STAT_COUNT];
+    for (int i = 0; i < BUSY_POLL_STAT_COUNT; i++) stats[i] = (jlong)atomic_load(&g_busyPoll.stats[i]);
+
+    jlongArray result = (*env)->NewLongArray(env, BUSY_POLL_STAT_COUNT);
+    if (result != NULL) {
+        (*env)->SetLongArrayRegion(env, result, 0, BUSY_POLL_STAT_COUNT, stats);
+    }
+    return result;
+}
+
+// The kernel polls the NIC queue for up to usec before a blocking read sleeps. Raising
+// it above net.core.busy_read needs CAP_NET_ADMIN on most kernels.
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_setSocketBusyPoll(JNIEnv *env, jobject thiz,
+                                                                             jint fd, jint usec) {
+    int value = usec;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0) return -errno;
+    return 0;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_compressBlock(JNIEnv *env, jobject thiz,
+                                                                         jobject src, jint srcOffset,
+                                                                         jint srcLength, jbyteArray dst) {
+    uint8_t* in = (*env)->GetDirectBufferAddress(env, src);
+    jlong capacity = (*env)->GetDirectBufferCapacity(env, src);
+    if (in == NULL || srcOffset < 0 || srcLength < 0 || (jlong)srcOffset + srcLength > capacity) {
+        return -EINVAL;
+    }
+
+    // Anything that doesn't beat the input is worthless to the caller, stop early
+    jsize dst_len = (*env)->GetArrayLength(env, dst);
+    int limit = dst_len < srcLength ? dst_len : srcLength - 1;
+    if (limit <= 0) return 0;
+
+    uint8_t* out = (*env)->GetPrimitiveArrayCritical(env, dst, NULL);
+    if (out == NULL) return -ENOMEM;
+    int r = lz4_compress_block(in + srcOffset, srcLength, out, limit);
+    (*env)->ReleasePrimitiveArrayCritical(env, dst, out, r > 0 ? 0 : JNI_ABORT);
+    return r;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_techphenom_usbipserver_server_protocol_usb_UsbLib_decompressBlock(JNIEnv *env, jobject thiz,
+                                                                           jbyteArray src, jint srcLength,
+                                                                           jbyteArray dst) {
+    if (srcLength < 0 || srcLength > (*env)->GetArrayLength(env, src)) return -EINVAL;
+    jsize dst_len = (*env)->GetArrayLength(env, dst);
+
+    uint8_t* in = (*env)->GetPrimitiveArrayCritical(env, src, NULL);
+    if (in == NULL) return -ENOMEM;
+    uint8_t* out = (*env)->GetPrimitiveArrayCritical(env, dst, NULL);
+    if (out == NULL) {
+        (*env)->ReleasePrimitiveArrayCritical(env, src, in, JNI_ABORT);
+        return -ENOMEM;
+    }
+    int r = lz4_decompress_block(in, srcLength, out, dst_len);
+    (*env)->ReleasePrimitiveArrayCritical(env, dst, out, 0);
+    (*env)->ReleasePrimitiveArrayCritical(env, src, in, JNI_ABORT);
+    return r < 0 ? -EPROTO : r;
+}
@@ -0,0 +1,217 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb_src/libusb/libusb.h"
+#include "usbipmetrics.h"
+
+// Everything is updated with relaxed atomics from whichever thread sees the event, so
+// the hot path never takes a lock. Snapshots are not a consistent cut across counters,
+// which is fine for monitoring.
+struct LatencyHistogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sumNs;
+    _Atomic uint64_t maxNs;
+    _Atomic uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
+struct EndpointMetrics {
+    _Atomic uint64_t urbs;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t unlinks;
+    _Atomic uint64_t statuses[METRICS_STATUS_COUNT];
+    struct LatencyHistogram stages[METRICS_STAGE_COUNT];
+};
+
+// Roughly 2 MB of bss, but only the pages of endpoints that actually see traffic get touched.
+static struct EndpointMetrics g_metrics[METRICS_MAX_DEVICES][METRICS_MAX_ENDPOINTS];
+
+static const char *const STAGE_NAMES[METRICS_STAGE_COUNT] = {
+        "submit", "device", "callback", "reply_queue"
+};
+static const char *const STATUS_NAMES[METRICS_STATUS_COUNT] = {
+        "ok", "cancelled", "timed_out", "stall", "no_device", "overflow", "error", "submit_failed"
+};
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts); // Same clock as System.nanoTime() on Android
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int metrics_endpoint_index(int endpoint_address) {
+    return (endpoint_address & 0x0f) | ((endpoint_address & 0x80) ? 0x10 : 0);
+}
+
+int metrics_endpoint_address(int endpoint) {
+    return (endpoint & 0x0f) | ((endpoint & 0x10) ? 0x80 : 0);
+}
+
+static struct EndpointMetrics *endpoint_metrics(int dev, int endpoint_address) {
+    if (dev < 0 || dev >= METRICS_MAX_DEVICES) return NULL;
+    return &g_metrics[dev][metrics_endpoint_index(endpoint_address)];
+}
+
+static int bucket_index(uint64_t ns) {
+    if (ns < (1ull << METRICS_MIN_SHIFT)) {
+        return (int)(ns >> (METRICS_MIN_SHIFT - METRICS_SUB_BUCKET_BITS));
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb > METRICS_MAX_SHIFT) return METRICS_HISTOGRAM_BUCKETS - 1;
+
+    int major = msb - METRICS_MIN_SHIFT + 1;
+    int sub = (int)((ns >> (msb - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1));
+    return major * METRICS_SUB_BUCKETS + sub;
+}
+
+// Upper bound of a bucket, so percentiles err on the pessimistic side.
+static uint64_t bucket_upper_bound(int index) {
+    int major = index / METRICS_SUB_BUCKETS;
+    int sub = index % METRICS_SUB_BUCKETS;
+    if (major == 0) {
+        return (uint64_t)(sub + 1) << (METRICS_MIN_SHIFT - METRICS_SUB_BUCKET_BITS);
+    }
+    int msb = major + METRICS_MIN_SHIFT - 1;
+    return (1ull << msb) + ((uint64_t)(sub + 1) << (msb - METRICS_SUB_BUCKET_BITS));
+}
+
+static enum MetricsStatus status_bucket(int libusb_status) {
+    switch (libusb_status) {
+        case LIBUSB_TRANSFER_COMPLETED: return METRICS_STATUS_OK;
+        case LIBUSB_TRANSFER_CANCELLED: return METRICS_STATUS_CANCELLED;
+        case LIBUSB_TRANSFER_TIMED_OUT: return METRICS_STATUS_TIMED_OUT;
+        case LIBUSB_TRANSFER_STALL: return METRICS_STATUS_STALL;
+        case LIBUSB_TRANSFER_NO_DEVICE: return METRICS_STATUS_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW: return METRICS_STATUS_OVERFLOW;
+        default: return METRICS_STATUS_ERROR;
+    }
+}
+
+void metrics_reset_device(int dev) {
+    if (dev < 0 || dev >= METRICS_MAX_DEVICES) return;
+    memset(g_metrics[dev], 0, sizeof(g_metrics[dev]));
+}
+
+void metrics_record_completion(int dev, int endpoint, int libusb_status, int bytes) {
+    struct EndpointMetrics *m = endpoint_metrics(dev, endpoint);
+    if (m == NULL) return;
+    atomic_fetch_add_explicit(&m->urbs, 1, memory_order_relaxed);
+    if (bytes > 0) atomic_fetch_add_explicit(&m->bytes, (uint64_t)bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->statuses[status_bucket(libusb_status)], 1, memory_order_relaxed);
+}
+
+void metrics_record_submit_failure(int dev, int endpoint) {
+    struct EndpointMetrics *m = endpoint_metrics(dev, endpoint);
+    if (m == NULL) return;
+    atomic_fetch_add_explicit(&m->statuses[METRICS_STATUS_SUBMIT_FAILED], 1, memory_order_relaxed);
+}
+
+void metrics_record_unlink(int dev, int endpoint) {
+    struct EndpointMetrics *m = endpoint_metrics(dev, endpoint);
+    if (m == NULL) return;
+    atomic_fetch_add_explicit(&m->unlinks, 1, memory_order_relaxed);
+}
+
+void metrics_record_latency(int dev, int endpoint, enum MetricsStage stage, uint64_t ns) {
+    struct EndpointMetrics *m = endpoint_metrics(dev, endpoint);
+    if (m == NULL || stage >= METRICS_STAGE_COUNT) return;
+
+    struct LatencyHistogram *h = &m->stages[stage];
+    atomic_fetch_add_explicit(&h->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sumNs, ns, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&h->maxNs, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->maxNs, &max, ns,
+                                                              memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+int metrics_endpoint_active(int dev, int endpoint) {
+    if (dev < 0 || dev >= METRICS_MAX_DEVICES || endpoint < 0 || endpoint >= METRICS_MAX_ENDPOINTS) return 0;
+    struct EndpointMetrics *m = &g_metrics[dev][endpoint];
+    if (atomic_load_explicit(&m->urbs, memory_order_relaxed) > 0) return 1;
+    if (atomic_load_explicit(&m->unlinks, memory_order_relaxed) > 0) return 1;
+    return atomic_load_explicit(&m->statuses[METRICS_STATUS_SUBMIT_FAILED], memory_order_relaxed) > 0;
+}
+
+void metrics_snapshot(int dev, int endpoint, struct EndpointMetricsSnapshot *out) {
+    memset(out, 0, sizeof(*out));
+    if (dev < 0 || dev >= METRICS_MAX_DEVICES || endpoint < 0 || endpoint >= METRICS_MAX_ENDPOINTS) return;
+
+    struct EndpointMetrics *m = &g_metrics[dev][endpoint];
+    out->urbs = atomic_load_explicit(&m->urbs, memory_order_relaxed);
+    out->bytes = atomic_load_explicit(&m->bytes, memory_order_relaxed);
+    out->unlinks = atomic_load_explicit(&m->unlinks, memory_order_relaxed);
+    for (int i = 0; i < METRICS_STATUS_COUNT; i++) {
+        out->statuses[i] = atomic_load_explicit(&m->statuses[i], memory_order_relaxed);
+    }
+    for (int s = 0; s < METRICS_STAGE_COUNT; s++) {
+        struct LatencyHistogram *h = &m->stages[s];
+        struct HistogramSnapshot *hs = &out->stages[s];
+        hs->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+        hs->sumNs = atomic_load_explicit(&h->sumNs, memory_order_relaxed);
+        hs->maxNs = atomic_load_explicit(&h->maxNs, memory_order_relaxed);
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+            hs->buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t metrics_histogram_percentile(const struct HistogramSnapshot *h, double percentile) {
+    uint64_t total = 0;
+    for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) total += h->buckets[b];
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t bound = bucket_upper_bound(b);
+            return bound < h->maxNs ? bound : h->maxNs;
+        }
+    }
+    return h->maxNs;
+}
+
+#define APPEND(...) do { \
+        int n = snprintf(out + used, used < size ? size - used : 0, __VA_ARGS__); \
+        if (n > 0) used += (size_t)n; \
+    } while (0)
+
+// Plain text, one block per endpoint that has seen traffic. Returns the length the full
+// report needs, like snprintf.
+size_t metrics_format_device(int dev, char *out, size_t size) {
+    size_t used = 0;
+    struct EndpointMetricsSnapshot snap;
+
+    if (size > 0) out[0] = '\0';
+    for (int ep = 0; ep < METRICS_MAX_ENDPOINTS; ep++) {
+        if (!metrics_endpoint_active(dev, ep)) continue;
+        metrics_snapshot(dev, ep, &snap);
+
+        APPEND("  endpoint 0x%02x: urbs=%llu bytes=%llu unlinks=%llu\n", metrics_endpoint_address(ep),
+               (unsigned long long)snap.urbs, (unsigned long long)snap.bytes, (unsigned long long)snap.unlinks);
+        APPEND("    status:");
+        for (int i = 0; i < METRICS_STATUS_COUNT; i++) {
+            if (snap.statuses[i] > 0) APPEND(" %s=%llu", STATUS_NAMES[i], (unsigned long long)snap.statuses[i]);
+        }
+        APPEND("\n");
+        for (int s = 0; s < METRICS_STAGE_COUNT; s++) {
+            const struct HistogramSnapshot *h = &snap.stages[s];
+            if (h->count == 0) continue;
+            APPEND("    %-11s n=%llu mean=%lluus p50=%lluus p99=%lluus p999=%lluus max=%lluus\n", STAGE_NAMES[s],
+                   (unsigned long long)h->count,
+                   (unsigned long long)(h->sumNs / h->count / 1000),
+                   (unsigned long long)(metrics_histogram_percentile(h, 50.0) / 1000),
+                   (unsigned long long)(metrics_histogram_percentile(h, 99.0) / 1000),
+                   (unsigned long long)(metrics_histogram_percentile(h, 99.9) / 1000),
+                   (unsigned long long)(h->maxNs / 1000));
+        }
+    }
+    return used;
+}
@@ -0,0 +1,73 @@
+#ifndef USBIP_USBIPMETRICS_H
+#define USBIP_USBIPMETRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_MAX_DEVICES 16
+#define METRICS_MAX_ENDPOINTS 32 // 16 endpoint numbers, both directions
+
+// Log-linear buckets in the spirit of HdrHistogram: every power of two between
+// 2^METRICS_MIN_SHIFT and 2^METRICS_MAX_SHIFT ns is split into 8 linear sub-buckets,
+// which keeps the error of any reported percentile under 12.5%.
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MIN_SHIFT 10 // ~1 us, everything below shares the linear first range
+#define METRICS_MAX_SHIFT 36 // ~68 s, everything above is clamped into the last bucket
+#define METRICS_HISTOGRAM_BUCKETS ((METRICS_MAX_SHIFT - METRICS_MIN_SHIFT + 2) * METRICS_SUB_BUCKETS)
+
+// Stage boundaries of a URB. Order matches UsbLib.METRICS_STAGE_* on the Kotlin side.
+enum MetricsStage {
+    METRICS_STAGE_SUBMIT,      // Request read off the socket -> libusb_submit_transfer
+    METRICS_STAGE_DEVICE,      // Submitted -> completion reaped
+    METRICS_STAGE_CALLBACK,    // Completion reaped -> Java callback returned
+    METRICS_STAGE_REPLY_QUEUE, // Reply queued -> written to the socket
+    METRICS_STAGE_COUNT
+};
+
+enum MetricsStatus {
+    METRICS_STATUS_OK,
+    METRICS_STATUS_CANCELLED,
+    METRICS_STATUS_TIMED_OUT,
+    METRICS_STATUS_STALL,
+    METRICS_STATUS_NO_DEVICE,
+    METRICS_STATUS_OVERFLOW,
+    METRICS_STATUS_ERROR,
+    METRICS_STATUS_SUBMIT_FAILED,
+    METRICS_STATUS_COUNT
+};
+
+struct HistogramSnapshot {
+    uint64_t count;
+    uint64_t sumNs;
+    uint64_t maxNs;
+    uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
+struct EndpointMetricsSnapshot {
+    uint64_t urbs;
+    uint64_t bytes;
+    uint64_t unlinks;
+    uint64_t statuses[METRICS_STATUS_COUNT];
+    struct HistogramSnapshot stages[METRICS_STAGE_COUNT];
+};
+
+uint64_t metrics_now_ns(void);
+
+void metrics_reset_device(int dev);
+
+void metrics_record_completion(int dev, int endpoint, int libusb_status, int bytes);
+void metrics_record_submit_failure(int dev, int endpoint);
+void metrics_record_unlink(int dev, int endpoint);
+void metrics_record_latency(int dev, int endpoint, enum MetricsStage stage, uint64_t ns);
+
+int metrics_endpoint_active(int dev, int endpoint);
+void metrics_snapshot(int dev, int endpoint, struct EndpointMetricsSnapshot *out);
+uint64_t metrics_histogram_percentile(const struct HistogramSnapshot *h, double percentile);
+
+int metrics_endpoint_address(int endpoint);
+int metrics_endpoint_index(int endpoint_address);
+
+size_t metrics_format_device(int dev, char *out, size_t size);
+
+#endif // USBIP_USBIPMETRICS_H
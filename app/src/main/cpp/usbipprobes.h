@@ -0,0 +1,85 @@
+#ifndef USBIP_PROBES_H
+#define USBIP_PROBES_H
+
+// USDT probes on the URB path under the provider "usbip". Every probe takes seqNum,
+// fd, endpoint, length and status (negative errno), all as 32-bit ints:
+//
+//   device_open      -1, fd, 0, 0, result
+//   device_close     -1, fd, 0, transfers cancelled, 0
+//   urb_submit       seqNum, fd, endpoint, length, 0 (as it goes to libusb)
+//   urb_submit_fail  seqNum, fd, endpoint, length, error
+//   urb_reap         seqNum, fd, endpoint, actual length, kernel URB status
+//                    (linux_usbfs.c, or host/simbackend.c)
+//   callback_entry   seqNum, -1, endpoint, actual length, status (fd not looked up yet)
+//   callback_return  seqNum, fd, endpoint, actual length, status
+//   urb_cancel       seqNum, fd, endpoint (-1 if unknown), 0, result
+//
+// e.g. callback time per endpoint:
+//   bpftrace -e 'usdt:libusbipfunctions.so:usbip:callback_entry { @t[arg0] = nsecs; }
+//                usdt:libusbipfunctions.so:usbip:callback_return /@t[arg0]/ {
+//                    @us[arg2] = hist((nsecs - @t[arg0]) / 1000); delete(@t[arg0]); }'
+//
+// A probe site is one nop plus an ELF note describing where its arguments live, so it
+// costs nothing until perf, bpftrace or simpleperf attaches. The note follows the
+// SystemTap sys/sdt.h format; that header is used when present, but neither the NDK
+// nor most hosts ship it. Define USBIP_NO_PROBES to compile the probes out.
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USBIP_HAVE_SYS_SDT 1
+#endif
+#endif
+
+#if defined(USBIP_NO_PROBES)
+
+#define USBIP_PROBE(name, seq, fd, ep, len, status) do {} while (0)
+
+#elif defined(USBIP_HAVE_SYS_SDT)
+
+#include <sys/sdt.h>
+#define USBIP_PROBE(name, seq, fd, ep, len, status) \
+    DTRACE_PROBE5(usbip, name, (int)(seq), (int)(fd), (int)(ep), (int)(len), (int)(status))
+
+#elif defined(__x86_64__) || defined(__aarch64__)
+
+#if defined(__x86_64__)
+#define USBIP_PROBE_ARG(x) "nor"((int)(x))
+#else
+#define USBIP_PROBE_ARG(x) "r"((int)(x))
+#endif
+
+#define USBIP_PROBE(name, seq, fd, ep, len, status)                                          \
+    __asm__ __volatile__("990: nop\n"                                                        \
+                         ".pushsection .note.stapsdt,\"?\",\"note\"\n"                       \
+                         ".balign 4\n"                                                       \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                                  \
+                         "991: .asciz \"stapsdt\"\n"                                         \
+                         "992: .balign 4\n"                                                  \
+                         "993: .8byte 990b\n"                                                \
+                         ".8byte _.stapsdt.base\n"                                           \
+                         ".8byte 0\n"                                                        \
+                         ".asciz \"usbip\"\n"                                                \
+                         ".asciz \"" #name "\"\n"                                            \
+                         ".asciz \"-4@%0 -4@%1 -4@%2 -4@%3 -4@%4\"\n"                       \
+                         "994: .balign 4\n"                                                  \
+                         ".popsection\n"                                                     \
+                         ".ifndef _.stapsdt.base\n"                                          \
+                         ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+                         ".weak _.stapsdt.base\n"                                            \
+                         ".hidden _.stapsdt.base\n"                                          \
+                         "_.stapsdt.base: .space 1\n"                                        \
+                         ".size _.stapsdt.base, 1\n"                                         \
+                         ".popsection\n"                                                     \
+                         ".endif\n"                                                          \
+                         :                                                                   \
+                         : USBIP_PROBE_ARG(seq), USBIP_PROBE_ARG(fd), USBIP_PROBE_ARG(ep),   \
+                           USBIP_PROBE_ARG(len), USBIP_PROBE_ARG(status))
+
+#else
+
+// No note layout for this architecture (32-bit ARM/x86 use 4-byte addresses)
+#define USBIP_PROBE(name, seq, fd, ep, len, status) do {} while (0)
+
+#endif
+
+#endif // USBIP_PROBES_H
@@ -4,52 +4,81 @@ import android.hardware.usb.UsbDevice
 import android.hardware.usb.UsbDeviceConnection
 import android.hardware.usb.UsbEndpoint
 import android.util.SparseArray
-import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpBasicPacket
+import com.techphenom.usbipserver.server.protocol.ongoing.MessagePool
+import com.techphenom.usbipserver.server.protocol.ongoing.TunnelCodec
 import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
-import com.techphenom.usbipserver.server.protocol.utils.Logger
-import kotlinx.coroutines.channels.Channel
+import com.techphenom.usbipserver.server.protocol.usb.UsbLib
 import kotlinx.coroutines.sync.Semaphore
-import java.net.Socket
+import java.io.IOException
 import java.nio.ByteBuffer
 import java.util.concurrent.ConcurrentHashMap
-import java.util.concurrent.ConcurrentLinkedQueue
+import java.util.concurrent.atomic.AtomicBoolean
 
-class AttachedDeviceContext {
+class AttachedDeviceContext(private val usbLib: UsbLib, config: UsbIpServerConfig) {
     lateinit var device: UsbDevice
     lateinit var devConn: UsbDeviceConnection
     var activeConfig: UsbConfiguration? = null
     var activeConfigEndpointCache: SparseArray<UsbEndpoint>? = null
-    val pendingTransfers: MutableMap<Int, PendingTransfer> = ConcurrentHashMap()
+    // Recycled URB messages, shared by the session's reader and whoever answers its URBs
+    val messages = MessagePool()
+    val pendingTransfers = PendingTransfers(messages)
     val transferSemaphore = Semaphore(permits = MAX_CONCURRENT_TRANSFERS)
-    val replyChannel = Channel<UsbIpBasicPacket>(Channel.UNLIMITED)
-    private val bufferPool = ConcurrentLinkedQueue<ByteBuffer>()
+    // Replaced when a parked session is resumed, the old one is closed with its socket
+    var replyQueue = ReplyQueue(config.replyQueueMaxBytes, config.replyQueueMaxCount)
+    var sessionRecorder: SessionRecorder? = null
+    var trafficProfile: TrafficProfile? = null
+    // Set by each import, for clients that asked for the compressed tunnel framing
+    var tunnel: TunnelCodec? = null
+    // Read-ahead state by endpoint address, and the owner of each read-ahead transfer
+    // still with libusb by its (negative) seqNum
+    val readAhead: MutableMap<Int, ReadAheadEndpoint> = ConcurrentHashMap()
+    val readAheadInFlight: MutableMap<Int, ReadAheadEndpoint> = ConcurrentHashMap()
+    // Bulk-Only Transport interfaces by both their endpoint addresses, filled in on the
+    // first bulk URB after each configuration change, and the owner of each transfer
+    // they have with libusb
+    val bulkOnly: MutableMap<Int, BulkOnlyAccelerator> = ConcurrentHashMap()
+    @Volatile var bulkOnlyScanned = false
+    val bulkOnlyInFlight: MutableMap<Int, BulkOnlyAccelerator> = ConcurrentHashMap()
+    // The current connection's submit queues, replaced like replyQueue on a resume
+    @Volatile var submitStages: SubmitStages? = null
+    // When the reader last took a command off the socket, for busy-poll mode
+    var lastRequestNs = 0L
+    // Set when the native layer reports the device unplugged, such a session isn't parked
+    @Volatile var deviceGone = false
 
     companion object {
         const val MAX_CONCURRENT_TRANSFERS = 50
     }
 
+    /**
+     * Buffers come from the native size-class pool of this device, so the capacity is
+     * [size] rounded up to the next power of two. Every buffer must be handed back
+     * through [releaseBuffer] exactly once.
+     */
+    @Throws(IOException::class)
     fun acquireBuffer(size: Int): ByteBuffer {
-        val iterator = bufferPool.iterator()
-        while (iterator.hasNext()) {
-            val buf = iterator.next()
-            if (buf.capacity() >= size) {
-                iterator.remove()
-                buf.clear()
-                Logger.i("AttachedDevCon", "Reusing Buffer, capacity: ${buf.capacity()}, position: ${buf.position()}, limit: ${buf.limit()}")
-                return buf
-            }
-        }
-        return ByteBuffer.allocateDirect(maxOf(size, 16384))
+        return usbLib.allocBuffer(devConn.fileDescriptor, size)
+            ?: throw IOException("Unable to allocate $size byte transfer buffer")
     }
 
     fun releaseBuffer(buffer: ByteBuffer?) {
-        buffer?.clear()
-        if(buffer != null) bufferPool.offer(buffer)
+        if (buffer != null) usbLib.releaseBuffer(buffer)
     }
 
-    data class PendingTransfer(
-        val socket: Socket,
-        val request: UsbIpSubmitUrb,
-        var transferBuffer: ByteBuffer
-    )
+    fun bufferPoolStats(): BufferPoolStats? {
+        return usbLib.getBufferPoolStats(devConn.fileDescriptor)?.let { BufferPoolStats.fromArray(it) }
+    }
+
+    /** Reused through [PendingTransfers], which fills the fields in. */
+    class PendingTransfer {
+        lateinit var socket: ClientConnection
+        lateinit var request: UsbIpSubmitUrb
+        lateinit var transferBuffer: ByteBuffer
+        // Set by whichever of UNLINK or completion gets to the transfer first
+        val unlinked = AtomicBoolean(false)
+        // Guarded by the PendingTransfers lock: set once libusb has the transfer, and by an
+        // UNLINK that came before that, for the submitter to cancel it
+        var submitted = false
+        var cancelOnSubmit = false
+    }
 }
\ No newline at end of file
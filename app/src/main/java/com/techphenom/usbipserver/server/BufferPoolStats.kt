@@ -0,0 +1,22 @@
+package com.techphenom.usbipserver.server
+
+/**
+ * Snapshot of a device's native transfer buffer pool. Layout of the backing array
+ * matches `enum BufferCacheStat` in bufferpool.h.
+ */
+data class BufferPoolStats(
+    val bytesInUse: Long,
+    val bytesCached: Long,
+    val peakInUse: Long,
+    val peakTotal: Long,
+    val allocations: Long,
+    val reuses: Long,
+    val trimmedBytes: Long,
+    val prewarmedBytes: Long
+) {
+    companion object {
+        fun fromArray(stats: LongArray): BufferPoolStats {
+            return BufferPoolStats(stats[0], stats[1], stats[2], stats[3], stats[4], stats[5], stats[6], stats[7])
+        }
+    }
+}
@@ -0,0 +1,309 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import com.techphenom.usbipserver.server.protocol.utils.Logger
+import kotlinx.coroutines.channels.Channel
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * Pipelining for one mass storage interface speaking Bulk-Only Transport (class 0x08,
+ * protocol 0x50). Every SCSI command there is a CBW on the bulk OUT endpoint, a data
+ * phase and a CSW on the bulk IN endpoint, and the client sends each URB only once the
+ * one before it has come back, so a read costs three network round trips.
+ *
+ * For READ(10) and READ(16) the server queues the data phase and the CSW transfers
+ * itself as soon as the CBW has reached the device, before the client hears about it,
+ * and answers the client's next IN URBs from their results. What the device returned
+ * is handed out in order and unchanged: data URBs take bytes until they are full or the
+ * data phase ends, the URB after that takes the CSW. A URB whose part is still on the
+ * device waits for it, holding up its endpoint's submitter like a real device would.
+ *
+ * A failed data phase, or a CSW that is malformed or reports a phase error, is still
+ * passed on as it came, then acceleration stays off for the interface. So it does when
+ * an OUT URB or a control request for the interface or its endpoints (a reset or a
+ * CLEAR_FEATURE) arrives while a command is in progress: the caller then [stop]s it,
+ * cancelling what is still on the device, and the client's URBs go to the device.
+ */
+class BulkOnlyAccelerator(
+    val interfaceNumber: Int,
+    val outEndpoint: Int,
+    val inEndpoint: Int,
+    inMaxPacketSize: Int,
+    private val acquire: (Int) -> ByteBuffer,
+    private val release: (ByteBuffer) -> Unit,
+    private val deliver: (ReadAheadEndpoint.Answer) -> Unit,
+    // Where turning acceleration off is reported
+    private val warn: (String) -> Unit = { Logger.w("BulkOnlyAccelerator", it) }
+) {
+    private class Transfer(val seqNum: Int, val buffer: ByteBuffer) {
+        // -1 while it is on the device
+        var actualLength = -1
+        var status = 0
+    }
+
+    private class Command(val tag: Int, val dataLength: Int, val data: Transfer) {
+        // null when the client's own URB fetches the CSW
+        var csw: Transfer? = null
+        var phase = PHASE_DATA
+        var offset = 0
+    }
+
+    private var candidateSeqNum = 0
+    private var candidateTag = 0
+    private var candidateLength = 0
+    private var command: Command? = null
+    private val inFlight = HashMap<Int, ByteBuffer>()
+    private var disabled = false
+    private val progress = Channel<Unit>(Channel.CONFLATED)
+    private val maxPacketSize = inMaxPacketSize.coerceAtLeast(1)
+
+    private var commands = 0L
+    private var accelerated = 0L
+    private var answered = 0L
+
+    /**
+     * Looks at an OUT URB on its way to the device and remembers it if it is a CBW for a
+     * read. Returns false if a command was still in progress, which the caller must then
+     * [stop].
+     */
+    @Synchronized
+    fun commandSubmitted(request: UsbIpSubmitUrb): Boolean {
+        candidateSeqNum = 0
+        if (command != null) {
+            disable("OUT URB during a command")
+            return false
+        }
+        if (disabled || request.transferBufferLength != CBW_LENGTH) return true
+        val cbw = ByteBuffer.wrap(request.outData, 0, CBW_LENGTH).order(ByteOrder.LITTLE_ENDIAN)
+        if (cbw.getInt(0) != CBW_SIGNATURE) return true
+        commands++
+        val dataLength = cbw.getInt(8)
+        val opcode = cbw.get(15).toInt() and 0xff
+        val cbLength = cbw.get(14).toInt() and 0x1f
+        if ((cbw.get(12).toInt() and 0x80) == 0 || dataLength !in 1..MAX_DATA_LENGTH) return true
+        if (!(opcode == READ_10 && cbLength >= 10 || opcode == READ_16 && cbLength >= 16)) return true
+        candidateSeqNum = request.seqNum
+        candidateTag = cbw.getInt(4)
+        candidateLength = dataLength
+        return true
+    }
+
+    /**
+     * The completion of a URB on the OUT endpoint. Returns the data length to read ahead
+     * if it was a read's CBW that reached the device whole, 0 otherwise.
+     */
+    @Synchronized
+    fun commandSent(seqNum: Int, status: Int, actualLength: Int): Int {
+        if (seqNum != candidateSeqNum) return 0
+        candidateSeqNum = 0
+        return if (status == 0 && actualLength == CBW_LENGTH && !disabled) candidateLength else 0
+    }
+
+    /** Starts the command with its data phase transfer, which the caller submits next. */
+    @Synchronized
+    fun begin(seqNum: Int, buffer: ByteBuffer) {
+        command = Command(candidateTag, candidateLength, Transfer(seqNum, buffer))
+        inFlight[seqNum] = buffer
+        accelerated++
+    }
+
+    /** Adds the CSW transfer to the command, which the caller submits next. */
+    @Synchronized
+    fun beginStatus(seqNum: Int, buffer: ByteBuffer) {
+        val cmd = command ?: return
+        cmd.csw = Transfer(seqNum, buffer)
+        inFlight[seqNum] = buffer
+    }
+
+    /** Takes back a transfer that failed to submit, the client's own URBs do its part. */
+    @Synchronized
+    fun withdraw(seqNum: Int) {
+        inFlight.remove(seqNum)?.let(release)
+        val cmd = command ?: return
+        if (cmd.data.seqNum == seqNum) {
+            command = null
+            accelerated--
+        } else if (cmd.csw?.seqNum == seqNum) {
+            cmd.csw = null
+        }
+        progress.trySend(Unit)
+    }
+
+    /** Keeps the result of one of our transfers. Returns false if it isn't ours. */
+    @Synchronized
+    fun onCompleted(seqNum: Int, status: Int, actualLength: Int): Boolean {
+        val buffer = inFlight.remove(seqNum) ?: return false
+        val cmd = command
+        val transfer = when {
+            cmd == null -> null
+            cmd.data.seqNum == seqNum -> cmd.data
+            else -> cmd.csw?.takeIf { it.seqNum == seqNum }
+        }
+        if (cmd == null || transfer == null) {
+            release(buffer) // Of a command that was stopped
+            return true
+        }
+        transfer.status = status
+        transfer.actualLength = actualLength
+        if (transfer === cmd.data) {
+            if (status != 0) disable("data phase ended with $status")
+        } else {
+            val csw = buffer.duplicate().order(ByteOrder.LITTLE_ENDIAN)
+            if (status != 0 || actualLength != CSW_LENGTH) {
+                disable("CSW transfer ended with $status, $actualLength bytes")
+            } else if (csw.getInt(0) != CSW_SIGNATURE || csw.getInt(4) != cmd.tag) {
+                disable("CSW doesn't match its CBW")
+            } else if (csw.get(12).toInt() == CSW_PHASE_ERROR) {
+                disable("device reported a phase error")
+            }
+        }
+        progress.trySend(Unit)
+        return true
+    }
+
+    /**
+     * Answers [request], an IN URB, if it is part of the command in progress. Returns
+     * [ANSWERED] once [deliver] has its answer, [WAIT] while its part is still on the
+     * device (see [awaitProgress]) and [PASS] when it should go to the device itself.
+     */
+    @Synchronized
+    fun take(request: UsbIpSubmitUrb): Int {
+        val cmd = command
+        if (cmd == null) {
+            // Already reading on its own, our transfers would take what it expects
+            candidateSeqNum = 0
+            return PASS
+        }
+        val answer = when (cmd.phase) {
+            PHASE_DATA -> if (cmd.data.actualLength < 0) null else takeData(cmd, request)
+            PHASE_ZERO_LENGTH -> ReadAheadEndpoint.Answer(request, 0, acquire(1), 0).also { cmd.phase = PHASE_STATUS }
+            else -> {
+                val csw = cmd.csw
+                if (csw == null) {
+                    command = null
+                    return PASS
+                }
+                if (csw.actualLength < 0) null else takeStatus(csw, request)
+            }
+        }
+        if (answer == null) return WAIT
+        deliver(answer)
+        answered++
+        return ANSWERED
+    }
+
+    /** Suspends until one of our transfers completes or the command ends. */
+    suspend fun awaitProgress() {
+        progress.receive()
+    }
+
+    /** Whether [stop] has anything to do: a command is in progress. */
+    @Synchronized
+    fun isBusy(): Boolean = command != null
+
+    /**
+     * Ends the command in progress, turning acceleration off when [disable] is set.
+     * Results not handed out yet are dropped; transfers still on the device hand their
+     * buffers back as they complete, their seqNums are added to [inFlightOut] for
+     * cancelling.
+     */
+    @Synchronized
+    fun stop(inFlightOut: MutableList<Int>, disable: Boolean) {
+        if (disable) disable("command interrupted")
+        candidateSeqNum = 0
+        val cmd = command ?: return
+        command = null
+        for (transfer in listOfNotNull(cmd.data, cmd.csw)) {
+            if (transfer.actualLength < 0) {
+                inFlightOut.add(transfer.seqNum)
+            } else if (transfer === cmd.csw || cmd.phase == PHASE_DATA) {
+                release(transfer.buffer)
+            }
+        }
+        progress.trySend(Unit)
+    }
+
+    /** Hands back the buffers of transfers that will never complete, after the handle is closed. */
+    @Synchronized
+    fun abandon() {
+        for (buffer in inFlight.values) release(buffer)
+        inFlight.clear()
+    }
+
+    @Synchronized
+    fun stats(): String =
+        "commands=$commands accelerated=$accelerated answered=$answered " +
+            "inFlight=${inFlight.size} off=$disabled"
+
+    private fun takeData(cmd: Command, request: UsbIpSubmitUrb): ReadAheadEndpoint.Answer {
+        val data = cmd.data
+        val want = request.transferBufferLength
+        val buffer = acquire(want.coerceAtLeast(1))
+        val count = minOf(want, data.actualLength - cmd.offset)
+        if (count > 0) {
+            val src = data.buffer.duplicate()
+            src.limit(cmd.offset + count)
+            src.position(cmd.offset)
+            buffer.put(src)
+            buffer.position(0)
+            cmd.offset += count
+        }
+        if (cmd.offset < data.actualLength) return ReadAheadEndpoint.Answer(request, 0, buffer, count)
+
+        // The end of the data phase. If it came back short but filled this URB exactly
+        // with whole packets, the device ended it with a zero length packet, which the
+        // next URB gets. Filled by a short packet, the URB simply completed.
+        release(data.buffer)
+        cmd.phase = if (data.status == 0 && count == want && want > 0 && want % maxPacketSize == 0 &&
+            data.actualLength < cmd.dataLength) {
+            PHASE_ZERO_LENGTH
+        } else {
+            PHASE_STATUS
+        }
+        return ReadAheadEndpoint.Answer(request, data.status, buffer, count)
+    }
+
+    private fun takeStatus(csw: Transfer, request: UsbIpSubmitUrb): ReadAheadEndpoint.Answer {
+        val buffer = acquire(request.transferBufferLength.coerceAtLeast(1))
+        val count = minOf(request.transferBufferLength, csw.actualLength)
+        val src = csw.buffer.duplicate()
+        src.limit(count)
+        src.position(0)
+        buffer.put(src)
+        buffer.position(0)
+        release(csw.buffer)
+        command = null
+        return ReadAheadEndpoint.Answer(request, csw.status, buffer, count)
+    }
+
+    private fun disable(reason: String) {
+        if (disabled) return
+        disabled = true
+        warn("Interface $interfaceNumber: $reason, acceleration off")
+    }
+
+    companion object {
+        // bInterfaceProtocol of Bulk-Only Transport, under USB_CLASS_MASS_STORAGE
+        const val PROTOCOL_BULK_ONLY = 0x50
+
+        const val ANSWERED = 0
+        const val WAIT = 1
+        const val PASS = 2
+
+        const val CSW_LENGTH = 13
+        // Bigger reads go through unaccelerated, the native pool doesn't cache such buffers
+        const val MAX_DATA_LENGTH = 1 shl 20
+
+        private const val CBW_LENGTH = 31
+        private const val CBW_SIGNATURE = 0x43425355 // "USBC"
+        private const val CSW_SIGNATURE = 0x53425355 // "USBS"
+        private const val CSW_PHASE_ERROR = 2
+        private const val READ_10 = 0x28
+        private const val READ_16 = 0x88
+
+        private const val PHASE_DATA = 0
+        private const val PHASE_ZERO_LENGTH = 1
+        private const val PHASE_STATUS = 2
+    }
+}
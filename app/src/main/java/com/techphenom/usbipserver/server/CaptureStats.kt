@@ -0,0 +1,18 @@
+package com.techphenom.usbipserver.server
+
+/**
+ * State of the native usbmon capture. Layout of the backing array matches
+ * `enum UsbCaptureStat` in usbcapture.h.
+ */
+data class CaptureStats(
+    val active: Boolean,
+    val capturedEvents: Long,
+    val droppedEvents: Long,
+    val bytesWritten: Long
+) {
+    companion object {
+        fun fromArray(stats: LongArray): CaptureStats {
+            return CaptureStats(stats[0] != 0L, stats[1], stats[2], stats[3])
+        }
+    }
+}
@@ -0,0 +1,74 @@
+package com.techphenom.usbipserver.server
+
+import android.net.LocalSocket
+import android.os.ParcelFileDescriptor
+import java.io.Closeable
+import java.io.IOException
+import java.io.InputStream
+import java.io.OutputStream
+import java.net.Socket
+
+/**
+ * A connected USB/IP client. The protocol is the same over every transport, only the
+ * stream underneath differs.
+ */
+sealed class ClientConnection : Closeable {
+    abstract val inputStream: InputStream
+    abstract val outputStream: OutputStream
+    abstract val isConnected: Boolean
+
+    /** Equal for two connections from the same client, used to match resumed sessions. */
+    abstract val peer: String
+
+    /** Sets socket options, called on the client's coroutine before the handshake. */
+    @Throws(IOException::class)
+    open fun configure() {}
+
+    /**
+     * A duplicate of the descriptor for setting native socket options, which the caller
+     * closes. Null for transports that have none worth setting.
+     */
+    @Throws(IOException::class)
+    open fun dupDescriptor(): ParcelFileDescriptor? = null
+
+    class Tcp(private val socket: Socket) : ClientConnection() {
+        override fun configure() {
+            socket.tcpNoDelay = true
+            socket.keepAlive = true
+        }
+
+        override val inputStream: InputStream get() = socket.getInputStream()
+        override val outputStream: OutputStream get() = socket.getOutputStream()
+        override val isConnected: Boolean get() = socket.isConnected
+        override val peer: String get() = "tcp:${socket.inetAddress.hostAddress}"
+
+        override fun dupDescriptor(): ParcelFileDescriptor = ParcelFileDescriptor.fromSocket(socket)
+
+        override fun close() = socket.close()
+        override fun toString() = socket.toString()
+    }
+
+    /** AF_UNIX client on the same host, see [UsbIpServerConfig.localSocketName]. */
+    class Local(private val socket: LocalSocket) : ClientConnection() {
+        // Resolved up front, the credentials are gone once the peer has closed
+        override val peer: String = try {
+            "local:uid=${socket.peerCredentials.uid}"
+        } catch (_: IOException) {
+            "local"
+        }
+
+        override val inputStream: InputStream get() = socket.inputStream
+        override val outputStream: OutputStream get() = socket.outputStream
+        override val isConnected: Boolean get() = socket.isConnected
+
+        override fun close() {
+            // Unblocks a reader stuck in read(), which close() alone doesn't on older releases
+            try {
+                socket.shutdownInput()
+            } catch (_: IOException) {}
+            socket.close()
+        }
+
+        override fun toString() = "LocalSocket[$peer]"
+    }
+}
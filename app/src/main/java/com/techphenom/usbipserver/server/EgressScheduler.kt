@@ -0,0 +1,214 @@
+package com.techphenom.usbipserver.server
+
+import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.CoroutineScope
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.launch
+import kotlinx.coroutines.withTimeoutOrNull
+
+/**
+ * Server-wide pacing of replies across devices. Without it every device's writer puts
+ * replies on its socket as fast as the kernel takes them, so one bulk device streaming
+ * to its client fills the uplink and the others' replies queue behind its data in the
+ * network.
+ *
+ * Each writer asks [acquire] before writing a reply, and all writers together are held
+ * to [rateBytesPerSec], which should sit a little below the real uplink so the queue
+ * builds here, where it can be ordered. Latency-critical replies (interrupt and
+ * isochronous endpoints, unlinks) go out at once and only push back the rest. The rest
+ * is shared in proportion to each device's weight, optionally capped per device.
+ *
+ * A writer holds at most one reply at a time, so the sharing is start-time fair
+ * queueing rather than round robin: each request is tagged with the virtual time at
+ * which its device's previous share ran out, and the smallest tag goes next.
+ *
+ * [clock] gives the time in nanoseconds, tests pass their scheduler's.
+ */
+class EgressScheduler(
+    private val rateBytesPerSec: Long,
+    scope: CoroutineScope,
+    private val clock: () -> Long = System::nanoTime
+) {
+
+    inner class Flow internal constructor(val name: String, val weight: Int, val maxBytesPerSec: Long) {
+        internal var finishTag = 0.0
+        internal var startTag = 0.0
+        internal var pendingBytes = 0
+        internal var requestedAtNs = 0L
+        internal var grant: CompletableDeferred<Unit>? = null
+        internal val cap = if (maxBytesPerSec > 0) TokenBucket(maxBytesPerSec, clock()) else null
+
+        internal var bytes = 0L
+        internal var criticalBytes = 0L
+        internal var waits = 0L
+        internal var waitTimeNs = 0L
+        internal var maxWaitNs = 0L
+        // Bytes sent while other devices were waiting too, against the share of those
+        // bytes the weights entitled this device to
+        internal var contendedBytes = 0L
+        internal var entitledBytes = 0.0
+    }
+
+    internal class TokenBucket(private val rate: Long, nowNs: Long) {
+        private val burst = maxOf(rate / BURST_DIVISOR, MIN_BURST_BYTES).toDouble()
+        private var tokens = burst
+        private var updatedNs = nowNs
+
+        fun refill(now: Long) {
+            tokens = minOf(burst, tokens + (now - updatedNs) * rate / 1e9)
+            updatedNs = now
+        }
+
+        fun take(bytes: Int) {
+            tokens -= bytes
+        }
+
+        /** Until the bucket is out of debt, 0 if it already is. */
+        fun waitNs(): Long = if (tokens >= 0) 0 else (-tokens * 1e9 / rate).toLong() + 1
+    }
+
+    private val lock = Any()
+    private val flows = ArrayList<Flow>()
+    private val waiting = ArrayList<Flow>()
+    private val link = TokenBucket(rateBytesPerSec, clock())
+    private var virtualTime = 0.0
+    private val wakeup = Channel<Unit>(Channel.CONFLATED)
+
+    init {
+        scope.launch { dispatch() }
+    }
+
+    fun register(name: String, weight: Int, maxBytesPerSec: Long): Flow = synchronized(lock) {
+        Flow(name, weight.coerceAtLeast(1), maxBytesPerSec).also {
+            it.finishTag = virtualTime
+            flows.add(it)
+        }
+    }
+
+    fun unregister(flow: Flow) {
+        synchronized(lock) {
+            flows.remove(flow)
+            waiting.remove(flow)
+            flow.grant?.cancel()
+            flow.grant = null
+        }
+        wakeup.trySend(Unit)
+    }
+
+    /** Suspends until [flow] may write a reply of [bytes]. */
+    suspend fun acquire(flow: Flow, bytes: Int, latencyCritical: Boolean) {
+        val granted = synchronized(lock) {
+            val now = clock()
+            link.refill(now)
+            if (latencyCritical) {
+                link.take(bytes)
+                flow.bytes += bytes
+                flow.criticalBytes += bytes
+                return
+            }
+            flow.startTag = maxOf(virtualTime, flow.finishTag)
+            flow.pendingBytes = bytes
+            flow.requestedAtNs = now
+            if (waiting.isEmpty() && link.waitNs() == 0L && capWaitNs(flow, now) == 0L) {
+                grant(flow, now)
+                return
+            }
+            // Only a reply that has to wait costs an allocation
+            CompletableDeferred<Unit>().also {
+                flow.grant = it
+                waiting.add(flow)
+            }
+        }
+        wakeup.trySend(Unit)
+        granted.await()
+    }
+
+    fun stats(): String = synchronized(lock) {
+        val sb = StringBuilder("rate=$rateBytesPerSec waiting=${waiting.size}\n")
+        for (flow in flows) {
+            val share = if (flow.entitledBytes > 0) "%.2f".format(flow.contendedBytes / flow.entitledBytes) else "-"
+            val avgWaitUs = if (flow.waits > 0) flow.waitTimeNs / flow.waits / 1000 else 0
+            sb.append("  ${flow.name}: weight=${flow.weight} cap=${flow.maxBytesPerSec} bytes=${flow.bytes} ")
+                .append("critical=${flow.criticalBytes} share=$share waits=${flow.waits} ")
+                .append("avgWaitUs=$avgWaitUs maxWaitUs=${flow.maxWaitNs / 1000}\n")
+        }
+        sb.toString()
+    }
+
+    private suspend fun dispatch() {
+        while (true) {
+            val waitNs = synchronized(lock) { grantReady(clock()) }
+            if (waitNs == null) {
+                wakeup.receive()
+            } else {
+                withTimeoutOrNull((waitNs + 999_999) / 1_000_000) { wakeup.receive() }
+            }
+        }
+    }
+
+    /** Grants what the link allows. Returns how long until the next grant could happen, null if nobody waits. */
+    private fun grantReady(now: Long): Long? {
+        link.refill(now)
+        while (waiting.isNotEmpty()) {
+            val linkWait = link.waitNs()
+            if (linkWait > 0) return linkWait
+
+            var next: Flow? = null
+            var eligible = 0
+            var weightSum = 0
+            var capWait = Long.MAX_VALUE
+            for (flow in waiting) {
+                val wait = capWaitNs(flow, now)
+                if (wait > 0) {
+                    capWait = minOf(capWait, wait)
+                    continue
+                }
+                eligible++
+                weightSum += flow.weight
+                if (next == null || flow.startTag < next.startTag) next = flow
+            }
+            if (next == null) return capWait
+
+            if (eligible > 1) {
+                for (flow in waiting) {
+                    if (flow.cap == null || flow.cap.waitNs() == 0L) {
+                        flow.entitledBytes += next.pendingBytes.toDouble() * flow.weight / weightSum
+                    }
+                }
+                next.contendedBytes += next.pendingBytes
+            }
+            waiting.remove(next)
+            grant(next, now)
+        }
+        return null
+    }
+
+    private fun capWaitNs(flow: Flow, now: Long): Long {
+        val cap = flow.cap ?: return 0
+        cap.refill(now)
+        return cap.waitNs()
+    }
+
+    private fun grant(flow: Flow, now: Long) {
+        val bytes = flow.pendingBytes
+        link.take(bytes)
+        flow.cap?.take(bytes)
+        virtualTime = flow.startTag
+        flow.finishTag = flow.startTag + bytes.toDouble() / flow.weight
+        flow.bytes += bytes
+        if (flow.grant != null) {
+            val waited = now - flow.requestedAtNs
+            flow.waits++
+            flow.waitTimeNs += waited
+            flow.maxWaitNs = maxOf(flow.maxWaitNs, waited)
+            flow.grant?.complete(Unit)
+            flow.grant = null
+        }
+    }
+
+    companion object {
+        // Buckets hold 20ms worth of tokens, at least enough for a full-size bulk reply
+        private const val BURST_DIVISOR = 50
+        private const val MIN_BURST_BYTES = 64L * 1024
+    }
+}
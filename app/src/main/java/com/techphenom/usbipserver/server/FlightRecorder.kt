@@ -0,0 +1,155 @@
+package com.techphenom.usbipserver.server
+
+import java.util.Locale
+import java.util.concurrent.CopyOnWriteArrayList
+
+/**
+ * Binary record of URB lifecycle events, cheap enough to leave on in release builds.
+ *
+ * Every thread that records gets its own fixed-size ring of longs, so [record] is a few
+ * array stores and a volatile write with no locking or allocation. Nothing is formatted
+ * until [dumpText] or [exportChromeTrace] is called. Dumps run concurrently with
+ * writers, so records that might have been overwritten during the copy are dropped.
+ */
+class FlightRecorder(eventsPerThread: Int) {
+
+    enum class Event(val label: String) {
+        SUBMIT_RECEIVED("submit_rx"),
+        SUBMITTED("submitted"),
+        SUBMIT_FAILED("submit_failed"),
+        COMPLETED("completed"),
+        REPLY_QUEUED("reply_queued"),
+        REPLY_WRITTEN("reply_written"),
+        UNLINK_RECEIVED("unlink_rx"),
+        UNLINKED("unlinked")
+    }
+
+    data class Record(
+        val timestampNs: Long,
+        val threadId: Long,
+        val threadName: String,
+        val event: Event,
+        val seqNum: Int,
+        val endpoint: Int,
+        val length: Int,
+        val status: Int
+    ) {
+        override fun toString(): String {
+            return "$timestampNs [$threadName] ${event.label} seq=$seqNum ep=0x${"%02x".format(endpoint)} " +
+                    "len=$length status=$status"
+        }
+    }
+
+    private class Ring(val capacity: Int, val thread: Thread) {
+        // WORDS_PER_RECORD longs per event: timestamp, event/endpoint/seqNum, length/status
+        val words = LongArray(capacity * WORDS_PER_RECORD)
+        @Volatile var head = 0L
+    }
+
+    private val capacity = Integer.highestOneBit(eventsPerThread.coerceAtLeast(16))
+    private val rings = CopyOnWriteArrayList<Ring>()
+    private val localRing = object : ThreadLocal<Ring>() {
+        override fun initialValue(): Ring {
+            val ring = Ring(capacity, Thread.currentThread())
+            // IO threads come and go; keep the history of dead ones only while there's room
+            if (rings.size >= MAX_RINGS) rings.removeIf { !it.thread.isAlive }
+            rings.add(ring)
+            return ring
+        }
+    }
+
+    @Volatile var enabled = eventsPerThread > 0
+
+    fun record(event: Event, seqNum: Int, endpoint: Int = 0, length: Int = 0, status: Int = 0) {
+        if (!enabled) return
+        val ring = localRing.get()!!
+        val head = ring.head
+        val base = (head.toInt() and (ring.capacity - 1)) * WORDS_PER_RECORD
+        ring.words[base] = System.nanoTime()
+        ring.words[base + 1] = (event.ordinal.toLong() and 0xff) or
+                ((endpoint.toLong() and 0xff) shl 8) or
+                (seqNum.toLong() shl 32)
+        ring.words[base + 2] = (length.toLong() shl 32) or (status.toLong() and 0xffffffffL)
+        ring.head = head + 1
+    }
+
+    /** Every surviving record from every thread, oldest first. */
+    fun snapshot(): List<Record> {
+        val records = ArrayList<Record>()
+        for (ring in rings) {
+            val headBefore = ring.head
+            val copy = ring.words.copyOf()
+            val headAfter = ring.head
+
+            // Slots written to while copying are unreliable, as is the one being written now
+            val first = maxOf(0L, headAfter - ring.capacity + 1)
+            for (i in first until headBefore) {
+                val base = (i.toInt() and (ring.capacity - 1)) * WORDS_PER_RECORD
+                val packed = copy[base + 1]
+                val event = EVENTS.getOrNull((packed and 0xff).toInt()) ?: continue
+                records.add(Record(
+                    timestampNs = copy[base],
+                    threadId = ring.thread.id,
+                    threadName = ring.thread.name,
+                    event = event,
+                    seqNum = (packed ushr 32).toInt(),
+                    endpoint = ((packed ushr 8) and 0xff).toInt(),
+                    length = (copy[base + 2] ushr 32).toInt(),
+                    status = copy[base + 2].toInt()
+                ))
+            }
+        }
+        records.sortBy { it.timestampNs }
+        return records
+    }
+
+    fun dumpText(): String = snapshot().joinToString("\n")
+
+    /**
+     * Chrome trace event format, loadable in Perfetto or chrome://tracing. Each URB is an
+     * async slice keyed by seqNum, from the socket read to its reply hitting the wire.
+     */
+    fun exportChromeTrace(): String {
+        val records = snapshot()
+        val origin = records.firstOrNull()?.timestampNs ?: 0L
+        val sb = StringBuilder(64 + records.size * 160)
+        sb.append("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[")
+
+        val threads = records.associate { it.threadId to it.threadName }
+        var first = true
+        for ((tid, name) in threads) {
+            if (!first) sb.append(',')
+            first = false
+            sb.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":").append(tid)
+                .append(",\"args\":{\"name\":\"").append(name.replace("\\", "\\\\").replace("\"", "\\\""))
+                .append("\"}}")
+        }
+
+        for (r in records) {
+            val phase = when (r.event) {
+                Event.SUBMIT_RECEIVED -> "b"
+                Event.REPLY_WRITTEN -> "e"
+                else -> "n"
+            }
+            if (!first) sb.append(',')
+            first = false
+            sb.append("{\"name\":\"").append(if (phase == "n") r.event.label else "urb")
+                .append("\",\"cat\":\"urb\",\"ph\":\"").append(phase)
+                .append("\",\"id\":").append(r.seqNum.toLong() and 0xffffffffL)
+                .append(",\"pid\":1,\"tid\":").append(r.threadId)
+                .append(",\"ts\":").append(String.format(Locale.ROOT, "%.3f", (r.timestampNs - origin) / 1000.0))
+                .append(",\"args\":{\"ep\":").append(r.endpoint)
+                .append(",\"len\":").append(r.length)
+                .append(",\"status\":").append(r.status)
+                .append("}}")
+        }
+        sb.append("]}")
+        return sb.toString()
+    }
+
+    companion object {
+        private const val WORDS_PER_RECORD = 3
+        private const val MAX_RINGS = 64
+        private val EVENTS = Event.values()
+    }
+}
@@ -0,0 +1,128 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.AttachedDeviceContext.PendingTransfer
+import com.techphenom.usbipserver.server.protocol.ongoing.MessagePool
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import java.nio.ByteBuffer
+
+/**
+ * The client URBs of one device that libusb has, by seqNum. A map would box the seqNum
+ * and allocate a node per URB; this is a small array scanned under a lock, and the
+ * entries are reused once [recycle]d. There are rarely more than
+ * AttachedDeviceContext.MAX_CONCURRENT_TRANSFERS of them, plus unlinked transfers
+ * still draining.
+ */
+class PendingTransfers(private val messages: MessagePool) {
+    private var entries = arrayOfNulls<PendingTransfer>(INITIAL_CAPACITY)
+    private var count = 0
+    private val free = ArrayList<PendingTransfer>(INITIAL_CAPACITY)
+
+    @Synchronized
+    fun add(socket: ClientConnection, request: UsbIpSubmitUrb, transferBuffer: ByteBuffer): PendingTransfer {
+        val pending = if (free.isEmpty()) {
+            messages.noteAllocation()
+            PendingTransfer()
+        } else {
+            free.removeAt(free.size - 1)
+        }
+        pending.socket = socket
+        pending.request = request
+        pending.transferBuffer = transferBuffer
+        pending.unlinked.set(false)
+        pending.submitted = false
+        pending.cancelOnSubmit = false
+        if (count == entries.size) {
+            messages.noteAllocation()
+            entries = entries.copyOf(count * 2)
+        }
+        entries[count++] = pending
+        return pending
+    }
+
+    @Synchronized
+    operator fun get(seqNum: Int): PendingTransfer? {
+        val index = indexOf(seqNum)
+        return if (index < 0) null else entries[index]
+    }
+
+    @Synchronized
+    fun remove(seqNum: Int): PendingTransfer? {
+        val index = indexOf(seqNum)
+        if (index < 0) return null
+        val pending = entries[index]
+        entries[index] = entries[--count]
+        entries[count] = null
+        return pending
+    }
+
+    /** Hands a removed entry back for reuse; nothing may hold on to it afterwards. */
+    @Synchronized
+    fun recycle(pending: PendingTransfer) {
+        if (free.size < entries.size) free.add(pending)
+    }
+
+    @Synchronized
+    fun isNotEmpty(): Boolean = count > 0
+
+    @Synchronized
+    fun hasEndpoint(endpointAddress: Int): Boolean {
+        for (i in 0 until count) {
+            if (entries[i]!!.request.endpointAddress == endpointAddress) return true
+        }
+        return false
+    }
+
+    /**
+     * For an UNLINK of [seqNum] that its submitter hasn't handed to libusb yet: flags it
+     * for the submitter to cancel once it has. False if libusb has it or it isn't here.
+     */
+    @Synchronized
+    fun cancelOnSubmit(seqNum: Int): Boolean {
+        val index = indexOf(seqNum)
+        if (index < 0 || entries[index]!!.submitted) return false
+        entries[index]!!.cancelOnSubmit = true
+        return true
+    }
+
+    /** The submitter's side: libusb has [seqNum] now. False if an UNLINK wants it cancelled. */
+    @Synchronized
+    fun markSubmitted(seqNum: Int): Boolean {
+        val index = indexOf(seqNum)
+        if (index < 0) return true // Completed already
+        entries[index]!!.submitted = true
+        return !entries[index]!!.cancelOnSubmit
+    }
+
+    /**
+     * For an UNLINK: takes over answering [seqNum] from its completion. Returns its
+     * endpoint address, or -1 if it has completed or was answered already.
+     */
+    @Synchronized
+    fun claim(seqNum: Int): Int {
+        val index = indexOf(seqNum)
+        if (index < 0) return -1
+        val pending = entries[index]!!
+        return if (pending.unlinked.compareAndSet(false, true)) pending.request.endpointAddress else -1
+    }
+
+    /** A copy, for the teardown paths that walk every transfer. */
+    @Synchronized
+    fun snapshot(): List<PendingTransfer> = List(count) { entries[it]!! }
+
+    @Synchronized
+    fun clear() {
+        entries.fill(null, 0, count)
+        count = 0
+    }
+
+    private fun indexOf(seqNum: Int): Int {
+        for (i in 0 until count) {
+            if (entries[i]!!.request.seqNum == seqNum) return i
+        }
+        return -1
+    }
+
+    companion object {
+        private const val INITIAL_CAPACITY = 64
+    }
+}
@@ -0,0 +1,208 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import java.nio.ByteBuffer
+
+/**
+ * Server-side read-ahead for one bulk or interrupt IN endpoint. Without it the device
+ * is only polled while the client has a URB outstanding, so every completion leaves the
+ * endpoint idle for a network round trip. Here the server keeps its own transfers
+ * queued, buffers what they return and answers client URBs from that buffer.
+ *
+ * Transfer boundaries are kept. A client URB takes bytes until it is full or until it
+ * reaches the end of a read-ahead transfer that came back short, which is where the
+ * device sent a short packet and a real URB would have completed too. A URB that can't
+ * complete either way waits for more data. An error completion goes to the next client
+ * URB after the data that preceded it (and to any queued behind it), then read-ahead
+ * ends on the endpoint and later URBs go straight to the device.
+ *
+ * Everything runs under the object's lock, including [deliver], so client URBs are
+ * answered in the order the data arrived whichever thread gets there first.
+ */
+class ReadAheadEndpoint(
+    val endpoint: Int,
+    val interrupt: Boolean,
+    private val policy: ReadAheadPolicy,
+    maxPacketSize: Int,
+    private val acquire: (Int) -> ByteBuffer,
+    private val release: (ByteBuffer) -> Unit,
+    private val deliver: (Answer) -> Unit
+) {
+    /** A client URB answered from the buffer; [data] is positioned at the first byte. */
+    class Answer(val request: UsbIpSubmitUrb, val status: Int, val data: ByteBuffer, val actualLength: Int)
+
+    // buffer is null for an error, which always counts as a boundary
+    private class Chunk(val buffer: ByteBuffer?, val length: Int, val short: Boolean, val status: Int) {
+        var offset = 0
+    }
+
+    /**
+     * Whole packets, so only a short packet from the device ends a transfer early. One
+     * packet on interrupt endpoints: a device sending full-size reports would otherwise
+     * only complete a transfer every transferSize / maxPacketSize reports.
+     */
+    val transferSize = maxPacketSize.coerceAtLeast(1).let { mps ->
+        if (interrupt) mps else (policy.transferSize + mps - 1) / mps * mps
+    }
+
+    private val chunks = ArrayDeque<Chunk>()
+    private val waiting = ArrayDeque<UsbIpSubmitUrb>()
+    private val inFlight = HashMap<Int, ByteBuffer>()
+    private var bufferedBytes = 0
+    private var failedStatus = 0
+    private var stopped = false
+
+    private var answered = 0L
+    private var answeredAtOnce = 0L
+    private var bytesServed = 0L
+
+    /**
+     * Queues a client URB and answers whatever can be answered. Returns false, without
+     * taking the URB, once read-ahead has ended on this endpoint.
+     */
+    @Synchronized
+    fun take(request: UsbIpSubmitUrb): Boolean {
+        if (stopped || (failedStatus != 0 && chunks.isEmpty() && waiting.isEmpty())) return false
+        val before = answered
+        waiting.addLast(request)
+        drain()
+        if (waiting.isEmpty() && answered > before) answeredAtOnce++
+        return true
+    }
+
+    /** Answers [seqNum] with nothing if it is still waiting. Returns false if it isn't here. */
+    @Synchronized
+    fun unlink(seqNum: Int): Boolean = waiting.removeAll { it.seqNum == seqNum }
+
+    /**
+     * How many transfers to submit now to keep the queue at depth within the byte budget.
+     * The budget stretches to the client URB at the head of the queue, which would never
+     * fill otherwise if it is larger.
+     */
+    @Synchronized
+    fun wanted(): Int {
+        if (stopped || failedStatus != 0) return 0
+        val budget = maxOf(policy.maxBufferedBytes, (waiting.firstOrNull()?.transferBufferLength ?: 0) + transferSize)
+        var count = 0
+        while (inFlight.size + count < policy.depth &&
+            bufferedBytes + (inFlight.size + count + 1) * transferSize <= budget) {
+            count++
+        }
+        return count
+    }
+
+    @Synchronized
+    fun register(seqNum: Int, buffer: ByteBuffer) {
+        inFlight[seqNum] = buffer
+    }
+
+    /** Buffers the result of one of our transfers. Returns false if it isn't ours. */
+    @Synchronized
+    fun onCompleted(seqNum: Int, status: Int, actualLength: Int): Boolean {
+        val buffer = inFlight.remove(seqNum) ?: return false
+        if (stopped) {
+            release(buffer)
+            return true
+        }
+        if (actualLength > 0) {
+            chunks.addLast(Chunk(buffer, actualLength, actualLength < transferSize || status != 0, 0))
+            bufferedBytes += actualLength
+        } else {
+            if (status == 0) chunks.addLast(Chunk(null, 0, true, 0)) // Zero length packet
+            release(buffer)
+        }
+        if (status != 0 && failedStatus == 0) {
+            failedStatus = status
+            chunks.addLast(Chunk(null, 0, true, status))
+        }
+        drain()
+        return true
+    }
+
+    /**
+     * Ends read-ahead and returns the client URBs that were still waiting. Buffered data
+     * is dropped; transfers in flight hand their buffers back as they complete, their
+     * seqNums are returned in [inFlightOut] for cancelling.
+     */
+    @Synchronized
+    fun stop(inFlightOut: MutableList<Int>): List<UsbIpSubmitUrb> {
+        stopped = true
+        for (chunk in chunks) chunk.buffer?.let(release)
+        chunks.clear()
+        bufferedBytes = 0
+        inFlightOut.addAll(inFlight.keys)
+        val pending = waiting.toList()
+        waiting.clear()
+        return pending
+    }
+
+    /** Hands back the buffers of transfers that will never complete, after the handle is closed. */
+    @Synchronized
+    fun abandon() {
+        for (buffer in inFlight.values) release(buffer)
+        inFlight.clear()
+    }
+
+    @Synchronized
+    fun stats(): String =
+        "answered=$answered atOnce=$answeredAtOnce bytes=$bytesServed buffered=$bufferedBytes " +
+            "inFlight=${inFlight.size} waiting=${waiting.size}"
+
+    private fun drain() {
+        while (waiting.isNotEmpty()) {
+            val request = waiting.first()
+            if (!isReady(request.transferBufferLength)) break
+            waiting.removeFirst()
+            deliver(fill(request))
+            answered++
+        }
+    }
+
+    private fun isReady(want: Int): Boolean {
+        if (want == 0 || chunks.isEmpty() && failedStatus != 0) return true
+        var available = 0
+        for (chunk in chunks) {
+            if (chunk.status != 0) return true
+            available += chunk.length - chunk.offset
+            if (available >= want || chunk.short) return true
+        }
+        return false
+    }
+
+    private fun fill(request: UsbIpSubmitUrb): Answer {
+        val want = request.transferBufferLength
+        val data = acquire(want.coerceAtLeast(1))
+        if (want == 0) return Answer(request, 0, data, 0)
+
+        val head = chunks.firstOrNull()
+        if (head == null || head.status != 0) {
+            // Everything before the error has been handed out
+            if (head != null) chunks.removeFirst()
+            return Answer(request, failedStatus, data, 0)
+        }
+
+        var filled = 0
+        while (chunks.isNotEmpty()) {
+            val chunk = chunks.first()
+            if (chunk.status != 0) break
+            val count = minOf(want - filled, chunk.length - chunk.offset)
+            if (count > 0) {
+                val src = chunk.buffer!!.duplicate()
+                src.limit(chunk.offset + count)
+                src.position(chunk.offset)
+                data.position(filled)
+                data.put(src)
+                chunk.offset += count
+                filled += count
+            }
+            if (chunk.offset < chunk.length) break // This URB is full
+            chunks.removeFirst()
+            chunk.buffer?.let(release)
+            bufferedBytes -= chunk.length
+            if (chunk.short || filled == want) break
+        }
+        data.position(0)
+        bytesServed += filled
+        return Answer(request, 0, data, filled)
+    }
+}
@@ -0,0 +1,111 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpBasicPacket
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrbReply
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.channels.ChannelIterator
+import java.io.IOException
+import java.util.concurrent.atomic.AtomicInteger
+import java.util.concurrent.atomic.AtomicLong
+
+/**
+ * Per-device queue of replies waiting to be written to the socket.
+ *
+ * [offer] never suspends because completions arrive on the libusb event thread. The
+ * bound is enforced on the request side instead: the reader calls [awaitCapacity]
+ * before taking the next command off the socket, so a slow network pushes back on the
+ * client through TCP flow control. At most the transfers already in flight can land on
+ * top of the limits.
+ */
+class ReplyQueue(private val maxBytes: Long, private val maxCount: Int) {
+    private val channel = Channel<UsbIpBasicPacket>(Channel.UNLIMITED)
+    private val spaceAvailable = Channel<Unit>(Channel.CONFLATED)
+
+    private val queuedCount = AtomicInteger()
+    private val queuedBytes = AtomicLong()
+    private val peakCount = AtomicInteger()
+    private val peakBytes = AtomicLong()
+    private val stallCount = AtomicLong()
+    private val stallTimeNs = AtomicLong()
+
+    val isFull: Boolean
+        get() = queuedCount.get() >= maxCount || queuedBytes.get() >= maxBytes
+
+    fun offer(reply: UsbIpBasicPacket): Boolean {
+        val count = queuedCount.incrementAndGet()
+        val bytes = queuedBytes.addAndGet(sizeOf(reply))
+        peakCount.accumulateAndGet(count, ::maxOf)
+        peakBytes.accumulateAndGet(bytes, ::maxOf)
+
+        if (channel.trySend(reply).isSuccess) return true
+        onWritten(reply)
+        return false
+    }
+
+    operator fun iterator(): ChannelIterator<UsbIpBasicPacket> = channel.iterator()
+
+    /** Called by the writer once [reply] has left the queue and hit the socket. */
+    fun onWritten(reply: UsbIpBasicPacket) {
+        queuedCount.decrementAndGet()
+        queuedBytes.addAndGet(-sizeOf(reply))
+        if (!isFull) spaceAvailable.trySend(Unit)
+    }
+
+    @Throws(IOException::class)
+    suspend fun awaitCapacity() {
+        if (!isFull) return
+
+        val start = System.nanoTime()
+        stallCount.incrementAndGet()
+        try {
+            while (isFull) {
+                if (spaceAvailable.receiveCatching().isClosed) throw IOException("Reply writer stopped")
+            }
+        } finally {
+            stallTimeNs.addAndGet(System.nanoTime() - start)
+        }
+    }
+
+    /** Wakes a reader stuck in [awaitCapacity] after the writer has died. */
+    fun abort() {
+        spaceAvailable.close()
+    }
+
+    /** Closes the queue and hands every reply that never made it out to [onDropped]. */
+    fun close(onDropped: (UsbIpBasicPacket) -> Unit) {
+        channel.close()
+        while (true) {
+            val reply = channel.tryReceive().getOrNull() ?: break
+            onWritten(reply)
+            onDropped(reply)
+        }
+        spaceAvailable.close()
+    }
+
+    fun stats(): ReplyQueueStats {
+        return ReplyQueueStats(
+            depth = queuedCount.get(),
+            bytesQueued = queuedBytes.get(),
+            peakDepth = peakCount.get(),
+            peakBytesQueued = peakBytes.get(),
+            stallCount = stallCount.get(),
+            stallTimeNs = stallTimeNs.get()
+        )
+    }
+
+    private fun sizeOf(reply: UsbIpBasicPacket): Long {
+        // Count the pooled buffer a reply pins rather than its wire size, since memory is
+        // what the bound is protecting.
+        val payload = if (reply is UsbIpSubmitUrbReply) reply.inData?.capacity() ?: 0 else 0
+        return (UsbIpBasicPacket.USBIP_HEADER_SIZE + payload).toLong()
+    }
+}
+
+data class ReplyQueueStats(
+    val depth: Int,
+    val bytesQueued: Long,
+    val peakDepth: Int,
+    val peakBytesQueued: Long,
+    val stallCount: Long,
+    val stallTimeNs: Long
+)
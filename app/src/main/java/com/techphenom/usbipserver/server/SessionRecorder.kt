@@ -0,0 +1,119 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpUnlinkUrb
+import com.techphenom.usbipserver.server.protocol.utils.Logger
+import java.io.File
+import java.io.FileOutputStream
+import java.io.IOException
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * Records the timed command stream of one attached device: every SUBMIT and UNLINK
+ * as the client sent it and every completion as the device returned it. Payloads are
+ * not kept, so sessions are small and safe to share. host/usbipreplay plays them back
+ * against a simulated device.
+ *
+ * The file is a [HEADER_SIZE] byte header followed by fixed [RECORD_SIZE] byte
+ * little-endian records, see usbipreplay.c for the layout.
+ */
+class SessionRecorder private constructor(private val out: FileOutputStream) {
+
+    private val startNs = System.nanoTime()
+    private val buffer = ByteBuffer.allocate(BUFFER_SIZE).order(ByteOrder.LITTLE_ENDIAN)
+    private var failed = false
+
+    fun submit(msg: UsbIpSubmitUrb, transferType: Int) =
+        append(KIND_SUBMIT, transferType, msg.endpointAddress, msg.direction, msg.seqNum) {
+            putInt(msg.transferBufferLength)
+            putInt(msg.transferFlags.value)
+            putInt(msg.numberOfPackets.coerceAtLeast(0))
+            putInt(msg.interval)
+            put(msg.setup.bytes)
+        }
+
+    fun unlink(msg: UsbIpUnlinkUrb) = append(KIND_UNLINK, 0, 0, 0, msg.seqNum) {
+        putInt(msg.seqNumToUnlink)
+    }
+
+    fun complete(seqNum: Int, status: Int, actualLength: Int, isoErrors: Int) =
+        append(KIND_COMPLETE, 0, 0, 0, seqNum) {
+            putInt(status)
+            putInt(actualLength)
+            putInt(isoErrors)
+        }
+
+    private inline fun append(kind: Int, transferType: Int, endpoint: Int, direction: Int, seqNum: Int,
+                              body: ByteBuffer.() -> Unit) {
+        val now = System.nanoTime()
+        synchronized(this) {
+            if (failed) return
+            if (buffer.remaining() < RECORD_SIZE) flushLocked()
+            val start = buffer.position()
+            buffer.put(kind.toByte())
+            buffer.put(transferType.toByte())
+            buffer.put(endpoint.toByte())
+            buffer.put(direction.toByte())
+            buffer.putInt(seqNum)
+            buffer.putLong(now - startNs)
+            buffer.body()
+            // Unused fields stay as left by the last record, zero them
+            while (buffer.position() < start + RECORD_SIZE) buffer.put(0)
+        }
+    }
+
+    private fun flushLocked() {
+        try {
+            out.write(buffer.array(), 0, buffer.position())
+        } catch (e: IOException) {
+            Logger.e("SessionRecorder", "Recording stopped: ${e.message}")
+            failed = true
+        }
+        buffer.clear()
+    }
+
+    fun close() {
+        synchronized(this) {
+            if (!failed) flushLocked()
+            failed = true
+            try {
+                out.close()
+            } catch (_: IOException) {}
+        }
+    }
+
+    companion object {
+        const val HEADER_SIZE = 32
+        const val RECORD_SIZE = 40
+        private const val VERSION = 1
+        private const val BUFFER_SIZE = RECORD_SIZE * 1024
+        private val MAGIC = "UIPRSESS".toByteArray(Charsets.US_ASCII)
+
+        const val KIND_SUBMIT = 1
+        const val KIND_UNLINK = 2
+        const val KIND_COMPLETE = 3
+
+        /** Returns null, after logging why, if the file can't be created. */
+        fun open(dir: String, busId: String, vendorId: Int, productId: Int, speed: Int): SessionRecorder? {
+            return try {
+                val file = File(dir, "session-$busId-${System.currentTimeMillis()}.uipr")
+                val out = FileOutputStream(file)
+                val header = ByteBuffer.allocate(HEADER_SIZE).order(ByteOrder.LITTLE_ENDIAN)
+                header.put(MAGIC)
+                header.putShort(VERSION.toShort())
+                header.putShort(vendorId.toShort())
+                header.putShort(productId.toShort())
+                header.put(speed.toByte())
+                header.put(0)
+                header.putLong(System.currentTimeMillis())
+                out.write(header.array())
+                Logger.i("SessionRecorder", "Recording to $file")
+                SessionRecorder(out)
+            } catch (e: IOException) {
+                Logger.e("SessionRecorder", "Unable to record in $dir: ${e.message}")
+                null
+            }
+        }
+    }
+}
@@ -0,0 +1,104 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import kotlinx.coroutines.channels.Channel
+
+/**
+ * Decoded CMD_SUBMITs for one endpoint on their way from the connection's reader to the
+ * endpoint's submitter, in the order the client sent them. Bounded: a full queue stops
+ * the reader, the same way a full reply queue does.
+ *
+ * The submitter works on the URB at the head in place and only removes it once it has
+ * been handed on (to pendingTransfers or a read-ahead endpoint). Callers hold the queue's
+ * monitor across [isHead], the hand-off and [removeHead], and [unlink] takes the same
+ * monitor, so an UNLINK finds the URB either still here or wherever it went.
+ */
+class SubmitQueue(capacity: Int) {
+    private val items = arrayOfNulls<UsbIpSubmitUrb>(capacity.coerceAtLeast(1))
+    private var head = 0
+    private var count = 0
+    private var closed = false
+    private val itemAvailable = Channel<Unit>(Channel.CONFLATED)
+    private val spaceAvailable = Channel<Unit>(Channel.CONFLATED)
+
+    private var peakCount = 0
+    private var stalls = 0L
+    private var unlinked = 0L
+
+    /** Reader side, suspends while the queue is full. Returns false once the queue is closed. */
+    suspend fun put(request: UsbIpSubmitUrb): Boolean {
+        var stalled = false
+        while (true) {
+            synchronized(this) {
+                if (closed) return false
+                if (count < items.size) {
+                    items[(head + count) % items.size] = request
+                    count++
+                    peakCount = maxOf(peakCount, count)
+                    if (stalled) stalls++
+                    itemAvailable.trySend(Unit)
+                    return true
+                }
+            }
+            stalled = true
+            if (spaceAvailable.receiveCatching().isClosed) return false
+        }
+    }
+
+    /** Submitter side, suspends until there is a URB and returns it without removing it. null once closed. */
+    suspend fun awaitHead(): UsbIpSubmitUrb? {
+        while (true) {
+            synchronized(this) {
+                if (closed) return null
+                if (count > 0) return items[head]
+            }
+            if (itemAvailable.receiveCatching().isClosed) return null
+        }
+    }
+
+    /** False if [request] was unlinked since [awaitHead] returned it. */
+    @Synchronized
+    fun isHead(request: UsbIpSubmitUrb): Boolean = count > 0 && items[head] === request
+
+    @Synchronized
+    fun removeHead() {
+        if (count == 0) return
+        items[head] = null
+        head = (head + 1) % items.size
+        count--
+        spaceAvailable.trySend(Unit)
+    }
+
+    /** Takes [seqNum] out of the queue if it is still waiting here. */
+    @Synchronized
+    fun unlink(seqNum: Int): Boolean {
+        for (i in 0 until count) {
+            val index = (head + i) % items.size
+            if (items[index]?.seqNum != seqNum) continue
+            // Close the gap, keeping the order of the rest
+            for (j in i until count - 1) {
+                items[(head + j) % items.size] = items[(head + j + 1) % items.size]
+            }
+            items[(head + count - 1) % items.size] = null
+            count--
+            unlinked++
+            spaceAvailable.trySend(Unit)
+            return true
+        }
+        return false
+    }
+
+    /** Wakes both sides for good. URBs still queued are dropped, their client is gone. */
+    fun close() {
+        synchronized(this) {
+            closed = true
+            items.fill(null)
+            count = 0
+        }
+        itemAvailable.close()
+        spaceAvailable.close()
+    }
+
+    @Synchronized
+    fun stats(): String = "queued=$count peak=$peakCount stalls=$stalls unlinked=$unlinked"
+}
@@ -0,0 +1,91 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import com.techphenom.usbipserver.server.protocol.utils.Logger
+import com.techphenom.usbipserver.server.protocol.utils.intToHex
+import kotlinx.coroutines.CoroutineScope
+import kotlinx.coroutines.Job
+import kotlinx.coroutines.cancelAndJoin
+import kotlinx.coroutines.launch
+import java.io.IOException
+
+/**
+ * The submit side of one connection: a [SubmitQueue] and a submitter coroutine per
+ * endpoint, started with the endpoint's first URB. The reader only decodes and queues,
+ * so a URB waiting for a transfer permit holds up its own endpoint and nothing else,
+ * and UNLINKs are answered while submissions are blocked. Order is kept per endpoint,
+ * which is all USB/IP promises.
+ *
+ * [put] and [unlink] are only called by the reader.
+ */
+class SubmitStages(
+    private val scope: CoroutineScope,
+    private val depth: Int,
+    private val submit: suspend (SubmitQueue, UsbIpSubmitUrb) -> Unit,
+    private val onFailure: () -> Unit
+) {
+    private val queues = arrayOfNulls<SubmitQueue>(ENDPOINT_SLOTS)
+    private val submitters = ArrayList<Job>()
+    private var stopped = false
+
+    /** Suspends while the endpoint's queue is full. Returns false once [stop] was called. */
+    suspend fun put(request: UsbIpSubmitUrb): Boolean {
+        val endpoint = request.endpointAddress
+        val slot = (endpoint and 0x0f) or ((endpoint and 0x80) shr 3)
+        val queue = queues[slot] ?: synchronized(this) {
+            if (stopped) return false
+            SubmitQueue(depth).also {
+                queues[slot] = it
+                submitters.add(scope.launch { runSubmitter(endpoint, it) })
+            }
+        }
+        return queue.put(request)
+    }
+
+    /** Takes [seqNum] out of whichever queue holds it. False if it already went on. */
+    fun unlink(seqNum: Int): Boolean {
+        for (queue in queues) {
+            if (queue != null && queue.unlink(seqNum)) return true
+        }
+        return false
+    }
+
+    /** Drops whatever is still queued and waits for the submitters to finish. */
+    suspend fun stop() {
+        val jobs = synchronized(this) {
+            stopped = true
+            for (queue in queues) queue?.close()
+            submitters.toList()
+        }
+        for (job in jobs) job.cancelAndJoin()
+    }
+
+    @Synchronized
+    fun stats(): String {
+        val sb = StringBuilder()
+        for ((slot, queue) in queues.withIndex()) {
+            if (queue == null) continue
+            val endpoint = (slot and 0x0f) or ((slot and 0x10) shl 3)
+            sb.append("  submit queue ${intToHex(endpoint)}: ${queue.stats()}\n")
+        }
+        return sb.toString()
+    }
+
+    private suspend fun runSubmitter(endpoint: Int, queue: SubmitQueue) {
+        try {
+            while (true) {
+                val request = queue.awaitHead() ?: return
+                submit(queue, request)
+            }
+        } catch (e: IOException) {
+            Logger.e("Submitter", "Error submitting to ${intToHex(endpoint)}: ${e.message}")
+            queue.close()
+            onFailure()
+        }
+    }
+
+    companion object {
+        // Endpoint number plus direction
+        private const val ENDPOINT_SLOTS = 32
+    }
+}
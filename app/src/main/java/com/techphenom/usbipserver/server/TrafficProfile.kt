@@ -0,0 +1,148 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.MessagePool
+import com.techphenom.usbipserver.server.protocol.usb.UsbLib
+import com.techphenom.usbipserver.server.protocol.utils.Logger
+import com.techphenom.usbipserver.server.protocol.utils.intToHex
+import java.io.File
+import java.io.IOException
+
+/**
+ * What one device's URB traffic looked like, learned over its sessions and kept in a
+ * small text file keyed by VID, PID and serial number. On the next attach [prewarm]
+ * fills the native buffer pool, the native transfer spares and the message pool to
+ * match, so the first seconds of a session, when the client enumerates and a camera
+ * starts streaming, don't pay for growing them.
+ *
+ * Per endpoint it keeps the buffer size most URBs used, the most URBs in flight at once
+ * and the ISO packet count of the last ISO URB. An endpoint the session didn't use
+ * keeps what was learned before. [submitted] and [completed] run on the submitters and
+ * the event thread, so the counters are locked.
+ */
+class TrafficProfile private constructor(private val file: File) {
+
+    private class Endpoint(
+        var bufferSize: Int = 0,
+        var peakInFlight: Int = 0,
+        var isoPackets: Int = 0
+    ) {
+        val sizeClassCounts = LongArray(SIZE_CLASSES)
+        var inFlight = 0
+        var urbs = 0L
+    }
+
+    private val endpoints = arrayOfNulls<Endpoint>(ENDPOINT_SLOTS)
+
+    @Synchronized
+    fun submitted(endpoint: Int, bufferSize: Int, isoPackets: Int) {
+        val slot = slotOf(endpoint)
+        val ep = endpoints[slot] ?: Endpoint().also { endpoints[slot] = it }
+        if (ep.urbs == 0L) ep.peakInFlight = 0 // What was learned gives way to what is seen
+        ep.urbs++
+        ep.sizeClassCounts[sizeClassOf(bufferSize)]++
+        ep.peakInFlight = maxOf(ep.peakInFlight, ++ep.inFlight)
+        if (isoPackets > 0) ep.isoPackets = isoPackets
+    }
+
+    @Synchronized
+    fun completed(endpoint: Int) {
+        val ep = endpoints[slotOf(endpoint)] ?: return
+        if (ep.inFlight > 0) ep.inFlight--
+    }
+
+    /** Prepares what the profile expects the device to need on [fd]. */
+    @Synchronized
+    fun prewarm(usbLib: UsbLib, fd: Int, messages: MessagePool) {
+        val buffers = HashMap<Int, Int>()
+        val transfers = HashMap<Int, Int>()
+        var urbs = 0
+        for (ep in endpoints) {
+            if (ep == null || ep.peakInFlight == 0) continue
+            buffers.merge(ep.bufferSize, ep.peakInFlight, Int::plus)
+            transfers.merge(ep.isoPackets, ep.peakInFlight, Int::plus)
+            urbs += ep.peakInFlight
+        }
+        if (urbs == 0) return
+
+        var bufferCount = 0
+        var transferCount = 0
+        for ((size, count) in buffers) bufferCount += usbLib.prewarmBuffers(fd, size, count).coerceAtLeast(0)
+        for ((packets, count) in transfers) transferCount += usbLib.prewarmTransfers(fd, packets, count).coerceAtLeast(0)
+        messages.prewarm(urbs)
+        Logger.i("TrafficProfile") { "Prewarmed $bufferCount buffers, $transferCount transfers and $urbs messages from $file" }
+    }
+
+    /** Writes what was learned, replacing the file atomically. Logs and gives up on errors. */
+    @Synchronized
+    fun save() {
+        val sb = StringBuilder(HEADER).append('\n')
+        for ((slot, ep) in endpoints.withIndex()) {
+            if (ep == null) continue
+            if (ep.urbs > 0) ep.bufferSize = sizeOfClass(ep.sizeClassCounts.indices.maxBy { ep.sizeClassCounts[it] })
+            if (ep.peakInFlight == 0) continue
+            sb.append("${intToHex(endpointOf(slot))} ${ep.bufferSize} ${ep.peakInFlight} ${ep.isoPackets}\n")
+        }
+        try {
+            val tmp = File(file.path + ".tmp")
+            tmp.writeText(sb.toString())
+            if (!tmp.renameTo(file)) throw IOException("Unable to rename $tmp")
+        } catch (e: IOException) {
+            Logger.e("TrafficProfile", "Unable to save $file: ${e.message}")
+        }
+    }
+
+    private fun load() {
+        val lines = try {
+            if (!file.exists()) return
+            file.readLines()
+        } catch (e: IOException) {
+            Logger.e("TrafficProfile", "Unable to read $file: ${e.message}")
+            return
+        }
+        if (lines.firstOrNull() != HEADER) {
+            Logger.w("TrafficProfile", "Ignoring $file, not a profile this version understands")
+            return
+        }
+        for (line in lines.drop(1)) {
+            val fields = line.split(' ')
+            if (fields.size != 4) continue
+            val endpoint = fields[0].removePrefix("0x").toIntOrNull(16) ?: continue
+            val bufferSize = fields[1].toIntOrNull() ?: continue
+            val peak = fields[2].toIntOrNull() ?: continue
+            val isoPackets = fields[3].toIntOrNull() ?: continue
+            if (bufferSize <= 0 || peak !in 1..MAX_PEAK || isoPackets !in 0..MAX_ISO_PACKETS) continue
+            endpoints[slotOf(endpoint)] = Endpoint(bufferSize, peak, isoPackets)
+        }
+    }
+
+    companion object {
+        private const val HEADER = "usbip-traffic-profile 1"
+        // Endpoint number plus direction
+        private const val ENDPOINT_SLOTS = 32
+        // The native pool's size classes, 64 B to 1 MiB
+        private const val MIN_SIZE_SHIFT = 6
+        private const val SIZE_CLASSES = 15
+        // Bounds for what a damaged file may ask for; the native side caps both anyway
+        private const val MAX_PEAK = 64
+        private const val MAX_ISO_PACKETS = 1024
+
+        /** The profile of a device, with whatever an earlier session stored in [dir]. */
+        fun open(dir: String, vendorId: Int, productId: Int, serial: String?): TrafficProfile {
+            val key = serial?.replace(Regex("[^A-Za-z0-9_-]"), "_")?.takeIf { it.isNotEmpty() } ?: "noserial"
+            val name = "%04x-%04x-%s.profile".format(vendorId, productId, key)
+            return TrafficProfile(File(dir, name)).also { it.load() }
+        }
+
+        private fun slotOf(endpoint: Int) = (endpoint and 0x0f) or ((endpoint and 0x80) shr 3)
+
+        private fun endpointOf(slot: Int) = (slot and 0x0f) or ((slot and 0x10) shl 3)
+
+        private fun sizeClassOf(size: Int): Int {
+            var shift = MIN_SIZE_SHIFT
+            while (shift < MIN_SIZE_SHIFT + SIZE_CLASSES - 1 && (1 shl shift) < size) shift++
+            return shift - MIN_SIZE_SHIFT
+        }
+
+        private fun sizeOfClass(sizeClass: Int) = 1 shl (sizeClass + MIN_SIZE_SHIFT)
+    }
+}
@@ -15,8 +15,9 @@ class UsbIpDeviceConstants {
         BULK_STREAM(4, "Bulk stream transfer");
 
         companion object {
+            // Codes match the ordinals, and completions look one up each
             fun fromCode(code: Int): LibusbTransferType? =
-                entries.find { it.code == code }
+                if (code in entries.indices) entries[code] else null
         }
     }
 
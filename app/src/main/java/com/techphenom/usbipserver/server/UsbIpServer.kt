@@ -3,16 +3,21 @@ package com.techphenom.usbipserver.server
 import android.hardware.usb.UsbConstants.*
 import android.hardware.usb.UsbDevice
 import android.hardware.usb.UsbDeviceConnection
+import android.hardware.usb.UsbEndpoint
 import android.hardware.usb.UsbInterface
 import android.hardware.usb.UsbManager
+import android.net.LocalServerSocket
+import android.net.LocalSocket
 import com.techphenom.usbipserver.UsbIpEvent
 import com.techphenom.usbipserver.data.UsbIpRepository
 import com.techphenom.usbipserver.server.protocol.ProtocolCodes
 import com.techphenom.usbipserver.server.protocol.initial.CommonPacket
 import com.techphenom.usbipserver.server.protocol.initial.ImportDeviceReply
 import com.techphenom.usbipserver.server.protocol.initial.ImportDeviceRequest
+import com.techphenom.usbipserver.server.protocol.initial.DiagnosticReply
 import com.techphenom.usbipserver.server.protocol.initial.ReplyDevListPacket
 import com.techphenom.usbipserver.server.protocol.initial.convertInputStreamToPacket
+import com.techphenom.usbipserver.server.protocol.ongoing.TunnelCodec
 import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpBasicPacket
 import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
 import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb.UsbControlSetup.Companion.CONTROL_SETUP_WIRE_SIZE
@@ -29,32 +34,61 @@ import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.SupervisorJob
 import kotlinx.coroutines.cancel
+import kotlinx.coroutines.delay
 import kotlinx.coroutines.isActive
 import kotlinx.coroutines.launch
 import java.io.IOException
 import java.net.ServerSocket
-import java.net.Socket
 import java.util.concurrent.ConcurrentHashMap
+import java.util.concurrent.atomic.AtomicInteger
 import com.techphenom.usbipserver.server.UsbIpDeviceConstants.UsbIpDeviceState.*
 import com.techphenom.usbipserver.server.UsbIpDeviceConstants.LibusbTransferType
 import com.techphenom.usbipserver.server.protocol.usb.UsbLib
 import kotlinx.coroutines.Job
+import kotlinx.coroutines.NonCancellable
+import kotlinx.coroutines.withContext
+import kotlinx.coroutines.ExecutorCoroutineDispatcher
+import kotlinx.coroutines.asCoroutineDispatcher
+import java.util.concurrent.Executors
+import kotlin.coroutines.EmptyCoroutineContext
 import java.nio.ByteBuffer
 
 class UsbIpServer(
     private val repository: UsbIpRepository,
     private val usbManager: UsbManager,
-    private val onEvent: (event: UsbIpEvent) -> Unit
+    private val onEvent: (event: UsbIpEvent) -> Unit,
+    private val config: UsbIpServerConfig = UsbIpServerConfig()
     ) : UsbLib.TransferListener {
 
     private lateinit var serverSocket: ServerSocket
+    private var localServerSocket: LocalServerSocket? = null
     private lateinit var serverScope: CoroutineScope
     private var serverShutdown = false
     private val usbLib = UsbLib()
-    private val attachedDevices = ConcurrentHashMap<Socket, AttachedDeviceContext>()
+    private val flightRecorder = FlightRecorder(config.flightRecorderEventsPerThread)
+    private val attachedDevices = ConcurrentHashMap<ClientConnection, AttachedDeviceContext>()
+    // Devices whose client dropped, held for config.sessionResumeGraceMs, by device id
+    private val parkedSessions = ConcurrentHashMap<Int, ParkedSession>()
+    // Contexts of both maps, for completions to search without allocating an iterator
+    @Volatile private var completionTargets = emptyArray<AttachedDeviceContext>()
+    // Read-ahead and Bulk-Only transfers belong to the server, not a client, and count
+    // down from -2; -1 marks a free transfer slot in the native layer
+    private val serverSeqNum = AtomicInteger(-1)
+    private var egressScheduler: EgressScheduler? = null
+    // Contexts released during shutdown, whose transfer buffers wait for usbLib.exit() to
+    // reap what was still in flight. Guards exitUnreaped too, -1 until exit() has run.
+    private val awaitingExit = ArrayList<AttachedDeviceContext>()
+    private var exitUnreaped = -1
+    private val writerProfileRefusals = AtomicInteger()
+
+    private class ParkedSession(val context: AttachedDeviceContext, val client: String, val expiry: Job)
 
     companion object {
         private const val USBIP_PORT = 3240
+        // bmRequestType fields, as UsbIpSubmitUrb.UsbControlSetup splits them
+        private const val REQUEST_TYPE_CLASS = 1
+        private const val RECIPIENT_INTERFACE = 1
+        private const val RECIPIENT_ENDPOINT = 2
     }
 
     fun start() {
@@ -62,15 +96,44 @@ class UsbIpServer(
             Logger.e("start()" , "$throwable")
         }
         serverShutdown = false
+        synchronized(awaitingExit) {
+            awaitingExit.clear()
+            exitUnreaped = -1
+        }
         if(usbLib.init() < 0) throw IOException("Unable to initialize libusb")
         usbLib.setListener(this)
+        config.schedulingProfile?.let {
+            usbLib.setEventThreadProfile(it.eventThreadNice, it.eventThreadFifoPriority, it.cpuMask)
+        }
+        if (config.busyPollSpinUs > 0) usbLib.setBusyPoll(config.busyPollSpinUs, config.busyPollIdleMs)
+        config.capturePath?.let { path ->
+            val res = usbLib.startCapture(path, config.captureSnapLen)
+            if (res < 0) Logger.e("start()", "Unable to capture to $path: $res")
+        }
 
         serverScope = CoroutineScope(Dispatchers.IO + exceptionHandler)
+        egressScheduler = if (config.egressRateBytesPerSec > 0) {
+            EgressScheduler(config.egressRateBytesPerSec, serverScope)
+        } else null
         serverScope.launch {
             serverSocket = ServerSocket(USBIP_PORT)
 
             while (isActive) {
-                handleClientConnection(serverSocket.accept(), this)
+                handleClientConnection(ClientConnection.Tcp(serverSocket.accept()), this)
+            }
+        }
+        config.localSocketName?.let { name ->
+            serverScope.launch {
+                val localServer = LocalServerSocket(name)
+                localServerSocket = localServer
+                while (isActive && !serverShutdown) {
+                    val socket = localServer.accept()
+                    if (serverShutdown) {
+                        socket.close()
+                        break
+                    }
+                    handleClientConnection(ClientConnection.Local(socket), this)
+                }
             }
         }
     }
@@ -82,9 +145,9 @@ class UsbIpServer(
             serverScope.cancel()
         }
 
-        for (socket in attachedDevices.keys) {
+        for (client in attachedDevices.keys) {
             try {
-                socket.close()
+                client.close()
             } catch (e : IOException) {
                 Logger.e("stop", "Error closing socket", e)
             }
@@ -93,14 +156,33 @@ class UsbIpServer(
         if(::serverSocket.isInitialized && !serverSocket.isClosed) {
             serverSocket.close()
         }
-        usbLib.exit()
+        val localServer = localServerSocket
+        if (localServer != null) {
+            // Closing doesn't wake accept(), a connection does, and it sees serverShutdown
+            try {
+                LocalSocket().use { it.connect(localServer.localSocketAddress) }
+            } catch (_: IOException) {}
+            localServer.close()
+            localServerSocket = null
+        }
+        for (deviceId in parkedSessions.keys) {
+            parkedSessions.remove(deviceId)?.let { releaseContext(it.context) }
+        }
+        refreshCompletionTargets()
+        usbLib.stopCapture()
+        val unreaped = usbLib.exit()
+        val released = synchronized(awaitingExit) {
+            exitUnreaped = unreaped
+            awaitingExit.toList().also { awaitingExit.clear() }
+        }
+        for (context in released) settleTransferBuffers(context, unreaped)
     }
 
     fun getAttachedDeviceCount(): Int {
         return attachedDevices.size
     }
 
-    private fun handleClientConnection(socket: Socket, scope: CoroutineScope) {
+    private fun handleClientConnection(socket: ClientConnection, scope: CoroutineScope) {
         Logger.i("handleClientConnection", "Client Connected: $socket")
 
         val exceptionHandler = CoroutineExceptionHandler { _, throwable ->
@@ -108,11 +190,13 @@ class UsbIpServer(
         }
 
         var writerJob: Job? = null
+        var stages: SubmitStages? = null
+        var writerDispatcher: ExecutorCoroutineDispatcher? = null
         val clientScope = CoroutineScope(scope.coroutineContext + SupervisorJob() + exceptionHandler)
         clientScope.launch {
             try {
-                socket.tcpNoDelay = true
-                socket.keepAlive = true
+                socket.configure()
+                if (config.busyPollSpinUs > 0) enableSocketBusyPoll(socket)
 
                 if(handleInitialRequest(socket)) {
 
@@ -122,26 +206,73 @@ class UsbIpServer(
                         return@launch
                     }
 
-                    writerJob = launch {
+                    val profile = config.schedulingProfile
+                    writerDispatcher = if (profile?.dedicatedWriters == true) {
+                        Executors.newSingleThreadExecutor { Thread(it, "UsbIpWriter-$socket") }.asCoroutineDispatcher()
+                    } else null
+                    val dedicatedThread = writerDispatcher != null
+                    writerJob = launch(writerDispatcher ?: EmptyCoroutineContext) {
+                        if (profile != null) applySchedulingProfile(profile, dedicatedThread)
+                        val egress = egressScheduler
+                        val flow = egress?.let { registerEgressFlow(it, context) }
+                        var inHand: UsbIpBasicPacket? = null
                         try {
-                            val output = socket.getOutputStream()
-                            for (reply in context.replyChannel) {
-                                output.write(reply.serialize())
+                            val output = socket.outputStream
+                            var scratch: ByteBuffer? = null
+                            for (reply in context.replyQueue) {
+                                inHand = reply
+                                val bytes = reply.serialize(scratch)
+                                if (bytes !== scratch) {
+                                    scratch = bytes
+                                    context.messages.noteAllocation()
+                                }
+                                if (egress != null && flow != null) {
+                                    egress.acquire(flow, bytes.limit(),
+                                        reply !is UsbIpSubmitUrbReply || reply.latencyCritical)
+                                }
+                                output.write(bytes.array(), 0, bytes.limit())
+                                context.replyQueue.onWritten(reply)
                                 if (reply is UsbIpSubmitUrbReply) {
-                                    context.releaseBuffer(reply.inData)
+                                    flightRecorder.record(FlightRecorder.Event.REPLY_WRITTEN, reply.seqNum,
+                                        reply.endpoint, reply.actualLength, reply.status)
+                                    usbLib.recordLatency(context.devConn.fileDescriptor, reply.endpoint,
+                                        UsbLib.METRICS_STAGE_REPLY_QUEUE, System.nanoTime() - reply.queuedAtNs)
                                 }
+                                inHand = null
+                                dropReply(context, reply)
                             }
                         } catch (e: IOException) {
                             Logger.e("WriterLoop", "Error writing to socket: ${e.message}")
+                            context.replyQueue.abort()
                             socket.close()
+                        } finally {
+                            // Taken off the queue but never written, by an error or a cancel
+                            inHand?.let {
+                                context.replyQueue.onWritten(it)
+                                dropReply(context, it)
+                            }
+                            if (egress != null && flow != null) egress.unregister(flow)
                         }
                     }
 
-                    while (isActive && handleOngoingRequest(socket, context)) {}
+                    val submitStages = SubmitStages(this, config.submitQueueDepth,
+                        submit = { queue, request -> submitUrbRequest(socket, request, context, queue) },
+                        onFailure = {
+                            try {
+                                socket.close()
+                            } catch (_: IOException) {}
+                        })
+                    stages = submitStages
+                    context.submitStages = submitStages
+                    while (isActive && handleOngoingRequest(socket, context, submitStages)) {}
                 }
             } finally {
+                // Nothing may reach the device once the session is parked or torn down
+                stages?.let { withContext(NonCancellable) { it.stop() } }
                 writerJob?.cancel()
-                cleanup(socket)
+                // Lets the writer finish unwinding, anything dispatched after it moves to the IO pool
+                writerDispatcher?.close()
+                if (!parkSession(socket)) cleanup(socket)
                 try {
                     if (socket.isConnected) socket.close()
                 } catch (_: IOException) {} // This is expected if the socket was already closed.
@@ -150,37 +281,188 @@ class UsbIpServer(
     }
 
     @Throws(IOException::class)
-    private suspend fun handleOngoingRequest(s: Socket, context: AttachedDeviceContext): Boolean {
-        val inMsg: UsbIpBasicPacket = UsbIpBasicPacket.read(s.getInputStream())
-        Logger.i("handleOngoingRequest", "$inMsg")
+    private suspend fun handleOngoingRequest(s: ClientConnection, context: AttachedDeviceContext, stages: SubmitStages): Boolean {
+        // Leave the next command in the socket while the writer is behind
+        context.replyQueue.awaitCapacity()
+        if (config.busyPollSpinUs > 0) spinForRequest(s, context)
+
+        val inMsg: UsbIpBasicPacket = UsbIpBasicPacket.read(s.inputStream, context.messages, context.tunnel)
+        val rxTimestampNs = System.nanoTime()
+        context.lastRequestNs = rxTimestampNs
 
         when (inMsg.command) {
-            UsbIpBasicPacket.USBIP_CMD_SUBMIT -> submitUrbRequest(s, inMsg as UsbIpSubmitUrb, context)
-            UsbIpBasicPacket.USBIP_CMD_UNLINK -> abortUrbRequest(inMsg as UsbIpUnlinkUrb, context)
+            UsbIpBasicPacket.USBIP_CMD_SUBMIT -> return queueUrbRequest(inMsg as UsbIpSubmitUrb, context, stages, rxTimestampNs)
+            UsbIpBasicPacket.USBIP_CMD_UNLINK -> abortUrbRequest(inMsg as UsbIpUnlinkUrb, context, stages)
             else -> throw IOException("Unknown incoming packet command: ${inMsg.command}")
         }
 
         return true
     }
 
-    private fun cleanup(socket: Socket) {
+    /** Hands a CMD_SUBMIT to its endpoint's submitter. Returns false once the connection is going away. */
+    private suspend fun queueUrbRequest(
+        inMsg: UsbIpSubmitUrb,
+        context: AttachedDeviceContext,
+        stages: SubmitStages,
+        rxTimestampNs: Long
+    ): Boolean {
+        inMsg.rxTimestampNs = rxTimestampNs
+        // Recorded here rather than by the submitter, so the session keeps the client's
+        // order of submits and unlinks
+        flightRecorder.record(FlightRecorder.Event.SUBMIT_RECEIVED, inMsg.seqNum, inMsg.endpointAddress, inMsg.transferBufferLength)
+        context.sessionRecorder?.let { recorder ->
+            transferTypeOf(inMsg, endpointOf(context, inMsg))?.let { recorder.submit(inMsg, it) }
+        }
+        return stages.put(inMsg)
+    }
+
+    /**
+     * Busy-poll mode: waits for the next command by polling the socket rather than
+     * sleeping in read(), as long as the client sent something within busyPollIdleMs.
+     */
+    @Throws(IOException::class)
+    private fun spinForRequest(s: ClientConnection, context: AttachedDeviceContext) {
+        val start = System.nanoTime()
+        if (start - context.lastRequestNs > config.busyPollIdleMs * 1_000_000L) return
+        val deadline = start + config.busyPollSpinUs * 1_000L
+        val input = s.inputStream
+        while (input.available() == 0 && System.nanoTime() < deadline) {}
+    }
+
+    private fun enableSocketBusyPoll(socket: ClientConnection) {
+        val res = try {
+            socket.dupDescriptor()?.use { usbLib.setSocketBusyPoll(it.fd, config.busyPollSpinUs) } ?: return
+        } catch (e: IOException) {
+            Logger.w("handleClientConnection", "No descriptor for SO_BUSY_POLL", e)
+            return
+        }
+        if (res < 0) Logger.w("handleClientConnection", "SO_BUSY_POLL refused: $res, spinning in userspace only")
+    }
+
+    /** Call after every change to attachedDevices or parkedSessions. */
+    @Synchronized
+    private fun refreshCompletionTargets() {
+        completionTargets = (attachedDevices.values + parkedSessions.values.map { it.context }).toTypedArray()
+    }
+
+    private fun cleanup(socket: ClientConnection) {
         val context: AttachedDeviceContext = attachedDevices[socket] ?: return
         attachedDevices.remove(socket)
+        refreshCompletionTargets()
+        releaseContext(context)
+    }
+
+    /**
+     * Keeps the device of a dropped client claimed and open, with its handle and warm
+     * buffer pool, so a re-import from the same client can pick it up without reopening
+     * anything. What the client had in flight is cancelled: a new session starts with
+     * fresh URBs. Returns false if the session should be cleaned up right away.
+     */
+    private fun parkSession(socket: ClientConnection): Boolean {
+        if (config.sessionResumeGraceMs <= 0 || serverShutdown) return false
+        val context = attachedDevices[socket] ?: return false
+        if (context.deviceGone) return false
+        val deviceId = context.device.deviceId
+
+        for (pending in context.pendingTransfers.snapshot()) {
+            if (pending.unlinked.compareAndSet(false, true)) {
+                usbLib.cancelTransfer(pending.request.seqNum, context.devConn.fileDescriptor)
+                context.transferSemaphore.release()
+            }
+        }
+        stopReadAhead(context, answerWaiting = false)
+        stopAllBulkOnly(context)
+        context.replyQueue.close { dropReply(context, it) }
+
+        val expiry = serverScope.launch {
+            delay(config.sessionResumeGraceMs)
+            val parked = parkedSessions[deviceId]
+            if (parked != null && parked.context === context && parkedSessions.remove(deviceId, parked)) {
+                refreshCompletionTargets()
+                Logger.i("parkSession") { "Grace period over for ${context.device.deviceName}" }
+                releaseContext(context)
+            }
+        }
+        // Parked before it leaves attachedDevices, so completions always find their context
+        val replaced = parkedSessions.put(deviceId, ParkedSession(context, socket.peer, expiry))
+        attachedDevices.remove(socket)
+        refreshCompletionTargets()
+        replaced?.let { releaseContext(it.context) }
+        Logger.i("parkSession") { "Holding ${context.device.deviceName} for ${config.sessionResumeGraceMs} ms" }
+        onEvent(UsbIpEvent.OnUpdateNotificationEvent)
+        return true
+    }
 
+    /** Hands back the parked session of [dev] if [client] may resume it, otherwise ends it. */
+    private fun resumeSession(client: String, dev: UsbDevice): AttachedDeviceContext? {
+        val parked = parkedSessions.remove(dev.deviceId) ?: return null
+        refreshCompletionTargets()
+        parked.expiry.cancel()
+        // Cancelled transfers still draining would share seqNums with the new session
+        if (parked.client != client || parked.context.pendingTransfers.isNotEmpty() ||
+            parked.context.readAheadInFlight.isNotEmpty() || parked.context.bulkOnlyInFlight.isNotEmpty()) {
+            releaseContext(parked.context)
+            return null
+        }
+        parked.context.replyQueue = ReplyQueue(config.replyQueueMaxBytes, config.replyQueueMaxCount)
+        Logger.i("resumeSession") { "Resumed ${dev.deviceName} for $client" }
+        return parked.context
+    }
+
+    private fun releaseContext(context: AttachedDeviceContext) {
+        stopReadAhead(context, answerWaiting = false)
+        stopAllBulkOnly(context)
         for (i in 0 until context.device.interfaceCount) {
             context.devConn.releaseInterface(context.device.getInterface(i))
         }
-        if(!serverShutdown) usbLib.closeDeviceHandle(context.devConn.fileDescriptor)
+        Logger.i("cleanup") { "Buffer pool at detach: ${context.bufferPoolStats()}" }
+        Logger.i("cleanup") { "Metrics at detach:\n${usbLib.getMetricsReport(context.devConn.fileDescriptor)}" }
+        // On shutdown exit() closes every handle at once, after reaping what it can
+        val unreaped = if (serverShutdown) -1 else usbLib.closeDeviceHandle(context.devConn.fileDescriptor)
         context.devConn.close()
+        if (unreaped >= 0) {
+            settleTransferBuffers(context, unreaped)
+        } else {
+            val exited = synchronized(awaitingExit) {
+                if (exitUnreaped < 0) awaitingExit.add(context)
+                exitUnreaped
+            }
+            if (exited >= 0) settleTransferBuffers(context, exited)
+        }
+        context.replyQueue.close { dropReply(context, it) }
+        context.sessionRecorder?.close()
+        context.trafficProfile?.save()
+        Logger.i("cleanup") { "Reply queue at detach: ${context.replyQueue.stats()}" }
+        context.tunnel?.let { Logger.i("cleanup") { "Tunnel at detach: ${it.stats()}" } }
 
         val dev = getDevice(context.device.deviceId)
         if(dev != null) onEvent(UsbIpEvent.DeviceDisconnectedEvent(dev))
         onEvent(UsbIpEvent.OnUpdateNotificationEvent)
     }
 
+    /**
+     * Hands back the buffers of the transfers [context] still had on the device, once its
+     * handle is closed. With [unreaped] transfers never reaped, usbfs may still copy into
+     * any of them, so they are all left to leak instead.
+     */
+    private fun settleTransferBuffers(context: AttachedDeviceContext, unreaped: Int) {
+        if (unreaped == 0) {
+            for (pending in context.pendingTransfers.snapshot()) {
+                context.releaseBuffer(pending.transferBuffer)
+            }
+            for (readAhead in context.readAheadInFlight.values.toSet()) readAhead.abandon()
+            for (bulkOnly in context.bulkOnlyInFlight.values.toSet()) bulkOnly.abandon()
+        } else {
+            Logger.w("cleanup", "${context.device.deviceName}: $unreaped transfers not reaped, leaking their buffers")
+        }
+        context.pendingTransfers.clear()
+        context.readAheadInFlight.clear()
+        context.bulkOnlyInFlight.clear()
+    }
+
     @Throws(IOException::class)
-    private fun handleInitialRequest(socket: Socket): Boolean {
-        val incomingMessage = convertInputStreamToPacket(socket.getInputStream())
+    private fun handleInitialRequest(socket: ClientConnection): Boolean {
+        val incomingMessage = convertInputStreamToPacket(socket.inputStream)
         val outgoingMessage: CommonPacket
 
         if(incomingMessage == null) throw IOException("Incoming packet null")
@@ -201,12 +483,17 @@ class UsbIpServer(
                 }
                 outgoingMessage = replyDevListPacket
             }
-            ProtocolCodes.OP_REQ_IMPORT -> {
+            ProtocolCodes.OP_REQ_IMPORT,
+            ProtocolCodes.OP_REQ_IMPORT_TUNNEL -> {
                 val importRequest: ImportDeviceRequest = incomingMessage as ImportDeviceRequest
                 val importReply = ImportDeviceReply(incomingMessage.version)
+                val tunnel = incomingMessage.code == ProtocolCodes.OP_REQ_IMPORT_TUNNEL
+                // The reply code tells the client its request for the framing was understood
+                if (tunnel) importReply.code = ProtocolCodes.OP_REP_IMPORT_TUNNEL
 
                 val context = attachToDevice(socket, importRequest.busId)
                 if (context != null) {
+                    context.tunnel = if (tunnel) TunnelCodec(usbLib, config.tunnelCompressMinBytes) else null
                     importReply.devInfo = getDeviceInfo(importRequest.busId, context)
                     result = importReply.devInfo != null
                 }
@@ -214,14 +501,89 @@ class UsbIpServer(
 
                 outgoingMessage = importReply
             }
+            ProtocolCodes.OP_REQ_METRICS -> {
+                outgoingMessage = DiagnosticReply(incomingMessage.version, ProtocolCodes.OP_REP_METRICS, buildMetricsReport())
+            }
+            ProtocolCodes.OP_REQ_TRACE -> {
+                outgoingMessage = DiagnosticReply(incomingMessage.version, ProtocolCodes.OP_REP_TRACE, flightRecorder.exportChromeTrace())
+            }
             else -> return false
         }
 
         Logger.i("handleInitialRequest", "$outgoingMessage")
-        socket.getOutputStream().write(outgoingMessage.serialize())
+        socket.outputStream.write(outgoingMessage.serialize())
         return result
     }
 
+    /**
+     * Runs on a new writer. Only a dedicated writer thread takes the writer profile, a
+     * pooled one would pass it on to whatever runs there next. By now the device is open
+     * and the event thread has normally taken its own profile, so that is reported too.
+     */
+    private fun applySchedulingProfile(profile: SchedulingProfile, dedicatedThread: Boolean) {
+        if (dedicatedThread) {
+            val refused = usbLib.applyThreadProfile(profile.writerNice, 0, profile.cpuMask)
+            if (refused != 0) {
+                writerProfileRefusals.incrementAndGet()
+                Logger.w("WriterLoop", "Writer scheduling profile ${describeProfileResult(refused)}")
+            }
+        }
+        val eventResult = usbLib.getEventThreadProfileResult()
+        if (eventResult > 0) {
+            Logger.w("WriterLoop", "Event thread scheduling profile ${describeProfileResult(eventResult)}")
+        }
+    }
+
+    private fun describeProfileResult(result: Int): String {
+        if (result < 0) return "not applied yet"
+        if (result == 0) return "applied"
+        val refused = listOfNotNull(
+            "SCHED_FIFO".takeIf { result and UsbLib.THREAD_PROFILE_FIFO_REFUSED != 0 },
+            "nice".takeIf { result and UsbLib.THREAD_PROFILE_NICE_REFUSED != 0 },
+            "CPU mask".takeIf { result and UsbLib.THREAD_PROFILE_AFFINITY_REFUSED != 0 }
+        )
+        return "refused ${refused.joinToString()}"
+    }
+
+    private fun registerEgressFlow(egress: EgressScheduler, context: AttachedDeviceContext): EgressScheduler.Flow {
+        val device = context.device
+        val policy = config.egressPolicies.firstOrNull { it.matches(device.vendorId, device.productId) }
+        val busId = "${deviceIdToBusNum(device.deviceId)}-${deviceIdToDevNum(device.deviceId)}"
+        return egress.register(busId, policy?.weight ?: 1, policy?.maxBytesPerSec ?: 0)
+    }
+
+    private fun buildMetricsReport(): String {
+        val sb = StringBuilder()
+        sb.append("usbfs budget: ${usbLib.getUsbfsBudgetStats()?.let { UsbfsBudgetStats.fromArray(it) }}\n")
+        sb.append("capture: ${usbLib.getCaptureStats()?.let { CaptureStats.fromArray(it) }}\n")
+        egressScheduler?.let { sb.append("egress: ${it.stats()}") }
+        usbLib.getBusyPollStats()?.takeIf { config.busyPollSpinUs > 0 }?.let {
+            sb.append("busy poll: spins=${it[0]} caught=${it[1]} spinMs=${it[2] / 1_000_000}\n")
+        }
+        if (config.schedulingProfile != null) {
+            sb.append("scheduling: event thread ${describeProfileResult(usbLib.getEventThreadProfileResult())}, ")
+            sb.append("writers refused ${writerProfileRefusals.get()}\n")
+        }
+        for (context in attachedDevices.values) {
+            val fd = context.devConn.fileDescriptor
+            val busId = "${deviceIdToBusNum(context.device.deviceId)}-${deviceIdToDevNum(context.device.deviceId)}"
+            sb.append("device $busId (fd $fd):\n")
+            sb.append("  reply queue: ${context.replyQueue.stats()}\n")
+            sb.append("  buffer pool: ${context.bufferPoolStats()}\n")
+            sb.append("  messages: ${context.messages.stats()}\n")
+            context.submitStages?.let { sb.append(it.stats()) }
+            context.tunnel?.let { sb.append("  tunnel: ${it.stats()}\n") }
+            for ((endpoint, readAhead) in context.readAhead) {
+                sb.append("  read-ahead ${intToHex(endpoint)}: ${readAhead.stats()}\n")
+            }
+            for (bulkOnly in context.bulkOnly.values.toSet()) {
+                sb.append("  bulk-only interface ${bulkOnly.interfaceNumber}: ${bulkOnly.stats()}\n")
+            }
+            sb.append(usbLib.getMetricsReport(fd) ?: "")
+        }
+        return sb.toString()
+    }
+
     private fun buildUsbDeviceInfo(device: UsbDevice, context: AttachedDeviceContext? = null): UsbDeviceInfo {
         val info = UsbDeviceInfo()
         val ipDev = UsbIpDevice()
@@ -274,7 +636,9 @@ class UsbIpServer(
             UsbControlHelper.buildEndpointCache(context)
         }
 
-        ipDev.speed = detectSpeed(device, devDesc)
+        // The link speed usbfs reports beats guessing from packet sizes, but needs an open handle
+        ipDev.speed = context?.let { usbLib.getDeviceSpeed(it.devConn.fileDescriptor) }?.takeIf { it > 0 }
+            ?: detectSpeed(device, devDesc)
 
         return info
     }
@@ -320,15 +684,20 @@ class UsbIpServer(
         else UsbIpDeviceConstants.USB_SPEED_FULL
     }
 
-    private fun attachToDevice(s: Socket, busId: String): AttachedDeviceContext? {
+    private fun attachToDevice(s: ClientConnection, busId: String): AttachedDeviceContext? {
         val dev: UsbDevice = getDevice(busId) ?: return null
         if (attachedDevices.get(s) != null) return null // Already attached
+        resumeSession(s.peer, dev)?.let { context ->
+            attachedDevices.put(s, context)
+            refreshCompletionTargets()
+            onEvent(UsbIpEvent.OnUpdateNotificationEvent)
+            return context
+        }
         val devConn: UsbDeviceConnection = usbManager.openDevice(dev) ?: return null
 
-        val attachedDeviceContext = AttachedDeviceContext()
+        val attachedDeviceContext = AttachedDeviceContext(usbLib, config)
         attachedDeviceContext.devConn = devConn
         attachedDeviceContext.device = dev
-
         for (i in 0 until dev.interfaceCount) { // Claim all interfaces
             if (!devConn.claimInterface(dev.getInterface(i), true)) {
                 Logger.e("attachToDevice()", "Unable to claim interface " + dev.getInterface(i).id)
@@ -336,7 +705,23 @@ class UsbIpServer(
         }
 
         usbLib.openDeviceHandle(devConn.fileDescriptor)
+        config.trafficProfileDir?.let { dir ->
+            val serial = try {
+                dev.serialNumber
+            } catch (_: SecurityException) {
+                null
+            }
+            attachedDeviceContext.trafficProfile = TrafficProfile.open(dir, dev.vendorId, dev.productId, serial).also {
+                it.prewarm(usbLib, devConn.fileDescriptor, attachedDeviceContext.messages)
+            }
+        }
+        config.sessionRecordDir?.let { dir ->
+            val speed = usbLib.getDeviceSpeed(devConn.fileDescriptor).takeIf { it > 0 } ?: detectSpeed(dev, null)
+            attachedDeviceContext.sessionRecorder =
+                SessionRecorder.open(dir, busId, dev.vendorId, dev.productId, speed)
+        }
         attachedDevices.put(s, attachedDeviceContext)
+        refreshCompletionTargets()
         onEvent(UsbIpEvent.OnUpdateNotificationEvent)
         onEvent(UsbIpEvent.DeviceConnectedEvent(dev))
         return attachedDeviceContext
@@ -353,27 +738,59 @@ class UsbIpServer(
         return buildUsbDeviceInfo(dev, context)
     }
 
+    private fun endpointOf(context: AttachedDeviceContext, inMsg: UsbIpSubmitUrb): UsbEndpoint? {
+        if (inMsg.ep == 0) return null
+        val endpoints = context.activeConfigEndpointCache ?: return null
+        return endpoints.get(inMsg.ep + (if (inMsg.direction == UsbIpBasicPacket.USBIP_DIR_IN) USB_DIR_IN else 0))
+    }
+
+    private fun transferTypeOf(inMsg: UsbIpSubmitUrb, endpoint: UsbEndpoint?): Int? =
+        if (inMsg.ep == 0) USB_ENDPOINT_XFER_CONTROL else endpoint?.type
+
+    /** Runs on the endpoint's submitter, with [inMsg] at the head of [queue]. */
     private suspend fun submitUrbRequest(
-        s: Socket,
+        s: ClientConnection,
         inMsg: UsbIpSubmitUrb,
-        context: AttachedDeviceContext
+        context: AttachedDeviceContext,
+        queue: SubmitQueue
     ) {
-        var epAddress = 0
-        val epType = if(inMsg.ep == 0) USB_ENDPOINT_XFER_CONTROL
-        else {
-            val endpoints = context.activeConfigEndpointCache
-            if (endpoints != null) {
-                val endpointNum = inMsg.ep + (if (inMsg.direction == UsbIpBasicPacket.USBIP_DIR_IN) USB_DIR_IN else 0)
-                val targetEndpoint = endpoints.get(endpointNum)
-                if (targetEndpoint != null) {
-                    epAddress = targetEndpoint.address
-                    targetEndpoint.type
-                } else null
-            } else null
+        val rxTimestampNs = inMsg.rxTimestampNs
+        // Once libusb has the URB its completion may answer it, recycling inMsg for the
+        // reader's next command, so what is needed afterwards is copied here
+        val seqNum = inMsg.seqNum
+        val endpointAddress = inMsg.endpointAddress
+        val transferLength = inMsg.transferBufferLength
+        val targetEndpoint = endpointOf(context, inMsg)
+        val epAddress = targetEndpoint?.address ?: 0
+        val epType = transferTypeOf(inMsg, targetEndpoint)
+
+        val isoPacketLengths = inMsg.isoPacketLengths
+
+        if (targetEndpoint != null && inMsg.direction == UsbIpBasicPacket.USBIP_DIR_IN &&
+            (epType == USB_ENDPOINT_XFER_BULK || epType == USB_ENDPOINT_XFER_INT)) {
+            val readAhead = readAheadFor(context, targetEndpoint)
+            if (readAhead != null) {
+                val taken = synchronized(queue) {
+                    if (!queue.isHead(inMsg)) return // Unlinked while it waited
+                    readAhead.take(inMsg).also { if (it) queue.removeHead() }
+                }
+                if (taken) {
+                    refillReadAhead(context, readAhead)
+                    return
+                }
+            }
         }
-
-        val isoPacketLengths = IntArray(inMsg.numberOfPackets) { i ->
-            inMsg.isoPacketDescriptors[i].length
+        val bulkOnly = if (targetEndpoint != null) bulkOnlyFor(context, targetEndpoint) else null
+        if (bulkOnly != null && inMsg.direction == UsbIpBasicPacket.USBIP_DIR_IN) {
+            while (true) {
+                val result = synchronized(queue) {
+                    if (!queue.isHead(inMsg)) return // Unlinked while it waited
+                    bulkOnly.take(inMsg).also { if (it == BulkOnlyAccelerator.ANSWERED) queue.removeHead() }
+                }
+                if (result == BulkOnlyAccelerator.ANSWERED) return
+                if (result == BulkOnlyAccelerator.PASS) break
+                bulkOnly.awaitProgress()
+            }
         }
 
         context.transferSemaphore.acquire()
@@ -384,84 +801,129 @@ class UsbIpServer(
         transferBuffer.limit(totalBufferLength)
 
         if (inMsg.direction == UsbIpBasicPacket.USBIP_DIR_OUT) {
-            transferBuffer.put(inMsg.outData)
+            transferBuffer.put(inMsg.outData, 0, inMsg.transferBufferLength)
             transferBuffer.position(0)
         }
-        context.pendingTransfers[inMsg.seqNum] = AttachedDeviceContext.PendingTransfer(s, inMsg, transferBuffer)
+        val handedOff = synchronized(queue) {
+            if (queue.isHead(inMsg)) {
+                context.pendingTransfers.add(s, inMsg, transferBuffer)
+                queue.removeHead()
+                true
+            } else false
+        }
+        if (!handedOff) {
+            // Unlinked while it waited for a permit, the UNLINK has been answered
+            context.releaseBuffer(transferBuffer)
+            context.transferSemaphore.release()
+            return
+        }
+        context.trafficProfile?.submitted(inMsg.endpointAddress, totalBufferLength, inMsg.numberOfPackets)
+        if (bulkOnly != null && inMsg.direction == UsbIpBasicPacket.USBIP_DIR_OUT && !bulkOnly.commandSubmitted(inMsg)) {
+            stopBulkOnly(context, bulkOnly, disable = true)
+        }
 
         var submitRes: Int
-        val seqNum: String = inMsg.seqNum.toString()
         when (epType) {
             USB_ENDPOINT_XFER_CONTROL -> {
-                Logger.i("submitUrbRequest","CONTROL: $seqNum - Started")
                 with(inMsg.setup) {
                     if(UsbControlHelper.handleTransferInternally(requestType, request)) {
-                        repeat(AttachedDeviceContext.MAX_CONCURRENT_TRANSFERS -1) {
-                            context.transferSemaphore.acquire()
-                        }
-                        UsbControlHelper.doInternalControlTransfer(context, requestType, request, value,index)
-                        repeat(AttachedDeviceContext.MAX_CONCURRENT_TRANSFERS - 1) {
-                            context.transferSemaphore.release()
+                        // The endpoints are about to change under the read-ahead transfers
+                        stopReadAhead(context, answerWaiting = true)
+                        stopAllBulkOnly(context)
+                        // The submitter can be stopped while it waits for the other permits,
+                        // the entry must not outlive the session then
+                        var held = 0
+                        try {
+                            repeat(AttachedDeviceContext.MAX_CONCURRENT_TRANSFERS -1) {
+                                context.transferSemaphore.acquire()
+                                held++
+                            }
+                            UsbControlHelper.doInternalControlTransfer(context, requestType, request, value,index)
+                        } finally {
+                            repeat(held) {
+                                context.transferSemaphore.release()
+                            }
+                            onTransferCompleted(seqNum, ProtocolCodes.STATUS_OK, 0, LibusbTransferType.CONTROL.code, isoPacketLengths, null)
                         }
-                        onTransferCompleted(inMsg.seqNum, ProtocolCodes.STATUS_OK, 0, LibusbTransferType.CONTROL.code, isoPacketLengths, null)
                         return
                     } else {
+                        if (context.bulkOnly.isNotEmpty()) interruptBulkOnly(context, this)
                         transferBuffer.clear()
                         transferBuffer.limit(totalBufferLength)
                         transferBuffer.put(bytes)
                         if (inMsg.direction == UsbIpBasicPacket.USBIP_DIR_OUT && length > 0) {
-                            transferBuffer.put(inMsg.outData)
+                            transferBuffer.put(inMsg.outData, 0, inMsg.transferBufferLength)
                         }
                         transferBuffer.position(0)
                         submitRes = usbLib.doControlTransferAsync(
                             context.devConn.fileDescriptor,
-                            transferBuffer.slice(),
+                            transferBuffer,
                             300,
-                            inMsg.seqNum,
-                            inMsg.transferFlags.value
+                            seqNum,
+                            inMsg.transferFlags.value,
+                            rxTimestampNs
                         )
                     }
                 }
             }
             USB_ENDPOINT_XFER_BULK -> {
-                Logger.i("submitUrbRequest", "BULK: $seqNum - ${inMsg.transferBufferLength} bytes ${if (inMsg.direction == UsbIpBasicPacket.USBIP_DIR_IN) "in" else "out"}")
                 submitRes = usbLib.doBulkTransferAsync(
                     context.devConn.fileDescriptor,
                     epAddress,
-                    transferBuffer.slice(),
+                    transferBuffer,
+                    totalBufferLength,
                     300,
-                    inMsg.seqNum,
-                    inMsg.transferFlags.value
+                    seqNum,
+                    inMsg.transferFlags.value,
+                    rxTimestampNs
                 )
             }
             USB_ENDPOINT_XFER_INT -> {
-                Logger.i("submitUrbRequest","INTERRUPT: $seqNum - ${inMsg.transferBufferLength} bytes ${if (inMsg.direction == UsbIpBasicPacket.USBIP_DIR_IN) "in" else "out"}")
                 submitRes = usbLib.doInterruptTransferAsync(
                     context.devConn.fileDescriptor,
                     epAddress,
-                    transferBuffer.slice(),
+                    transferBuffer,
+                    totalBufferLength,
                     1000,
-                    inMsg.seqNum,
-                    inMsg.transferFlags.value
+                    seqNum,
+                    inMsg.transferFlags.value,
+                    rxTimestampNs
                 )
             }
             USB_ENDPOINT_XFER_ISOC -> {
-                Logger.i("submitUrbRequest", "ISO: ${inMsg.seqNum} - Started")
                 submitRes = usbLib.doIsochronousTransferAsync(
                     context.devConn.fileDescriptor,
                     epAddress,
-                    transferBuffer.slice(),
+                    transferBuffer,
+                    totalBufferLength,
                     isoPacketLengths,
-                    inMsg.seqNum,
-                    inMsg.transferFlags.value
+                    seqNum,
+                    inMsg.transferFlags.value,
+                    rxTimestampNs
                 )
             }
-            else -> throw IOException("Unsupported endpoint type: $epType, seqNum: $seqNum")
+            else -> throw IOException("Unsupported endpoint type: $epType, seqNum: ${seqNum}")
         }
 
-        if (submitRes < 0) {
+        if (submitRes >= 0) {
+            flightRecorder.record(FlightRecorder.Event.SUBMITTED, seqNum, endpointAddress, transferLength)
+            // Unlinked while it was being submitted, the UNLINK has been answered already
+            if (!context.pendingTransfers.markSubmitted(seqNum)) {
+                usbLib.cancelTransfer(seqNum, context.devConn.fileDescriptor)
+            }
+        } else {
+            flightRecorder.record(FlightRecorder.Event.SUBMIT_FAILED, seqNum, endpointAddress, 0, submitRes)
             Logger.e("submitUrbRequest", "Submission failed with $submitRes")
-            context.pendingTransfers.remove(inMsg.seqNum)
+            val pending = context.pendingTransfers.remove(seqNum)
+            val unlinked = pending != null && !pending.unlinked.compareAndSet(false, true)
+            pending?.let { context.pendingTransfers.recycle(it) }
+            context.trafficProfile?.completed(endpointAddress)
+            if (unlinked) {
+                // Answered with RET_UNLINK, which released its permit
+                context.releaseBuffer(transferBuffer)
+                context.messages.recycle(inMsg)
+                return
+            }
 
             if (epType == USB_ENDPOINT_XFER_CONTROL) {
                 repeat(AttachedDeviceContext.MAX_CONCURRENT_TRANSFERS) {
@@ -475,44 +937,357 @@ class UsbIpServer(
         }
     }
 
-    private fun abortUrbRequest(msg: UsbIpUnlinkUrb, context: AttachedDeviceContext) {
-        val pending = context.pendingTransfers.remove(msg.seqNumToUnlink)
-        var wasCancelled = false
-        if (pending != null) {
-            wasCancelled = usbLib.cancelTransfer(msg.seqNumToUnlink, context.devConn.fileDescriptor) == 0
-            context.transferSemaphore.release()
+    private fun abortUrbRequest(msg: UsbIpUnlinkUrb, context: AttachedDeviceContext, stages: SubmitStages) {
+        // The entry stays in pendingTransfers so the completion callback can still hand
+        // the buffer back once libusb is done with it.
+        flightRecorder.record(FlightRecorder.Event.UNLINK_RECEIVED, msg.seqNumToUnlink)
+        context.sessionRecorder?.unlink(msg)
+        if (stages.unlink(msg.seqNumToUnlink)) {
+            // Still queued behind its endpoint's submitter, never reached the device. The
+            // request isn't recycled: the submitter may still hold it as its old head.
+            val reply = UsbIpUnlinkUrbReply(msg.seqNum)
+            reply.status = UsbIpBasicPacket.USBIP_ECONNRESET
+            flightRecorder.record(FlightRecorder.Event.UNLINKED, msg.seqNumToUnlink)
+            offerReply(context, reply)
+            return
+        }
+        if (context.readAhead.values.any { it.unlink(msg.seqNumToUnlink) }) {
+            // Was waiting for read-ahead data, nothing on the device to cancel
+            val reply = UsbIpUnlinkUrbReply(msg.seqNum)
+            reply.status = UsbIpBasicPacket.USBIP_ECONNRESET
+            flightRecorder.record(FlightRecorder.Event.UNLINKED, msg.seqNumToUnlink)
+            offerReply(context, reply)
+            return
         }
+        // Only a transfer libusb agreed to cancel is answered here. If it can't be, it is
+        // completing and its completion answers it, the permit stays with it. One its
+        // submitter is still handing to libusb is cancelled by the submitter afterwards.
+        val cancelled = context.pendingTransfers.cancelOnSubmit(msg.seqNumToUnlink) ||
+            context.pendingTransfers[msg.seqNumToUnlink] != null &&
+            usbLib.cancelTransfer(msg.seqNumToUnlink, context.devConn.fileDescriptor) == 0
+        val endpoint = if (cancelled) context.pendingTransfers.claim(msg.seqNumToUnlink) else -1
+        if (endpoint >= 0) context.transferSemaphore.release()
 
         val reply = UsbIpUnlinkUrbReply(msg.seqNum)
-        reply.status = if (wasCancelled) UsbIpBasicPacket.USBIP_ECONNRESET else 0
-        Logger.i("abortUrbRequest", "$reply")
-        context.replyChannel.trySend(reply)
+        reply.status = if (endpoint >= 0) UsbIpBasicPacket.USBIP_ECONNRESET else 0
+        if (endpoint >= 0) flightRecorder.record(FlightRecorder.Event.UNLINKED, msg.seqNumToUnlink, endpoint)
+        offerReply(context, reply)
     }
 
     override fun onTransferCompleted(seqNum: Int, status: Int, actualLength: Int, type: Int, isoPacketActualLengths: IntArray?, isoPacketStatuses: IntArray?) {
         val transferType = LibusbTransferType.fromCode(type)
-        Logger.i("onTransferCompleted", "${transferType?.description}: $seqNum - Complete with $actualLength bytes (status: $status)")
 
-        for (context in attachedDevices.values) {
-            val pending = context.pendingTransfers.remove(seqNum)
-            if (pending != null) {
-                if (transferType == LibusbTransferType.CONTROL && actualLength > 0) {
-                    pending.transferBuffer.position(8) // Skip CONTROL Transfer 8-byte header
-                } else {
-                    pending.transferBuffer.position(0) // Ensure buffer at starting position
-                }
+        for (context in completionTargets) {
+            if (completeTransfer(context, seqNum, status, actualLength, transferType, isoPacketActualLengths, isoPacketStatuses)) return
+        }
+        Logger.i("onTransferCompleted") { "Orphaned callback - seqNum: $seqNum (status: $status)" }
+    }
+
+    /**
+     * Runs on the libusb event thread, inside a completion, so closing anything is left to
+     * the server scope. Dropping the client right away lets it tear the device down
+     * instead of waiting on URBs; the ones it had out are answered with ENODEV already.
+     */
+    override fun onDeviceDisconnected(fd: Int) {
+        for ((socket, context) in attachedDevices) {
+            if (context.devConn.fileDescriptor != fd) continue
+            context.deviceGone = true
+            Logger.i("onDeviceDisconnected") { "${context.device.deviceName} unplugged, dropping $socket" }
+            serverScope.launch {
+                try {
+                    socket.close()
+                } catch (_: IOException) {}
+            }
+            return
+        }
+        for ((deviceId, parked) in parkedSessions) {
+            if (parked.context.devConn.fileDescriptor != fd) continue
+            if (parkedSessions.remove(deviceId, parked)) {
+                refreshCompletionTargets()
+                parked.expiry.cancel()
+                Logger.i("onDeviceDisconnected") { "${parked.context.device.deviceName} unplugged while parked" }
+                serverScope.launch { releaseContext(parked.context) }
+            }
+            return
+        }
+    }
+
+    private fun completeTransfer(
+        context: AttachedDeviceContext,
+        seqNum: Int,
+        status: Int,
+        actualLength: Int,
+        transferType: LibusbTransferType?,
+        isoPacketActualLengths: IntArray?,
+        isoPacketStatuses: IntArray?
+    ): Boolean {
+        if (seqNum < 0) {
+            return completeReadAhead(context, seqNum, status, actualLength) ||
+                completeBulkOnly(context, seqNum, status, actualLength)
+        }
+        val pending = context.pendingTransfers.remove(seqNum) ?: return false
+        context.trafficProfile?.completed(pending.request.endpointAddress)
+        flightRecorder.record(FlightRecorder.Event.COMPLETED, seqNum, pending.request.endpointAddress, actualLength, status)
+        context.sessionRecorder?.complete(seqNum, status, actualLength, isoPacketStatuses?.count { it < 0 } ?: 0)
+        if (!pending.unlinked.compareAndSet(false, true)) {
+            // Already answered with RET_UNLINK, only the buffer is left to reclaim
+            context.releaseBuffer(pending.transferBuffer)
+            context.messages.recycle(pending.request)
+            context.pendingTransfers.recycle(pending)
+            return true
+        }
+        if (transferType == LibusbTransferType.CONTROL && actualLength > 0) {
+            pending.transferBuffer.position(8) // Skip CONTROL Transfer 8-byte header
+        } else {
+            pending.transferBuffer.position(0) // Ensure buffer at starting position
+        }
+
+        context.transferSemaphore.release()
 
+        val request = pending.request
+        val transferBuffer = pending.transferBuffer
+        context.pendingTransfers.recycle(pending)
+        if (transferType == LibusbTransferType.BULK && request.direction == UsbIpBasicPacket.USBIP_DIR_OUT &&
+            context.bulkOnly.isNotEmpty()) {
+            context.bulkOnly[request.endpointAddress]?.let { startBulkOnly(context, it, seqNum, status, actualLength) }
+        }
+        sendReply(context, request, status, transferBuffer, actualLength, isoPacketActualLengths, isoPacketStatuses)
+        return true
+    }
+
+    private fun readAheadFor(context: AttachedDeviceContext, endpoint: UsbEndpoint): ReadAheadEndpoint? {
+        val existing = context.readAhead[endpoint.address]
+        if (existing != null || config.readAheadPolicies.isEmpty()) return existing
+        val policy = config.readAheadPolicies.firstOrNull {
+            it.matches(context.device.vendorId, context.device.productId, endpoint.address)
+        } ?: return null
+
+        val readAhead = ReadAheadEndpoint(
+            endpoint.address,
+            endpoint.type == USB_ENDPOINT_XFER_INT,
+            policy,
+            endpoint.maxPacketSize,
+            acquire = context::acquireBuffer,
+            release = context::releaseBuffer,
+            deliver = { deliverAnswer(context, it) }
+        )
+        Logger.i("readAheadFor") { "Read-ahead on ${intToHex(endpoint.address)}, ${readAhead.transferSize} byte transfers" }
+        return context.readAhead.putIfAbsent(endpoint.address, readAhead) ?: readAhead
+    }
+
+    private fun deliverAnswer(context: AttachedDeviceContext, answer: ReadAheadEndpoint.Answer) {
+        with(answer) {
+            flightRecorder.record(FlightRecorder.Event.COMPLETED, request.seqNum, request.endpointAddress, actualLength, status)
+            context.sessionRecorder?.complete(request.seqNum, status, actualLength, 0)
+            sendReply(context, request, status, data, actualLength, null, null)
+        }
+    }
+
+    private fun nextServerSeqNum(): Int = serverSeqNum.updateAndGet { if (it == Int.MIN_VALUE) -2 else it - 1 }
+
+    private fun refillReadAhead(context: AttachedDeviceContext, readAhead: ReadAheadEndpoint) {
+        val fd = context.devConn.fileDescriptor
+        repeat(readAhead.wanted()) {
+            // Never wait for a permit, the client's own URBs come first
+            if (!context.transferSemaphore.tryAcquire()) return
+            val buffer = try {
+                context.acquireBuffer(readAhead.transferSize)
+            } catch (e: IOException) {
                 context.transferSemaphore.release()
+                return
+            }
+            buffer.limit(readAhead.transferSize)
+            val seqNum = nextServerSeqNum()
+            readAhead.register(seqNum, buffer)
+            context.readAheadInFlight[seqNum] = readAhead
+
+            // No timeout, these wait on the device for as long as the session lasts
+            val res = if (readAhead.interrupt) {
+                usbLib.doInterruptTransferAsync(fd, readAhead.endpoint, buffer, readAhead.transferSize, 0, seqNum, 0, System.nanoTime())
+            } else {
+                usbLib.doBulkTransferAsync(fd, readAhead.endpoint, buffer, readAhead.transferSize, 0, seqNum, 0, System.nanoTime())
+            }
+            if (res < 0) {
+                Logger.e("refillReadAhead", "Read-ahead on ${intToHex(readAhead.endpoint)} failed to submit: $res")
+                completeReadAhead(context, seqNum, res, 0)
+                return
+            }
+        }
+    }
+
+    private fun completeReadAhead(context: AttachedDeviceContext, seqNum: Int, status: Int, actualLength: Int): Boolean {
+        val readAhead = context.readAheadInFlight.remove(seqNum) ?: return false
+        readAhead.onCompleted(seqNum, status, actualLength)
+        context.transferSemaphore.release()
+        refillReadAhead(context, readAhead)
+        return true
+    }
+
+    /**
+     * Ends read-ahead on every endpoint of [context]. Client URBs still waiting for data
+     * are answered as unlinked when [answerWaiting] is set, otherwise dropped with the client.
+     */
+    private fun stopReadAhead(context: AttachedDeviceContext, answerWaiting: Boolean) {
+        if (context.readAhead.isEmpty()) return
+        val inFlight = ArrayList<Int>()
+        for (readAhead in context.readAhead.values) {
+            val waiting = readAhead.stop(inFlight)
+            if (!answerWaiting) continue
+            for (request in waiting) {
+                sendReply(context, request, UsbIpBasicPacket.USBIP_ECONNRESET, context.acquireBuffer(1), 0, null, null)
+            }
+        }
+        context.readAhead.clear()
+        for (seqNum in inFlight) usbLib.cancelTransfer(seqNum, context.devConn.fileDescriptor)
+    }
 
-                with(pending){
-                    sendReply(context, request, status, transferBuffer, actualLength, isoPacketActualLengths, isoPacketStatuses)
+    private fun bulkOnlyFor(context: AttachedDeviceContext, endpoint: UsbEndpoint): BulkOnlyAccelerator? {
+        if (!config.bulkOnlyAccelerator || endpoint.type != USB_ENDPOINT_XFER_BULK) return null
+        if (!context.bulkOnlyScanned) {
+            synchronized(context.bulkOnly) {
+                if (!context.bulkOnlyScanned) context.bulkOnlyScanned = findBulkOnlyInterfaces(context)
+            }
+        }
+        return context.bulkOnly[endpoint.address]
+    }
+
+    /** Sets up an accelerator per Bulk-Only interface of the active configuration. False if there is none yet. */
+    private fun findBulkOnlyInterfaces(context: AttachedDeviceContext): Boolean {
+        val activeConfig = context.activeConfig ?: return false
+        for (i in 0 until activeConfig.interfaceCount) {
+            val iface = activeConfig.getInterface(i)
+            if (iface.interfaceClass != USB_CLASS_MASS_STORAGE ||
+                iface.interfaceProtocol != BulkOnlyAccelerator.PROTOCOL_BULK_ONLY) continue
+            var outEndpoint: UsbEndpoint? = null
+            var inEndpoint: UsbEndpoint? = null
+            for (k in 0 until iface.endpointCount) {
+                val ep = iface.getEndpoint(k)
+                if (ep.type != USB_ENDPOINT_XFER_BULK) continue
+                if (ep.direction == USB_DIR_IN) {
+                    if (inEndpoint == null) inEndpoint = ep
+                } else if (outEndpoint == null) {
+                    outEndpoint = ep
                 }
-                return
             }
+            val bulkOut = outEndpoint ?: continue
+            val bulkIn = inEndpoint ?: continue
+            if (context.bulkOnly.containsKey(bulkOut.address)) continue // Another alternate setting
+            if (config.readAheadPolicies.any {
+                    it.matches(context.device.vendorId, context.device.productId, bulkIn.address)
+                }) continue
+
+            val bulkOnly = BulkOnlyAccelerator(
+                iface.id,
+                bulkOut.address,
+                bulkIn.address,
+                bulkIn.maxPacketSize,
+                acquire = context::acquireBuffer,
+                release = context::releaseBuffer,
+                deliver = { deliverAnswer(context, it) }
+            )
+            context.bulkOnly[bulkOut.address] = bulkOnly
+            context.bulkOnly[bulkIn.address] = bulkOnly
+            Logger.i("findBulkOnlyInterfaces") {
+                "Bulk-Only acceleration on interface ${iface.id}, ${intToHex(bulkOut.address)}/${intToHex(bulkIn.address)}"
+            }
+        }
+        return true
+    }
+
+    /**
+     * Runs inside the completion of [seqNum], an OUT URB of [bulkOnly]. If it was the CBW
+     * of a read, queues the data phase and CSW transfers before the client hears back.
+     */
+    private fun startBulkOnly(context: AttachedDeviceContext, bulkOnly: BulkOnlyAccelerator, seqNum: Int, status: Int, actualLength: Int) {
+        val dataLength = bulkOnly.commandSent(seqNum, status, actualLength)
+        if (dataLength == 0) return
+        // A client URB already reading the IN endpoint would get the data instead
+        if (context.pendingTransfers.hasEndpoint(bulkOnly.inEndpoint)) return
+
+        // Never wait for a permit, the client's own URBs come first
+        if (!context.transferSemaphore.tryAcquire()) return
+        val dataBuffer = try {
+            context.acquireBuffer(dataLength)
+        } catch (e: IOException) {
+            context.transferSemaphore.release()
+            return
         }
-        Logger.i("onTransferCompleted", "Orphaned callback - seqNum: $seqNum (status: $status)")
+        dataBuffer.limit(dataLength)
+        val dataSeqNum = nextServerSeqNum()
+        bulkOnly.begin(dataSeqNum, dataBuffer)
+        context.bulkOnlyInFlight[dataSeqNum] = bulkOnly
+        if (!submitBulkOnly(context, bulkOnly, dataSeqNum, dataBuffer, dataLength)) return
+
+        // Without a CSW transfer the client's own URB fetches the CSW
+        if (!context.transferSemaphore.tryAcquire()) return
+        val cswBuffer = try {
+            context.acquireBuffer(BulkOnlyAccelerator.CSW_LENGTH)
+        } catch (e: IOException) {
+            context.transferSemaphore.release()
+            return
+        }
+        cswBuffer.limit(BulkOnlyAccelerator.CSW_LENGTH)
+        val cswSeqNum = nextServerSeqNum()
+        bulkOnly.beginStatus(cswSeqNum, cswBuffer)
+        context.bulkOnlyInFlight[cswSeqNum] = bulkOnly
+        submitBulkOnly(context, bulkOnly, cswSeqNum, cswBuffer, BulkOnlyAccelerator.CSW_LENGTH)
+    }
+
+    private fun submitBulkOnly(context: AttachedDeviceContext, bulkOnly: BulkOnlyAccelerator, seqNum: Int, buffer: ByteBuffer, length: Int): Boolean {
+        // No timeout: a command that hangs is ended by the client's recovery, an unlink and a reset
+        val res = usbLib.doBulkTransferAsync(context.devConn.fileDescriptor, bulkOnly.inEndpoint, buffer, length, 0, seqNum, 0, System.nanoTime())
+        if (res >= 0) return true
+        Logger.e("submitBulkOnly", "Bulk-Only transfer on ${intToHex(bulkOnly.inEndpoint)} failed to submit: $res")
+        context.bulkOnlyInFlight.remove(seqNum)
+        bulkOnly.withdraw(seqNum)
+        context.transferSemaphore.release()
+        return false
+    }
+
+    private fun completeBulkOnly(context: AttachedDeviceContext, seqNum: Int, status: Int, actualLength: Int): Boolean {
+        val bulkOnly = context.bulkOnlyInFlight.remove(seqNum) ?: return false
+        bulkOnly.onCompleted(seqNum, status, actualLength)
+        context.transferSemaphore.release()
+        return true
+    }
+
+    /** A class request to a Bulk-Only interface (a reset) or one to its endpoints (CLEAR_FEATURE) ends its command. */
+    private fun interruptBulkOnly(context: AttachedDeviceContext, setup: UsbIpSubmitUrb.UsbControlSetup) {
+        val bulkOnly = when (setup.reqRecipient) {
+            RECIPIENT_INTERFACE -> if (setup.reqType != REQUEST_TYPE_CLASS) null
+                else context.bulkOnly.values.firstOrNull { it.interfaceNumber == (setup.index and 0xff) }
+            RECIPIENT_ENDPOINT -> context.bulkOnly[setup.index and 0xff]
+            else -> null
+        } ?: return
+        if (bulkOnly.isBusy()) stopBulkOnly(context, bulkOnly, disable = true)
+    }
+
+    private fun stopBulkOnly(context: AttachedDeviceContext, bulkOnly: BulkOnlyAccelerator, disable: Boolean) {
+        val inFlight = ArrayList<Int>()
+        bulkOnly.stop(inFlight, disable)
+        for (seqNum in inFlight) usbLib.cancelTransfer(seqNum, context.devConn.fileDescriptor)
     }
 
+    /** Ends the commands of every Bulk-Only interface and forgets them, the next bulk URB looks again. */
+    private fun stopAllBulkOnly(context: AttachedDeviceContext) {
+        for (bulkOnly in context.bulkOnly.values.toSet()) stopBulkOnly(context, bulkOnly, disable = false)
+        context.bulkOnly.clear()
+        context.bulkOnlyScanned = false
+    }
+
+    /** Queues [reply] for the writer, or hands it back if the queue has been closed. */
+    private fun offerReply(context: AttachedDeviceContext, reply: UsbIpBasicPacket) {
+        if (!context.replyQueue.offer(reply)) dropReply(context, reply)
+    }
+
+    /** Gives back what a reply holds once it is written or will never be. */
+    private fun dropReply(context: AttachedDeviceContext, reply: UsbIpBasicPacket) {
+        if (reply !is UsbIpSubmitUrbReply) return
+        context.releaseBuffer(reply.inData)
+        context.messages.recycle(reply)
+    }
+
+    /** Queues the answer to [request], which goes back to the pool: nothing may use it afterwards. */
     private fun sendReply(
         context: AttachedDeviceContext,
         request: UsbIpSubmitUrb,
@@ -522,10 +1297,12 @@ class UsbIpServer(
         isoPacketActualLengths: IntArray?,
         isoPacketStatuses: IntArray?
     ) {
-        val validIsoLengths = isoPacketActualLengths ?: IntArray(request.numberOfPackets)
-        val validIsoStatuses = isoPacketStatuses ?: IntArray(request.numberOfPackets)
-
-        val reply = UsbIpSubmitUrbReply(request.seqNum)
+        val reply = context.messages.takeReply(request.seqNum)
+        reply.endpoint = request.endpointAddress
+        reply.queuedAtNs = System.nanoTime()
+        reply.tunnel = context.tunnel
+        reply.latencyCritical = request.numberOfPackets > 0 ||
+            context.activeConfigEndpointCache?.get(request.endpointAddress)?.type == USB_ENDPOINT_XFER_INT
         reply.status = status
         reply.actualLength = actualLength
         reply.inData = if(request.direction == UsbIpBasicPacket.USBIP_DIR_IN) transferBuffer
@@ -534,17 +1311,21 @@ class UsbIpServer(
             null
         }
 
-        reply.isoPacketDescriptors = request.isoPacketDescriptors.toList()
         reply.numberOfPackets = request.numberOfPackets
         reply.startFrame = request.startFrame
+        val descriptors = reply.isoPacketDescriptors
+        while (descriptors.size < request.numberOfPackets) descriptors.add(context.messages.newIsoDescriptor())
         for (i in 0 until request.numberOfPackets) {
-            reply.isoPacketDescriptors[i].actualLength = validIsoLengths[i]
-            reply.isoPacketDescriptors[i].status = validIsoStatuses[i]
-            if(validIsoStatuses[i] < 0) reply.errorCount++
+            val packetStatus = isoPacketStatuses?.get(i) ?: 0
+            with(request.isoPacketDescriptors[i]) {
+                descriptors[i].set(offset, length, isoPacketActualLengths?.get(i) ?: 0, packetStatus)
+            }
+            if(packetStatus < 0) reply.errorCount++
         }
         reply.errorCount = if(status < 0 && request.numberOfPackets == 0) 1 else 0
+        context.messages.recycle(request)
 
-        Logger.i("submitUrbRequest", "$reply")
-        context.replyChannel.trySend(reply)
+        flightRecorder.record(FlightRecorder.Event.REPLY_QUEUED, reply.seqNum, reply.endpoint, actualLength, status)
+        offerReply(context, reply)
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,116 @@
+package com.techphenom.usbipserver.server
+
+/**
+ * Tunables for [UsbIpServer]. The defaults are what the app ships with.
+ */
+data class UsbIpServerConfig(
+    // Replies waiting for the socket, per device. Once either limit is hit the server
+    // stops reading new requests from that client until the writer catches up.
+    val replyQueueMaxBytes: Long = 8L * 1024 * 1024,
+    val replyQueueMaxCount: Int = 256,
+    // Decoded URBs waiting per endpoint for that endpoint's submitter, see SubmitStages.
+    // A full queue stops the reader like a full reply queue does.
+    val submitQueueDepth: Int = 32,
+    // URB lifecycle events kept per thread by the flight recorder, 0 turns it off
+    val flightRecorderEventsPerThread: Int = 2048,
+    // When set, every URB put on the bus is written to this file as a usbmon pcap.
+    // Payloads are truncated to captureSnapLen bytes per event.
+    val capturePath: String? = null,
+    val captureSnapLen: Int = 256,
+    // When set, each attached device's command stream is saved in this directory for
+    // replay with host/usbipreplay
+    val sessionRecordDir: String? = null,
+    // When set, each device's traffic (buffer sizes, URBs in flight, ISO packet counts) is
+    // learned into a profile in this directory and used to prewarm its pools on the next
+    // attach, see TrafficProfile
+    val trafficProfileDir: String? = null,
+    // How long a device stays claimed and open after its client's connection drops, so
+    // a re-import from the same client resumes without reopening it. 0, the default,
+    // turns it off.
+    val sessionResumeGraceMs: Long = 0,
+    // When set, the server also listens on this abstract-namespace AF_UNIX socket, for
+    // clients on the same host that don't need to go through the TCP loopback stack
+    val localSocketName: String? = null,
+    // Smallest payload a tunnel session (OP_REQ_IMPORT_TUNNEL) tries to compress
+    val tunnelCompressMinBytes: Int = 512,
+    // Bulk and interrupt IN endpoints the server keeps polling on the client's behalf,
+    // see ReadAheadEndpoint. The first matching policy applies, none means no read-ahead.
+    val readAheadPolicies: List<ReadAheadPolicy> = emptyList(),
+    // Pipelines READ(10/16) on mass storage interfaces using the Bulk-Only Transport, see
+    // BulkOnlyAccelerator. Interfaces whose IN endpoint has a read-ahead policy are left alone.
+    val bulkOnlyAccelerator: Boolean = false,
+    // Total rate of replies to all clients, see EgressScheduler. Set a little below the
+    // uplink so devices share it by weight instead of by who queued first. 0 turns it off.
+    val egressRateBytesPerSec: Long = 0,
+    // Weights and caps per device; the first matching policy applies, none means weight 1
+    // and no cap
+    val egressPolicies: List<EgressPolicy> = emptyList(),
+    // Priority and CPU placement of the libusb event thread and the reply writers. null
+    // leaves the event thread at default priority and the writers on the shared IO pool.
+    val schedulingProfile: SchedulingProfile? = null,
+    // Low-latency mode: the event thread and each client's reader spin for up to this
+    // long waiting for the next completion or command before they block, and TCP sockets
+    // ask the kernel for SO_BUSY_POLL. Costs a core while traffic flows. 0 turns it off.
+    val busyPollSpinUs: Int = 0,
+    // Spinning stops once nothing has moved for this long, so an idle device costs nothing
+    val busyPollIdleMs: Int = 50
+)
+
+/**
+ * Read-ahead for the IN endpoint [endpoint] (e.g. 0x81) of devices matching [vendorId]
+ * and [productId], null matching any. Worth it for streaming devices: serial adapters,
+ * SDR dongles, HID. Not for protocols that rely on the IN endpoint stalling or on
+ * exact per-URB lengths, such as mass storage.
+ */
+data class ReadAheadPolicy(
+    val endpoint: Int,
+    val vendorId: Int? = null,
+    val productId: Int? = null,
+    // Transfers kept queued on the device
+    val depth: Int = 4,
+    // Rounded up to whole packets. Interrupt endpoints ignore it and use one packet.
+    val transferSize: Int = 16 * 1024,
+    // Completed data plus transfers in flight; when reached the server stops polling
+    // until the client catches up, and the device sees backpressure as usual
+    val maxBufferedBytes: Int = 256 * 1024
+) {
+    fun matches(vendorId: Int, productId: Int, endpoint: Int): Boolean =
+        endpoint == this.endpoint &&
+            (this.vendorId == null || this.vendorId == vendorId) &&
+            (this.productId == null || this.productId == productId)
+}
+
+/**
+ * Scheduling for the threads between a completion and its reply hitting the socket, for
+ * audio, video and input devices that suffer from completion jitter. Parts the system
+ * refuses are reported in the log and the metrics report, the rest still applies.
+ */
+data class SchedulingProfile(
+    // 1..99 asks for SCHED_FIFO on the event thread, which ordinary apps are usually
+    // refused; eventThreadNice applies instead then
+    val eventThreadFifoPriority: Int = 0,
+    // -20..19, Android's own audio threads run at -16
+    val eventThreadNice: Int = -16,
+    // Bit n allows CPU n, for the event thread and the writers alike so completions and
+    // their replies stay on the same cores. 0 leaves affinity alone.
+    val cpuMask: Long = 0,
+    // A thread of its own per device for the reply writer instead of Dispatchers.IO
+    val dedicatedWriters: Boolean = true,
+    val writerNice: Int = -8
+)
+
+/**
+ * Share of the egress rate for devices matching [vendorId] and [productId], null
+ * matching any. A device gets [weight] parts of whatever the latency-critical replies
+ * leave over, and never more than [maxBytesPerSec] of it when that is set.
+ */
+data class EgressPolicy(
+    val vendorId: Int? = null,
+    val productId: Int? = null,
+    val weight: Int = 1,
+    val maxBytesPerSec: Long = 0
+) {
+    fun matches(vendorId: Int, productId: Int): Boolean =
+        (this.vendorId == null || this.vendorId == vendorId) &&
+            (this.productId == null || this.productId == productId)
+}
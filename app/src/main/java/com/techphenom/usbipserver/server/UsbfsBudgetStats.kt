@@ -0,0 +1,21 @@
+package com.techphenom.usbipserver.server
+
+/**
+ * Snapshot of the native usbfs admission control shared by all devices. Layout of the
+ * backing array matches `enum UsbfsBudgetStat` in usbfsbudget.h. A limit of -1 means
+ * the kernel limit is disabled.
+ */
+data class UsbfsBudgetStats(
+    val limitBytes: Long,
+    val configuredBytes: Long,
+    val inFlightBytes: Long,
+    val peakInFlightBytes: Long,
+    val deferredSubmissions: Long,
+    val noMemEvents: Long
+) {
+    companion object {
+        fun fromArray(stats: LongArray): UsbfsBudgetStats {
+            return UsbfsBudgetStats(stats[0], stats[1], stats[2], stats[3], stats[4], stats[5])
+        }
+    }
+}
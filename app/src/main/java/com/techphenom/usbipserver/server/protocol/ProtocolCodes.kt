@@ -7,6 +7,12 @@ class ProtocolCodes {
         OP_REP_IMPORT -> "OP_REP_IMPORT"
         OP_REQ_DEVLIST -> "OP_REQ_DEVLIST"
         OP_REP_DEVLIST -> "OP_REP_DEVLIST"
+        OP_REQ_METRICS -> "OP_REQ_METRICS"
+        OP_REP_METRICS -> "OP_REP_METRICS"
+        OP_REQ_TRACE -> "OP_REQ_TRACE"
+        OP_REP_TRACE -> "OP_REP_TRACE"
+        OP_REQ_IMPORT_TUNNEL -> "OP_REQ_IMPORT_TUNNEL"
+        OP_REP_IMPORT_TUNNEL -> "OP_REP_IMPORT_TUNNEL"
         else -> "UNKNOWN"
     }
 
@@ -38,5 +44,18 @@ class ProtocolCodes {
         const val OP_UNEXPORT = 0x07
         const val OP_REQ_UNEXPORT = (OP_REQUEST or OP_UNEXPORT).toShort()
         const val OP_REP_UNEXPORT = (OP_REPLY or OP_UNEXPORT).toShort()
+
+        // Vendor extensions, not part of USB/IP, for local diagnostics
+        const val OP_METRICS = 0x70 // Plain text metrics report
+        const val OP_REQ_METRICS = (OP_REQUEST or OP_METRICS).toShort()
+        const val OP_REP_METRICS = (OP_REPLY or OP_METRICS).toShort()
+
+        const val OP_TRACE = 0x71 // Flight recorder as Chrome trace JSON
+        const val OP_REQ_TRACE = (OP_REQUEST or OP_TRACE).toShort()
+        const val OP_REP_TRACE = (OP_REPLY or OP_TRACE).toShort()
+
+        const val OP_IMPORT_TUNNEL = 0x72 // OP_IMPORT, then compressed payload framing
+        const val OP_REQ_IMPORT_TUNNEL = (OP_REQUEST or OP_IMPORT_TUNNEL).toShort()
+        const val OP_REP_IMPORT_TUNNEL = (OP_REPLY or OP_IMPORT_TUNNEL).toShort()
     }
 }
\ No newline at end of file
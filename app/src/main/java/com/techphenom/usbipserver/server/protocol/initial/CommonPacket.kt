@@ -54,7 +54,10 @@ fun convertInputStreamToPacket(incoming: InputStream): CommonPacket? {
 
     val pkt: CommonPacket = when (val code = bb.short) {
         ProtocolCodes.OP_REQ_DEVLIST -> RequestDevListPacket(bb.array())
-        ProtocolCodes.OP_REQ_IMPORT -> {
+        ProtocolCodes.OP_REQ_METRICS,
+        ProtocolCodes.OP_REQ_TRACE -> DiagnosticRequest(bb.array())
+        ProtocolCodes.OP_REQ_IMPORT,
+        ProtocolCodes.OP_REQ_IMPORT_TUNNEL -> {
             val pkt = ImportDeviceRequest(bb.array())
             pkt.populateInternal(incoming)
             pkt
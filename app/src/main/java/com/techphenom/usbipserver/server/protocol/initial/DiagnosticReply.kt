@@ -0,0 +1,31 @@
+package com.techphenom.usbipserver.server.protocol.initial
+
+import com.techphenom.usbipserver.server.protocol.ProtocolCodes
+import com.techphenom.usbipserver.server.protocol.utils.shortToHex
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * Reply to a [DiagnosticRequest]: a 4-byte length followed by a UTF-8 body.
+ */
+class DiagnosticReply(version: Short, code: Short, private val body: String) :
+    CommonPacket(version, code, ProtocolCodes.STATUS_OK) {
+
+    override fun serializeInternal(): ByteArray {
+        val text = body.toByteArray(Charsets.UTF_8)
+        val bb = ByteBuffer.allocate(4 + text.size).order(ByteOrder.BIG_ENDIAN)
+        bb.putInt(text.size)
+        bb.put(text)
+        return bb.array()
+    }
+
+    override fun toString(): String {
+        return """
+            ${ProtocolCodes().decodeOpCode(code)}:
+                USB/IP Version: ${shortToHex(version)}
+                Reply Code: ${shortToHex(code)}
+                Status: $status
+                Body Length: ${body.length}
+        """.trimIndent()
+    }
+}
@@ -0,0 +1,23 @@
+package com.techphenom.usbipserver.server.protocol.initial
+
+import com.techphenom.usbipserver.server.protocol.ProtocolCodes
+import com.techphenom.usbipserver.server.protocol.utils.shortToHex
+
+/**
+ * Header-only vendor request (OP_REQ_METRICS, OP_REQ_TRACE) for local diagnostics.
+ */
+class DiagnosticRequest(header: ByteArray) : CommonPacket(header) {
+
+    override fun serializeInternal(): ByteArray {
+        throw UnsupportedOperationException("Serialization not supported")
+    }
+
+    override fun toString(): String {
+        return """
+            ${ProtocolCodes().decodeOpCode(code)}:
+                USB/IP Version: ${shortToHex(version)}
+                Command Code: ${shortToHex(code)}
+                Status: $status (unused, shall be set to 0)
+        """
+    }
+}
@@ -0,0 +1,132 @@
+package com.techphenom.usbipserver.server.protocol.ongoing
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpBasicPacket.UsbIpIsoPacketDescriptor
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.util.concurrent.atomic.AtomicLong
+
+/**
+ * Message objects and read scratch of one session, recycled so that a device streaming
+ * steadily allocates nothing per URB once the pools are warm. Every object or array the
+ * URB path still has to create goes through here and is counted in [stats]; in steady
+ * state the count stops moving.
+ *
+ * Requests are taken by the session's reader and come back from whichever thread
+ * answers them, replies are taken there and come back from the writer, so the pools
+ * are locked. The scratch buffers belong to the reader alone.
+ */
+class MessagePool {
+
+    private class Pool<T : Any> {
+        private val items = arrayOfNulls<Any>(POOL_CAPACITY)
+        private var count = 0
+
+        @Suppress("UNCHECKED_CAST")
+        @Synchronized
+        fun take(): T? {
+            if (count == 0) return null
+            val item = items[--count] as T
+            items[count] = null
+            return item
+        }
+
+        /** Beyond the capacity the object is left to the GC, bursts shouldn't pin memory. */
+        @Synchronized
+        fun give(item: T) {
+            if (count < POOL_CAPACITY) items[count++] = item
+        }
+    }
+
+    private val requests = Pool<UsbIpSubmitUrb>()
+    private val replies = Pool<UsbIpSubmitUrbReply>()
+
+    // The basic header, and the rest of a CMD_SUBMIT's
+    val header: ByteBuffer = ByteBuffer.allocate(20).order(ByteOrder.BIG_ENDIAN)
+    val continuation: ByteBuffer =
+        ByteBuffer.allocate(UsbIpBasicPacket.USBIP_HEADER_SIZE - 20).order(ByteOrder.BIG_ENDIAN)
+    private var isoBytes = ByteBuffer.allocate(0)
+
+    private val urbs = AtomicLong()
+    private val allocations = AtomicLong()
+    private var reportedUrbs = 0L
+    private var reportedAllocations = 0L
+
+    fun takeRequest(): UsbIpSubmitUrb {
+        urbs.incrementAndGet()
+        return requests.take() ?: UsbIpSubmitUrb().also { allocations.incrementAndGet() }
+    }
+
+    fun recycle(request: UsbIpSubmitUrb) {
+        // A pooled request keeps its OUT buffer; up to 256 of them holding the largest
+        // writes of a burst would be the pinned memory the pool's capacity avoids
+        request.trimOutData(MAX_POOLED_OUT_BYTES)
+        requests.give(request)
+    }
+
+    fun takeReply(seqNum: Int): UsbIpSubmitUrbReply {
+        val reply = replies.take() ?: UsbIpSubmitUrbReply().also { allocations.incrementAndGet() }
+        reply.reset(seqNum)
+        return reply
+    }
+
+    fun recycle(reply: UsbIpSubmitUrbReply) = replies.give(reply)
+
+    /** Fills both pools with up to [count] objects ahead of the first URBs; not counted as allocations. */
+    fun prewarm(count: Int) {
+        repeat(count.coerceAtMost(POOL_CAPACITY)) {
+            requests.give(UsbIpSubmitUrb())
+            replies.give(UsbIpSubmitUrbReply())
+        }
+    }
+
+    /** For allocations made elsewhere on the URB path, such as a reply buffer that had to grow. */
+    fun noteAllocation() {
+        allocations.incrementAndGet()
+    }
+
+    fun newBytes(size: Int): ByteArray {
+        allocations.incrementAndGet()
+        return ByteArray(size)
+    }
+
+    fun newInts(size: Int): IntArray {
+        allocations.incrementAndGet()
+        return IntArray(size)
+    }
+
+    fun newIsoDescriptor(): UsbIpIsoPacketDescriptor {
+        allocations.incrementAndGet()
+        return UsbIpIsoPacketDescriptor(0, 0, 0, 0)
+    }
+
+    /** Reader scratch for the ISO descriptors of one URB, cleared with its limit at [size]. */
+    fun isoScratch(size: Int): ByteBuffer {
+        if (isoBytes.capacity() < size) {
+            allocations.incrementAndGet()
+            isoBytes = ByteBuffer.allocate(size).order(ByteOrder.BIG_ENDIAN)
+        }
+        isoBytes.clear()
+        isoBytes.limit(size)
+        return isoBytes
+    }
+
+    /** Totals, then the change since the previous call. */
+    @Synchronized
+    fun stats(): String {
+        val urbs = urbs.get()
+        val allocations = allocations.get()
+        val report = "urbs=$urbs allocations=$allocations, since last report urbs=${urbs - reportedUrbs} " +
+            "allocations=${allocations - reportedAllocations}"
+        reportedUrbs = urbs
+        reportedAllocations = allocations
+        return report
+    }
+
+    companion object {
+        // More than the transfers a device can have in flight plus a full reply queue
+        // is only reached in bursts
+        private const val POOL_CAPACITY = 256
+        // Covers the usual bulk OUT transfer sizes; larger writes allocate per URB
+        const val MAX_POOLED_OUT_BYTES = 64 * 1024
+    }
+}
@@ -0,0 +1,113 @@
+package com.techphenom.usbipserver.server.protocol.ongoing
+
+import com.techphenom.usbipserver.server.protocol.usb.UsbLib
+import com.techphenom.usbipserver.server.protocol.utils.convertInputStreamToByteArray
+import java.io.IOException
+import java.io.InputStream
+import java.nio.ByteBuffer
+import java.util.concurrent.atomic.AtomicLong
+
+/**
+ * Payload framing of a session imported with OP_REQ_IMPORT_TUNNEL. Every CMD_SUBMIT and
+ * RET_SUBMIT carries its transfer data as a big-endian raw length and encoded length,
+ * then the encoded bytes. Equal lengths mean the bytes are stored as is, anything else
+ * is an LZ4 block. ISO descriptors and UNLINKs are unchanged. host/usbiptunnel is the
+ * other end for a stock USB/IP client.
+ *
+ * Only payloads of at least [minCompressBytes] are compressed, and an endpoint whose
+ * data keeps failing to shrink is passed through for a while before trying again. In
+ * practice that leaves bulk: control and interrupt payloads are small and isochronous
+ * streams rarely compress.
+ *
+ * [encode] is only called by the writer and [readPayload] by the reader.
+ */
+class TunnelCodec(private val usbLib: UsbLib, private val minCompressBytes: Int) {
+
+    private var encodeScratch = ByteArray(0)
+    private var decodeScratch = ByteArray(0)
+    private val prefixBuffer = ByteBuffer.allocate(PREFIX_SIZE)
+    private val poorStreak = IntArray(ENDPOINT_SLOTS)
+    private val skipRemaining = IntArray(ENDPOINT_SLOTS)
+
+    private val rawBytes = AtomicLong()
+    private val wireBytes = AtomicLong()
+    private val compressedPayloads = AtomicLong()
+    private val storedPayloads = AtomicLong()
+
+    /** Holds the block of the last [encode] that returned non-zero. */
+    val encoded: ByteArray get() = encodeScratch
+
+    /**
+     * Compresses [length] bytes of [data] from its position, as sent by [endpoint].
+     * Returns the size of the block left in [encoded], or 0 to send the bytes as they are.
+     */
+    fun encode(data: ByteBuffer, length: Int, endpoint: Int): Int {
+        val slot = (endpoint and 0x0f) or ((endpoint and 0x80) shr 3)
+        var size = 0
+        if (length >= minCompressBytes) {
+            if (skipRemaining[slot] > 0) {
+                skipRemaining[slot]--
+            } else {
+                if (encodeScratch.size < length) encodeScratch = ByteArray(length)
+                size = usbLib.compressBlock(data, data.position(), length, encodeScratch)
+                if (size < 0 || size > length - length / MIN_SAVING_DIVISOR) size = 0
+                if (size > 0) {
+                    poorStreak[slot] = 0
+                } else if (++poorStreak[slot] >= POOR_STREAK_LIMIT) {
+                    poorStreak[slot] = 0
+                    skipRemaining[slot] = BACKOFF_PAYLOADS
+                }
+            }
+        }
+        rawBytes.addAndGet(length.toLong())
+        wireBytes.addAndGet(PREFIX_SIZE.toLong() + if (size > 0) size else length)
+        if (size > 0) compressedPayloads.incrementAndGet() else storedPayloads.incrementAndGet()
+        return size
+    }
+
+    /** Reads one framed payload, which must decode to [expectedLength] bytes, into the start of [dst]. */
+    @Throws(IOException::class)
+    fun readPayload(incoming: InputStream, expectedLength: Int, dst: ByteArray) {
+        val bb = prefixBuffer
+        convertInputStreamToByteArray(incoming, bb.array())
+        val rawLength = bb.getInt(0)
+        val encodedLength = bb.getInt(4)
+        if (rawLength != expectedLength || encodedLength < 0 || encodedLength > rawLength) {
+            throw IOException("Bad tunnel payload: $encodedLength of $rawLength bytes, expected $expectedLength")
+        }
+
+        rawBytes.addAndGet(rawLength.toLong())
+        wireBytes.addAndGet(PREFIX_SIZE.toLong() + encodedLength)
+        if (encodedLength == rawLength) {
+            convertInputStreamToByteArray(incoming, dst, 0, rawLength)
+            if (rawLength > 0) storedPayloads.incrementAndGet()
+            return
+        }
+
+        if (decodeScratch.size < encodedLength) decodeScratch = ByteArray(encodedLength)
+        convertInputStreamToByteArray(incoming, decodeScratch, 0, encodedLength)
+        val size = usbLib.decompressBlock(decodeScratch, encodedLength, dst)
+        if (size != rawLength) throw IOException("Corrupt tunnel payload: $size of $rawLength bytes")
+        compressedPayloads.incrementAndGet()
+    }
+
+    fun stats(): String {
+        val raw = rawBytes.get()
+        val wire = wireBytes.get()
+        val ratio = if (wire > 0) raw.toDouble() / wire else 1.0
+        return "raw=$raw wire=$wire ratio=${"%.2f".format(ratio)} " +
+            "compressed=${compressedPayloads.get()} stored=${storedPayloads.get()}"
+    }
+
+    companion object {
+        const val PREFIX_SIZE = 8
+
+        // A block has to save at least 1/16th to be worth the decompression
+        private const val MIN_SAVING_DIVISOR = 16
+        // After this many poor results in a row an endpoint skips the next payloads
+        private const val POOR_STREAK_LIMIT = 4
+        private const val BACKOFF_PAYLOADS = 64
+        // Endpoint number plus direction
+        private const val ENDPOINT_SLOTS = 32
+    }
+}
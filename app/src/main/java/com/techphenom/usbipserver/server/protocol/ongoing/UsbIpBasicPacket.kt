@@ -15,12 +15,7 @@ abstract class UsbIpBasicPacket {
     var ep: Int = 0
 
     constructor(header: ByteArray) {
-        val bb = ByteBuffer.wrap(header).order(ByteOrder.BIG_ENDIAN)
-        command = bb.getInt()
-        seqNum = bb.getInt()
-        devId = bb.getInt()
-        direction = bb.getInt()
-        ep = bb.getInt()
+        decodeHeader(ByteBuffer.wrap(header).order(ByteOrder.BIG_ENDIAN))
     }
 
     constructor(command: Int, seqNum: Int, devId: Int, dir: Int, ep: Int) {
@@ -31,18 +26,38 @@ abstract class UsbIpBasicPacket {
         this.ep = ep
     }
 
-    protected abstract fun serializeInternal(): ByteArray
+    /** Reads the basic header from the position of [bb], which must be big-endian. */
+    internal fun decodeHeader(bb: ByteBuffer) {
+        command = bb.getInt()
+        seqNum = bb.getInt()
+        devId = bb.getInt()
+        direction = bb.getInt()
+        ep = bb.getInt()
+    }
+
+    /** Size of what follows the basic header; does any work the size depends on. */
+    protected abstract fun prepareInternal(): Int
 
-    fun serialize(): ByteArray? {
-        val internalData = serializeInternal()
-        val bb = ByteBuffer.allocate(20 + internalData.size).order(ByteOrder.BIG_ENDIAN)
+    /** Writes the [prepareInternal] bytes, padding included: [bb] may hold an older message. */
+    protected abstract fun writeInternal(bb: ByteBuffer)
+
+    /**
+     * Serializes into [scratch] if it is large enough, otherwise into a new buffer for the
+     * caller to keep instead. The message is left between position 0 and the limit.
+     */
+    fun serialize(scratch: ByteBuffer? = null): ByteBuffer {
+        val size = 20 + prepareInternal()
+        val bb = if (scratch != null && scratch.capacity() >= size) scratch else ByteBuffer.allocate(size)
+        bb.clear()
+        bb.order(ByteOrder.BIG_ENDIAN)
         bb.putInt(command)
         bb.putInt(seqNum)
         bb.putInt(devId)
         bb.putInt(direction)
         bb.putInt(ep)
-        bb.put(internalData)
-        return bb.array()
+        writeInternal(bb)
+        bb.flip()
+        return bb
     }
 
     override fun toString(): String {
@@ -74,12 +89,17 @@ abstract class UsbIpBasicPacket {
 
         const val USBIP_HEADER_SIZE = 48
 
+        /**
+         * CMD_SUBMITs come out of [pool] and go back to it once answered. [tunnel] is set
+         * for sessions imported with the compressed tunnel framing.
+         */
         @Throws(IOException::class)
-        fun read(incoming: InputStream): UsbIpBasicPacket {
-            val bb = ByteBuffer.allocate(20)
+        fun read(incoming: InputStream, pool: MessagePool, tunnel: TunnelCodec? = null): UsbIpBasicPacket {
+            val bb = pool.header
             convertInputStreamToByteArray(incoming, bb.array())
-            return when (val command = bb.getInt()) {
-                USBIP_CMD_SUBMIT -> UsbIpSubmitUrb.read(bb.array(), incoming)
+            bb.clear()
+            return when (val command = bb.getInt(0)) {
+                USBIP_CMD_SUBMIT -> UsbIpSubmitUrb.read(bb, incoming, pool, tunnel)
                 USBIP_CMD_UNLINK -> UsbIpUnlinkUrb.read(bb.array(), incoming)
                 else -> throw IOException("Unknown incoming packet command: $command")
             }
@@ -92,6 +112,13 @@ abstract class UsbIpBasicPacket {
         var actualLength: Int,
         var status: Int
     ) {
+        fun set(offset: Int, length: Int, actualLength: Int, status: Int) {
+            this.offset = offset
+            this.length = length
+            this.actualLength = actualLength
+            this.status = status
+        }
+
         override fun toString(): String {
             return "[Offset: $offset, Len: $length, Actual Len: $actualLength, Status: $status]"
         }
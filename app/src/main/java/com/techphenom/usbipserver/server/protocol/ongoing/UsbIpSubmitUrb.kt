@@ -8,19 +8,36 @@ import java.io.InputStream
 import java.nio.ByteBuffer
 import java.nio.ByteOrder
 
-class UsbIpSubmitUrb(header: ByteArray) : UsbIpBasicPacket(header) {
+/**
+ * Instances are recycled through [MessagePool], so everything here is rewritten by
+ * [read]. [outData] and [isoPacketDescriptors] only grow while the request is in use,
+ * [outData] up to [MessagePool] keeping it: their first [transferBufferLength] bytes
+ * and [numberOfPackets] entries are the current URB's.
+ */
+class UsbIpSubmitUrb : UsbIpBasicPacket(USBIP_CMD_SUBMIT, 0, 0, 0, 0) {
     var transferFlags = UsbIpTransferFlags(0)
     var transferBufferLength = 0
     var startFrame = 0
     var numberOfPackets = 0
     var interval = 0
-    var isoPacketDescriptors: List<UsbIpIsoPacketDescriptor> = emptyList()
+    val isoPacketDescriptors = ArrayList<UsbIpIsoPacketDescriptor>()
+    // The descriptors' lengths, as libusb wants them; exactly numberOfPackets long
+    var isoPacketLengths = NO_PACKETS
+        private set
 
-    lateinit var setup: UsbControlSetup
-    var outData: ByteArray = ByteArray(0)
+    val setup = UsbControlSetup()
+    // When the reader took it off the socket; not on the wire
+    var rxTimestampNs = 0L
+    var outData: ByteArray = NO_BYTES
+        private set
+
+    /** Endpoint address as libusb sees it; the control endpoint is always 0x00. */
+    val endpointAddress: Int
+        get() = if (ep == 0) 0 else ep or (if (direction == USBIP_DIR_IN) 0x80 else 0)
 
     override fun toString(): String {
-        val isoPacketDescriptorsString =  isoPacketDescriptors.joinToString(separator = "\n", postfix = ",") { it.toString() }
+        val isoPacketDescriptorsString = isoPacketDescriptors.take(numberOfPackets)
+            .joinToString(separator = "\n", postfix = ",") { it.toString() }
         return """
             USBIP_CMD_SUBMIT
                 ${super.toString()},
@@ -30,66 +47,80 @@ class UsbIpSubmitUrb(header: ByteArray) : UsbIpBasicPacket(header) {
                 Number of Packets: $numberOfPackets,
                 Interval: $interval,
                 Setup: ${if(setup.isEmpty()) "[]" else setup.toString()}
-                ISO Packet Descriptors: ${if(isoPacketDescriptors.isEmpty()) "[]" else isoPacketDescriptorsString}
+                ISO Packet Descriptors: ${if(numberOfPackets <= 0) "[]" else isoPacketDescriptorsString}
             """
     }
 
-    override fun serializeInternal(): ByteArray {
+    /** Lets go of an [outData] larger than [maxBytes], the next [read] allocates what it needs. */
+    internal fun trimOutData(maxBytes: Int) {
+        if (outData.size > maxBytes) outData = NO_BYTES
+    }
+
+    override fun prepareInternal(): Int {
+        throw UnsupportedOperationException("Serializing not supported")
+    }
+
+    override fun writeInternal(bb: ByteBuffer) {
         throw UnsupportedOperationException("Serializing not supported")
     }
 
     companion object {
-        private const val WIRE_SIZE = 20 + 8
+        private val NO_PACKETS = IntArray(0)
+        private val NO_BYTES = ByteArray(0)
 
+        /** Reads the rest of a CMD_SUBMIT whose basic header is in [header]. */
         @Throws(IOException::class)
-        fun read(header: ByteArray, incoming: InputStream): UsbIpSubmitUrb {
-            val msg = UsbIpSubmitUrb(header)
-            val continuationHeader = ByteArray(WIRE_SIZE)
-            convertInputStreamToByteArray(incoming, continuationHeader)
-            val bb = ByteBuffer.wrap(continuationHeader).order(ByteOrder.BIG_ENDIAN)
+        fun read(header: ByteBuffer, incoming: InputStream, pool: MessagePool, tunnel: TunnelCodec? = null): UsbIpSubmitUrb {
+            val msg = pool.takeRequest()
+            msg.decodeHeader(header)
+            val bb = pool.continuation
+            convertInputStreamToByteArray(incoming, bb.array())
+            bb.clear()
             msg.transferFlags = UsbIpTransferFlags(bb.getInt())
             msg.transferBufferLength = bb.getInt()
             msg.startFrame = bb.getInt()
             msg.numberOfPackets = bb.getInt()
             msg.interval = bb.getInt()
-
-            val bytes = ByteArray(8)
-            bb.get(bytes)
-            msg.setup = UsbControlSetup(bytes)
-
-            if (msg.direction == USBIP_DIR_OUT) {
-                msg.outData = ByteArray(msg.transferBufferLength)
-                convertInputStreamToByteArray(incoming, msg.outData)
+            bb.get(msg.setup.bytes)
+            msg.setup.decode()
+
+            val outLength = if (msg.direction == USBIP_DIR_OUT) msg.transferBufferLength else 0
+            if (msg.outData.size < outLength) msg.outData = pool.newBytes(outLength)
+            if (tunnel != null) {
+                // Framed even when empty, IN requests carry a zero length payload
+                tunnel.readPayload(incoming, outLength, msg.outData)
+            } else if (outLength > 0) {
+                convertInputStreamToByteArray(incoming, msg.outData, 0, outLength)
             }
 
-            val totalIsoDescriptorAreaSize = msg.numberOfPackets * UsbIpIsoPacketDescriptor.WIRE_SIZE
-            if(totalIsoDescriptorAreaSize > 0) {
-                val allIsoDescriptorsBytes = ByteArray(totalIsoDescriptorAreaSize)
-                convertInputStreamToByteArray(incoming, allIsoDescriptorsBytes)
-                val isoBuff = ByteBuffer.wrap(allIsoDescriptorsBytes).order(ByteOrder.BIG_ENDIAN)
-                val descriptors = ArrayList<UsbIpIsoPacketDescriptor>(msg.numberOfPackets)
-
-                repeat(msg.numberOfPackets) {
-                    val offset = isoBuff.getInt()
-                    val length = isoBuff.getInt()
-                    val actualLength = isoBuff.getInt()
-                    val status = isoBuff.getInt()
-                    descriptors.add(UsbIpIsoPacketDescriptor(offset, length, actualLength, status))
+            val packets = msg.numberOfPackets.coerceAtLeast(0)
+            if (msg.isoPacketLengths.size != packets) {
+                msg.isoPacketLengths = if (packets == 0) NO_PACKETS else pool.newInts(packets)
+            }
+            if (packets > 0) {
+                val isoBuff = pool.isoScratch(packets * UsbIpIsoPacketDescriptor.WIRE_SIZE)
+                convertInputStreamToByteArray(incoming, isoBuff.array(), 0, isoBuff.limit())
+                val descriptors = msg.isoPacketDescriptors
+                while (descriptors.size < packets) descriptors.add(pool.newIsoDescriptor())
+
+                for (i in 0 until packets) {
+                    descriptors[i].set(isoBuff.getInt(), isoBuff.getInt(), isoBuff.getInt(), isoBuff.getInt())
+                    msg.isoPacketLengths[i] = descriptors[i].length
                 }
-                msg.isoPacketDescriptors = descriptors
             }
             return msg
         }
     }
 
-    class UsbControlSetup(bytes: ByteArray) {
-        private val _requestType: Byte
-        private val _request: Byte
-        private val _value: Short
-        private val _index: Short
-        private val _length: Short
-        private val _bytes: ByteArray
-
+    /** Decoded from [bytes], which the reader overwrites for every URB before calling [decode]. */
+    class UsbControlSetup {
+        private var _requestType: Byte = 0
+        private var _request: Byte = 0
+        private var _value: Short = 0
+        private var _index: Short = 0
+        private var _length: Short = 0
+        private val _bytes = ByteArray(CONTROL_SETUP_WIRE_SIZE)
+        private val bb = ByteBuffer.wrap(_bytes).order(ByteOrder.LITTLE_ENDIAN)
 
         val requestType: Int get() = _requestType.toInt() and 0xFF
         val request: Int get() = _request.toInt() and 0xFF
@@ -102,17 +133,12 @@ class UsbIpSubmitUrb(header: ByteArray) : UsbIpBasicPacket(header) {
         val reqType: Int get() = (requestType and 0x60) shr 5
         val reqRecipient: Int get() = requestType and 0x1f
 
-        init {
-            require(bytes.size == CONTROL_SETUP_WIRE_SIZE) { "Setup packet must be 8 bytes long" }
-
-            val bb = ByteBuffer.wrap(bytes).order(ByteOrder.LITTLE_ENDIAN)
-            _requestType = bb.get()
-            _request = bb.get()
-            _value = bb.getShort()
-            _index = bb.getShort()
-            _length = bb.getShort()
-
-            _bytes = bytes
+        fun decode() {
+            _requestType = bb.get(0)
+            _request = bb.get(1)
+            _value = bb.getShort(2)
+            _index = bb.getShort(4)
+            _length = bb.getShort(6)
         }
 
         fun isEmpty(): Boolean {
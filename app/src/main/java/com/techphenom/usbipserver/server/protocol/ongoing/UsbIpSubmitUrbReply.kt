@@ -1,10 +1,9 @@
 package com.techphenom.usbipserver.server.protocol.ongoing
 
 import java.nio.ByteBuffer
-import java.nio.ByteOrder
 
-class UsbIpSubmitUrbReply(seqNum: Int) :
-    UsbIpBasicPacket(USBIP_RET_SUBMIT, seqNum, 0, 0, 0) {
+/** Recycled through [MessagePool]; [reset] before reuse. */
+class UsbIpSubmitUrbReply : UsbIpBasicPacket(USBIP_RET_SUBMIT, 0, 0, 0, 0) {
 
     var status = -1
     var actualLength = 0
@@ -13,22 +12,63 @@ class UsbIpSubmitUrbReply(seqNum: Int) :
     var errorCount = 0
 
     var inData: ByteBuffer? = null
-    var isoPacketDescriptors: List<UsbIpIsoPacketDescriptor> = emptyList()
+    // Only grows, the first numberOfPackets entries are this reply's
+    val isoPacketDescriptors = ArrayList<UsbIpIsoPacketDescriptor>()
 
-    override fun serializeInternal(): ByteArray {
-        val inDataLen = if (inData == null || inData!!.capacity() == 0) 0 else actualLength
+    // Not sent on the wire, only used to time the reply queue
+    var endpoint = 0
+    var queuedAtNs = 0L
+    // Interrupt and isochronous replies skip ahead of other devices' bulk data
+    var latencyCritical = false
+    // Set when the session uses the compressed tunnel framing
+    var tunnel: TunnelCodec? = null
+
+    // Worked out by prepareInternal for writeInternal
+    private var inDataLen = 0
+    private var encodedLen = 0
+
+    fun reset(seqNum: Int) {
+        this.seqNum = seqNum
+        status = -1
+        actualLength = 0
+        startFrame = 0
+        numberOfPackets = 0xffffffff.toInt()
+        errorCount = 0
+        inData = null
+        endpoint = 0
+        queuedAtNs = 0L
+        latencyCritical = false
+        tunnel = null
+    }
+
+    override fun prepareInternal(): Int {
+        inDataLen = if (inData == null || inData!!.capacity() == 0) 0 else actualLength
         val isoDescriptorSize = if (numberOfPackets <= 0) 0 else numberOfPackets * UsbIpIsoPacketDescriptor.WIRE_SIZE
-        val totalSize = USBIP_HEADER_SIZE - 20 + inDataLen + isoDescriptorSize
+        val tunnel = tunnel
+        encodedLen = if (tunnel != null && inDataLen > 0) tunnel.encode(inData!!, inDataLen, endpoint) else 0
+        val payloadSize = when {
+            tunnel == null -> inDataLen
+            encodedLen > 0 -> TunnelCodec.PREFIX_SIZE + encodedLen
+            else -> TunnelCodec.PREFIX_SIZE + inDataLen
+        }
+        return USBIP_HEADER_SIZE - 20 + payloadSize + isoDescriptorSize
+    }
 
-        val bb = ByteBuffer.allocate(totalSize).order(ByteOrder.BIG_ENDIAN)
+    override fun writeInternal(bb: ByteBuffer) {
         bb.putInt(status)
         bb.putInt(actualLength)
         bb.putInt(startFrame)
         bb.putInt(numberOfPackets)
         bb.putInt(errorCount)
-        bb.position(USBIP_HEADER_SIZE - 20)
+        bb.putLong(0) // Padding
 
-        if (inDataLen > 0 && inData != null) {
+        if (tunnel != null) {
+            bb.putInt(inDataLen)
+            bb.putInt(if (encodedLen > 0) encodedLen else inDataLen)
+        }
+        if (encodedLen > 0) {
+            bb.put(tunnel!!.encoded, 0, encodedLen)
+        } else if (inDataLen > 0 && inData != null) {
             val buf = inData!!
             val originalLimit = buf.limit()
 
@@ -40,17 +80,17 @@ class UsbIpSubmitUrbReply(seqNum: Int) :
             buf.limit(originalLimit)
         }
 
-        for (descriptor in isoPacketDescriptors) {
+        for (i in 0 until numberOfPackets) {
+            val descriptor = isoPacketDescriptors[i]
             bb.putInt(descriptor.offset)
             bb.putInt(descriptor.length)
             bb.putInt(descriptor.actualLength)
             bb.putInt(descriptor.status)
         }
-        return bb.array()
     }
 
     override fun toString(): String {
-        val isoPacketDescriptorsString = isoPacketDescriptors.joinToString(separator = "\n", postfix = ",") { it.toString() }
+        val isoPacketDescriptorsString = isoPacketDescriptors.take(numberOfPackets.coerceAtLeast(0)).joinToString(separator = "\n", postfix = ",") { it.toString() }
         val statusString = if (status == 0) "SUCCESS" else "NOT SUCCESSFUL"
         return """
             USBIP_RET_SUBMIT
@@ -10,7 +10,11 @@ class UsbIpUnlinkUrb(header: ByteArray) : UsbIpBasicPacket(header) {
     
     var seqNumToUnlink = -1
 
-    override fun serializeInternal(): ByteArray {
+    override fun prepareInternal(): Int {
+        throw UnsupportedOperationException("Serializing not supported")
+    }
+
+    override fun writeInternal(bb: ByteBuffer) {
         throw UnsupportedOperationException("Serializing not supported")
     }
 
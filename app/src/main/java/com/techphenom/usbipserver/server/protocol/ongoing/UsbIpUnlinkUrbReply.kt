@@ -1,7 +1,6 @@
 package com.techphenom.usbipserver.server.protocol.ongoing
 
 import java.nio.ByteBuffer
-import java.nio.ByteOrder
 
 
 class UsbIpUnlinkUrbReply(seqNum: Int) :
@@ -9,10 +8,11 @@ class UsbIpUnlinkUrbReply(seqNum: Int) :
 
     var status = -1
 
-    override fun serializeInternal(): ByteArray {
-        val bb = ByteBuffer.allocate(USBIP_HEADER_SIZE - 20).order(ByteOrder.BIG_ENDIAN)
+    override fun prepareInternal(): Int = USBIP_HEADER_SIZE - 20
+
+    override fun writeInternal(bb: ByteBuffer) {
         bb.putInt(status)
-        return bb.array()
+        repeat((USBIP_HEADER_SIZE - 24) / 8) { bb.putLong(0) } // Padding
     }
 
     override fun toString(): String {
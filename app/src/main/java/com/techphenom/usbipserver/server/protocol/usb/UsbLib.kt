@@ -7,8 +7,19 @@ class UsbLib {
     init {
         System.loadLibrary("usbipfunctions")
     }
+    companion object {
+        // Stage ids for recordLatency(), matching enum MetricsStage in usbipmetrics.h
+        const val METRICS_STAGE_REPLY_QUEUE = 3
+        // Bits of the thread profile results, matching threadprofile.h
+        const val THREAD_PROFILE_FIFO_REFUSED = 0x1
+        const val THREAD_PROFILE_NICE_REFUSED = 0x2
+        const val THREAD_PROFILE_AFFINITY_REFUSED = 0x4
+    }
     interface TransferListener {
         fun onTransferCompleted(seqNum: Int, status: Int, actualLength: Int, type: Int, isoPacketActualLengths: IntArray?, isoPacketStatuses: IntArray?)
+        // Once per open, when the native layer finds the device on fd unplugged. Its
+        // transfers have been failed with ENODEV and new ones are refused.
+        fun onDeviceDisconnected(fd: Int)
     }
     private var listener: TransferListener? = null
     fun setListener(listener: TransferListener) {
@@ -18,13 +29,56 @@ class UsbLib {
     private fun onTransferCompleted(seqNum: Int, status: Int, actualLength: Int, type: Int, isoPacketActualLengths: IntArray?, isoPacketStatuses: IntArray?) {
         listener?.onTransferCompleted(seqNum, status, actualLength, type, isoPacketActualLengths, isoPacketStatuses)
     }
+    @Keep
+    private fun onDeviceDisconnected(fd: Int) {
+        listener?.onDeviceDisconnected(fd)
+    }
 
     external fun init(): Int
-    external fun exit()
+    // exit and closeDeviceHandle return how many transfers were still not reaped when
+    // they gave up waiting. Their buffers may still be written to and must not be released.
+    external fun exit(): Int
     external fun openDeviceHandle(fd: Int): Int
     external fun closeDeviceHandle(fd: Int): Int
     external fun cancelTransfer(seqNum: Int, fd: Int): Int
 
+    external fun allocBuffer(fd: Int, size: Int): ByteBuffer?
+    external fun releaseBuffer(buffer: ByteBuffer): Int
+    external fun getBufferPoolStats(fd: Int): LongArray?
+    // Ahead of use: up to count free buffers of size's class, and up to count spare
+    // transfers for isoPackets ISO packets (0 for the other types). Both return how many
+    // were added, -ENOENT if fd isn't open.
+    external fun prewarmBuffers(fd: Int, size: Int, count: Int): Int
+    external fun prewarmTransfers(fd: Int, isoPackets: Int, count: Int): Int
+    external fun getUsbfsBudgetStats(): LongArray?
+    external fun recordLatency(fd: Int, endpoint: Int, stage: Int, nanos: Long)
+    external fun getMetricsReport(fd: Int): String?
+    // Negotiated link speed as a USB/IP speed code, from usbfs or failing that the BOS.
+    // 0 when neither tells, -ENOENT if fd isn't open.
+    external fun getDeviceSpeed(fd: Int): Int
+    external fun startCapture(path: String, snapLen: Int): Int
+    external fun stopCapture()
+    external fun getCaptureStats(): LongArray?
+
+    // Scheduling profiles. The event thread takes its profile when it starts, or at once
+    // if it is running; getEventThreadProfileResult is -1 until then. applyThreadProfile
+    // is for the calling thread. Both return the THREAD_PROFILE_* parts that were refused.
+    external fun setEventThreadProfile(nice: Int, fifoPriority: Int, cpuMask: Long): Int
+    external fun getEventThreadProfileResult(): Int
+    external fun applyThreadProfile(nice: Int, fifoPriority: Int, cpuMask: Long): Int
+
+    // Busy-poll mode of the event thread, spinUs 0 turns it off. Stats are spins, spins
+    // that caught a completion and nanoseconds spent spinning. setSocketBusyPoll sets
+    // SO_BUSY_POLL and returns -errno if the kernel refuses.
+    external fun setBusyPoll(spinUs: Int, idleMs: Int)
+    external fun getBusyPollStats(): LongArray?
+    external fun setSocketBusyPoll(fd: Int, usec: Int): Int
+
+    // LZ4 blocks for the tunnel framing. compressBlock returns 0 unless the result is
+    // smaller than the input; decompressBlock returns -EPROTO on a corrupt block.
+    external fun compressBlock(src: ByteBuffer, srcOffset: Int, srcLength: Int, dst: ByteArray): Int
+    external fun decompressBlock(src: ByteArray, srcLength: Int, dst: ByteArray): Int
+
     external fun doControlTransfer(
         fd: Int,
         requestType: Byte,
@@ -36,39 +90,48 @@ class UsbLib {
         timeout: Int
     ): Int
 
+    // The async transfers take the first length bytes of a pooled buffer, which is
+    // usually larger; control transfers are sized by the setup packet at its start.
     external fun doControlTransferAsync(
         fd: Int,
         data: ByteBuffer,
         timeout: Int,
         seqNum: Int,
-        flags: Int
+        flags: Int,
+        rxTimestampNs: Long
     ): Int
 
     external fun doBulkTransferAsync(
         fd: Int,
         endpoint: Int,
         data: ByteBuffer,
+        length: Int,
         timeout: Int,
         seqNum: Int,
-        flags: Int
+        flags: Int,
+        rxTimestampNs: Long
     ): Int
 
     external fun doInterruptTransferAsync(
         fd: Int,
         endpoint: Int,
         data: ByteBuffer,
+        length: Int,
         timeout: Int,
         seqNum: Int,
-        flags: Int
+        flags: Int,
+        rxTimestampNs: Long
     ): Int
 
     external fun doIsochronousTransferAsync(
         fd: Int,
         endpoint: Int,
         data: ByteBuffer,
+        length: Int,
         isoPacketLengths: IntArray,
         seqNum: Int,
-        flags: Int
+        flags: Int,
+        rxTimestampNs: Long
     ): Int
 
 }
@@ -4,7 +4,7 @@ import com.techphenom.usbipserver.BuildConfig
 import android.util.Log
 
 object Logger {
-    private const val TAG_PREFIX = "USB/IP - "
+    @PublishedApi internal const val TAG_PREFIX = "USB/IP - "
 
     fun v(tag: String, msg: String, tr: Throwable? = null) {
         if (BuildConfig.DEBUG) {
@@ -27,6 +27,15 @@ object Logger {
         }
     }
 
+    // Lambda variants only build the message in debug builds
+    inline fun d(tag: String, msg: () -> String) {
+        if (BuildConfig.DEBUG) Log.d(TAG_PREFIX + tag, msg())
+    }
+
+    inline fun i(tag: String, msg: () -> String) {
+        if (BuildConfig.DEBUG) Log.i(TAG_PREFIX + tag, msg())
+    }
+
     fun w(tag: String, msg: String, tr: Throwable? = null) {
         if (BuildConfig.DEBUG) {
             if (tr == null) Log.w(TAG_PREFIX + tag, msg)
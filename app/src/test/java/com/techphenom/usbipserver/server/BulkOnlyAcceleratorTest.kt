@@ -0,0 +1,258 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.BulkOnlyAccelerator.Companion.ANSWERED
+import com.techphenom.usbipserver.server.BulkOnlyAccelerator.Companion.CSW_LENGTH
+import com.techphenom.usbipserver.server.BulkOnlyAccelerator.Companion.PASS
+import com.techphenom.usbipserver.server.BulkOnlyAccelerator.Companion.WAIT
+import com.techphenom.usbipserver.server.protocol.ongoing.MessagePool
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpBasicPacket
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertFalse
+import org.junit.Assert.assertTrue
+import org.junit.Before
+import org.junit.Test
+import java.io.ByteArrayInputStream
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+class BulkOnlyAcceleratorTest {
+    private val pool = MessagePool()
+    private val delivered = ArrayList<ReadAheadEndpoint.Answer>()
+    private val released = ArrayList<ByteBuffer>()
+    private val warnings = ArrayList<String>()
+    private lateinit var accelerator: BulkOnlyAccelerator
+
+    @Before
+    fun setUp() {
+        accelerator = BulkOnlyAccelerator(
+            interfaceNumber = 0,
+            outEndpoint = OUT_EP,
+            inEndpoint = IN_EP or 0x80,
+            inMaxPacketSize = MAX_PACKET_SIZE,
+            acquire = { ByteBuffer.allocate(it) },
+            release = { released.add(it) },
+            deliver = { delivered.add(it) },
+            warn = { warnings.add(it) }
+        )
+    }
+
+    @Test
+    fun readIsAnsweredFromItsOwnTransfers() {
+        val (data, status) = startRead(seqNum = 1, tag = 7, dataLength = 4096)
+
+        assertEquals(WAIT, accelerator.take(inUrb(2, 4096)))
+        for (i in 0 until 4096) data.put(i, i.toByte())
+        assertTrue(accelerator.onCompleted(100, 0, 4096))
+        assertEquals(ANSWERED, accelerator.take(inUrb(2, 4096)))
+        val answer = delivered.removeAt(0)
+        assertEquals(2, answer.request.seqNum)
+        assertEquals(0, answer.status)
+        assertEquals(4096, answer.actualLength)
+        assertEquals(data.get(4095), answer.data.get(4095))
+
+        assertEquals(WAIT, accelerator.take(inUrb(3, CSW_LENGTH)))
+        writeCsw(status, tag = 7)
+        assertTrue(accelerator.onCompleted(101, 0, CSW_LENGTH))
+        assertEquals(ANSWERED, accelerator.take(inUrb(3, CSW_LENGTH)))
+        val csw = delivered.removeAt(0)
+        assertEquals(CSW_LENGTH, csw.actualLength)
+        assertEquals(CSW_SIGNATURE, csw.data.order(ByteOrder.LITTLE_ENDIAN).getInt(0))
+
+        assertFalse(accelerator.isBusy())
+        assertTrue(released.any { it === data } && released.any { it === status })
+    }
+
+    @Test
+    fun dataSplitsAcrossUrbs() {
+        val (data, _) = startRead(seqNum = 1, tag = 1, dataLength = 4096)
+        for (i in 0 until 4096) data.put(i, (i / 1024).toByte())
+        accelerator.onCompleted(100, 0, 4096)
+
+        assertEquals(ANSWERED, accelerator.take(inUrb(2, 1024)))
+        assertEquals(ANSWERED, accelerator.take(inUrb(3, 3072)))
+        assertEquals(1024, delivered[0].actualLength)
+        assertEquals(0.toByte(), delivered[0].data.get(1023))
+        assertEquals(3072, delivered[1].actualLength)
+        assertEquals(1.toByte(), delivered[1].data.get(0))
+        assertEquals(3.toByte(), delivered[1].data.get(3071))
+        assertTrue(released.any { it === data })
+    }
+
+    @Test
+    fun shortDataPhaseFillingTheUrbIsFollowedByZeroLength() {
+        val (_, status) = startRead(seqNum = 1, tag = 3, dataLength = 8192)
+        accelerator.onCompleted(100, 0, 4096)
+
+        assertEquals(ANSWERED, accelerator.take(inUrb(2, 4096)))
+        assertEquals(4096, delivered.removeAt(0).actualLength)
+        assertEquals(ANSWERED, accelerator.take(inUrb(3, 4096)))
+        assertEquals(0, delivered.removeAt(0).actualLength)
+
+        writeCsw(status, tag = 3)
+        accelerator.onCompleted(101, 0, CSW_LENGTH)
+        assertEquals(ANSWERED, accelerator.take(inUrb(4, CSW_LENGTH)))
+        assertEquals(CSW_LENGTH, delivered.removeAt(0).actualLength)
+    }
+
+    @Test
+    fun shortPacketFillingTheUrbIsFollowedByTheCsw() {
+        val (_, status) = startRead(seqNum = 1, tag = 4, dataLength = 8192)
+        accelerator.onCompleted(100, 0, 4000)
+
+        // 4000 bytes end in a short packet, there is no zero length packet to hand out
+        assertEquals(ANSWERED, accelerator.take(inUrb(2, 4000)))
+        assertEquals(4000, delivered.removeAt(0).actualLength)
+        assertEquals(WAIT, accelerator.take(inUrb(3, CSW_LENGTH)))
+
+        writeCsw(status, tag = 4)
+        accelerator.onCompleted(101, 0, CSW_LENGTH)
+        assertEquals(ANSWERED, accelerator.take(inUrb(3, CSW_LENGTH)))
+        assertEquals(CSW_LENGTH, delivered.removeAt(0).actualLength)
+    }
+
+    @Test
+    fun onlyReadsAreAccelerated() {
+        assertTrue(accelerator.commandSubmitted(cbw(1, tag = 1, dataLength = 4096, dataIn = false, opcode = WRITE_10)))
+        assertEquals(0, accelerator.commandSent(1, 0, CBW_LENGTH))
+        assertTrue(accelerator.commandSubmitted(cbw(2, tag = 2, dataLength = 36, dataIn = true, opcode = INQUIRY)))
+        assertEquals(0, accelerator.commandSent(2, 0, CBW_LENGTH))
+        assertTrue(accelerator.commandSubmitted(cbw(3, tag = 3, dataLength = 4096, dataIn = true, opcode = READ_10)))
+        assertEquals(0, accelerator.commandSent(3, 0, 0))
+        assertEquals(PASS, accelerator.take(inUrb(4, 4096)))
+    }
+
+    @Test
+    fun unknownCompletionIsNotTaken() {
+        startRead(seqNum = 1, tag = 1, dataLength = 512)
+        assertFalse(accelerator.onCompleted(55, 0, 512))
+    }
+
+    @Test
+    fun outUrbDuringCommandStopsAndDisables() {
+        val (data, status) = startRead(seqNum = 1, tag = 1, dataLength = 512)
+
+        assertFalse(accelerator.commandSubmitted(cbw(2, tag = 2, dataLength = 512, dataIn = true, opcode = READ_10)))
+        val inFlight = ArrayList<Int>()
+        accelerator.stop(inFlight, disable = true)
+        assertEquals(listOf(100, 101), inFlight)
+        assertFalse(accelerator.isBusy())
+        assertEquals(1, warnings.size)
+
+        // Cancelled transfers still hand their buffers back
+        assertTrue(accelerator.onCompleted(100, -2, 0))
+        assertTrue(accelerator.onCompleted(101, -2, 0))
+        assertTrue(released.any { it === data } && released.any { it === status })
+        assertTrue(delivered.isEmpty())
+
+        assertTrue(accelerator.commandSubmitted(cbw(3, tag = 3, dataLength = 512, dataIn = true, opcode = READ_10)))
+        assertEquals(0, accelerator.commandSent(3, 0, CBW_LENGTH))
+    }
+
+    @Test
+    fun stopDropsResultsNotHandedOut() {
+        val (data, _) = startRead(seqNum = 1, tag = 1, dataLength = 512)
+        accelerator.onCompleted(100, 0, 512)
+
+        val inFlight = ArrayList<Int>()
+        accelerator.stop(inFlight, disable = false)
+        assertEquals(listOf(101), inFlight)
+        assertTrue(released.any { it === data })
+
+        // Not disabled, the next read is accelerated again
+        accelerator.onCompleted(101, -2, 0)
+        assertTrue(accelerator.commandSubmitted(cbw(2, tag = 2, dataLength = 512, dataIn = true, opcode = READ_10)))
+        assertEquals(512, accelerator.commandSent(2, 0, CBW_LENGTH))
+    }
+
+    @Test
+    fun mismatchedCswIsPassedOnThenDisables() {
+        val (_, status) = startRead(seqNum = 1, tag = 5, dataLength = 512)
+        accelerator.onCompleted(100, 0, 512)
+        assertEquals(ANSWERED, accelerator.take(inUrb(2, 512)))
+
+        writeCsw(status, tag = 6)
+        accelerator.onCompleted(101, 0, CSW_LENGTH)
+        assertEquals(ANSWERED, accelerator.take(inUrb(3, CSW_LENGTH)))
+        assertEquals(6, delivered.last().data.order(ByteOrder.LITTLE_ENDIAN).getInt(4))
+
+        assertTrue(accelerator.commandSubmitted(cbw(4, tag = 7, dataLength = 512, dataIn = true, opcode = READ_10)))
+        assertEquals(0, accelerator.commandSent(4, 0, CBW_LENGTH))
+    }
+
+    @Test
+    fun withdrawnDataTransferLeavesTheUrbsToTheDevice() {
+        assertTrue(accelerator.commandSubmitted(cbw(1, tag = 1, dataLength = 512, dataIn = true, opcode = READ_10)))
+        assertEquals(512, accelerator.commandSent(1, 0, CBW_LENGTH))
+        val data = ByteBuffer.allocate(512)
+        accelerator.begin(100, data)
+        accelerator.withdraw(100)
+
+        assertFalse(accelerator.isBusy())
+        assertTrue(released.any { it === data })
+        assertEquals(PASS, accelerator.take(inUrb(2, 512)))
+    }
+
+    /** Sends a READ(10) CBW and starts its data (seqNum 100) and CSW (101) transfers. */
+    private fun startRead(seqNum: Int, tag: Int, dataLength: Int): Pair<ByteBuffer, ByteBuffer> {
+        assertTrue(accelerator.commandSubmitted(cbw(seqNum, tag, dataLength, dataIn = true, opcode = READ_10)))
+        assertEquals(dataLength, accelerator.commandSent(seqNum, 0, CBW_LENGTH))
+        val data = ByteBuffer.allocate(dataLength)
+        val status = ByteBuffer.allocate(CSW_LENGTH)
+        accelerator.begin(100, data)
+        accelerator.beginStatus(101, status)
+        assertTrue(accelerator.isBusy())
+        return data to status
+    }
+
+    private fun cbw(seqNum: Int, tag: Int, dataLength: Int, dataIn: Boolean, opcode: Int): UsbIpSubmitUrb {
+        val cbw = ByteBuffer.allocate(CBW_LENGTH).order(ByteOrder.LITTLE_ENDIAN)
+        cbw.putInt(0, CBW_SIGNATURE)
+        cbw.putInt(4, tag)
+        cbw.putInt(8, dataLength)
+        cbw.put(12, (if (dataIn) 0x80 else 0).toByte())
+        cbw.put(14, 10.toByte())
+        cbw.put(15, opcode.toByte())
+        return urb(seqNum, UsbIpBasicPacket.USBIP_DIR_OUT, OUT_EP, CBW_LENGTH, cbw.array())
+    }
+
+    private fun inUrb(seqNum: Int, length: Int): UsbIpSubmitUrb =
+        urb(seqNum, UsbIpBasicPacket.USBIP_DIR_IN, IN_EP, length, ByteArray(0))
+
+    /** Decodes a CMD_SUBMIT off the wire, the way the reader gets one. */
+    private fun urb(seqNum: Int, direction: Int, ep: Int, length: Int, payload: ByteArray): UsbIpSubmitUrb {
+        val wire = ByteBuffer.allocate(UsbIpBasicPacket.USBIP_HEADER_SIZE - 20 + payload.size)
+        wire.putInt(0) // transfer flags
+        wire.putInt(length)
+        wire.putInt(0) // start frame
+        wire.putInt(0) // number of packets
+        wire.putInt(0) // interval
+        wire.put(ByteArray(8)) // setup
+        wire.put(payload)
+        val header = pool.header
+        header.clear()
+        header.putInt(UsbIpBasicPacket.USBIP_CMD_SUBMIT).putInt(seqNum).putInt(1).putInt(direction).putInt(ep)
+        header.flip()
+        return UsbIpSubmitUrb.read(header, ByteArrayInputStream(wire.array()), pool)
+    }
+
+    private fun writeCsw(buffer: ByteBuffer, tag: Int, result: Int = 0) {
+        val csw = buffer.duplicate().order(ByteOrder.LITTLE_ENDIAN)
+        csw.putInt(0, CSW_SIGNATURE)
+        csw.putInt(4, tag)
+        csw.putInt(8, 0)
+        csw.put(12, result.toByte())
+    }
+
+    companion object {
+        private const val OUT_EP = 1
+        private const val IN_EP = 2
+        private const val MAX_PACKET_SIZE = 512
+        private const val CBW_LENGTH = 31
+        private const val CBW_SIGNATURE = 0x43425355
+        private const val CSW_SIGNATURE = 0x53425355
+        private const val READ_10 = 0x28
+        private const val WRITE_10 = 0x2a
+        private const val INQUIRY = 0x12
+    }
+}
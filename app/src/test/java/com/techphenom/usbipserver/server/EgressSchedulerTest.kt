@@ -0,0 +1,116 @@
+package com.techphenom.usbipserver.server
+
+import kotlinx.coroutines.CoroutineStart
+import kotlinx.coroutines.ExperimentalCoroutinesApi
+import kotlinx.coroutines.delay
+import kotlinx.coroutines.launch
+import kotlinx.coroutines.test.TestScope
+import kotlinx.coroutines.test.runTest
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertFalse
+import org.junit.Assert.assertTrue
+import org.junit.Test
+
+/**
+ * Runs on the test scheduler's virtual time, which is also the scheduler's clock, so
+ * seconds of pacing take no real time and come out the same on every run.
+ */
+@OptIn(ExperimentalCoroutinesApi::class)
+class EgressSchedulerTest {
+
+    @Test
+    fun weightsShareTheLink() = runTest {
+        val scheduler = scheduler()
+        val light = scheduler.register("light", 1, 0)
+        val heavy = scheduler.register("heavy", 3, 0)
+        saturate(scheduler, light)
+        saturate(scheduler, heavy)
+        delay(10_000)
+
+        val ratio = heavy.bytes.toDouble() / light.bytes
+        assertTrue("heavy/light = $ratio\n${scheduler.stats()}", ratio in 2.7..3.3)
+        // Both got what the weights entitled them to while contending
+        for (flow in listOf(light, heavy)) {
+            val share = flow.contendedBytes / flow.entitledBytes
+            assertTrue("${flow.name} share = $share", share in 0.9..1.1)
+        }
+        // And together no more than the link, plus the burst it starts with
+        assertTrue(light.bytes + heavy.bytes <= 10 * RATE + BURST + REPLY)
+    }
+
+    @Test
+    fun cappedFlowStaysUnderItsCap() = runTest {
+        val scheduler = scheduler()
+        val capped = scheduler.register("capped", 1, CAP)
+        val open = scheduler.register("open", 1, 0)
+        saturate(scheduler, capped)
+        saturate(scheduler, open)
+        delay(10_000)
+
+        assertTrue("capped: ${capped.bytes}", capped.bytes <= 10 * CAP + BURST + REPLY)
+        assertTrue("capped: ${capped.bytes}", capped.bytes >= 9 * CAP)
+        // The other takes up what the capped one leaves
+        assertTrue("open: ${open.bytes}", open.bytes >= 10 * (RATE - CAP) * 9 / 10)
+    }
+
+    @Test
+    fun latencyCriticalAcquireNeverSuspends() = runTest {
+        val scheduler = scheduler()
+        val bulk = scheduler.register("bulk", 1, 0)
+        val hid = scheduler.register("hid", 1, 0)
+        // Put the link deep in debt and a reply in line behind it
+        scheduler.acquire(bulk, 200_000, latencyCritical = false)
+        val waiting = launch { scheduler.acquire(bulk, REPLY.toInt(), latencyCritical = false) }
+        testScheduler.runCurrent()
+        assertTrue(waiting.isActive)
+
+        repeat(10) {
+            val critical = launch(start = CoroutineStart.UNDISPATCHED) {
+                scheduler.acquire(hid, 64, latencyCritical = true)
+            }
+            assertTrue(critical.isCompleted)
+        }
+        assertEquals(640L, hid.criticalBytes)
+        assertTrue(waiting.isActive)
+        waiting.join()
+    }
+
+    @Test
+    fun unregisterCancelsTheWaitingGrant() = runTest {
+        val scheduler = scheduler()
+        val bulk = scheduler.register("bulk", 1, 0)
+        val gone = scheduler.register("gone", 1, 0)
+        scheduler.acquire(bulk, 200_000, latencyCritical = false)
+        val waiting = launch { scheduler.acquire(gone, REPLY.toInt(), latencyCritical = false) }
+        testScheduler.runCurrent()
+        assertTrue(waiting.isActive)
+
+        scheduler.unregister(gone)
+        testScheduler.runCurrent()
+        assertTrue(waiting.isCancelled)
+        assertEquals(0L, gone.bytes)
+        assertFalse(scheduler.stats().contains("gone:"))
+
+        // The link goes on to the others
+        launch { scheduler.acquire(bulk, REPLY.toInt(), latencyCritical = false) }.join()
+        assertEquals(200_000 + REPLY, bulk.bytes)
+    }
+
+    private fun TestScope.scheduler() =
+        EgressScheduler(RATE, backgroundScope, clock = { testScheduler.currentTime * 1_000_000 })
+
+    /** Keeps [flow] asking for the link until the test ends. */
+    private fun TestScope.saturate(scheduler: EgressScheduler, flow: EgressScheduler.Flow) {
+        backgroundScope.launch {
+            while (true) scheduler.acquire(flow, REPLY.toInt(), latencyCritical = false)
+        }
+    }
+
+    companion object {
+        private const val RATE = 1_000_000L
+        private const val CAP = 100_000L
+        private const val REPLY = 4096L
+        // What a bucket at these rates holds when full, see EgressScheduler.MIN_BURST_BYTES
+        private const val BURST = 64L * 1024
+    }
+}
@@ -0,0 +1,123 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.MessagePool
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpBasicPacket
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertFalse
+import org.junit.Assert.assertNotNull
+import org.junit.Assert.assertNull
+import org.junit.Assert.assertSame
+import org.junit.Assert.assertTrue
+import org.junit.Test
+import java.net.Socket
+import java.nio.ByteBuffer
+
+/**
+ * The hand-off between a submitter, the completion and an UNLINK, in the order
+ * UsbIpServer drives it: the submitter adds, hands the URB to libusb and then calls
+ * [PendingTransfers.markSubmitted]; an UNLINK tries [PendingTransfers.cancelOnSubmit]
+ * before cancelling through libusb, then [PendingTransfers.claim]s the reply; the
+ * completion removes the entry and answers unless it was claimed.
+ */
+class PendingTransfersTest {
+    private val socket = ClientConnection.Tcp(Socket())
+    private val transfers = PendingTransfers(MessagePool())
+
+    @Test
+    fun unlinkBeforeSubmitIsLeftToTheSubmitter() {
+        transfers.add(socket, urb(1), buffer())
+
+        assertTrue(transfers.cancelOnSubmit(1))
+        assertFalse(transfers.markSubmitted(1)) // The submitter cancels it itself
+        assertEquals(ENDPOINT, transfers.claim(1))
+        assertEquals(-1, transfers.claim(1))
+
+        // The cancelled completion finds the reply already claimed
+        val pending = transfers.remove(1)!!
+        assertFalse(pending.unlinked.compareAndSet(false, true))
+    }
+
+    @Test
+    fun unlinkAfterSubmitCancelsThroughLibusb() {
+        transfers.add(socket, urb(1), buffer())
+        assertTrue(transfers.markSubmitted(1))
+
+        assertFalse(transfers.cancelOnSubmit(1))
+        assertNotNull(transfers[1])
+        assertEquals(ENDPOINT, transfers.claim(1))
+    }
+
+    @Test
+    fun unlinkAfterCompletionFindsNothing() {
+        transfers.add(socket, urb(1), buffer())
+        assertTrue(transfers.markSubmitted(1))
+        val pending = transfers.remove(1)!!
+        assertTrue(pending.unlinked.compareAndSet(false, true))
+
+        assertFalse(transfers.cancelOnSubmit(1))
+        assertNull(transfers[1])
+        assertEquals(-1, transfers.claim(1))
+    }
+
+    @Test
+    fun completionBeforeMarkSubmittedNeedsNoCancel() {
+        transfers.add(socket, urb(1), buffer())
+        transfers.remove(1)
+
+        assertTrue(transfers.markSubmitted(1))
+    }
+
+    @Test
+    fun completionClaimedFirstLeavesTheUnlinkUnanswered() {
+        transfers.add(socket, urb(1), buffer())
+        transfers.markSubmitted(1)
+        assertTrue(transfers[1]!!.unlinked.compareAndSet(false, true))
+
+        assertEquals(-1, transfers.claim(1))
+    }
+
+    @Test
+    fun reusedEntryStartsClean() {
+        transfers.add(socket, urb(1), buffer())
+        transfers.cancelOnSubmit(1)
+        transfers.claim(1)
+        val first = transfers.remove(1)!!
+        transfers.recycle(first)
+
+        val second = transfers.add(socket, urb(2), buffer())
+        assertSame(first, second)
+        assertFalse(second.unlinked.get())
+        assertFalse(second.cancelOnSubmit)
+        assertTrue(transfers.markSubmitted(2))
+        assertEquals(ENDPOINT, transfers.claim(2))
+    }
+
+    @Test
+    fun removeKeepsTheOthersAndGrows() {
+        for (seqNum in 1..100) transfers.add(socket, urb(seqNum), buffer())
+
+        assertEquals(50, transfers.remove(50)!!.request.seqNum)
+        assertNull(transfers.remove(50))
+        for (seqNum in 1..100) {
+            if (seqNum != 50) assertEquals(seqNum, transfers[seqNum]!!.request.seqNum)
+        }
+        assertEquals(99, transfers.snapshot().size)
+        assertTrue(transfers.hasEndpoint(ENDPOINT))
+
+        transfers.clear()
+        assertFalse(transfers.isNotEmpty())
+    }
+
+    private fun urb(seqNum: Int) = UsbIpSubmitUrb().also {
+        it.seqNum = seqNum
+        it.direction = UsbIpBasicPacket.USBIP_DIR_IN
+        it.ep = ENDPOINT and 0x0f
+    }
+
+    private fun buffer() = ByteBuffer.allocate(64)
+
+    companion object {
+        private const val ENDPOINT = 0x81
+    }
+}
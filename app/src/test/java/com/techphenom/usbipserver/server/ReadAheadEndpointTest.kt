@@ -0,0 +1,181 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertFalse
+import org.junit.Assert.assertTrue
+import org.junit.Test
+import java.nio.ByteBuffer
+
+class ReadAheadEndpointTest {
+    private val delivered = ArrayList<ReadAheadEndpoint.Answer>()
+    private val released = ArrayList<ByteBuffer>()
+    private val readAhead = endpoint(POLICY)
+
+    @Test
+    fun transfersAreWholePacketsOrOneOnInterrupt() {
+        assertEquals(512, readAhead.transferSize)
+        assertEquals(1024, endpoint(POLICY.copy(transferSize = 1000)).transferSize)
+        assertEquals(8, endpoint(POLICY, interrupt = true, maxPacketSize = 8).transferSize)
+    }
+
+    @Test
+    fun urbLargerThanOneChunkWaitsForTheNext() {
+        assertTrue(readAhead.take(urb(1, 1024)))
+        val first = complete(100, 512, start = 0)
+        assertTrue(delivered.isEmpty())
+        val second = complete(101, 512, start = 512)
+
+        val answer = delivered.single()
+        assertEquals(1, answer.request.seqNum)
+        assertEquals(0, answer.status)
+        assertEquals(1024, answer.actualLength)
+        assertEquals(0.toByte(), answer.data.get(0))
+        assertEquals(1023.toByte(), answer.data.get(1023))
+        assertReleasedOnce(first, second)
+    }
+
+    @Test
+    fun shortChunkEndsTheUrb() {
+        complete(100, 512)
+        val short = complete(101, 100, start = 1)
+        complete(102, 512, start = 2)
+
+        assertTrue(readAhead.take(urb(1, 1024)))
+        assertTrue(readAhead.take(urb(2, 200)))
+        assertTrue(readAhead.take(urb(3, 824)))
+        assertEquals(listOf(612, 200), delivered.map { it.actualLength })
+        assertEquals((1 + 99).toByte(), delivered[0].data.get(611))
+        assertEquals(2.toByte(), delivered[1].data.get(0))
+        assertReleasedOnce(short)
+
+        // The rest of the chunk and the next one fill the third
+        complete(103, 512, start = 3)
+        assertEquals(824, delivered[2].actualLength)
+        assertEquals((2 + 511).toByte(), delivered[2].data.get(311))
+        assertEquals(3.toByte(), delivered[2].data.get(312))
+    }
+
+    @Test
+    fun zeroLengthPacketAnswersWithNothing() {
+        val zlp = complete(100, 0)
+        assertTrue(readAhead.take(urb(1, 512)))
+
+        assertEquals(0, delivered.single().actualLength)
+        assertEquals(0, delivered.single().status)
+        assertReleasedOnce(zlp)
+    }
+
+    @Test
+    fun errorGoesAfterTheDataAndToUrbsQueuedBehind() {
+        for (seqNum in 1..3) assertTrue(readAhead.take(urb(seqNum, 1024)))
+        complete(100, 512)
+        complete(101, 0, status = EPIPE)
+
+        assertEquals(listOf(1, 2, 3), delivered.map { it.request.seqNum })
+        assertEquals(listOf(0, EPIPE, EPIPE), delivered.map { it.status })
+        assertEquals(listOf(512, 0, 0), delivered.map { it.actualLength })
+
+        // Read-ahead has ended, later URBs go to the device
+        assertEquals(0, readAhead.wanted())
+        assertFalse(readAhead.take(urb(4, 1024)))
+    }
+
+    @Test
+    fun errorWithDataKeepsTheData() {
+        complete(100, 100, status = EPIPE)
+        assertTrue(readAhead.take(urb(1, 512)))
+        assertTrue(readAhead.take(urb(2, 512)))
+
+        assertEquals(listOf(100, 0), delivered.map { it.actualLength })
+        assertEquals(listOf(0, EPIPE), delivered.map { it.status })
+        assertFalse(readAhead.take(urb(3, 512)))
+    }
+
+    @Test
+    fun unlinkedUrbIsNotAnswered() {
+        assertTrue(readAhead.take(urb(1, 512)))
+        assertTrue(readAhead.take(urb(2, 512)))
+        assertTrue(readAhead.unlink(1))
+        assertFalse(readAhead.unlink(1))
+
+        complete(100, 512)
+        assertEquals(2, delivered.single().request.seqNum)
+    }
+
+    @Test
+    fun budgetStretchesToTheHeadUrb() {
+        val deep = endpoint(POLICY.copy(depth = 16))
+        assertEquals(4, deep.wanted()) // 2048 bytes of 512 byte transfers
+
+        deep.take(urb(1, 4096))
+        assertEquals(9, deep.wanted()) // The URB and one transfer more
+        for (seqNum in 100 until 109) deep.register(seqNum, ByteBuffer.allocate(512))
+        assertEquals(0, deep.wanted())
+    }
+
+    @Test
+    fun stopReleasesEachBufferOnce() {
+        val buffered = complete(100, 512)
+        val inFlight = List(2) { ByteBuffer.allocate(512).also { buffer -> readAhead.register(101 + it, buffer) } }
+        assertTrue(readAhead.take(urb(1, 1024)))
+
+        val seqNums = ArrayList<Int>()
+        val waiting = readAhead.stop(seqNums)
+        assertEquals(listOf(1), waiting.map { it.seqNum })
+        assertEquals(setOf(101, 102), seqNums.toSet())
+        assertReleasedOnce(buffered)
+        assertEquals(0, released.count { it === inFlight[0] || it === inFlight[1] })
+        assertTrue(delivered.isEmpty())
+
+        // One is cancelled and comes back, the other is left when the handle closes
+        assertTrue(readAhead.onCompleted(101, ECONNRESET, 0))
+        readAhead.abandon()
+        readAhead.abandon()
+        assertReleasedOnce(buffered, inFlight[0], inFlight[1])
+        assertEquals(3, released.size)
+
+        assertFalse(readAhead.take(urb(2, 512)))
+        assertEquals(0, readAhead.wanted())
+    }
+
+    @Test
+    fun unknownCompletionIsNotTaken() {
+        assertFalse(readAhead.onCompleted(55, 0, 512))
+    }
+
+    private fun endpoint(policy: ReadAheadPolicy, interrupt: Boolean = false, maxPacketSize: Int = 512) =
+        ReadAheadEndpoint(
+            endpoint = 0x81,
+            interrupt = interrupt,
+            policy = policy,
+            maxPacketSize = maxPacketSize,
+            acquire = { ByteBuffer.allocate(it) },
+            release = { released.add(it) },
+            deliver = { delivered.add(it) }
+        )
+
+    /** Completes one of our transfers with [length] bytes, each (start + offset). */
+    private fun complete(seqNum: Int, length: Int, start: Int = 0, status: Int = 0): ByteBuffer {
+        val buffer = ByteBuffer.allocate(readAhead.transferSize)
+        readAhead.register(seqNum, buffer)
+        for (i in 0 until length) buffer.put(i, (start + i).toByte())
+        assertTrue(readAhead.onCompleted(seqNum, status, length))
+        return buffer
+    }
+
+    private fun assertReleasedOnce(vararg buffers: ByteBuffer) {
+        for (buffer in buffers) assertEquals(1, released.count { it === buffer })
+    }
+
+    private fun urb(seqNum: Int, length: Int) = UsbIpSubmitUrb().also {
+        it.seqNum = seqNum
+        it.transferBufferLength = length
+    }
+
+    companion object {
+        private val POLICY = ReadAheadPolicy(endpoint = 0x81, depth = 4, transferSize = 512, maxBufferedBytes = 2048)
+        private const val EPIPE = -32
+        private const val ECONNRESET = -104
+    }
+}
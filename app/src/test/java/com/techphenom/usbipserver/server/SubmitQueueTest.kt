@@ -0,0 +1,104 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import kotlinx.coroutines.launch
+import kotlinx.coroutines.runBlocking
+import kotlinx.coroutines.yield
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertFalse
+import org.junit.Assert.assertNull
+import org.junit.Assert.assertTrue
+import org.junit.Test
+
+class SubmitQueueTest {
+
+    @Test
+    fun headsComeOutInOrder() = runBlocking {
+        val queue = SubmitQueue(4)
+        for (seqNum in 1..3) assertTrue(queue.put(urb(seqNum)))
+
+        assertEquals(listOf(1, 2, 3), drain(queue, 3))
+    }
+
+    @Test
+    fun unlinkKeepsTheOrderOfTheRest() = runBlocking {
+        val queue = SubmitQueue(4)
+        for (seqNum in 1..4) queue.put(urb(seqNum))
+
+        assertTrue(queue.unlink(2))
+        assertFalse(queue.unlink(2))
+        assertFalse(queue.unlink(9))
+        assertEquals(listOf(1, 3, 4), drain(queue, 3))
+    }
+
+    @Test
+    fun unlinkAcrossTheWrap() = runBlocking {
+        val queue = SubmitQueue(3)
+        for (seqNum in 1..3) queue.put(urb(seqNum))
+        queue.removeHead()
+        queue.removeHead()
+        queue.put(urb(4))
+        queue.put(urb(5))
+
+        assertTrue(queue.unlink(4))
+        queue.put(urb(6))
+        assertEquals(listOf(3, 5, 6), drain(queue, 3))
+    }
+
+    @Test
+    fun unlinkedHeadIsNoLongerHead() = runBlocking {
+        val queue = SubmitQueue(2)
+        queue.put(urb(1))
+        queue.put(urb(2))
+        val head = queue.awaitHead()!!
+
+        assertTrue(queue.unlink(1))
+        assertFalse(queue.isHead(head))
+        assertEquals(2, queue.awaitHead()!!.seqNum)
+    }
+
+    @Test
+    fun fullQueueHoldsThePutUntilThereIsSpace() = runBlocking {
+        val queue = SubmitQueue(1)
+        queue.put(urb(1))
+        val put = launch { queue.put(urb(2)) }
+        yield()
+        assertTrue(put.isActive)
+
+        queue.removeHead()
+        put.join()
+        assertEquals(2, queue.awaitHead()!!.seqNum)
+
+        val next = launch { queue.put(urb(3)) }
+        yield()
+        assertTrue(next.isActive)
+        assertTrue(queue.unlink(2))
+        next.join()
+        assertEquals(3, queue.awaitHead()!!.seqNum)
+    }
+
+    @Test
+    fun closeEndsBothSides() = runBlocking {
+        val queue = SubmitQueue(1)
+        queue.put(urb(1))
+        var accepted = true
+        val put = launch { accepted = queue.put(urb(2)) }
+        yield()
+
+        queue.close()
+        put.join()
+        assertFalse(accepted)
+        assertNull(queue.awaitHead())
+        assertFalse(queue.put(urb(3)))
+    }
+
+    private suspend fun drain(queue: SubmitQueue, count: Int): List<Int> =
+        List(count) {
+            val head = queue.awaitHead()!!
+            assertTrue(queue.isHead(head))
+            queue.removeHead()
+            head.seqNum
+        }
+
+    private fun urb(seqNum: Int) = UsbIpSubmitUrb().also { it.seqNum = seqNum }
+}
@@ -0,0 +1,93 @@
+package com.techphenom.usbipserver.server
+
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpBasicPacket
+import com.techphenom.usbipserver.server.protocol.ongoing.UsbIpSubmitUrb
+import com.techphenom.usbipserver.server.protocol.utils.intToHex
+import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.runBlocking
+import kotlinx.coroutines.yield
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertFalse
+import org.junit.Assert.assertTrue
+import org.junit.Test
+
+class SubmitStagesTest {
+
+    @Test
+    fun eachEndpointAndDirectionGetsItsOwnQueue() = runBlocking {
+        val gate = CompletableDeferred<Unit>()
+        val submitted = ArrayList<Int>()
+        val stages = SubmitStages(this, depth = 4, submit = { queue, request ->
+            gate.await()
+            submitted.add(request.seqNum)
+            queue.removeHead()
+        }, onFailure = {})
+
+        val endpoints = listOf(0x00, 0x01, 0x81, 0x0f, 0x8f)
+        for ((i, endpoint) in endpoints.withIndex()) assertTrue(stages.put(urb(i + 1, endpoint)))
+        yield()
+
+        val stats = stages.stats()
+        for (endpoint in endpoints) {
+            assertTrue("${intToHex(endpoint)} in\n$stats", stats.contains("submit queue ${intToHex(endpoint)}:"))
+        }
+        assertEquals(endpoints.size, stats.lines().count { it.isNotBlank() })
+
+        gate.complete(Unit)
+        stages.stop()
+    }
+
+    @Test
+    fun orderIsKeptPerEndpoint() = runBlocking {
+        val gate = CompletableDeferred<Unit>()
+        val submitted = HashMap<Int, ArrayList<Int>>()
+        val stages = SubmitStages(this, depth = 8, submit = { queue, request ->
+            gate.await()
+            submitted.getOrPut(request.endpointAddress) { ArrayList() }.add(request.seqNum)
+            queue.removeHead()
+        }, onFailure = {})
+
+        for (seqNum in 1..6) stages.put(urb(seqNum, if (seqNum % 2 == 0) 0x82 else 0x02))
+        gate.complete(Unit)
+        while (submitted.values.sumOf { it.size } < 6) yield()
+
+        assertEquals(listOf(1, 3, 5), submitted[0x02])
+        assertEquals(listOf(2, 4, 6), submitted[0x82])
+        stages.stop()
+    }
+
+    @Test
+    fun unlinkFindsTheQueueHoldingTheUrb() = runBlocking {
+        val gate = CompletableDeferred<Unit>()
+        val submitted = ArrayList<Int>()
+        val stages = SubmitStages(this, depth = 4, submit = { queue, request ->
+            gate.await()
+            submitted.add(request.seqNum)
+            queue.removeHead()
+        }, onFailure = {})
+
+        stages.put(urb(1, 0x81))
+        stages.put(urb(2, 0x81))
+        stages.put(urb(3, 0x01))
+        stages.put(urb(4, 0x01))
+        yield()
+
+        // The heads are with their submitters already, the URBs behind them are not
+        assertTrue(stages.unlink(2))
+        assertTrue(stages.unlink(4))
+        assertFalse(stages.unlink(4))
+        assertFalse(stages.unlink(9))
+
+        gate.complete(Unit)
+        while (submitted.size < 2) yield()
+        stages.stop()
+        assertEquals(listOf(1, 3), submitted.sorted())
+        assertFalse(stages.put(urb(4, 0x83)))
+    }
+
+    private fun urb(seqNum: Int, endpoint: Int) = UsbIpSubmitUrb().also {
+        it.seqNum = seqNum
+        it.ep = endpoint and 0x0f
+        it.direction = if (endpoint and 0x80 != 0) UsbIpBasicPacket.USBIP_DIR_IN else UsbIpBasicPacket.USBIP_DIR_OUT
+    }
+}
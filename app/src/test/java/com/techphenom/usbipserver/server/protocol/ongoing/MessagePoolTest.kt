@@ -0,0 +1,49 @@
+package com.techphenom.usbipserver.server.protocol.ongoing
+
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertSame
+import org.junit.Test
+import java.io.ByteArrayInputStream
+import java.nio.ByteBuffer
+
+class MessagePoolTest {
+    private val pool = MessagePool()
+
+    @Test
+    fun outBufferIsReusedUpToTheLimit() {
+        val first = readOut(1, MessagePool.MAX_POOLED_OUT_BYTES)
+        val buffer = first.outData
+        pool.recycle(first)
+
+        val second = readOut(2, 512)
+        assertSame(first, second)
+        assertSame(buffer, second.outData)
+        assertEquals(2.toByte(), second.outData[511])
+    }
+
+    @Test
+    fun largeOutBufferIsNotKept() {
+        val large = readOut(1, 1024 * 1024)
+        assertEquals(1024 * 1024, large.outData.size)
+        pool.recycle(large)
+
+        val next = pool.takeRequest()
+        assertSame(large, next)
+        assertEquals(0, next.outData.size)
+    }
+
+    /** A CMD_SUBMIT writing [length] bytes of [seqNum] to endpoint 1. */
+    private fun readOut(seqNum: Int, length: Int): UsbIpSubmitUrb {
+        val header = ByteBuffer.allocate(20)
+            .putInt(UsbIpBasicPacket.USBIP_CMD_SUBMIT).putInt(seqNum).putInt(0x10002)
+            .putInt(UsbIpBasicPacket.USBIP_DIR_OUT).putInt(1)
+        header.flip()
+        val rest = ByteBuffer.allocate(UsbIpBasicPacket.USBIP_HEADER_SIZE - 20 + length)
+        rest.putInt(0).putInt(length).putInt(0).putInt(0).putInt(0).put(ByteArray(8))
+        while (rest.hasRemaining()) rest.put(seqNum.toByte())
+
+        val request = UsbIpSubmitUrb.read(header, ByteArrayInputStream(rest.array()), pool)
+        assertEquals(length, request.transferBufferLength)
+        return request
+    }
+}